@@ -26,16 +26,25 @@ IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdarg.h>
 
 #include "hidapi/hidapi.h"
+#include "hidbackend.h"
 #include "SSPCommandLineTool.h"
 #include "protocol.h"
 #include "util.h"
-
-#define IFNOTQUIET(x)  \
-	do {							\
-		if (!quietOperation) {		\
-			x;						\
-		}							\
-	} while(0)
+#include "scenario.h"
+#ifdef __linux__
+#include <errno.h>
+#include <time.h>
+#include "server.h"
+#include "pool.h"
+#include "probelock.h"
+#include "schedule.h"
+#include "stress.h"
+#include "faults.h"
+#include "session.h"
+#include "simprobe.h"
+#include "hidinject.h"
+#include "metrics.h"
+#endif
 
 
 // Hack to pull in version number from version.bat
@@ -49,6 +58,11 @@ IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 commandLineParameter * commandLineParameterList = NULL;
 bool quietOperation = false;
+SspDevice * probe = NULL;
+#ifdef __linux__
+static SspDevice ** connectedProbes = NULL;		///< the probes opened by connectProbes
+static size_t connectedProbeCount = 0;
+#endif
 
 // frees the allocated memory for the commandLineParameterList;
 static void freeCommandLineParameterList() {
@@ -74,10 +88,62 @@ void cleanUpAndExit(int code, char * errorMessage, ...) {
 	va_end(argptr);
 
 	freeCommandLineParameterList();
+#ifdef __linux__
+	for (size_t i = 0; i < connectedProbeCount; i++) {
+		if (connectedProbes[i] != probe) {
+			sspClose(connectedProbes[i]);
+		}
+	}
+	free(connectedProbes);
+	connectedProbes = NULL;
+	connectedProbeCount = 0;
+#endif
+	sspClose(probe);
+	probe = NULL;
+#ifdef __linux__
+	serverCleanUp();
+	sessionRecordStop();
+	simulationStop();
+	hidInjectStop();
+	metricsStop();
+#endif
 
 	exit(code);
 }
 
+// Exits with a meaningful error message and exit code when the result is not OK.
+void checkResult(SspResult result) {
+	if (result == SspResultOk) {
+		return;
+	}
+	int code;
+	switch (result) {
+	case SspResultErrorHidApi:
+	case SspResultErrorOutOfMemory:
+		code = ExitErrorHidApi;
+		break;
+	case SspResultErrorHidOpen:
+	case SspResultErrorReportDescriptor:
+		code = ExitErrorHidOpen;
+		break;
+	case SspResultErrorInvalidCharacter:
+		code = ExitErrorCommandLineParameter;
+		break;
+	default:
+		code = ExitErrorCommunicationProtocol;
+		break;
+	}
+	cleanUpAndExit(code, "%s", (probe != NULL) ? sspErrorMessage(probe) : sspResultString(result));
+}
+
+// Exits when the passed pointer is NULL
+void * checkMalloc(void * ptr) {
+	if (ptr == NULL) {
+		cleanUpAndExit(-1, "Out of memory, exiting...");
+	}
+	return ptr;
+}
+
 
 void parseCommandline(int argc, char *argv[]) {
 	commandLineParameter * clplEnd = commandLineParameterList;
@@ -138,11 +204,35 @@ bool getCommandLineParameterPresent(char * parameter) {
 }
 
 
+// Selects the HID backend given with --backend, or the default one.
+void selectBackend() {
+#ifdef __linux__
+	if (getCommandLineParameterPresent("--simulate")) {
+		simulationStart();
+	}
+	else
+#endif
+	{
+		char * backend = getCommandLineParameterValue("--backend", (char *)hidBackendNames[0]);
+		if (!hidBackendSelect(backend)) {
+			cleanUpAndExit(ExitErrorHidApi, "HID backend %s is unknown or could not be loaded", backend);
+		}
+	}
+#ifdef __linux__
+	char * profile = getCommandLineParameterValue("--inject", NULL);
+	if (profile != NULL) {
+		hidInjectStart(profile);
+	}
+#endif
+}
+
 void listProbes() {
+	selectBackend();
+
 	struct hid_device_info *devs, *cur_dev;
 
 	// SmartStripe Probes have VID 0x2B2F and PID 0x0001
-	devs = hid_enumerate(SSP_VID, SSP_PID);
+	devs = hidBackend->enumerate(SSP_VID, SSP_PID);
 	cur_dev = devs;
 
 	unsigned int devcount = 0;
@@ -158,7 +248,7 @@ void listProbes() {
 		printf("Serial_number: %ls Path: %s\n", cur_dev->serial_number, cur_dev->path);
 		cur_dev = cur_dev->next;
 	}
-	hid_free_enumeration(devs);
+	hidBackend->free_enumeration(devs);
 }
 
 void printUsage(char * utilityName ) {
@@ -167,16 +257,141 @@ void printUsage(char * utilityName ) {
 	printf("  %s --help\n", utilityName);
 	printf("  %s /?\n", utilityName);
 	printf("  %s list [-q]\n", utilityName);
-	printf("  %s swipe [-q] [--serial=(auto | <SSP serial>)] [--track1=<data>] [--track2=<data>] [--track3=<data>]\n", utilityName);
+	printf("  %s swipe [-q] [--serial=(auto | any-free | <SSP serial>)] [--wait | --timeout=<seconds>] [--reconnect[=<n>]] [--track1=<data>] [--track2=<data>] [--track3=<data>]\n", utilityName);
+	printf("  %s deck [-q] [--serial=(auto | any-free | <SSP serial>)] [--wait | --timeout=<seconds>] [--reconnect[=<n>]] --file=<deck> [--window=<n>] [--await-swiped] [--no-autosuspend] [--idle=<ms>]\n", utilityName);
+#ifdef __linux__
+	printf("  %s serve [-q] [--serial=<serial>[,<serial>...]] [--shm=<name>] [--window=<n>] [--await-swiped] [--reconnect[=<n>]] [--max-error-rate=<percent>] [--max-latency=<ms>] [--check-interval=<seconds>] [--no-autosuspend] [--keep-alive=<ms>]\n", utilityName);
+	printf("  %s submit [-q] [--shm=<name>] [--probe=(<n> | any)] --file=<deck>\n", utilityName);
+	printf("  %s schedule [-q] [--serial=(auto | any-free | <serial>[,<serial>...])] --file=<deck> (--interval=<ms> | --profile=<profile> <profile options> | --times=<file>) [--count=<n>] [--duration=<s>] [--await-swiped] [--log=<file>]\n", utilityName);
+	printf("      profiles: constant --rate=<swipes/s> | poisson --rate=<swipes/s> [--seed=<n>] | bursts --rate=<swipes/s> --on=<s> --off=<s> [--poisson]\n");
+	printf("                | ramp --rate=<swipes/s> --end-rate=<swipes/s> --duration=<s> [--poisson] | trace --trace=<file>\n");
+	printf("  %s stress [-q] [--serial=(auto | any-free | <serial>[,<serial>...])] --file=<deck> [--start-rate=<arms/s>] [--step=<arms/s>] [--max-rate=<arms/s>] [--step-time=<s>] [--swipe-timeout=<ms>] [--feedback=<file> [--settle=<ms>] [--min-accept=<percent>] [--search=<n>]]\n", utilityName);
+	printf("  %s faults [-q] [--serial=(auto | any-free | <SSP serial>)] --file=<deck> [--faults=parity,lrc,sentinels] [--tracks=1,2,3] [--await-swiped] [--feedback=<file>] [--settle=<ms>] [--log=<file>]\n", utilityName);
+	printf("  %s replay [-q] [--serial=(auto | any-free | <serial>[,<serial>...])] --file=<session log> [--fast | --speed=<factor>] [--from=<n>] [--to=<n>] [--window=<n>]\n", utilityName);
+	printf("  %s pool [-q] [--pool=<socket>] [--labels=<serial>=<label>[,...]] [--max-lease=<seconds>]\n", utilityName);
+	printf("  %s status [--pool=<socket>]\n", utilityName);
+	printf("  %s histogram --file=<file>[,<file>...] [--out=<file>]\n", utilityName);
+#endif
+	printf("  %s scenario [-q] [--serial=(auto | any-free | <SSP serial>)] --file=<scenario> [--check]\n", utilityName);
+	printf("  %s compare [-q] [--serial=(auto | <SSP serial>)] [--count=<n>]\n", utilityName);
 	printf("\n");
 	printf("Commands:\n");
 	printf(optionformat, "list",				"List the connected probes\n");
 	printf(optionformat, "swipe",				"Lets the probe swipe a card\n");
+	printf(optionformat, "deck",				"Swipes all cards of a deck file, one card per line with the tracks separated by '|'\n");
+#ifdef __linux__
+	printf(optionformat, "serve",				"Keeps the probes open and swipes the cards submitted through shared memory, until interrupted\n");
+	printf(optionformat, "submit",				"Submits a deck file to a running server\n");
+	printf(optionformat, "schedule",			"Swipes the cards of a deck following a load profile or at given times and reports the timing jitter\n");
+	printf(optionformat, "stress",				"Swipes the first card of a deck at rising rates to find the highest rate the terminal sustains\n");
+	printf(optionformat, "faults",				"Swipes every card of a deck as is and with parity, LRC and sentinel faults, and records which are accepted\n");
+	printf(optionformat, "replay",				"Sends the commands of a session recorded with --record to the probe again\n");
+	printf(optionformat, "pool",				"Hands out leases on the connected probes to concurrent jobs, until interrupted\n");
+	printf(optionformat, "status",				"Shows the probes of the probe pool and their leases\n");
+	printf(optionformat, "histogram",			"Merges the histogram files written with --histograms, e.g. by runs on several hosts, and prints the percentiles\n");
+#endif
+	printf(optionformat, "scenario",			"Compiles a scenario file (see scenario.h for the statements) and runs it on the probe\n");
+	printf(optionformat, "compare",				"Runs the same command mix over every HID backend and reports latency and CPU cost\n");
 	printf("\n");
 	printf("Options:\n");
 	printf(optionformat, "--help, /?",			"Print the usage\n");
+	printf(optionformat, "--backend=<name>",	"HID backend to use:");
+	for (size_t i = 0; hidBackendNames[i] != NULL; i++) {
+		printf(" %s%s", hidBackendNames[i], (i == 0) ? " (default)" : "");
+	}
+	printf("\n");
+	printf(optionformat, "--await-swiped",		"In deck mode, wait for the swiped event of each card before loading the next\n");
+	printf(optionformat, "--check",				"In scenario mode, only compile the scenario\n");
+#ifdef __linux__
+	printf(optionformat, "--check-interval=<s>",	"In serve mode, time between the checks of a quarantined probe (default 5)\n");
+#endif
+	printf(optionformat, "--count=<n>",			"Number of command mixes to run per backend in compare mode (default 100), or maximum number of swipes in schedule mode (default: the deck)\n");
+#ifdef __linux__
+	printf(optionformat, "--duration=<s>",		"In schedule mode, time span of the load profile\n");
+	printf(optionformat, "--end-rate=<n>",		"In schedule mode, swipes per second at the end of a ramp\n");
+#endif
+#ifdef __linux__
+	printf(optionformat, "--faults=<list>",		"In faults mode, the faults to inject: parity, lrc and/or sentinels (default all)\n");
+	printf(optionformat, "--feedback=<file>",	"In stress and faults mode, file or pipe the terminal under test writes a line to for every accepted swipe\n");
+	printf(optionformat, "--fast",				"In replay mode, send the commands as fast as possible instead of at the recorded timing\n");
+#endif
+	printf(optionformat, "--file=<deck>",		"Deck file for deck mode, the scenario file in scenario mode, or the session log in replay mode\n");
+#ifdef __linux__
+	printf(optionformat, "--from=<n>",			"In replay mode, first command to replay; the probe gets the configuration of the session at that point first\n");
+#endif
+#ifdef __linux__
+	printf(optionformat, "--histograms=<file>",	"Write the latency histograms of the probes and the command to a file on exit, for the histogram command\n");
+	printf(optionformat, "--interval=<ms>",		"In schedule mode, time between two swipes (a constant profile)\n");
+#endif
+	printf(optionformat, "--idle=<ms>",			"In deck mode, wait before the first card, to measure the wake-up latency of the probe\n");
+#ifdef __linux__
+	printf(optionformat, "--inject=<profile>",	"Inject transport faults, e.g. drop:0.01,crc:0.005 (faults: drop, dup, stale, crc, split, spike, lose)\n");
+	printf(optionformat, "--inject-seed=<n>",	"With --inject, seed of the fault generator (default 1)\n");
+	printf(optionformat, "--inject-spike=<ms>",	"With --inject, time a spike holds back the input (default 200)\n");
+#endif
+#ifdef __linux__
+	printf(optionformat, "--label=<label>",		"With --pool, lease any probe with the given label\n");
+	printf(optionformat, "--labels=<list>",		"In pool mode, labels of the probes as <serial>=<label>, separated by commas\n");
+	printf(optionformat, "--lease=<seconds>",	"With --pool, requested lease time (default and maximum: the --max-lease of the pool)\n");
+	printf(optionformat, "--keep-alive=<ms>",	"In serve mode, send a software version command to probes that were idle for the given time\n");
+	printf(optionformat, "--log=<file>",		"In schedule mode, write the target and actual time of every swipe to a CSV file; in faults mode the result of every case\n");
+	printf(optionformat, "--max-error-rate=<p>",	"In serve mode, percentage of failing recent operations that quarantines a probe (default 20)\n");
+	printf(optionformat, "--max-latency=<ms>",	"In serve mode, 95th percentile of the recent latencies that quarantines a probe (default 1000)\n");
+	printf(optionformat, "--max-lease=<seconds>",	"In pool mode, maximum lease time (default 3600)\n");
+	printf(optionformat, "--max-rate=<arms/s>",	"In stress mode, highest rate to try (default 500)\n");
+	printf(optionformat, "--metrics=[<addr>:]<port>",	"Serve the metrics of the probes over HTTP in Prometheus format (address 127.0.0.1 by default)\n");
+	printf(optionformat, "--metrics-file=<file>",	"Write the metrics of the probes in Prometheus format to a file, for the node exporter textfile collector\n");
+	printf(optionformat, "--metrics-interval=<s>",	"With --metrics-file, time between two writes of the file (default 15)\n");
+	printf(optionformat, "--min-accept=<p>",	"In stress mode, percentage of the swipes of a step that must be accepted (default 100)\n");
+	printf(optionformat, "--off=<s>",			"In schedule mode, pause between two bursts\n");
+	printf(optionformat, "--on=<s>",			"In schedule mode, length of a burst\n");
+	printf(optionformat, "--out=<file>",		"In histogram mode, write the merged histograms to a file\n");
+	printf(optionformat, "--poisson",			"In schedule mode, random arrivals at the momentary rate of a bursts or ramp profile\n");
+	printf(optionformat, "--pool[=<socket>]",	"Lease the probe from the probe pool at the socket (default " POOL_DEFAULT_SOCKET ") before connecting\n");
+	printf(optionformat, "--priority=<n>",		"With --pool, priority of the lease request, higher is served first (default 0)\n");
+	printf(optionformat, "--probe=<n>",			"In submit mode, index of the probe of the server to use (default 0)\n");
+	printf(optionformat, "--probe=any",			"In submit mode, let the server spread the cards over its healthy probes\n");
+	printf(optionformat, "--profile=<profile>",	"In schedule mode, arrival process: constant (default), poisson, bursts, ramp or trace\n");
+	printf(optionformat, "--rate=<n>",			"In schedule mode, swipes per second\n");
+	printf(optionformat, "--record=<file>",		"Record every command sent to the probes, with its timing, to a session log for the replay command\n");
+#endif
+#ifdef __linux__
+	printf(optionformat, "--port-reset",		"With --reconnect, reset the USB port of the probe from the second attempt on\n");
+#endif
+	printf(optionformat, "--no-autosuspend",	"Keep the probe out of USB runtime suspend while it is in use (Linux, needs write access to sysfs)\n");
+	printf(optionformat, "--reconnect[=<n>]",	"Reconnect to the probe (by serial number) after connection errors, with up to n attempts per command (default 5)\n");
+	printf(optionformat, "--reconnect-delay=<ms>",	"Wait before the first reconnect attempt, doubled for every next attempt (default 200)\n");
+#ifdef __linux__
+	printf(optionformat, "--search=<n>",		"In stress mode with --feedback, binary search steps after the first failing rate (default 6)\n");
+#endif
+#ifdef __linux__
+	printf(optionformat, "--seed=<n>",			"In schedule mode, seed of the random arrivals (default 1)\n");
+#endif
 	printf(optionformat, "--serial=auto",		"Select the probe using autodetection. When multiple probes are connected, the first one is selected\n");
 	printf(optionformat, "--serial=<serial>",	"Select the probe using the given serial number. A list of connected probes can be retrieved using the 'list' command\n");
+#ifdef __linux__
+	printf(optionformat, "--serial=any-free",	"Select the first probe that is not in use by another process\n");
+	printf(optionformat, "--speed=<factor>",	"In replay mode, replay faster (above 1) or slower than recorded (default 1)\n");
+	printf(optionformat, "--settle=<ms>",		"In stress mode, time to wait for the feedback after each step (default 1000); in faults mode after each case (default 500 with --feedback)\n");
+	printf(optionformat, "--sim-latency=<us>",	"With --simulate, time a simulated probe takes to respond to a command (default 1000)\n");
+	printf(optionformat, "--sim-probes=<n>",	"With --simulate, number of simulated probes, serial numbers SIM0000 and up (default 1)\n");
+	printf(optionformat, "--sim-swipe=<ms>",	"With --simulate, time from a go to the swiped event (default 100)\n");
+	printf(optionformat, "--simulate",			"Use simulated probes and a virtual clock that jumps to the next event, to check long runs in seconds\n");
+	printf(optionformat, "--start-rate=<arms/s>",	"In stress mode, first rate to try (default 10)\n");
+	printf(optionformat, "--step=<arms/s>",		"In stress mode, rate increase per step (default 10)\n");
+	printf(optionformat, "--step-time=<s>",		"In stress mode, duration of each step (default 2)\n");
+	printf(optionformat, "--swipe-timeout=<ms>",	"In stress mode, time to wait for the swiped event of an arm (default 1000)\n");
+	printf(optionformat, "--to=<n>",			"In replay mode, last command to replay\n");
+	printf(optionformat, "--times=<file>",		"In schedule mode, swipe times in ms after the first swipe, one per line\n");
+	printf(optionformat, "--tracks=<list>",		"In faults mode, the tracks to inject faults in (default 1,2,3)\n");
+	printf(optionformat, "--trace=<file>",		"In schedule mode, recorded times between swipes in ms, one per line, for the trace profile\n");
+	printf(optionformat, "--timeout=<seconds>",	"Wait at most the given time for a probe that is in use by another process\n");
+	printf(optionformat, "--wait",				"Wait until the probe is no longer in use by another process\n");
+#endif
+#ifdef __linux__
+	printf(optionformat, "--shm=<name>",		"Shared memory segment of the server (default ssp)\n");
+#endif
+	printf(optionformat, "--window=<n>",		"In deck mode, number of commands sent ahead of their responses (default 4); in replay mode per probe (default 1)\n");
 	printf(optionformat, "--track1=<data>",		"Data for track 1\n");
 	printf(optionformat, "--track2=<data>",		"Data for track 2\n");
 	printf(optionformat, "--track3=<data>",		"Data for track 3\n");
@@ -261,6 +476,197 @@ void checkTrackData(int tracknum, char * trackcontents) {
 
 }
 
+#ifdef __linux__
+// Time to wait for a probe that is locked by another process: --timeout=<seconds>, or forever with --wait. By default it is not waited for.
+static int lockTimeoutMs() {
+	char * timeout = getCommandLineParameterValue("--timeout", NULL);
+	if (timeout != NULL) {
+		if (atoi(timeout) < 0) {
+			cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --timeout, should be a number of seconds");
+		}
+		return atoi(timeout) * 1000;
+	}
+	return getCommandLineParameterPresent("--wait") ? -1 : 0;
+}
+
+// Locks the probe with the given key for this process, exits when it stays locked by another process. Simulated probes are not locked.
+static void lockProbeOrExit(const char * key, int timeoutMs) {
+	if (simulationActive()) {
+		return;
+	}
+	switch (lockProbe(key, timeoutMs)) {
+	case ProbeLockOk:
+		return;
+	case ProbeLockBusy:
+		cleanUpAndExit(ExitErrorHidOpen, "Probe %s is in use by another process (use --wait or --timeout to wait for it)", key);
+		break;
+	default:
+		cleanUpAndExit(ExitErrorHidOpen, "Cannot create the lock file of probe %s: %s", key, strerror(errno));
+	}
+}
+
+// Locks the first connected probe, or with anyFree the first probe that is not locked by another process, and stores its HID path.
+static void lockFirstProbe(bool anyFree, int timeoutMs, char * path, size_t pathSize) {
+	// the probes are locked by other processes, so the timeout is on the real clock also in the simulation mode
+	uint64_t deadline = getRealMonotonicTimeNs() + (uint64_t)(timeoutMs > 0 ? timeoutMs : 0) * 1000000ull;
+	for (;;) {
+		bool found = false;
+		struct hid_device_info * devs = hidBackend->enumerate(SSP_VID, SSP_PID);
+		for (struct hid_device_info * dev = devs; dev != NULL; dev = dev->next) {
+			char key[256];
+			snprintf(key, sizeof(key), "%ls", (dev->serial_number != NULL && dev->serial_number[0] != L'\0') ? dev->serial_number : L"");
+			if (key[0] == '\0') {
+				snprintf(key, sizeof(key), "%s", dev->path);
+			}
+			snprintf(path, pathSize, "%s", dev->path);
+			found = true;
+			if (!anyFree) {
+				hidBackend->free_enumeration(devs);
+				lockProbeOrExit(key, timeoutMs);
+				return;
+			}
+			if (simulationActive() || lockProbe(key, 0) == ProbeLockOk) {
+				hidBackend->free_enumeration(devs);
+				IFNOTQUIET(printf("Selected free probe %s\n", key));
+				return;
+			}
+		}
+		hidBackend->free_enumeration(devs);
+		if (!found) {
+			cleanUpAndExit(ExitErrorHidOpen, "Error opening HID device (using automatic selection)");
+		}
+		if (timeoutMs == 0 || (timeoutMs > 0 && getRealMonotonicTimeNs() >= deadline)) {
+			cleanUpAndExit(ExitErrorHidOpen, "All probes are in use by other processes (use --wait or --timeout to wait for one)");
+		}
+		struct timespec retry = { 0, 20000000L };
+		nanosleep(&retry, NULL);
+	}
+}
+#endif
+
+// Connects to the probe with the given serial (or "auto") and stores it in probe. Exits when the probe cannot be opened.
+// With --pool the probe is leased from the probe pool first: --serial=auto leases any free probe, --label=<label> any probe of the group.
+// On Linux the probe is locked against use by other processes until this process exits; --serial=any-free selects the first probe that is not locked.
+void connectProbe(char * serial) {
+#ifdef __linux__
+	static char leasedSerial[128];
+	if (getCommandLineParameterPresent("--pool")) {
+		char selector[160];
+		char * label = getCommandLineParameterValue("--label", "");
+		if (label[0] != '\0') {
+			snprintf(selector, sizeof(selector), "label:%s", label);
+		}
+		else if (strcmp(serial, "auto") == 0 || strcmp(serial, "any-free") == 0) {
+			snprintf(selector, sizeof(selector), "any");
+		}
+		else {
+			snprintf(selector, sizeof(selector), "serial:%s", serial);
+		}
+		int priority = atoi(getCommandLineParameterValue("--priority", "0"));
+		int leaseSeconds = atoi(getCommandLineParameterValue("--lease", "0"));
+		char error[256];
+		IFNOTQUIET(printf("Waiting for a lease on %s from the probe pool\n", selector));
+		if (!poolLeaseProbe(poolSocketPath(), selector, priority, leaseSeconds, leasedSerial, sizeof(leasedSerial), error, sizeof(error))) {
+			cleanUpAndExit(ExitErrorHidOpen, "%s", error);
+		}
+		IFNOTQUIET(printf("Leased probe %s\n", leasedSerial));
+		serial = leasedSerial;
+	}
+
+	SspResult result;
+	if (strcmp(serial, "auto") == 0 || strcmp(serial, "any-free") == 0) {
+		char path[512];
+		lockFirstProbe(strcmp(serial, "any-free") == 0, lockTimeoutMs(), path, sizeof(path));
+		result = sspOpenPath(path, &probe);
+		serial = "auto";
+	}
+	else {
+		lockProbeOrExit(serial, lockTimeoutMs());
+		result = sspOpen(serial, &probe);
+	}
+#else
+	SspResult result = sspOpen(serial, &probe);
+#endif
+	if (result == SspResultErrorHidOpen) {
+		if (strcmp(serial, "auto") == 0) {
+			cleanUpAndExit(ExitErrorHidOpen, "Error opening HID device (using automatic selection)");
+		}
+		cleanUpAndExit(ExitErrorHidOpen, "Error opening HID device (using serial %s)", serial);
+	}
+	checkResult(result);
+	applyDeviceOptions(probe);
+}
+
+#ifdef __linux__
+// Connects to the probes of a comma separated list of serials, or to one probe (auto, any-free or a serial) as connectProbe
+// does. The first probe is stored in probe, all of them in devices. Returns the number of probes, they are closed by
+// cleanUpAndExit.
+size_t connectProbes(char * serials, SspDevice *** devices) {
+	if (strchr(serials, ',') == NULL) {
+		connectProbe(serials);
+		connectedProbes = checkMalloc(malloc(sizeof(SspDevice *)));
+		connectedProbes[0] = probe;
+		connectedProbeCount = 1;
+		*devices = connectedProbes;
+		return connectedProbeCount;
+	}
+	char * list = checkMalloc(strdup(serials));
+	for (char * serial = strtok(list, ","); serial != NULL; serial = strtok(NULL, ",")) {
+		lockProbeOrExit(serial, lockTimeoutMs());
+		SspDevice * device;
+		SspResult result = sspOpen(serial, &device);
+		if (result != SspResultOk) {
+			free(list);
+			cleanUpAndExit(ExitErrorHidOpen, "Error opening HID device (using serial %s)", serial);
+		}
+		connectedProbes = checkMalloc(realloc(connectedProbes, (connectedProbeCount + 1) * sizeof(SspDevice *)));
+		connectedProbes[connectedProbeCount++] = device;
+		if (probe == NULL) {
+			probe = device;
+		}
+		applyDeviceOptions(device);
+	}
+	free(list);
+	*devices = connectedProbes;
+	return connectedProbeCount;
+}
+#endif
+
+// Applies the options for an opened probe: --no-autosuspend keeps it out of USB runtime suspend, --reconnect[=<attempts>]
+// enables reconnecting after connection errors, --record=<file> records the commands sent to it, --metrics and
+// --metrics-file export its counters.
+void applyDeviceOptions(SspDevice * device) {
+#ifdef __linux__
+	metricsAttach(device);
+	static bool recording = false;
+	char * record = getCommandLineParameterValue("--record", NULL);
+	if (record != NULL) {
+		if (!recording && !sessionRecordStart(record)) {
+			cleanUpAndExit(ExitErrorCommandLineParameter, "Cannot create session log %s", record);
+		}
+		recording = true;
+		sessionRecordProbe(device);
+	}
+#endif
+	if (getCommandLineParameterPresent("--no-autosuspend") && !sspPreventAutosuspend(device)) {
+		fprintf(stderr, "Warning: cannot disable USB autosuspend of the probe (no write access to power/control in sysfs?)\n");
+	}
+	char * reconnect = getCommandLineParameterValue("--reconnect", NULL);
+	if (reconnect == NULL) {
+		return;
+	}
+	SspRecoveryOptions options = SSP_RECOVERY_OPTIONS_DEFAULT;
+	if (reconnect[0] != '\0') {
+		options.attempts = atoi(reconnect);
+	}
+	options.delayMs = atoi(getCommandLineParameterValue("--reconnect-delay", "200"));
+	options.portReset = getCommandLineParameterPresent("--port-reset");
+	if (options.attempts == 0 || options.delayMs < 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --reconnect or --reconnect-delay, should be a positive number");
+	}
+	sspSetRecovery(device, &options);
+}
+
 int swipeCard() {
 	char * serial = getCommandLineParameterValue("--serial", "");
 	if (strcmp(serial, "auto") == 0) {
@@ -269,12 +675,16 @@ int swipeCard() {
 	else {
 		IFNOTQUIET(printf("Connecting to probe with serialnumber %s\n", serial));
 	}
-	sspConnect(serial);
+	selectBackend();
+	connectProbe(serial);
 	// wipe any configuration traces from a previous run
-	sspResetToDefaultConfiguration();
+	checkResult(sspResetToDefaultConfiguration(probe));
 	// Retrieve firmware version:
-	SspFirmwareVersion version = sspGetFirmwareVersion();
-	IFNOTQUIET(printf("Firmware version: %d.%d Bootloader %d.%d\n\n", version.firmwareMajor, version.firmwareMinor, version.bootloaderMajor, version.bootloaderMinor));
+	SspFirmwareVersion version;
+	checkResult(sspGetFirmwareVersion(probe, &version));
+	IFNOTQUIET(printf("Firmware version: %d.%d Bootloader %d.%d\n", version.firmwareMajor, version.firmwareMinor, version.bootloaderMajor, version.bootloaderMinor));
+	HidReportLayout layout = sspGetReportLayout(probe);
+	IFNOTQUIET(printf("Reports: input %d bytes (ID %d), output %d bytes (ID %d)\n\n", layout.inputReportLength, layout.inputReportId, layout.outputReportLength, layout.outputReportId));
 	
 	char *track1 = getCommandLineParameterValue("--track1", "");
 	char *track2 = getCommandLineParameterValue("--track2", "");
@@ -291,15 +701,177 @@ int swipeCard() {
 
 	IFNOTQUIET(printf("\nSwiping card...\n"));
 	// Send the contents of the tracks
-	sspSetTrackDataString(1, track1, strlen(track1));
-	sspSetTrackDataString(2, track2, strlen(track2));
-	sspSetTrackDataString(3, track3, strlen(track3));
+	checkResult(sspSetTrackDataString(probe, 1, track1, strlen(track1)));
+	checkResult(sspSetTrackDataString(probe, 2, track2, strlen(track2)));
+	checkResult(sspSetTrackDataString(probe, 3, track3, strlen(track3)));
 
 	// Set trigger mode immediately
-	sspSetTriggerMode(SspTriggerModeImmediately);
+	checkResult(sspSetTriggerMode(probe, SspTriggerModeImmediately));
 	// Arm the trigger (because we just set the trigger mode to immediately, the swipe will be fired and we return to stop mode);
-	sspSendGo();	
+	checkResult(sspSendGo(probe));	
+
+	return 0;
+}
 
+// Reads a deck file (see sspParseDeck for the format). Returns the number of cards.
+// The tracks of the cards point into *buffer, which must be freed by the caller.
+size_t readDeck(const char * filename, SspCard ** cards, char ** buffer) {
+	FILE * file = fopen(filename, "rb");
+	if (file == NULL) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Cannot open deck file %s", filename);
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	*buffer = checkMalloc(malloc(size + 1));
+	size_t length = fread(*buffer, 1, size, file);
+	fclose(file);
+
+	size_t count = sspParseDeck(*buffer, length, NULL, 0);
+	*cards = checkMalloc(malloc((count + 1) * sizeof(SspCard)));
+	sspParseDeck(*buffer, length, *cards, count);
+	return count;
+}
+
+// Swipes all cards of a deck file in one batch.
+int swipeDeck() {
+	char * serial = getCommandLineParameterValue("--serial", "auto");
+	char * filename = getCommandLineParameterValue("--file", "");
+	SspBatchOptions options = SSP_BATCH_OPTIONS_DEFAULT;
+	options.window = atoi(getCommandLineParameterValue("--window", "4"));
+	options.awaitSwiped = getCommandLineParameterPresent("--await-swiped");
+	if (options.window == 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --window, should be a positive number");
+	}
+
+	SspCard * cards;
+	char * buffer;
+	size_t count = readDeck(filename, &cards, &buffer);
+	SspSwipeResult * results = checkMalloc(malloc((count + 1) * sizeof(SspSwipeResult)));
+
+	int idleMs = atoi(getCommandLineParameterValue("--idle", "0"));
+
+	selectBackend();
+	connectProbe(serial);
+	checkResult(sspResetToDefaultConfiguration(probe));
+	// an idle period before the first card shows the cost of waking the probe up
+	if (idleMs > 0) {
+		IFNOTQUIET(printf("Idle for %d ms\n", idleMs));
+		sleepMs(idleMs);
+	}
+
+	IFNOTQUIET(printf("Swiping %zu cards from %s (window %u)\n", count, filename, options.window));
+	uint64_t start = getMonotonicTimeNs();
+	SspResult result = sspSwipeMany(probe, cards, count, results, &options);
+	uint64_t elapsed = getMonotonicTimeNs() - start;
+
+	size_t swiped = 0;
+	uint64_t firstNs = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (results[i].result == SspResultOk) {
+			if (swiped++ == 0) {
+				firstNs = results[i].completedNs - start;
+			}
+		}
+		else {
+			printf("Card %zu: %s\n", i + 1, sspResultString(results[i].result));
+		}
+	}
+	IFNOTQUIET(printf("%zu of %zu cards swiped in %.3f s (%.1f cards/s)\n", swiped, count, elapsed / 1e9, swiped / (elapsed / 1e9)));
+	// the first card includes waking up the probe, it is reported apart from the rate of the others
+	if (swiped > 1) {
+		IFNOTQUIET(printf("First card after %.3f ms, the others at %.1f cards/s\n", firstNs / 1e6, (swiped - 1) / ((elapsed - firstNs) / 1e9)));
+	}
+
+	free(results);
+	free(cards);
+	free(buffer);
+	checkResult(result);
+	return 0;
+}
+
+// Prints the latencies of one command of the mix, and saves them for --histograms as compare/<backend>/<command>.
+static void printLatency(const char * backend, const char * command, const char * label, const Histogram * histogram) {
+	histogramPrint(stdout, label, histogram);
+#ifdef __linux__
+	char name[128];
+	snprintf(name, sizeof(name), "compare/%s/%s", backend, command);
+	metricsSaveHistogram(name, histogram);
+#else
+	(void)backend;
+	(void)command;
+#endif
+}
+
+// Runs the same command mix over each available HID backend and prints latency and CPU cost per backend.
+// Note: the libusb backend detaches the kernel hidraw driver while it has the probe open and re-attaches it on close.
+int compareBackends() {
+	char * serial = getCommandLineParameterValue("--serial", "auto");
+	int count = atoi(getCommandLineParameterValue("--count", "100"));
+	if (count <= 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --count, should be a positive number");
+	}
+
+	char track2[] = ";1234567890123456=99121010000000000000?";
+
+	for (size_t b = 0; hidBackendNames[b] != NULL; b++) {
+		const char * name = hidBackendNames[b];
+		if (!hidBackendSelect(name)) {
+			printf("Backend %s: not available\n\n", name);
+			continue;
+		}
+		IFNOTQUIET(printf("Backend %s: running %d command mixes on probe %s\n", name, count, serial));
+
+		uint64_t connectStart = getMonotonicTimeNs();
+		connectProbe(serial);
+		uint64_t connectNs = getMonotonicTimeNs() - connectStart;
+		// the first command also wakes up the probe, it is not part of the statistics
+		uint64_t firstStart = getMonotonicTimeNs();
+		checkResult(sspResetToDefaultConfiguration(probe));
+		uint64_t firstNs = getMonotonicTimeNs() - firstStart;
+
+		Histogram * versionStats = checkMalloc(malloc(sizeof(Histogram)));
+		Histogram * trackDataStats = checkMalloc(malloc(sizeof(Histogram)));
+		Histogram * resetStats = checkMalloc(malloc(sizeof(Histogram)));
+		histogramInit(versionStats);
+		histogramInit(trackDataStats);
+		histogramInit(resetStats);
+
+		uint64_t wallStart = getMonotonicTimeNs();
+		uint64_t cpuStart = getProcessCpuTimeNs();
+		for (int i = 0; i < count; i++) {
+			uint64_t t0 = getMonotonicTimeNs();
+			SspFirmwareVersion version;
+			checkResult(sspGetFirmwareVersion(probe, &version));
+			uint64_t t1 = getMonotonicTimeNs();
+			checkResult(sspSetTrackDataString(probe, 2, track2, strlen(track2)));
+			uint64_t t2 = getMonotonicTimeNs();
+			checkResult(sspResetToDefaultConfiguration(probe));
+			uint64_t t3 = getMonotonicTimeNs();
+			histogramRecord(versionStats, t1 - t0);
+			histogramRecord(trackDataStats, t2 - t1);
+			histogramRecord(resetStats, t3 - t2);
+		}
+		uint64_t wallNs = getMonotonicTimeNs() - wallStart;
+		uint64_t cpuNs = getProcessCpuTimeNs() - cpuStart;
+
+		sspClose(probe);
+		probe = NULL;
+		sspExit();
+
+		unsigned int commands = 3 * (unsigned int)count;
+		printf("Backend %s:\n", name);
+		printf("  %-20s %8.3f ms\n", "connect", connectNs / 1e6);
+		printf("  %-20s %8.3f ms\n", "first command", firstNs / 1e6);
+		printLatency(name, "version", "firmware version", versionStats);
+		printLatency(name, "trackdata", "track data", trackDataStats);
+		printLatency(name, "reset", "reset config", resetStats);
+		free(versionStats);
+		free(trackDataStats);
+		free(resetStats);
+		printf("  %-20s %.1f commands/s, CPU %.3f ms total, %.1f us per command (%.1f%% of wall time)\n\n", "throughput",
+			commands / (wallNs / 1e9), cpuNs / 1e6, cpuNs / 1e3 / commands, 100.0 * cpuNs / wallNs);
+	}
 	return 0;
 }
 
@@ -316,6 +888,32 @@ int main(int argc, char *argv[]) {
 		listProbes();
 	} else if (getCommandLineParameterPresent("swipe") && getCommandLineParameterPresent("--serial")) {
 		swipeCard();
+	} else if (getCommandLineParameterPresent("deck")) {
+		swipeDeck();
+#ifdef __linux__
+	} else if (getCommandLineParameterPresent("serve")) {
+		serveProbes();
+	} else if (getCommandLineParameterPresent("submit")) {
+		submitDeck();
+	} else if (getCommandLineParameterPresent("schedule")) {
+		scheduleSwipes();
+	} else if (getCommandLineParameterPresent("stress")) {
+		stressSwipes();
+	} else if (getCommandLineParameterPresent("replay")) {
+		replaySession();
+	} else if (getCommandLineParameterPresent("faults")) {
+		runFaultCampaign();
+	} else if (getCommandLineParameterPresent("pool")) {
+		runPool();
+	} else if (getCommandLineParameterPresent("status")) {
+		poolStatus();
+	} else if (getCommandLineParameterPresent("histogram")) {
+		mergeHistograms();
+#endif
+	} else if (getCommandLineParameterPresent("scenario")) {
+		runScenario();
+	} else if (getCommandLineParameterPresent("compare")) {
+		compareBackends();
 	} else { 
 		printUsage(argv[0]);
 	}
@@ -21,6 +21,8 @@ IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "protocol.h"
+
 #define SSP_VID	0x2B2F
 #define SSP_PID	0x0001
 #define DLE		0x10
@@ -45,6 +47,27 @@ typedef enum {
 	ExitErrorCommandLineParameter = -5,
 } ExitCode;
 
+#define IFNOTQUIET(x)  \
+	do {							\
+		if (!quietOperation) {		\
+			x;						\
+		}							\
+	} while(0)
+
+extern bool quietOperation;
+extern SspDevice * probe;
+
 void cleanUpAndExit(int code, char * errorMessage, ...);
+void checkResult(SspResult result);
+void * checkMalloc(void * ptr);
+char * getCommandLineParameterValue(char * parameter, char * _default);
+bool getCommandLineParameterPresent(char * parameter);
+void selectBackend();
+void connectProbe(char * serial);
+#ifdef __linux__
+size_t connectProbes(char * serials, SspDevice *** devices);
+#endif
+void applyDeviceOptions(SspDevice * device);
+size_t readDeck(const char * filename, SspCard ** cards, char ** buffer);
 
 #endif /*not defined SSPCOMMANDLINEC_H */
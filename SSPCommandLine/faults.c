@@ -0,0 +1,309 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "SSPCommandLineTool.h"
+#include "protocol.h"
+#include "faults.h"
+#include "util.h"
+
+typedef enum {
+	FaultNone,					///< the card as is
+	FaultParity,				///< wrong parity bit of the character at position
+	FaultLrcBit,				///< data bit position of the LRC flipped
+	FaultLrcParity,				///< right LRC with a wrong parity bit
+	FaultNoStartSentinel,
+	FaultNoEndSentinel,
+	FaultNoSentinels,
+	FaultKinds
+} FaultKind;
+
+static const char * faultNames[FaultKinds] = { "none", "parity", "lrc-bit", "lrc-parity", "no-start-sentinel", "no-end-sentinel", "no-sentinels" };
+
+typedef struct {
+	size_t card;
+	int track;					///< 1 to 3, 0 for FaultNone
+	FaultKind kind;
+	int position;				///< character (FaultParity) or bit (FaultLrcBit)
+} FaultCase;
+
+// What is loaded in one track of the probe
+typedef struct {
+	uint8_t symbols[SSP_MAX_TRACK_LENGTH];
+	size_t length;
+	uint8_t config[SSP_TRACK_CONFIG_LENGTH];
+} FaultTrack;
+
+// Symbols of a card, checked before the campaign starts
+typedef struct {
+	uint8_t symbols[3][SSP_MAX_TRACK_LENGTH];
+	size_t length[3];
+	bool valid;
+} FaultCard;
+
+static size_t addCase(FaultCase ** cases, size_t count, size_t * allocated, FaultCase faultCase) {
+	if (count == *allocated) {
+		*allocated = (*allocated == 0) ? 1024 : *allocated * 2;
+		*cases = checkMalloc(realloc(*cases, *allocated * sizeof(FaultCase)));
+	}
+	(*cases)[count] = faultCase;
+	return count + 1;
+}
+
+static bool hasStartSentinel(int track, const FaultCard * card) {
+	// '%' on track 1, ';' on track 2 and 3, as symbols
+	return card->length[track - 1] > 0 && card->symbols[track - 1][0] == ((track == 1) ? '%' - 0x20 : ';' - 0x30);
+}
+
+static bool hasEndSentinel(int track, const FaultCard * card) {
+	size_t length = card->length[track - 1];
+	return length > 0 && card->symbols[track - 1][length - 1] == ((track == 1) ? '?' - 0x20 : '?' - 0x30);
+}
+
+// Lists the cases: for every card the card as is, followed by the selected faults on the selected tracks.
+static size_t enumerateCases(const FaultCard * cards, size_t cardCount, const char * faults, const bool * tracks, FaultCase ** cases) {
+	bool parity = strstr(faults, "parity") != NULL;
+	bool lrc = strstr(faults, "lrc") != NULL;
+	bool sentinels = strstr(faults, "sentinels") != NULL;
+	size_t count = 0;
+	size_t allocated = 0;
+	*cases = NULL;
+	for (size_t c = 0; c < cardCount; c++) {
+		if (!cards[c].valid) {
+			continue;
+		}
+		count = addCase(cases, count, &allocated, (FaultCase) { c, 0, FaultNone, 0 });
+		for (int t = 1; t <= 3; t++) {
+			size_t length = cards[c].length[t - 1];
+			if (!tracks[t - 1] || length == 0) {
+				continue;
+			}
+			for (size_t i = 0; parity && i < length; i++) {
+				count = addCase(cases, count, &allocated, (FaultCase) { c, t, FaultParity, (int)i });
+			}
+			for (int bit = 0; lrc && bit < ((t == 1) ? 6 : 4); bit++) {
+				count = addCase(cases, count, &allocated, (FaultCase) { c, t, FaultLrcBit, bit });
+			}
+			if (lrc) {
+				count = addCase(cases, count, &allocated, (FaultCase) { c, t, FaultLrcParity, 0 });
+			}
+			if (sentinels && hasStartSentinel(t, &cards[c])) {
+				count = addCase(cases, count, &allocated, (FaultCase) { c, t, FaultNoStartSentinel, 0 });
+			}
+			if (sentinels && hasEndSentinel(t, &cards[c])) {
+				count = addCase(cases, count, &allocated, (FaultCase) { c, t, FaultNoEndSentinel, 0 });
+			}
+			if (sentinels && hasStartSentinel(t, &cards[c]) && hasEndSentinel(t, &cards[c])) {
+				count = addCase(cases, count, &allocated, (FaultCase) { c, t, FaultNoSentinels, 0 });
+			}
+		}
+	}
+	return count;
+}
+
+// The LRC the probe calculates: the exclusive or of the data bits of all characters.
+static uint8_t calculateLrc(int track, const uint8_t * symbols, size_t length) {
+	uint8_t lrc = 0;
+	for (size_t i = 0; i < length; i++) {
+		lrc ^= symbols[i];
+	}
+	return lrc & ((track == 1) ? 0x3f : 0x0f);
+}
+
+// Builds what should be loaded in track t for a case.
+static void buildTrack(const FaultCase * faultCase, const FaultCard * card, int t, FaultTrack * track) {
+	SspTrackConfiguration config = { .lrcGeneration = LrcAuto };
+	const uint8_t * symbols = card->symbols[t - 1];
+	size_t length = card->length[t - 1];
+	FaultKind kind = (faultCase->track == t) ? faultCase->kind : FaultNone;
+	if (kind == FaultNoStartSentinel || kind == FaultNoSentinels) {
+		symbols++;
+		length--;
+	}
+	if (kind == FaultNoEndSentinel || kind == FaultNoSentinels) {
+		length--;
+	}
+	memcpy(track->symbols, symbols, length);
+	track->length = length;
+	if (kind == FaultParity) {
+		// the probe calculates the parity over the whole byte and sends only the low bits, so bit 7 inverts the parity
+		track->symbols[faultCase->position] |= 0x80;
+	}
+	else if (kind == FaultLrcBit || kind == FaultLrcParity) {
+		config.lrcGeneration = LrcManual;
+		config.manualLrc = calculateLrc(t, symbols, length);
+		config.manualLrc ^= (kind == FaultLrcBit) ? (uint8_t)(1 << faultCase->position) : 0x80;
+	}
+	sspEncodeTrackConfig(&config, track->config);
+}
+
+// Swipes one case, uploading only the tracks and configurations that differ from what is loaded.
+static SspResult runCase(const FaultCase * faultCase, const FaultCard * card, FaultTrack * loaded, bool awaitSwiped, unsigned * commands) {
+	SspResult result = SspResultOk;
+	for (int t = 1; t <= 3 && result == SspResultOk; t++) {
+		FaultTrack wanted;
+		buildTrack(faultCase, card, t, &wanted);
+		FaultTrack * current = &loaded[t - 1];
+		if (memcmp(wanted.config, current->config, SSP_TRACK_CONFIG_LENGTH) != 0) {
+			SspTrackConfiguration config = { .lrcGeneration = wanted.config[0], .manualLrc = wanted.config[7] };
+			result = sspSetTrackConfig(probe, t, &config);
+			(*commands)++;
+			memcpy(current->config, wanted.config, SSP_TRACK_CONFIG_LENGTH);
+			if (result != SspResultOk) {
+				// the state of the probe is not known, it is uploaded again for the next case
+				current->config[0] = 0xff;
+			}
+		}
+		if (result == SspResultOk && (wanted.length != current->length || memcmp(wanted.symbols, current->symbols, wanted.length) != 0)) {
+			result = sspSetTrackDataBinary(probe, t, wanted.symbols, wanted.length);
+			(*commands)++;
+			memcpy(current->symbols, wanted.symbols, wanted.length);
+			current->length = (result == SspResultOk) ? wanted.length : SIZE_MAX;
+		}
+	}
+	if (result == SspResultOk) {
+		result = sspSendGo(probe);
+		(*commands)++;
+	}
+	if (result == SspResultOk && awaitSwiped) {
+		result = sspAwaitSwiped(probe, 5000);
+	}
+	return result;
+}
+
+int runFaultCampaign() {
+	char * serial = getCommandLineParameterValue("--serial", "auto");
+	char * filename = getCommandLineParameterValue("--file", "");
+	char * faults = getCommandLineParameterValue("--faults", "parity,lrc,sentinels");
+	char * trackList = getCommandLineParameterValue("--tracks", "1,2,3");
+	char * feedbackFilename = getCommandLineParameterValue("--feedback", NULL);
+	char * logFilename = getCommandLineParameterValue("--log", NULL);
+	bool awaitSwiped = getCommandLineParameterPresent("--await-swiped");
+	int settleMs = atoi(getCommandLineParameterValue("--settle", (feedbackFilename != NULL) ? "500" : "0"));
+	bool tracks[3] = { strchr(trackList, '1') != NULL, strchr(trackList, '2') != NULL, strchr(trackList, '3') != NULL };
+
+	SspCard * deck;
+	char * buffer;
+	size_t cardCount = readDeck(filename, &deck, &buffer);
+	FaultCard * cards = checkMalloc(calloc(cardCount + 1, sizeof(FaultCard)));
+	for (size_t c = 0; c < cardCount; c++) {
+		cards[c].valid = true;
+		for (int t = 0; t < 3; t++) {
+			cards[c].length[t] = deck[c].length[t];
+			if (deck[c].length[t] > SSP_MAX_TRACK_LENGTH || sspEncodeTrackData(t + 1, deck[c].track[t], deck[c].length[t], cards[c].symbols[t], NULL) != SspResultOk) {
+				printf("Skipping card %zu: track %d cannot be encoded\n", c + 1, t + 1);
+				cards[c].valid = false;
+				break;
+			}
+		}
+	}
+	FaultCase * cases;
+	size_t count = enumerateCases(cards, cardCount, faults, tracks, &cases);
+	if (count == 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "No cases to run, check --file, --faults and --tracks");
+	}
+
+	int feedbackFd = -1;
+	if (feedbackFilename != NULL && (feedbackFd = openFeedback(feedbackFilename)) < 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Cannot open feedback source %s", feedbackFilename);
+	}
+	FILE * log = NULL;
+	if (logFilename != NULL) {
+		log = fopen(logFilename, "w");
+		if (log == NULL) {
+			cleanUpAndExit(ExitErrorCommandLineParameter, "Cannot write log file %s", logFilename);
+		}
+		fprintf(log, "case,card,track,fault,position,result,accepted\n");
+	}
+
+	selectBackend();
+	connectProbe(serial);
+	checkResult(sspResetToDefaultConfiguration(probe));
+	checkResult(sspSetTriggerMode(probe, SspTriggerModeImmediately));
+	// after the reset the tracks are empty and calculate their own LRC
+	FaultTrack loaded[3];
+	memset(loaded, 0, sizeof(loaded));
+	for (int t = 0; t < 3; t++) {
+		SspTrackConfiguration config = { .lrcGeneration = LrcAuto };
+		sspEncodeTrackConfig(&config, loaded[t].config);
+	}
+
+	IFNOTQUIET(printf("Running %zu cases on %zu cards\n", count, cardCount));
+	unsigned caseCount[FaultKinds] = { 0 };
+	unsigned swiped[FaultKinds] = { 0 };
+	unsigned accepted[FaultKinds] = { 0 };
+	unsigned commands = 0;
+	uint64_t start = getMonotonicTimeNs();
+	for (size_t i = 0; i < count; i++) {
+		const FaultCase * faultCase = &cases[i];
+		if (feedbackFd >= 0) {
+			// feedback on earlier cases that came in late does not count for this one
+			readFeedbackLines(feedbackFd);
+		}
+		SspResult result = runCase(faultCase, &cards[faultCase->card], loaded, awaitSwiped, &commands);
+		bool caseAccepted = false;
+		if (settleMs > 0) {
+			sleepMs(settleMs);
+		}
+		if (feedbackFd >= 0) {
+			caseAccepted = readFeedbackLines(feedbackFd) > 0;
+		}
+		caseCount[faultCase->kind]++;
+		swiped[faultCase->kind] += (result == SspResultOk);
+		accepted[faultCase->kind] += caseAccepted;
+		if (result != SspResultOk) {
+			printf("Case %zu (card %zu, track %d, %s %d): %s\n", i + 1, faultCase->card + 1, faultCase->track, faultNames[faultCase->kind],
+				faultCase->position, sspErrorMessage(probe));
+		}
+		if (log != NULL) {
+			fprintf(log, "%zu,%zu,%d,%s,%d,%s,%s\n", i + 1, faultCase->card + 1, faultCase->track, faultNames[faultCase->kind], faultCase->position,
+				sspResultString(result), (feedbackFd < 0) ? "" : (caseAccepted ? "yes" : "no"));
+		}
+	}
+	uint64_t elapsed = getMonotonicTimeNs() - start;
+
+	printf("%zu cases in %.1f s (%.0f cases/hour), %u commands sent (%.2f per case)\n", count, elapsed / 1e9, count / (elapsed / 3.6e12),
+		commands, (double)commands / count);
+	for (int kind = 0; kind < FaultKinds; kind++) {
+		if (caseCount[kind] == 0) {
+			continue;
+		}
+		printf("  %-18s %6u cases, %6u swiped", faultNames[kind], caseCount[kind], swiped[kind]);
+		if (feedbackFd >= 0) {
+			printf(", %6u accepted", accepted[kind]);
+		}
+		printf("\n");
+	}
+
+	if (log != NULL) {
+		fclose(log);
+	}
+	if (feedbackFd >= 0) {
+		close(feedbackFd);
+	}
+	free(cases);
+	free(cards);
+	free(deck);
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,32 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef FAULTS_H
+#define FAULTS_H
+
+// Fault campaigns (the faults command, Linux only): every card of a deck is swiped once as is and then with one fault
+// at a time, to see which malformed cards the terminal under test accepts. The faults are:
+//	parity		the parity bit of one character is wrong, for every character of the track
+//	lrc			the LRC has one data bit wrong, for every data bit, or the right value with a wrong parity bit
+//	sentinels	the start sentinel, the end sentinel or both are left out
+// Consecutive cases differ in one track only, so only the track data and configuration that changed are uploaded before
+// the next arm. With --feedback the terminal writes a line per accepted swipe to a file or pipe, which is recorded per case.
+
+// faults command: runs the campaign and reports per fault how many cases were accepted.
+int runFaultCampaign();
+
+#endif /* not defined FAULTS_H */
@@ -0,0 +1,127 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#define _CRT_NONSTDC_NO_DEPRECATE
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "hidbackend.h"
+#include "util.h"
+
+HidBackend * hidBackend = NULL;
+
+#ifdef _WIN32
+
+// On Windows there is only one hidapi implementation, linked in directly.
+const char * const hidBackendNames[] = { "windows", NULL };
+
+static HidBackend windowsBackend = {
+	.name = "windows",
+	.init = hid_init,
+	.exit = hid_exit,
+	.enumerate = hid_enumerate,
+	.free_enumeration = hid_free_enumeration,
+	.open = hid_open,
+	.open_path = hid_open_path,
+	.write = hid_write,
+	.read_timeout = hid_read_timeout,
+	.close = hid_close,
+	.get_report_descriptor = NULL,	// not available on Windows
+};
+
+bool hidBackendSelect(const char * name) {
+	if (strcmp(name, windowsBackend.name) != 0) {
+		return false;
+	}
+	hidBackend = &windowsBackend;
+	return true;
+}
+
+#else
+
+#include <dlfcn.h>
+
+const char * const hidBackendNames[] = { "hidraw", "libusb", NULL };
+
+typedef struct {
+	HidBackend functions;
+	const char * libraries[3];		///< Library names to try, in order
+	void * handle;					///< dlopen handle, NULL when not loaded yet
+} LoadableHidBackend;
+
+static LoadableHidBackend loadableBackends[] = {
+	{ .functions = { .name = "hidraw" }, .libraries = { "libhidapi-hidraw.so.0", "libhidapi-hidraw.so", NULL } },
+	{ .functions = { .name = "libusb" }, .libraries = { "libhidapi-libusb.so.0", "libhidapi-libusb.so", NULL } },
+};
+
+// Resolves symbol [name] from [handle] into [target]. Returns false when it is missing.
+static bool resolve(void * handle, const char * name, void * target) {
+	void * symbol = dlsym(handle, name);
+	if (symbol == NULL) {
+		return false;
+	}
+	memcpy(target, &symbol, sizeof(symbol));
+	return true;
+}
+
+static bool loadBackend(LoadableHidBackend * backend) {
+	for (size_t i = 0; backend->handle == NULL && backend->libraries[i] != NULL; i++) {
+		backend->handle = dlopen(backend->libraries[i], RTLD_NOW | RTLD_LOCAL);
+	}
+	if (backend->handle == NULL) {
+		return false;
+	}
+
+	HidBackend * f = &backend->functions;
+	bool ok = resolve(backend->handle, "hid_init", &f->init);
+	ok &= resolve(backend->handle, "hid_exit", &f->exit);
+	ok &= resolve(backend->handle, "hid_enumerate", &f->enumerate);
+	ok &= resolve(backend->handle, "hid_free_enumeration", &f->free_enumeration);
+	ok &= resolve(backend->handle, "hid_open", &f->open);
+	ok &= resolve(backend->handle, "hid_open_path", &f->open_path);
+	ok &= resolve(backend->handle, "hid_write", &f->write);
+	ok &= resolve(backend->handle, "hid_read_timeout", &f->read_timeout);
+	ok &= resolve(backend->handle, "hid_close", &f->close);
+	// optional: libraries built before hid_get_report_descriptor was added do not have it
+	if (!resolve(backend->handle, "hid_get_report_descriptor", &f->get_report_descriptor)) {
+		f->get_report_descriptor = NULL;
+	}
+	if (!ok) {
+		dlclose(backend->handle);
+		backend->handle = NULL;
+	}
+	return ok;
+}
+
+bool hidBackendSelect(const char * name) {
+	for (size_t i = 0; i < ARRAY_SIZE(loadableBackends); i++) {
+		if (strcmp(name, loadableBackends[i].functions.name) == 0) {
+			if (!loadBackend(&loadableBackends[i])) {
+				return false;
+			}
+			hidBackend = &loadableBackends[i].functions;
+			return true;
+		}
+	}
+	return false;
+}
+
+#endif
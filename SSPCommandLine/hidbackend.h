@@ -0,0 +1,52 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef HIDBACKEND_H
+#define HIDBACKEND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <wchar.h>
+
+#include "hidapi/hidapi.h"
+
+// Table of the hidapi functions used by the utility. On Linux the tree contains two hidapi implementations (hidraw and libusb)
+// that export the same symbols, so they cannot be linked together. Instead the selected one is loaded at runtime.
+typedef struct {
+	const char * name;
+	int (*init)(void);
+	int (*exit)(void);
+	struct hid_device_info * (*enumerate)(unsigned short vendor_id, unsigned short product_id);
+	void (*free_enumeration)(struct hid_device_info * devs);
+	hid_device * (*open)(unsigned short vendor_id, unsigned short product_id, const wchar_t * serial_number);
+	hid_device * (*open_path)(const char * path);
+	int (*write)(hid_device * device, const unsigned char * data, size_t length);
+	int (*read_timeout)(hid_device * device, unsigned char * data, size_t length, int milliseconds);
+	void (*close)(hid_device * device);
+	int (*get_report_descriptor)(hid_device * device, unsigned char * buf, size_t buf_size);	///< Optional, NULL when the library does not provide it
+} HidBackend;
+
+// The currently selected backend, NULL until hidBackendSelect succeeded.
+extern HidBackend * hidBackend;
+
+// Names of the backends that can be passed to hidBackendSelect, NULL terminated. The first one is the default.
+extern const char * const hidBackendNames[];
+
+// Selects (and on Linux loads) the backend with the given name. Returns false when it is unknown or cannot be loaded.
+bool hidBackendSelect(const char * name);
+
+#endif /* not defined HIDBACKEND_H */
@@ -0,0 +1,323 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "SSPCommandLineTool.h"
+#include "hidinject.h"
+#include "hidbackend.h"
+#include "util.h"
+
+// Largest report: the HID maximum of 1024 bytes plus the report number
+#define INJECT_MAX_REPORT (1024 + 1)
+// Reports held back for later reads: at most one duplicate, split part or stale report, plus the report itself
+#define INJECT_HELD 4
+
+typedef enum {
+	InjectDrop,
+	InjectDuplicate,
+	InjectStale,
+	InjectCrc,
+	InjectSplit,
+	InjectSpike,
+	InjectLose,
+	InjectKindCount,
+} InjectKind;
+
+static const char * const injectNames[InjectKindCount] = { "drop", "dup", "stale", "crc", "split", "spike", "lose" };
+
+typedef struct {
+	uint8_t data[INJECT_MAX_REPORT];
+	int length;
+	uint64_t readyNs;
+} InjectReport;
+
+// A device opened through the shim
+typedef struct {
+	hid_device * hid;				///< the device of the wrapped backend
+	uint64_t random;				///< generator state
+	InjectReport held[INJECT_HELD];	///< reports to deliver before reading new ones, in order
+	size_t heldCount;
+	InjectReport last;				///< the report delivered last, for stale reports
+} InjectDevice;
+
+static HidBackend * injectTarget = NULL;
+static double injectProbability[InjectKindCount];
+static uint64_t injectSeed = 1;
+static uint64_t injectSpikeNs = 0;
+static unsigned int injectDevices = 0;
+static uint64_t injectCount[InjectKindCount];
+static uint64_t injectReportsIn = 0;
+static uint64_t injectReportsOut = 0;
+
+// splitmix64, like the load profiles
+static uint64_t nextRandom(uint64_t * state) {
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+// Draws whether a fault of the given kind is injected, and counts it.
+static bool inject(InjectDevice * device, InjectKind kind) {
+	if (injectProbability[kind] <= 0 || (nextRandom(&device->random) >> 11) * (1.0 / 9007199254740992.0) >= injectProbability[kind]) {
+		return false;
+	}
+	__atomic_add_fetch(&injectCount[kind], 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+static void hold(InjectDevice * device, const uint8_t * data, int length, uint64_t readyNs) {
+	if (device->heldCount == INJECT_HELD) {
+		return;
+	}
+	InjectReport * report = &device->held[device->heldCount++];
+	memcpy(report->data, data, length);
+	report->length = length;
+	report->readyNs = readyNs;
+}
+
+// Flips a bit in a byte of the frame in the report, leaving DLE sequences alone so the framing stays intact.
+static void corruptFrame(InjectDevice * device, uint8_t * data, int length) {
+	int start = 0;
+	while (start + 1 < length && !(data[start] == DLE && data[start + 1] == STX)) {
+		start++;
+	}
+	start = (start + 1 < length) ? start + 2 : 0;
+	int candidates[INJECT_MAX_REPORT];
+	int count = 0;
+	for (int i = start; i < length; i++) {
+		if (data[i] == DLE) {
+			if (i + 1 < length && data[i + 1] == ETX) {
+				break;
+			}
+			i++;	// skip the escaped byte
+			continue;
+		}
+		candidates[count++] = i;
+	}
+	if (count == 0) {
+		return;
+	}
+	uint64_t r = nextRandom(&device->random);
+	uint8_t * byte = &data[candidates[r % count]];
+	int bit = (int)((r >> 32) % 8);
+	*byte ^= (uint8_t)(1 << bit);
+	if (*byte == DLE) {
+		*byte ^= (uint8_t)((1 << bit) | (1 << ((bit + 1) % 8)));
+	}
+}
+
+static int injectInit(void) {
+	return injectTarget->init();
+}
+
+static int injectExit(void) {
+	return injectTarget->exit();
+}
+
+static struct hid_device_info * injectEnumerate(unsigned short vendorId, unsigned short productId) {
+	return injectTarget->enumerate(vendorId, productId);
+}
+
+static void injectFreeEnumeration(struct hid_device_info * devs) {
+	injectTarget->free_enumeration(devs);
+}
+
+static hid_device * injectWrap(hid_device * hid) {
+	if (hid == NULL) {
+		return NULL;
+	}
+	InjectDevice * device = calloc(1, sizeof(InjectDevice));
+	if (device == NULL) {
+		injectTarget->close(hid);
+		return NULL;
+	}
+	device->hid = hid;
+	// every device opened gets its own sequence, reconnects included
+	device->random = injectSeed + 0x632BE59BD9B4E019ull * __atomic_fetch_add(&injectDevices, 1, __ATOMIC_RELAXED);
+	return (hid_device *)device;
+}
+
+static hid_device * injectOpen(unsigned short vendorId, unsigned short productId, const wchar_t * serial) {
+	return injectWrap(injectTarget->open(vendorId, productId, serial));
+}
+
+static hid_device * injectOpenPath(const char * path) {
+	return injectWrap(injectTarget->open_path(path));
+}
+
+static int injectWrite(hid_device * hid, const unsigned char * data, size_t length) {
+	InjectDevice * device = (InjectDevice *)hid;
+	__atomic_add_fetch(&injectReportsOut, 1, __ATOMIC_RELAXED);
+	if (inject(device, InjectLose)) {
+		return (int)length;
+	}
+	return injectTarget->write(device->hid, data, length);
+}
+
+static int injectReadTimeout(hid_device * hid, unsigned char * data, size_t length, int milliseconds) {
+	InjectDevice * device = (InjectDevice *)hid;
+	uint64_t deadline = getMonotonicTimeNs() + (uint64_t)max(milliseconds, 0) * 1000000ull;
+	InjectReport report;
+	for (;;) {
+		uint64_t now = getMonotonicTimeNs();
+		if (device->heldCount > 0) {
+			if (device->held[0].readyNs <= now) {
+				report = device->held[0];
+				memmove(&device->held[0], &device->held[1], --device->heldCount * sizeof(InjectReport));
+				break;
+			}
+			if (milliseconds >= 0 && now >= deadline) {
+				return 0;
+			}
+			sleepUntilNs((milliseconds >= 0) ? min(device->held[0].readyNs, deadline) : device->held[0].readyNs);
+			continue;
+		}
+
+		int remainingMs = (milliseconds < 0) ? -1 : (now >= deadline) ? 0 : (int)((deadline - now + 999999) / 1000000);
+		report.length = injectTarget->read_timeout(device->hid, report.data, min(length, sizeof(report.data)), remainingMs);
+		if (report.length <= 0) {
+			return report.length;
+		}
+		__atomic_add_fetch(&injectReportsIn, 1, __ATOMIC_RELAXED);
+		if (inject(device, InjectDrop)) {
+			if (milliseconds >= 0 && getMonotonicTimeNs() >= deadline) {
+				return 0;
+			}
+			continue;
+		}
+		if (inject(device, InjectCrc)) {
+			corruptFrame(device, report.data, report.length);
+		}
+		if (inject(device, InjectSpike)) {
+			hold(device, report.data, report.length, now + injectSpikeNs);
+			continue;
+		}
+		if (inject(device, InjectDuplicate)) {
+			hold(device, report.data, report.length, now);
+		}
+		if (report.length > 1 && inject(device, InjectSplit)) {
+			// the second part goes in front of a duplicate
+			int first = report.length / 2;
+			memmove(&device->held[1], &device->held[0], device->heldCount * sizeof(InjectReport));
+			device->heldCount++;
+			memcpy(device->held[0].data, report.data + first, report.length - first);
+			device->held[0].length = report.length - first;
+			device->held[0].readyNs = now;
+			report.length = first;
+		}
+		if (device->last.length > 0 && inject(device, InjectStale)) {
+			memmove(&device->held[1], &device->held[0], device->heldCount * sizeof(InjectReport));
+			device->heldCount++;
+			device->held[0] = report;
+			device->held[0].readyNs = now;
+			report = device->last;
+		}
+		break;
+	}
+	memcpy(data, report.data, report.length);
+	device->last = report;
+	return report.length;
+}
+
+static void injectClose(hid_device * hid) {
+	InjectDevice * device = (InjectDevice *)hid;
+	injectTarget->close(device->hid);
+	free(device);
+}
+
+static int injectGetReportDescriptor(hid_device * hid, unsigned char * buf, size_t size) {
+	InjectDevice * device = (InjectDevice *)hid;
+	return injectTarget->get_report_descriptor(device->hid, buf, size);
+}
+
+static HidBackend injectBackend = {
+	.name = "inject",
+	.init = injectInit,
+	.exit = injectExit,
+	.enumerate = injectEnumerate,
+	.free_enumeration = injectFreeEnumeration,
+	.open = injectOpen,
+	.open_path = injectOpenPath,
+	.write = injectWrite,
+	.read_timeout = injectReadTimeout,
+	.close = injectClose,
+	.get_report_descriptor = NULL,
+};
+
+// Parses the profile into injectProbability. Returns false when it is invalid.
+static bool parseProfile(const char * profile) {
+	const char * p = profile;
+	while (*p != '\0') {
+		size_t nameLength = strcspn(p, ":,");
+		size_t kind;
+		for (kind = 0; kind < InjectKindCount; kind++) {
+			if (strlen(injectNames[kind]) == nameLength && strncmp(p, injectNames[kind], nameLength) == 0) {
+				break;
+			}
+		}
+		if (kind == InjectKindCount || p[nameLength] != ':') {
+			return false;
+		}
+		char * end;
+		double probability = strtod(p + nameLength + 1, &end);
+		if (end == p + nameLength + 1 || probability < 0 || probability > 1 || (*end != ',' && *end != '\0')) {
+			return false;
+		}
+		injectProbability[kind] = probability;
+		p = (*end == ',') ? end + 1 : end;
+	}
+	return true;
+}
+
+void hidInjectStart(const char * profile) {
+	if (hidBackend == &injectBackend) {
+		return;
+	}
+	if (!parseProfile(profile)) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --inject=%s, should be a list of <fault>:<probability> with the faults drop, dup, stale, crc, split, spike and lose", profile);
+	}
+	int spikeMs = atoi(getCommandLineParameterValue("--inject-spike", "200"));
+	if (spikeMs < 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --inject-spike, should be a number of milliseconds");
+	}
+	injectSpikeNs = (uint64_t)spikeMs * 1000000ull;
+	injectSeed = strtoull(getCommandLineParameterValue("--inject-seed", "1"), NULL, 10);
+	injectTarget = hidBackend;
+	if (injectTarget->get_report_descriptor != NULL) {
+		injectBackend.get_report_descriptor = injectGetReportDescriptor;
+	}
+	hidBackend = &injectBackend;
+}
+
+void hidInjectStop() {
+	if (injectTarget == NULL) {
+		return;
+	}
+	IFNOTQUIET(
+		fprintf(stderr, "Injected faults in %llu input and %llu output reports:", (unsigned long long)injectReportsIn, (unsigned long long)injectReportsOut);
+		for (size_t kind = 0; kind < InjectKindCount; kind++) {
+			fprintf(stderr, " %llu %s", (unsigned long long)injectCount[kind], injectNames[kind]);
+		}
+		fprintf(stderr, "\n")
+	);
+	injectTarget = NULL;
+}
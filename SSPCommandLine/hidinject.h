@@ -0,0 +1,40 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef HIDINJECT_H
+#define HIDINJECT_H
+
+// Fault injection between the protocol and the HID backend (Linux only). With --inject=<profile> the selected backend
+// (hidraw, libusb or the simulated probes) is wrapped by a shim that misbehaves like a bad USB connection, to exercise
+// the error and recovery paths of the protocol and to measure the throughput that is kept. The profile is a comma
+// separated list of <fault>:<probability>, the probability per report between 0 and 1:
+//	drop	an input report is lost
+//	dup		an input report is delivered twice
+//	stale	the previous input report is delivered again before this one
+//	crc		a bit of the frame in an input report is flipped, so its CRC (or tag or length) is wrong
+//	split	an input report is delivered in two reads
+//	spike	an input report, and everything after it, is held back for --inject-spike=<ms> (default 200)
+//	lose	an output report is not sent, while the write reports success
+// The faults are drawn from a generator seeded with --inject-seed=<n> (default 1), so on the simulated probes a run is
+// repeated exactly. Example: --inject=drop:0.01,crc:0.005,spike:0.001
+
+// Wraps the selected backend with the profile given with --inject, called by selectBackend.
+void hidInjectStart(const char * profile);
+// Prints the number of faults injected, called from cleanUpAndExit.
+void hidInjectStop();
+
+#endif /* not defined HIDINJECT_H */
@@ -0,0 +1,148 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#define _CRT_NONSTDC_NO_DEPRECATE
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hidreport.h"
+
+// Item tags (HID specification 1.11, section 6.2.2), with the size bits masked off
+#define ITEM_INPUT			0x80
+#define ITEM_OUTPUT			0x90
+#define ITEM_REPORT_SIZE	0x74
+#define ITEM_REPORT_ID		0x84
+#define ITEM_REPORT_COUNT	0x94
+#define ITEM_PUSH			0xa4
+#define ITEM_POP			0xb4
+
+#define GLOBAL_STACK_DEPTH	4
+#define REPORT_ID_COUNT		256
+
+typedef struct {
+	uint32_t reportSize;	///< bits per field
+	uint32_t reportCount;	///< number of fields
+	uint8_t reportId;
+} GlobalState;
+
+// Parses the report descriptor item by item, summing the bits of all Input and Output main items per report ID.
+// Only the global items that influence the report length are tracked.
+bool hidParseReportLayout(const uint8_t * descriptor, size_t length, HidReportLayout * layout) {
+	uint32_t inputBits[REPORT_ID_COUNT];
+	uint32_t outputBits[REPORT_ID_COUNT];
+	GlobalState stack[GLOBAL_STACK_DEPTH];
+	GlobalState global = { 0, 0, 0 };
+	int depth = 0;
+	bool usesReportIds = false;
+
+	memset(inputBits, 0, sizeof(inputBits));
+	memset(outputBits, 0, sizeof(outputBits));
+
+	size_t i = 0;
+	while (i < length) {
+		uint8_t key = descriptor[i];
+		size_t dataLength;
+		size_t keyLength;
+
+		if (key == 0xfe) {
+			// Long item: the next byte is the data length, then the long item tag. Long items are never main or global items.
+			if (i + 1 >= length) {
+				return false;
+			}
+			dataLength = descriptor[i + 1];
+			keyLength = 3;
+		}
+		else {
+			// Short item: the bottom two bits are the size code, 3 means 4 bytes.
+			dataLength = key & 0x03;
+			if (dataLength == 3) {
+				dataLength = 4;
+			}
+			keyLength = 1;
+		}
+		if (i + keyLength + dataLength > length) {
+			return false;
+		}
+
+		uint32_t value = 0;
+		if (keyLength == 1) {
+			for (size_t b = 0; b < dataLength; b++) {
+				value |= (uint32_t)descriptor[i + 1 + b] << (8 * b);
+			}
+		}
+
+		switch (key & 0xfc) {
+		case ITEM_REPORT_SIZE:
+			global.reportSize = value;
+			break;
+		case ITEM_REPORT_COUNT:
+			global.reportCount = value;
+			break;
+		case ITEM_REPORT_ID:
+			if (value == 0 || value >= REPORT_ID_COUNT) {
+				return false;
+			}
+			global.reportId = (uint8_t)value;
+			usesReportIds = true;
+			break;
+		case ITEM_PUSH:
+			if (depth >= GLOBAL_STACK_DEPTH) {
+				return false;
+			}
+			stack[depth++] = global;
+			break;
+		case ITEM_POP:
+			if (depth == 0) {
+				return false;
+			}
+			global = stack[--depth];
+			break;
+		case ITEM_INPUT:
+			inputBits[global.reportId] += global.reportSize * global.reportCount;
+			break;
+		case ITEM_OUTPUT:
+			outputBits[global.reportId] += global.reportSize * global.reportCount;
+			break;
+		default:
+			break;
+		}
+		i += keyLength + dataLength;
+	}
+
+	bool inputFound = false;
+	bool outputFound = false;
+	for (int id = usesReportIds ? 1 : 0; id < REPORT_ID_COUNT; id++) {
+		if (inputBits[id] > 8u * UINT16_MAX || outputBits[id] > 8u * UINT16_MAX) {
+			return false;
+		}
+		if (!inputFound && inputBits[id] > 0) {
+			layout->inputReportId = (uint8_t)id;
+			layout->inputReportLength = (uint16_t)((inputBits[id] + 7) / 8);
+			inputFound = true;
+		}
+		if (!outputFound && outputBits[id] > 0) {
+			layout->outputReportId = (uint8_t)id;
+			layout->outputReportLength = (uint16_t)((outputBits[id] + 7) / 8);
+			outputFound = true;
+		}
+	}
+	return inputFound && outputFound;
+}
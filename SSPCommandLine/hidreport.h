@@ -0,0 +1,45 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef HIDREPORT_H
+#define HIDREPORT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The input and output report used for the SSP frames, as described by the HID report descriptor of the probe.
+typedef struct {
+	uint8_t inputReportId;			///< Report ID of the input report, 0 when the device does not use numbered reports
+	uint16_t inputReportLength;		///< Length of the input report in bytes, excluding the report ID
+	uint8_t outputReportId;			///< Report ID of the output report, 0 when the device does not use numbered reports
+	uint16_t outputReportLength;	///< Length of the output report in bytes, excluding the report ID
+} HidReportLayout;
+
+// Parses a HID report descriptor and fills layout with the first (lowest numbered) input and output report.
+// Returns false when the descriptor is malformed or does not describe both an input and an output report.
+bool hidParseReportLayout(const uint8_t * descriptor, size_t length, HidReportLayout * layout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* not defined HIDREPORT_H */
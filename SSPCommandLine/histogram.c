@@ -0,0 +1,247 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "histogram.h"
+
+// Aligned 64 bit loads and stores are atomic on the supported platforms, the builtins keep the compiler from tearing them
+#ifdef _MSC_VER
+#define histogramLoad(x) (*(volatile const uint64_t *)&(x))
+#define histogramStore(x, value) (*(volatile uint64_t *)&(x) = (value))
+#else
+#define histogramLoad(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define histogramStore(x, value) __atomic_store_n(&(x), (value), __ATOMIC_RELAXED)
+#endif
+
+#define SUB_BUCKETS (1u << HISTOGRAM_SUB_BITS)
+
+// Index of the highest bit set, value must not be 0
+static unsigned int highestBit(uint64_t value) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return index;
+#else
+	return 63 - __builtin_clzll(value);
+#endif
+}
+
+static size_t bucketIndex(uint64_t value) {
+	if (value < SUB_BUCKETS) {
+		return (size_t)value;
+	}
+	unsigned int exponent = highestBit(value);
+	unsigned int shift = exponent - HISTOGRAM_SUB_BITS;
+	return ((size_t)(shift + 1) << HISTOGRAM_SUB_BITS) + (size_t)((value >> shift) - SUB_BUCKETS);
+}
+
+// Lowest value counted in a bucket
+static uint64_t bucketLow(size_t index) {
+	if (index < SUB_BUCKETS) {
+		return index;
+	}
+	unsigned int shift = (unsigned int)(index >> HISTOGRAM_SUB_BITS) - 1;
+	return (uint64_t)(SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << shift;
+}
+
+// Highest value counted in a bucket
+static uint64_t bucketHigh(size_t index) {
+	if (index < SUB_BUCKETS) {
+		return index;
+	}
+	unsigned int shift = (unsigned int)(index >> HISTOGRAM_SUB_BITS) - 1;
+	return bucketLow(index) + ((1ull << shift) - 1);
+}
+
+void histogramInit(Histogram * histogram) {
+	memset(histogram, 0, sizeof(*histogram));
+}
+
+void histogramRecord(Histogram * histogram, uint64_t value) {
+	size_t index = bucketIndex(value);
+	histogramStore(histogram->bucket[index], histogram->bucket[index] + 1);
+	if (histogram->count == 0 || value < histogram->min) {
+		histogramStore(histogram->min, value);
+	}
+	if (value > histogram->max) {
+		histogramStore(histogram->max, value);
+	}
+	histogramStore(histogram->sum, histogram->sum + value);
+	histogramStore(histogram->count, histogram->count + 1);
+}
+
+void histogramMerge(Histogram * into, const Histogram * from) {
+	uint64_t count = histogramLoad(from->count);
+	if (count == 0) {
+		return;
+	}
+	uint64_t min = histogramLoad(from->min);
+	uint64_t max = histogramLoad(from->max);
+	if (into->count == 0 || min < into->min) {
+		histogramStore(into->min, min);
+	}
+	if (max > into->max) {
+		histogramStore(into->max, max);
+	}
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		uint64_t bucket = histogramLoad(from->bucket[i]);
+		if (bucket != 0) {
+			histogramStore(into->bucket[i], into->bucket[i] + bucket);
+		}
+	}
+	histogramStore(into->sum, into->sum + histogramLoad(from->sum));
+	histogramStore(into->count, into->count + count);
+}
+
+uint64_t histogramCount(const Histogram * histogram) {
+	return histogramLoad(histogram->count);
+}
+
+uint64_t histogramMin(const Histogram * histogram) {
+	return (histogramLoad(histogram->count) > 0) ? histogramLoad(histogram->min) : 0;
+}
+
+uint64_t histogramMax(const Histogram * histogram) {
+	return histogramLoad(histogram->max);
+}
+
+double histogramMean(const Histogram * histogram) {
+	uint64_t count = histogramLoad(histogram->count);
+	return (count > 0) ? (double)histogramLoad(histogram->sum) / count : 0;
+}
+
+// From the middle of the buckets, like the percentiles
+double histogramStddev(const Histogram * histogram) {
+	uint64_t count = 0;
+	double sum = 0;
+	double sumSquares = 0;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		uint64_t bucket = histogramLoad(histogram->bucket[i]);
+		if (bucket != 0) {
+			double middle = ((double)bucketLow(i) + (double)bucketHigh(i)) / 2;
+			count += bucket;
+			sum += middle * bucket;
+			sumSquares += middle * middle * bucket;
+		}
+	}
+	if (count == 0) {
+		return 0;
+	}
+	double mean = sum / count;
+	return sqrt(fmax(sumSquares / count - mean * mean, 0));
+}
+
+uint64_t histogramPercentile(const Histogram * histogram, double percentile) {
+	uint64_t count = histogramLoad(histogram->count);
+	if (count == 0) {
+		return 0;
+	}
+	// the rank of the sample, 1 based
+	uint64_t rank = (uint64_t)ceil(percentile / 100 * count);
+	rank = (rank < 1) ? 1 : rank;
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += histogramLoad(histogram->bucket[i]);
+		if (seen >= rank) {
+			uint64_t middle = bucketLow(i) + (bucketHigh(i) - bucketLow(i)) / 2;
+			// the exact extremes are known
+			uint64_t min = histogramMin(histogram);
+			uint64_t max = histogramMax(histogram);
+			return (middle < min) ? min : (middle > max) ? max : middle;
+		}
+	}
+	return histogramMax(histogram);
+}
+
+uint64_t histogramCountAtMost(const Histogram * histogram, uint64_t value) {
+	uint64_t count = 0;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS && bucketHigh(i) <= value; i++) {
+		count += histogramLoad(histogram->bucket[i]);
+	}
+	return count;
+}
+
+void histogramPrint(FILE * out, const char * label, const Histogram * histogram) {
+	if (histogramCount(histogram) == 0) {
+		return;
+	}
+	fprintf(out, "  %-16s min %9.1f us  avg %9.1f us  stddev %8.1f us  p50 %9.1f us  p99 %9.1f us  max %9.1f us\n", label,
+		histogramMin(histogram) / 1e3, histogramMean(histogram) / 1e3, histogramStddev(histogram) / 1e3,
+		histogramPercentile(histogram, 50) / 1e3, histogramPercentile(histogram, 99) / 1e3, histogramMax(histogram) / 1e3);
+}
+
+bool histogramWrite(FILE * out, const char * name, const Histogram * histogram) {
+	fprintf(out, "%s %d %llu %llu %llu %llu", name, HISTOGRAM_SUB_BITS, (unsigned long long)histogramLoad(histogram->count),
+		(unsigned long long)histogramLoad(histogram->sum), (unsigned long long)histogramMin(histogram), (unsigned long long)histogramMax(histogram));
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		uint64_t bucket = histogramLoad(histogram->bucket[i]);
+		if (bucket != 0) {
+			fprintf(out, " %zu:%llu", i, (unsigned long long)bucket);
+		}
+	}
+	return fprintf(out, "\n") > 0;
+}
+
+int histogramRead(FILE * in, char * name, size_t nameSize, Histogram * histogram) {
+	char word[64];
+	int subBits;
+	unsigned long long count, sum, min, max;
+	int c;
+	// skip empty lines
+	while ((c = fgetc(in)) == '\n' || c == '\r') {
+	}
+	if (c == EOF) {
+		return 0;
+	}
+	ungetc(c, in);
+
+	size_t length = 0;
+	while ((c = fgetc(in)) != EOF && c != ' ' && c != '\n') {
+		if (length + 1 < nameSize) {
+			name[length++] = (char)c;
+		}
+	}
+	name[length] = '\0';
+	if (c != ' ' || fscanf(in, "%d %llu %llu %llu %llu", &subBits, &count, &sum, &min, &max) != 5 || subBits != HISTOGRAM_SUB_BITS) {
+		return -1;
+	}
+	histogramInit(histogram);
+	histogram->count = count;
+	histogram->sum = sum;
+	histogram->min = min;
+	histogram->max = max;
+	uint64_t total = 0;
+	while ((c = fgetc(in)) == ' ') {
+		size_t index;
+		unsigned long long bucket;
+		if (fscanf(in, "%63s", word) != 1 || sscanf(word, "%zu:%llu", &index, &bucket) != 2 || index >= HISTOGRAM_BUCKETS) {
+			return -1;
+		}
+		histogram->bucket[index] += bucket;
+		total += bucket;
+	}
+	return (total == count && (c == '\n' || c == '\r' || c == EOF)) ? 1 : -1;
+}
@@ -0,0 +1,78 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Latency histogram in the style of HdrHistogram, used for every timing in the tool. Values (nanoseconds) below
+// 2^HISTOGRAM_SUB_BITS are counted exactly, larger ones in 2^HISTOGRAM_SUB_BITS buckets per power of two, so percentiles
+// are within 1/32 (3 %) of the real value at any magnitude, in constant memory whatever the number of samples.
+//
+// A histogram has one writer: every thread records into its own. Other threads can merge or read it at any time without
+// a lock. Counts are stored and loaded as relaxed atomics, so a reader sees a recent state that can be a few samples
+// behind in places, never a torn value.
+//
+// Histograms are written as one text line each, so runs on different hosts can be merged afterwards:
+//	<name> <sub bits> <count> <sum> <min> <max> <bucket index>:<count> ...
+// with only the buckets that are not empty.
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;						///< only valid when count is not 0
+	uint64_t max;
+	uint64_t bucket[HISTOGRAM_BUCKETS];
+} Histogram;
+
+void histogramInit(Histogram * histogram);
+void histogramRecord(Histogram * histogram, uint64_t value);
+// Adds the samples of from (which may be recorded into meanwhile) to into.
+void histogramMerge(Histogram * into, const Histogram * from);
+uint64_t histogramCount(const Histogram * histogram);
+uint64_t histogramMin(const Histogram * histogram);
+uint64_t histogramMax(const Histogram * histogram);
+double histogramMean(const Histogram * histogram);
+double histogramStddev(const Histogram * histogram);
+// Value below which the given percentage (0 to 100) of the samples lies.
+uint64_t histogramPercentile(const Histogram * histogram, double percentile);
+// Number of samples in the buckets that end at or below value, for cumulative buckets like those of Prometheus.
+uint64_t histogramCountAtMost(const Histogram * histogram, uint64_t value);
+// Prints count, min, average, standard deviation, p50, p99 and max in microseconds on one line.
+void histogramPrint(FILE * out, const char * label, const Histogram * histogram);
+
+bool histogramWrite(FILE * out, const char * name, const Histogram * histogram);
+// Reads the next histogram written by histogramWrite. Returns 1 when one was read, 0 at the end of the file and -1 when
+// the line is not a histogram.
+int histogramRead(FILE * in, char * name, size_t nameSize, Histogram * histogram);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* not defined HISTOGRAM_H */
@@ -0,0 +1,145 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "loadprofile.h"
+
+static const char * loadProfileNames[] = { "constant", "poisson", "bursts", "ramp", "trace" };
+
+bool loadProfileKindFromName(const char * name, LoadProfileKind * kind) {
+	for (size_t i = 0; i < sizeof(loadProfileNames) / sizeof(loadProfileNames[0]); i++) {
+		if (strcmp(name, loadProfileNames[i]) == 0) {
+			*kind = (LoadProfileKind)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char * loadProfileCheck(const LoadProfile * profile) {
+	if (profile->kind == LoadProfileTrace) {
+		return (profile->traceLength == 0) ? "The trace contains no times" : NULL;
+	}
+	if (profile->rate <= 0 && !(profile->kind == LoadProfileRamp && profile->endRate > 0)) {
+		return "The rate should be positive";
+	}
+	if (profile->kind == LoadProfileRamp && (profile->durationSeconds <= 0 || profile->endRate < 0)) {
+		return "A ramp needs a duration and an end rate that is not negative";
+	}
+	if (profile->kind == LoadProfileBursts && (profile->onSeconds <= 0 || profile->offSeconds < 0)) {
+		return "Bursts need a positive burst length and a pause that is not negative";
+	}
+	if (profile->count == 0 && profile->durationSeconds <= 0) {
+		return "The number of swipes or the duration should be given";
+	}
+	return NULL;
+}
+
+// splitmix64, a small generator with a good spread even for seeds that are close together
+static uint64_t nextRandom(uint64_t * state) {
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+// Uniformly distributed in (0, 1]
+static double nextUniform(uint64_t * state) {
+	return ((nextRandom(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+// Momentary rate of the profile at t seconds after the first arrival.
+static double rateAt(const LoadProfile * profile, double t) {
+	switch (profile->kind) {
+	case LoadProfileBursts:
+		return (fmod(t, profile->onSeconds + profile->offSeconds) < profile->onSeconds) ? profile->rate : 0;
+	case LoadProfileRamp:
+		return profile->rate + (profile->endRate - profile->rate) * fmin(t / profile->durationSeconds, 1.0);
+	default:
+		return profile->rate;
+	}
+}
+
+// Time of the arrival after the one at t. Evenly spaced arrivals step 1 / rate ahead, skipping pauses; random arrivals
+// are drawn at the highest rate of the profile and kept with a probability of the momentary rate over the highest rate
+// (thinning), which gives Poisson arrivals at the momentary rate.
+static double nextArrival(const LoadProfile * profile, double t, size_t index, uint64_t * state) {
+	if (profile->kind == LoadProfileTrace) {
+		return t + profile->trace[index % profile->traceLength] / 1e9;
+	}
+	bool random = profile->kind == LoadProfilePoisson || (profile->randomArrivals && profile->kind != LoadProfileConstant);
+	if (random) {
+		double maxRate = fmax(profile->rate, (profile->kind == LoadProfileRamp) ? profile->endRate : 0);
+		do {
+			t -= log(nextUniform(state)) / maxRate;
+		} while (nextUniform(state) * maxRate > rateAt(profile, t) && (profile->durationSeconds <= 0 || t <= profile->durationSeconds));
+		return t;
+	}
+	double rate = rateAt(profile, t);
+	if (profile->kind == LoadProfileBursts) {
+		double period = profile->onSeconds + profile->offSeconds;
+		double next = t + 1.0 / rate;
+		// an arrival that falls in a pause moves to the start of the next burst
+		if (fmod(next, period) >= profile->onSeconds) {
+			next = (floor(next / period) + 1) * period;
+		}
+		return next;
+	}
+	if (rate <= 0) {
+		// a ramp up from 0 has its second arrival when one swipe has accumulated, a ramp down to 0 has ended
+		if (profile->endRate <= profile->rate) {
+			return INFINITY;
+		}
+		return t + sqrt(2 * profile->durationSeconds / (profile->endRate - profile->rate));
+	}
+	return t + 1.0 / rate;
+}
+
+size_t loadProfileGenerate(const LoadProfile * profile, uint64_t ** times) {
+	uint64_t state = profile->seed;
+	size_t allocated = (profile->count > 0) ? profile->count : 1024;
+	size_t count = 0;
+	// a trace without a limit is played once
+	size_t limit = (profile->count == 0 && profile->durationSeconds <= 0) ? profile->traceLength : profile->count;
+	*times = malloc(allocated * sizeof(uint64_t));
+	if (*times == NULL) {
+		return 0;
+	}
+	double t = 0;
+	while (limit == 0 || count < limit) {
+		if (profile->durationSeconds > 0 && t > profile->durationSeconds) {
+			break;
+		}
+		if (count == allocated) {
+			allocated *= 2;
+			uint64_t * grown = realloc(*times, allocated * sizeof(uint64_t));
+			if (grown == NULL) {
+				free(*times);
+				*times = NULL;
+				return 0;
+			}
+			*times = grown;
+		}
+		(*times)[count] = (uint64_t)(t * 1e9);
+		t = nextArrival(profile, t, count, &state);
+		count++;
+	}
+	return count;
+}
@@ -0,0 +1,59 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef LOADPROFILE_H
+#define LOADPROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Arrival processes for timed swipes. A load profile is turned into the complete list of arrival times before the first
+// swipe, so the schedule does not depend on how long the commands to the probes take: a slow command makes swipes late,
+// it never moves the arrivals after it.
+
+typedef enum {
+	LoadProfileConstant,		///< fixed time between swipes
+	LoadProfilePoisson,			///< exponentially distributed time between swipes
+	LoadProfileBursts,			///< swipes at the rate during bursts of onSeconds, none during the offSeconds between them
+	LoadProfileRamp,			///< rate changing linearly from rate to endRate over durationSeconds
+	LoadProfileTrace,			///< recorded times between swipes, repeated when needed
+} LoadProfileKind;
+
+typedef struct {
+	LoadProfileKind kind;
+	double rate;				///< swipes per second (at the start, for a ramp)
+	double endRate;				///< ramp: swipes per second at the end
+	double onSeconds;			///< bursts: length of a burst
+	double offSeconds;			///< bursts: pause between two bursts
+	bool randomArrivals;		///< bursts and ramp: Poisson arrivals at the momentary rate instead of evenly spaced ones
+	double durationSeconds;		///< the last arrival is at most this long after the first, 0 for no limit
+	size_t count;				///< maximum number of arrivals, 0 for no limit
+	const uint64_t * trace;		///< trace: times between swipes in nanoseconds
+	size_t traceLength;
+	uint64_t seed;				///< seed of the random arrivals, the same seed gives the same schedule
+} LoadProfile;
+
+// Looks up a profile kind by its name: constant, poisson, bursts, ramp or trace.
+bool loadProfileKindFromName(const char * name, LoadProfileKind * kind);
+// Checks a profile, returns NULL when it is usable and otherwise what is wrong with it.
+const char * loadProfileCheck(const LoadProfile * profile);
+// Generates the arrival times of a checked profile, in nanoseconds after the first arrival (which is at 0), in a
+// malloc'ed array stored in times. Returns the number of arrivals, 0 when out of memory.
+size_t loadProfileGenerate(const LoadProfile * profile, uint64_t ** times);
+
+#endif /* not defined LOADPROFILE_H */
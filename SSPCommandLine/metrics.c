@@ -0,0 +1,440 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "SSPCommandLineTool.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "util.h"
+
+// Prometheus buckets of the latency histograms: 50 us, 100 us, ... 1.6 s
+#define METRICS_BUCKETS 16
+#define METRICS_BUCKET0_NS 50000ull
+// Time a scrape may take to send its request or to read the answer, so one stalled connection does not block the next ones
+#define METRICS_HTTP_TIMEOUT_S 5
+
+// The metrics of one probe serial number
+typedef struct ProbeMetrics_s {
+	char serial[128];
+	SspMetrics counters;
+	struct ProbeMetrics_s * next;
+} ProbeMetrics;
+
+// A histogram of a command, saved with --histograms
+typedef struct SavedHistogram_s {
+	char name[128];
+	Histogram histogram;
+	struct SavedHistogram_s * next;
+} SavedHistogram;
+
+static ProbeMetrics * probeMetrics = NULL;
+static SavedHistogram * savedHistograms = NULL;
+static const char * histogramsFile = NULL;
+static pthread_mutex_t probeMetricsMutex = PTHREAD_MUTEX_INITIALIZER;
+static bool metricsStarted = false;
+static const char * metricsFile = NULL;
+static int metricsIntervalS = 15;
+// Serializes the writes of the metrics file by the exporter thread and metricsStop, which both use the same temporary file
+static pthread_mutex_t metricsFileMutex = PTHREAD_MUTEX_INITIALIZER;
+static bool metricsFileFinal = false;
+
+// Label values of ssp_failures_total, by SspResult
+static const char * const failureClasses[SspResultCount] = {
+	[SspResultOk] = "ok",
+	[SspResultPending] = "pending",
+	[SspResultErrorHidApi] = "hidapi",
+	[SspResultErrorHidOpen] = "open",
+	[SspResultErrorReportDescriptor] = "report_descriptor",
+	[SspResultErrorOutOfMemory] = "out_of_memory",
+	[SspResultErrorFrameTooLong] = "frame_too_long",
+	[SspResultErrorWrite] = "write",
+	[SspResultErrorRead] = "read",
+	[SspResultErrorNoResponse] = "no_response",
+	[SspResultErrorParse] = "parse",
+	[SspResultErrorCrc] = "crc",
+	[SspResultErrorNotOk] = "not_ok",
+	[SspResultErrorWrongTag] = "wrong_tag",
+	[SspResultErrorShortResponse] = "short_response",
+	[SspResultErrorInvalidCharacter] = "invalid_character",
+	[SspResultErrorCancelled] = "cancelled",
+};
+
+static uint64_t load(const uint64_t * counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void printHeader(FILE * out, const char * name, const char * type, const char * help) {
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Prints a counter per probe.
+static void printCounter(FILE * out, const char * name, const char * help, size_t offset) {
+	printHeader(out, name, "counter", help);
+	for (ProbeMetrics * m = probeMetrics; m != NULL; m = m->next) {
+		fprintf(out, "%s{serial=\"%s\"} %llu\n", name, m->serial, (unsigned long long)load((const uint64_t *)((const char *)&m->counters + offset)));
+	}
+}
+
+// Prints a counter per probe and tag, only for the tags that were counted.
+static void printTagCounter(FILE * out, const char * name, const char * help, size_t offset) {
+	printHeader(out, name, "counter", help);
+	for (ProbeMetrics * m = probeMetrics; m != NULL; m = m->next) {
+		const uint64_t * counters = (const uint64_t *)((const char *)&m->counters + offset);
+		for (size_t tag = 0; tag < 256; tag++) {
+			uint64_t value = load(&counters[tag]);
+			if (value != 0) {
+				fprintf(out, "%s{serial=\"%s\",tag=\"0x%02zx\"} %llu\n", name, m->serial, tag, (unsigned long long)value);
+			}
+		}
+	}
+}
+
+// The buckets are those of the histogram, rounded to METRICS_BUCKETS Prometheus buckets of 50 us << i. The count is
+// loaded first and the buckets are clamped to it, so they stay cumulative while the probe thread records.
+static void printHistogram(FILE * out, const char * name, const char * help, size_t offset) {
+	printHeader(out, name, "histogram", help);
+	for (ProbeMetrics * m = probeMetrics; m != NULL; m = m->next) {
+		const Histogram * histogram = (const Histogram *)((const char *)&m->counters + offset);
+		uint64_t count = histogramCount(histogram);
+		uint64_t sum = load(&histogram->sum);
+		for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+			uint64_t bound = METRICS_BUCKET0_NS << i;
+			fprintf(out, "%s_bucket{serial=\"%s\",le=\"%g\"} %llu\n", name, m->serial, bound / 1e9, (unsigned long long)min(histogramCountAtMost(histogram, bound), count));
+		}
+		fprintf(out, "%s_bucket{serial=\"%s\",le=\"+Inf\"} %llu\n", name, m->serial, (unsigned long long)count);
+		fprintf(out, "%s_sum{serial=\"%s\"} %.9f\n", name, m->serial, sum / 1e9);
+		fprintf(out, "%s_count{serial=\"%s\"} %llu\n", name, m->serial, (unsigned long long)count);
+	}
+}
+
+// Prints all metrics in the Prometheus text format.
+static void printMetrics(FILE * out) {
+	pthread_mutex_lock(&probeMetricsMutex);
+	printTagCounter(out, "ssp_commands_total", "Commands written to the probe, by command tag", offsetof(SspMetrics, commands));
+	printHeader(out, "ssp_swipes_issued_total", "counter", "Gos written to the probe");
+	for (ProbeMetrics * m = probeMetrics; m != NULL; m = m->next) {
+		fprintf(out, "ssp_swipes_issued_total{serial=\"%s\"} %llu\n", m->serial, (unsigned long long)load(&m->counters.commands[SspCommandTriggerArm]));
+	}
+	printHeader(out, "ssp_swipes_completed_total", "counter", "Swiped events received from the probe");
+	for (ProbeMetrics * m = probeMetrics; m != NULL; m = m->next) {
+		fprintf(out, "ssp_swipes_completed_total{serial=\"%s\"} %llu\n", m->serial, (unsigned long long)load(&m->counters.responses[SspEventSwiped]));
+	}
+	printTagCounter(out, "ssp_responses_total", "Responses received from the probe, by status or event tag", offsetof(SspMetrics, responses));
+	printHeader(out, "ssp_failures_total", "counter", "Errors, by class");
+	for (ProbeMetrics * m = probeMetrics; m != NULL; m = m->next) {
+		for (size_t result = SspResultErrorHidApi; result < SspResultCount; result++) {
+			uint64_t value = load(&m->counters.failures[result]);
+			if (value != 0) {
+				fprintf(out, "ssp_failures_total{serial=\"%s\",class=\"%s\"} %llu\n", m->serial, failureClasses[result], (unsigned long long)value);
+			}
+		}
+	}
+	printCounter(out, "ssp_crc_failures_total", "Responses with a wrong CRC", offsetof(SspMetrics, failures[SspResultErrorCrc]));
+	printCounter(out, "ssp_reconnects_total", "Reconnects after connection errors", offsetof(SspMetrics, reconnects));
+	printHistogram(out, "ssp_write_seconds", "Time to write a command to the probe", offsetof(SspMetrics, writeLatency));
+	printHistogram(out, "ssp_response_seconds", "Time from writing a method or function call to its response", offsetof(SspMetrics, responseLatency));
+	printHistogram(out, "ssp_swipe_seconds", "Time from writing a go to the swiped event", offsetof(SspMetrics, swipeLatency));
+	pthread_mutex_unlock(&probeMetricsMutex);
+}
+
+// Writes the metrics file through a temporary file, so the collector never reads a partial one. After the final write
+// (by metricsStop) the exporter thread no longer writes it.
+static void writeMetricsFile(bool final) {
+	pthread_mutex_lock(&metricsFileMutex);
+	if (metricsFileFinal) {
+		pthread_mutex_unlock(&metricsFileMutex);
+		return;
+	}
+	metricsFileFinal = final;
+	char temporary[4096];
+	snprintf(temporary, sizeof(temporary), "%s.tmp", metricsFile);
+	FILE * out = fopen(temporary, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Cannot write metrics file %s: %s\n", temporary, strerror(errno));
+	}
+	else {
+		printMetrics(out);
+		if (fclose(out) != 0 || rename(temporary, metricsFile) != 0) {
+			fprintf(stderr, "Cannot write metrics file %s: %s\n", metricsFile, strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&metricsFileMutex);
+}
+
+// Rewrites the metrics file every interval. It runs outside the virtual clock of the simulation mode, so it sleeps on the real one.
+static void * runMetricsFile(void * argument) {
+	for (;;) {
+		struct timespec interval = { metricsIntervalS, 0 };
+		while (nanosleep(&interval, &interval) != 0) {
+		}
+		writeMetricsFile(false);
+	}
+	return NULL;
+}
+
+// Answers every HTTP request on the listening socket with the metrics, whatever its path.
+static void * runMetricsHttp(void * argument) {
+	int listenFd = (int)(intptr_t)argument;
+	for (;;) {
+		int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		struct timeval timeout = { METRICS_HTTP_TIMEOUT_S, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		// the request itself is not needed, only wait for it
+		char request[1024];
+		if (recv(fd, request, sizeof(request), 0) > 0) {
+			char * body = NULL;
+			size_t length = 0;
+			FILE * out = open_memstream(&body, &length);
+			if (out != NULL) {
+				printMetrics(out);
+				fclose(out);
+				dprintf(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", length);
+				for (size_t sent = 0; sent < length;) {
+					ssize_t n = send(fd, body + sent, length - sent, MSG_NOSIGNAL);
+					if (n <= 0) {
+						break;
+					}
+					sent += (size_t)n;
+				}
+				free(body);
+			}
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+// Listens on [<address>:]<port>. Returns -1 when that fails.
+static int openMetricsSocket(const char * endpoint) {
+	char address[64] = "127.0.0.1";
+	const char * port = strrchr(endpoint, ':');
+	if (port != NULL) {
+		snprintf(address, sizeof(address), "%.*s", (int)(port - endpoint), endpoint);
+		port++;
+	}
+	else {
+		port = endpoint;
+	}
+	struct sockaddr_in socketAddress = { .sin_family = AF_INET, .sin_port = htons((uint16_t)atoi(port)) };
+	if (atoi(port) <= 0 || atoi(port) > 65535 || inet_pton(AF_INET, address, &socketAddress.sin_addr) != 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (bind(fd, (struct sockaddr *)&socketAddress, sizeof(socketAddress)) != 0 || listen(fd, 16) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void startThread(void * (*function)(void *), void * argument) {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, function, argument) != 0) {
+		cleanUpAndExit(ExitErrorHidApi, "Cannot start the metrics exporter");
+	}
+	pthread_detach(thread);
+}
+
+// Starts the exporters given on the command line. Returns false when metrics are not wanted.
+static bool startMetrics() {
+	char * endpoint = getCommandLineParameterValue("--metrics", NULL);
+	metricsFile = getCommandLineParameterValue("--metrics-file", NULL);
+	histogramsFile = getCommandLineParameterValue("--histograms", NULL);
+	if (endpoint == NULL && metricsFile == NULL && histogramsFile == NULL) {
+		return false;
+	}
+	if (histogramsFile != NULL) {
+		histogramsFile = checkMalloc(strdup(histogramsFile));
+	}
+	if (endpoint != NULL) {
+		int fd = openMetricsSocket(endpoint);
+		if (fd < 0) {
+			cleanUpAndExit(ExitErrorCommandLineParameter, "Cannot serve metrics on %s: %s", endpoint, strerror(errno));
+		}
+		startThread(runMetricsHttp, (void *)(intptr_t)fd);
+		IFNOTQUIET(printf("Serving metrics on %s\n", endpoint));
+	}
+	if (metricsFile != NULL) {
+		// the command line is freed before metricsStop writes the file a last time
+		metricsFile = checkMalloc(strdup(metricsFile));
+		metricsIntervalS = atoi(getCommandLineParameterValue("--metrics-interval", "15"));
+		if (metricsIntervalS <= 0) {
+			cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --metrics-interval, should be a positive number of seconds");
+		}
+		startThread(runMetricsFile, NULL);
+	}
+	return true;
+}
+
+void metricsAttach(SspDevice * device) {
+	if (!metricsStarted) {
+		if (!startMetrics()) {
+			return;
+		}
+		metricsStarted = true;
+	}
+	const char * serial = sspGetSerial(device);
+	pthread_mutex_lock(&probeMetricsMutex);
+	ProbeMetrics ** link = &probeMetrics;
+	while (*link != NULL && strcmp((*link)->serial, serial) != 0) {
+		link = &(*link)->next;
+	}
+	if (*link == NULL) {
+		*link = checkMalloc(calloc(1, sizeof(ProbeMetrics)));
+		snprintf((*link)->serial, sizeof((*link)->serial), "%s", serial);
+	}
+	sspSetMetrics(device, &(*link)->counters);
+	pthread_mutex_unlock(&probeMetricsMutex);
+}
+
+void metricsSaveHistogram(const char * name, const Histogram * histogram) {
+	if (!metricsStarted && !startMetrics()) {
+		return;
+	}
+	metricsStarted = true;
+	if (histogramsFile == NULL) {
+		return;
+	}
+	SavedHistogram * saved = checkMalloc(calloc(1, sizeof(SavedHistogram)));
+	snprintf(saved->name, sizeof(saved->name), "%s", name);
+	histogramMerge(&saved->histogram, histogram);
+	SavedHistogram ** link = &savedHistograms;
+	while (*link != NULL) {
+		link = &(*link)->next;
+	}
+	*link = saved;
+}
+
+// Writes the histograms of the probes and the saved ones, named <histogram> or <histogram>/<serial>.
+static void writeHistogramsFile() {
+	FILE * out = fopen(histogramsFile, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Cannot write histograms file %s: %s\n", histogramsFile, strerror(errno));
+		return;
+	}
+	pthread_mutex_lock(&probeMetricsMutex);
+	for (ProbeMetrics * m = probeMetrics; m != NULL; m = m->next) {
+		char name[256];
+		snprintf(name, sizeof(name), "write/%s", m->serial);
+		histogramWrite(out, name, &m->counters.writeLatency);
+		snprintf(name, sizeof(name), "response/%s", m->serial);
+		histogramWrite(out, name, &m->counters.responseLatency);
+		snprintf(name, sizeof(name), "swipe/%s", m->serial);
+		histogramWrite(out, name, &m->counters.swipeLatency);
+	}
+	pthread_mutex_unlock(&probeMetricsMutex);
+	for (SavedHistogram * saved = savedHistograms; saved != NULL; saved = saved->next) {
+		histogramWrite(out, saved->name, &saved->histogram);
+	}
+	if (fclose(out) != 0) {
+		fprintf(stderr, "Cannot write histograms file %s: %s\n", histogramsFile, strerror(errno));
+	}
+}
+
+void metricsStop() {
+	if (metricsFile != NULL) {
+		writeMetricsFile(true);
+	}
+	if (histogramsFile != NULL) {
+		writeHistogramsFile();
+	}
+}
+
+// Finds or adds the histogram with the given name.
+static SavedHistogram * findHistogram(SavedHistogram ** list, const char * name) {
+	SavedHistogram ** link = list;
+	while (*link != NULL && strcmp((*link)->name, name) != 0) {
+		link = &(*link)->next;
+	}
+	if (*link == NULL) {
+		*link = checkMalloc(calloc(1, sizeof(SavedHistogram)));
+		snprintf((*link)->name, sizeof((*link)->name), "%s", name);
+	}
+	return *link;
+}
+
+int mergeHistograms() {
+	char * files = getCommandLineParameterValue("--file", "");
+	char * outFilename = getCommandLineParameterValue("--out", NULL);
+	if (files[0] == '\0') {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "No histogram files given with --file");
+	}
+	SavedHistogram * merged = NULL;
+	Histogram * histogram = checkMalloc(malloc(sizeof(Histogram)));
+	char * list = checkMalloc(strdup(files));
+	for (char * filename = strtok(list, ","); filename != NULL; filename = strtok(NULL, ",")) {
+		FILE * in = fopen(filename, "r");
+		if (in == NULL) {
+			cleanUpAndExit(ExitErrorCommandLineParameter, "Cannot open histogram file %s", filename);
+		}
+		char name[128];
+		int result;
+		while ((result = histogramRead(in, name, sizeof(name), histogram)) == 1) {
+			histogramMerge(&findHistogram(&merged, name)->histogram, histogram);
+		}
+		fclose(in);
+		if (result < 0) {
+			cleanUpAndExit(ExitErrorCommandLineParameter, "Histogram file %s is not valid", filename);
+		}
+	}
+	free(list);
+	free(histogram);
+
+	FILE * out = NULL;
+	if (outFilename != NULL && (out = fopen(outFilename, "w")) == NULL) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Cannot write histogram file %s", outFilename);
+	}
+	while (merged != NULL) {
+		SavedHistogram * next = merged->next;
+		printf("%s: %llu samples\n", merged->name, (unsigned long long)histogramCount(&merged->histogram));
+		histogramPrint(stdout, "", &merged->histogram);
+		if (out != NULL) {
+			histogramWrite(out, merged->name, &merged->histogram);
+		}
+		free(merged);
+		merged = next;
+	}
+	if (out != NULL) {
+		fclose(out);
+	}
+	return 0;
+}
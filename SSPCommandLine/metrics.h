@@ -0,0 +1,51 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "protocol.h"
+
+// Metrics of the probes in Prometheus text format (Linux only), for every command. The protocol keeps SspMetrics per probe
+// serial number; they are served over HTTP with --metrics=[<address>:]<port> (address 127.0.0.1 by default, any path)
+// and/or written to --metrics-file=<file> every --metrics-interval=<s> seconds (default 15) and on exit, for the
+// textfile collector of the node exporter. Exposed, all labelled with the serial number:
+//	ssp_commands_total{tag}				commands written, by command tag
+//	ssp_swipes_issued_total				gos written
+//	ssp_swipes_completed_total			swiped events received
+//	ssp_responses_total{tag}			responses received, by status or event tag
+//	ssp_failures_total{class}			errors, by class (the SspResult)
+//	ssp_crc_failures_total				responses with a wrong CRC
+//	ssp_reconnects_total				reconnects after connection errors
+//	ssp_write_seconds					histogram of writing a command
+//	ssp_response_seconds				histogram of waiting for the response to a method or function call
+//	ssp_swipe_seconds					histogram from a go to its swiped event
+// With --histograms=<file> the latency histograms of the probes (write/<serial>, response/<serial> and swipe/<serial>)
+// and those of the command (like schedule/lateness) are written to file on exit, see histogram.h for the format. The
+// histogram command merges such files, of runs on several hosts, by name: --file=<list> [--out=<file>].
+
+// Keeps the metrics of an opened probe (when --metrics or --metrics-file is given), starting the exporter the first time.
+// A probe opened again with the same serial number continues its counters.
+void metricsAttach(SspDevice * device);
+// Saves a histogram of the command to be written with --histograms.
+void metricsSaveHistogram(const char * name, const Histogram * histogram);
+// Writes the metrics file and the histograms file a last time, called from cleanUpAndExit.
+void metricsStop();
+// histogram command: merges histogram files and prints the percentiles.
+int mergeHistograms();
+
+#endif /* not defined METRICS_H */
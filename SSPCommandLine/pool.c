@@ -0,0 +1,526 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hidapi/hidapi.h"
+#include "hidbackend.h"
+#include "SSPCommandLineTool.h"
+#include "pool.h"
+#include "util.h"
+
+#define POOL_MAX_PROBES 64
+#define POOL_MAX_CLIENTS 256
+#define POOL_MAX_FIELD 64
+// Seconds of waiting that raise the priority of a request by one
+#define POOL_AGING_SECONDS 30
+// Interval at which the pool looks for newly connected probes
+#define POOL_RESCAN_SECONDS 10
+
+typedef struct {
+	char serial[POOL_MAX_FIELD];
+	char label[POOL_MAX_FIELD];
+	int client;					///< index of the client holding the lease, -1 when the probe is free
+	uint64_t leaseExpiresNs;
+} PoolProbe;
+
+typedef enum { SelectAny, SelectSerial, SelectLabel } PoolSelectorType;
+
+typedef struct {
+	int fd;						///< -1 when the slot is unused
+	pid_t pid;
+	char line[256];
+	size_t lineLength;
+	bool waiting;
+	PoolSelectorType selectorType;
+	char selector[POOL_MAX_FIELD];
+	int priority;
+	int leaseSeconds;
+	uint64_t waitingSinceNs;
+	uint64_t sequence;			///< arrival order, for first come, first served within a priority
+} PoolClient;
+
+static PoolProbe poolProbes[POOL_MAX_PROBES];
+static size_t poolProbeCount = 0;
+static PoolClient poolClients[POOL_MAX_CLIENTS];
+static uint64_t poolSequence = 0;
+static volatile sig_atomic_t stopPool = 0;
+
+static void handleStopSignal(int signal) {
+	stopPool = 1;
+}
+
+static void sendLine(int fd, const char * format, ...) {
+	char line[512];
+	va_list argptr;
+	va_start(argptr, format);
+	int length = vsnprintf(line, sizeof(line) - 1, format, argptr);
+	va_end(argptr);
+	if (length < 0) {
+		return;
+	}
+	length = min(length, (int)sizeof(line) - 2);
+	line[length++] = '\n';
+	// clients that do not read are not waited for
+	send(fd, line, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+// Looks up the label of serial in the --labels option: <serial>=<label>[,<serial>=<label>...]
+static void lookupLabel(const char * labels, const char * serial, char * label, size_t labelSize) {
+	label[0] = '\0';
+	size_t serialLength = strlen(serial);
+	const char * entry = labels;
+	while (entry != NULL && *entry != '\0') {
+		const char * end = strchr(entry, ',');
+		size_t entryLength = (end != NULL) ? (size_t)(end - entry) : strlen(entry);
+		if (entryLength > serialLength && strncmp(entry, serial, serialLength) == 0 && entry[serialLength] == '=') {
+			snprintf(label, labelSize, "%.*s", (int)(entryLength - serialLength - 1), entry + serialLength + 1);
+			return;
+		}
+		entry = (end != NULL) ? end + 1 : NULL;
+	}
+}
+
+// Adds the probes that are connected and not known yet.
+static void scanProbes(const char * labels) {
+	struct hid_device_info * devs = hidBackend->enumerate(SSP_VID, SSP_PID);
+	for (struct hid_device_info * dev = devs; dev != NULL; dev = dev->next) {
+		char serial[POOL_MAX_FIELD];
+		snprintf(serial, sizeof(serial), "%ls", dev->serial_number != NULL ? dev->serial_number : L"");
+		bool known = false;
+		for (size_t i = 0; i < poolProbeCount && !known; i++) {
+			known = strcmp(poolProbes[i].serial, serial) == 0;
+		}
+		if (known || serial[0] == '\0' || poolProbeCount == POOL_MAX_PROBES) {
+			continue;
+		}
+		PoolProbe * probe = &poolProbes[poolProbeCount++];
+		snprintf(probe->serial, sizeof(probe->serial), "%s", serial);
+		lookupLabel(labels, serial, probe->label, sizeof(probe->label));
+		probe->client = -1;
+		IFNOTQUIET(printf("Probe %s%s%s\n", probe->serial, probe->label[0] ? " label " : "", probe->label));
+	}
+	hidBackend->free_enumeration(devs);
+}
+
+static bool probeMatches(const PoolProbe * probe, const PoolClient * client) {
+	switch (client->selectorType) {
+	case SelectSerial:
+		return strcmp(probe->serial, client->selector) == 0;
+	case SelectLabel:
+		return strcmp(probe->label, client->selector) == 0;
+	default:
+		return true;
+	}
+}
+
+static void releaseLeases(int clientIndex) {
+	for (size_t i = 0; i < poolProbeCount; i++) {
+		if (poolProbes[i].client == clientIndex) {
+			IFNOTQUIET(printf("Lease of %s released\n", poolProbes[i].serial));
+			poolProbes[i].client = -1;
+		}
+	}
+}
+
+static void dropClient(int clientIndex) {
+	releaseLeases(clientIndex);
+	close(poolClients[clientIndex].fd);
+	poolClients[clientIndex].fd = -1;
+	poolClients[clientIndex].waiting = false;
+}
+
+// Grants free probes to waiting clients, highest (aged) priority first.
+static void schedule(uint64_t now) {
+	for (;;) {
+		int best = -1;
+		size_t bestProbe = 0;
+		int64_t bestPriority = 0;
+		for (int c = 0; c < POOL_MAX_CLIENTS; c++) {
+			PoolClient * client = &poolClients[c];
+			if (client->fd < 0 || !client->waiting) {
+				continue;
+			}
+			int64_t priority = client->priority + (int64_t)((now - client->waitingSinceNs) / (POOL_AGING_SECONDS * 1000000000ull));
+			if (best >= 0 && (priority < bestPriority || (priority == bestPriority && client->sequence > poolClients[best].sequence))) {
+				continue;
+			}
+			for (size_t p = 0; p < poolProbeCount; p++) {
+				if (poolProbes[p].client < 0 && probeMatches(&poolProbes[p], client)) {
+					best = c;
+					bestProbe = p;
+					bestPriority = priority;
+					break;
+				}
+			}
+		}
+		if (best < 0) {
+			return;
+		}
+		PoolClient * client = &poolClients[best];
+		PoolProbe * probe = &poolProbes[bestProbe];
+		probe->client = best;
+		probe->leaseExpiresNs = now + (uint64_t)client->leaseSeconds * 1000000000ull;
+		client->waiting = false;
+		sendLine(client->fd, "GRANTED %s %d", probe->serial, client->leaseSeconds);
+		IFNOTQUIET(printf("Lease of %s granted to pid %d for %d s\n", probe->serial, (int)client->pid, client->leaseSeconds));
+	}
+}
+
+static void handleLine(int clientIndex, char * line, int maxLeaseSeconds, uint64_t now) {
+	PoolClient * client = &poolClients[clientIndex];
+	char command[16];
+	char selector[POOL_MAX_FIELD + 8];
+	int priority = 0;
+	int leaseSeconds = maxLeaseSeconds;
+	int fields = sscanf(line, "%15s %71s %d %d", command, selector, &priority, &leaseSeconds);
+	if (fields < 1) {
+		return;
+	}
+	if (strcmp(command, "LEASE") == 0 && fields >= 2) {
+		if (client->waiting) {
+			sendLine(client->fd, "ERROR already waiting for a lease");
+			return;
+		}
+		if (strcmp(selector, "any") == 0) {
+			client->selectorType = SelectAny;
+			client->selector[0] = '\0';
+		}
+		else if (strncmp(selector, "serial:", 7) == 0) {
+			client->selectorType = SelectSerial;
+			snprintf(client->selector, sizeof(client->selector), "%s", selector + 7);
+		}
+		else if (strncmp(selector, "label:", 6) == 0) {
+			client->selectorType = SelectLabel;
+			snprintf(client->selector, sizeof(client->selector), "%s", selector + 6);
+		}
+		else {
+			sendLine(client->fd, "ERROR invalid selector %s", selector);
+			return;
+		}
+		// requests that can never be granted are refused instead of queued forever
+		bool possible = false;
+		for (size_t p = 0; p < poolProbeCount && !possible; p++) {
+			possible = probeMatches(&poolProbes[p], client);
+		}
+		if (!possible) {
+			sendLine(client->fd, "ERROR no probe matches %s", selector);
+			return;
+		}
+		client->priority = priority;
+		client->leaseSeconds = (leaseSeconds > 0 && leaseSeconds < maxLeaseSeconds) ? leaseSeconds : maxLeaseSeconds;
+		client->waiting = true;
+		client->waitingSinceNs = now;
+		client->sequence = poolSequence++;
+	}
+	else if (strcmp(command, "RELEASE") == 0) {
+		client->waiting = false;
+		releaseLeases(clientIndex);
+	}
+	else if (strcmp(command, "STATUS") == 0) {
+		for (size_t p = 0; p < poolProbeCount; p++) {
+			PoolProbe * probe = &poolProbes[p];
+			if (probe->client < 0) {
+				sendLine(client->fd, "%s %s free", probe->serial, probe->label[0] ? probe->label : "-");
+			}
+			else {
+				sendLine(client->fd, "%s %s leased pid %d %d s left", probe->serial, probe->label[0] ? probe->label : "-",
+					(int)poolClients[probe->client].pid, (int)((probe->leaseExpiresNs - min(now, probe->leaseExpiresNs)) / 1000000000ull));
+			}
+		}
+		int waiting = 0;
+		for (int c = 0; c < POOL_MAX_CLIENTS; c++) {
+			waiting += (poolClients[c].fd >= 0 && poolClients[c].waiting) ? 1 : 0;
+		}
+		sendLine(client->fd, "%d waiting", waiting);
+		sendLine(client->fd, ".");
+	}
+	else {
+		sendLine(client->fd, "ERROR unknown command %s", command);
+	}
+}
+
+// Reads from a client and handles every complete line. Returns false when the client disconnected.
+static bool readClient(int clientIndex, int maxLeaseSeconds, uint64_t now) {
+	PoolClient * client = &poolClients[clientIndex];
+	ssize_t length = recv(client->fd, client->line + client->lineLength, sizeof(client->line) - 1 - client->lineLength, 0);
+	if (length <= 0) {
+		return false;
+	}
+	client->lineLength += (size_t)length;
+	client->line[client->lineLength] = '\0';
+	char * newline;
+	while ((newline = strchr(client->line, '\n')) != NULL) {
+		*newline = '\0';
+		handleLine(clientIndex, client->line, maxLeaseSeconds, now);
+		size_t used = (size_t)(newline - client->line) + 1;
+		memmove(client->line, newline + 1, client->lineLength - used + 1);
+		client->lineLength -= used;
+	}
+	// a line that does not fit is a protocol error
+	return client->lineLength < sizeof(client->line) - 1;
+}
+
+static int connectPool(const char * socketPath) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+// Listens on the socket at path. A socket file left by a pool that is gone is replaced, but when a pool still accepts
+// connections on it this fails with EADDRINUSE.
+static int openListenSocket(const char * path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+	int live = connectPool(path);
+	if (live >= 0) {
+		close(live);
+		errno = EADDRINUSE;
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+const char * poolSocketPath() {
+	char * socketPath = getCommandLineParameterValue("--pool", "");
+	return (socketPath[0] != '\0') ? socketPath : POOL_DEFAULT_SOCKET;
+}
+
+int runPool() {
+	const char * socketPath = poolSocketPath();
+	char * labels = getCommandLineParameterValue("--labels", "");
+	int maxLeaseSeconds = atoi(getCommandLineParameterValue("--max-lease", "3600"));
+	if (maxLeaseSeconds <= 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --max-lease, should be a positive number of seconds");
+	}
+
+	selectBackend();
+	if (hidBackend->init()) {
+		cleanUpAndExit(ExitErrorHidApi, "Error initializing HID api");
+	}
+	scanProbes(labels);
+
+	int listenFd = openListenSocket(socketPath);
+	if (listenFd < 0 && errno == EADDRINUSE) {
+		cleanUpAndExit(ExitErrorHidApi, "Another probe pool is running on %s", socketPath);
+	}
+	if (listenFd < 0) {
+		cleanUpAndExit(ExitErrorHidApi, "Cannot listen on %s: %s", socketPath, strerror(errno));
+	}
+	for (int c = 0; c < POOL_MAX_CLIENTS; c++) {
+		poolClients[c].fd = -1;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handleStopSignal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	IFNOTQUIET(printf("Pool of %zu probe(s) listening on %s\n", poolProbeCount, socketPath));
+	// leases are held by other processes, so they expire on the real clock also in the simulation mode
+	uint64_t nextScan = getRealMonotonicTimeNs() + POOL_RESCAN_SECONDS * 1000000000ull;
+	struct pollfd fds[POOL_MAX_CLIENTS + 1];
+	int fdClient[POOL_MAX_CLIENTS + 1];
+	while (!stopPool) {
+		nfds_t count = 0;
+		fds[count].fd = listenFd;
+		fds[count].events = POLLIN;
+		fdClient[count++] = -1;
+		for (int c = 0; c < POOL_MAX_CLIENTS; c++) {
+			if (poolClients[c].fd >= 0) {
+				fds[count].fd = poolClients[c].fd;
+				fds[count].events = POLLIN;
+				fdClient[count++] = c;
+			}
+		}
+		// wake up at least once per second to expire leases
+		if (poll(fds, count, 1000) < 0 && errno != EINTR) {
+			break;
+		}
+		uint64_t now = getRealMonotonicTimeNs();
+
+		for (nfds_t i = 1; i < count; i++) {
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				if (!readClient(fdClient[i], maxLeaseSeconds, now)) {
+					dropClient(fdClient[i]);
+				}
+			}
+		}
+		if (fds[0].revents & POLLIN) {
+			int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+			int c = 0;
+			while (fd >= 0 && c < POOL_MAX_CLIENTS && poolClients[c].fd >= 0) {
+				c++;
+			}
+			if (fd >= 0 && c == POOL_MAX_CLIENTS) {
+				sendLine(fd, "ERROR too many clients");
+				close(fd);
+			}
+			else if (fd >= 0) {
+				memset(&poolClients[c], 0, sizeof(PoolClient));
+				poolClients[c].fd = fd;
+				struct ucred credentials;
+				socklen_t credentialsLength = sizeof(credentials);
+				if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentialsLength) == 0) {
+					poolClients[c].pid = credentials.pid;
+				}
+			}
+		}
+
+		// expired leases: the client is told and disconnected, the probe goes back to the pool
+		for (size_t p = 0; p < poolProbeCount; p++) {
+			if (poolProbes[p].client >= 0 && now >= poolProbes[p].leaseExpiresNs) {
+				int c = poolProbes[p].client;
+				IFNOTQUIET(printf("Lease of %s held by pid %d expired\n", poolProbes[p].serial, (int)poolClients[c].pid));
+				sendLine(poolClients[c].fd, "EXPIRED");
+				dropClient(c);
+			}
+		}
+		if (now >= nextScan) {
+			scanProbes(labels);
+			nextScan = now + POOL_RESCAN_SECONDS * 1000000000ull;
+		}
+		schedule(now);
+	}
+
+	for (int c = 0; c < POOL_MAX_CLIENTS; c++) {
+		if (poolClients[c].fd >= 0) {
+			close(poolClients[c].fd);
+		}
+	}
+	close(listenFd);
+	unlink(socketPath);
+	IFNOTQUIET(printf("Pool stopped\n"));
+	return 0;
+}
+
+// Reads one line from the pool. Returns false when the connection was closed.
+static bool readLine(int fd, char * line, size_t size) {
+	size_t length = 0;
+	while (length < size - 1) {
+		char c;
+		ssize_t n = recv(fd, &c, 1, 0);
+		if (n <= 0) {
+			return false;
+		}
+		if (c == '\n') {
+			break;
+		}
+		line[length++] = c;
+	}
+	line[length] = '\0';
+	return true;
+}
+
+// The connection holding the lease. It is closed when the process exits, which releases the lease.
+static int leaseFd = -1;
+static char leasedProbe[POOL_MAX_FIELD];
+
+// Waits on the lease connection for the pool to end the lease. The pool sends EXPIRED (or goes away) and may then grant
+// the probe to another job, but that job cannot use it while this process holds the probe lock; it only tells so.
+static void * watchLease(void * argument) {
+	(void)argument;
+	char line[256];
+	if (readLine(leaseFd, line, sizeof(line)) && strcmp(line, "EXPIRED") == 0) {
+		fprintf(stderr, "The lease on probe %s expired, the probe pool can hand it out to another job once this one exits\n", leasedProbe);
+	}
+	else {
+		fprintf(stderr, "The probe pool closed the lease on probe %s\n", leasedProbe);
+	}
+	return NULL;
+}
+
+bool poolLeaseProbe(const char * socketPath, const char * selector, int priority, int leaseSeconds, char * serial, size_t serialSize, char * error, size_t errorSize) {
+	int fd = connectPool(socketPath);
+	if (fd < 0) {
+		snprintf(error, errorSize, "Cannot connect to probe pool %s: %s", socketPath, strerror(errno));
+		return false;
+	}
+	char line[256];
+	snprintf(line, sizeof(line), "LEASE %s %d %d\n", selector, priority, leaseSeconds);
+	if (send(fd, line, strlen(line), MSG_NOSIGNAL) < 0 || !readLine(fd, line, sizeof(line))) {
+		snprintf(error, errorSize, "Probe pool %s closed the connection", socketPath);
+		close(fd);
+		return false;
+	}
+	char granted[POOL_MAX_FIELD];
+	if (sscanf(line, "GRANTED %63s", granted) != 1) {
+		snprintf(error, errorSize, "Probe pool: %s", line);
+		close(fd);
+		return false;
+	}
+	snprintf(serial, serialSize, "%s", granted);
+	snprintf(leasedProbe, sizeof(leasedProbe), "%s", granted);
+	leaseFd = fd;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, watchLease, NULL) == 0) {
+		pthread_detach(thread);
+	}
+	return true;
+}
+
+int poolStatus() {
+	const char * socketPath = poolSocketPath();
+	int fd = connectPool(socketPath);
+	if (fd < 0) {
+		cleanUpAndExit(ExitErrorHidOpen, "Cannot connect to probe pool %s: %s", socketPath, strerror(errno));
+	}
+	char line[256];
+	send(fd, "STATUS\n", 7, MSG_NOSIGNAL);
+	while (readLine(fd, line, sizeof(line)) && strcmp(line, ".") != 0) {
+		printf("%s\n", line);
+	}
+	close(fd);
+	return 0;
+}
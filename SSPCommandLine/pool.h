@@ -0,0 +1,48 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Probe pool manager (Linux only). The pool command manages all probes found by hid_enumerate and hands out leases over a
+// unix socket, so concurrent jobs never use the same probe. The lease protocol is line based:
+//	client: LEASE <selector> <priority> <lease seconds>		selector: any | serial:<serial> | label:<label>
+//	pool:	GRANTED <serial> <lease seconds>				or ERROR <message>
+//	client: RELEASE (or just closes the connection)
+//	pool:	EXPIRED											when the lease timed out, the connection is closed
+//	client: STATUS											pool: one line per probe, followed by a line "."
+// Waiting requests are served by priority (higher first), the priority of a request grows while it waits so low
+// priority jobs are not starved, and requests with the same priority are served first come, first served.
+
+#define POOL_DEFAULT_SOCKET "/tmp/ssppool.sock"
+
+// Socket given with --pool=<socket>, or the default one for a bare --pool
+const char * poolSocketPath();
+// pool command: runs the pool manager until it is interrupted.
+int runPool();
+// Leases a probe from the pool at socketPath and stores its serial. The lease is held until the process exits. When
+// the pool ends the lease earlier (it expired) a message is printed on stderr. The pool may then grant the probe to
+// another job, which is kept from using it by the probe lock (see probelock.h) this process holds until it exits.
+// Returns false with a message in error when no lease could be obtained.
+bool poolLeaseProbe(const char * socketPath, const char * selector, int priority, int leaseSeconds, char * serial, size_t serialSize, char * error, size_t errorSize);
+// status command: prints the probes of the pool and their leases.
+int poolStatus();
+
+#endif /* not defined POOL_H */
@@ -0,0 +1,117 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "probehealth.h"
+
+void probeHealthInit(ProbeHealth * health) {
+	memset(health, 0, sizeof(ProbeHealth));
+}
+
+void probeHealthRecord(ProbeHealth * health, SspResult result, uint64_t latencyNs) {
+	health->latencyNs[health->windowNext] = latencyNs;
+	health->failed[health->windowNext] = (result != SspResultOk);
+	health->windowNext = (health->windowNext + 1) % PROBEHEALTH_WINDOW;
+	if (health->windowCount < PROBEHEALTH_WINDOW) {
+		health->windowCount++;
+	}
+	health->operations++;
+	if (result != SspResultOk) {
+		health->errors++;
+		health->consecutiveErrors++;
+	}
+	else {
+		health->consecutiveErrors = 0;
+	}
+	if (result == SspResultErrorCrc) {
+		health->crcErrors++;
+	}
+	if (result == SspResultErrorNoResponse) {
+		health->timeouts++;
+	}
+}
+
+static int compareLatency(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+uint64_t probeHealthPercentile(const ProbeHealth * health, unsigned percent) {
+	if (health->windowCount == 0) {
+		return 0;
+	}
+	uint64_t sorted[PROBEHEALTH_WINDOW];
+	memcpy(sorted, health->latencyNs, health->windowCount * sizeof(uint64_t));
+	qsort(sorted, health->windowCount, sizeof(uint64_t), compareLatency);
+	unsigned index = (health->windowCount * percent) / 100;
+	return sorted[index < health->windowCount ? index : health->windowCount - 1];
+}
+
+unsigned probeHealthErrorPercent(const ProbeHealth * health) {
+	if (health->windowCount == 0) {
+		return 0;
+	}
+	unsigned failures = 0;
+	for (unsigned i = 0; i < health->windowCount; i++) {
+		failures += health->failed[i] ? 1 : 0;
+	}
+	return failures * 100 / health->windowCount;
+}
+
+bool probeHealthEvaluate(ProbeHealth * health, const ProbeHealthThresholds * thresholds, uint64_t nowNs) {
+	if (health->quarantined) {
+		return false;
+	}
+	bool failing = health->consecutiveErrors >= thresholds->maxConsecutiveErrors;
+	if (health->windowCount >= thresholds->minSamples) {
+		failing = failing || probeHealthErrorPercent(health) > thresholds->maxErrorPercent || probeHealthPercentile(health, 95) > thresholds->maxLatencyNs;
+	}
+	if (!failing) {
+		return false;
+	}
+	health->quarantined = true;
+	health->quarantines++;
+	health->nextCheckNs = nowNs + thresholds->checkIntervalNs;
+	health->goodChecks = 0;
+	return true;
+}
+
+bool probeHealthCheckDue(const ProbeHealth * health, uint64_t nowNs) {
+	return health->quarantined && nowNs >= health->nextCheckNs;
+}
+
+bool probeHealthCheckDone(ProbeHealth * health, const ProbeHealthThresholds * thresholds, SspResult result, uint64_t latencyNs, uint64_t nowNs) {
+	if (result == SspResultOk && latencyNs <= thresholds->maxLatencyNs) {
+		health->goodChecks++;
+	}
+	else {
+		health->goodChecks = 0;
+	}
+	if (health->goodChecks < thresholds->reinstateChecks) {
+		health->nextCheckNs = nowNs + thresholds->checkIntervalNs;
+		return false;
+	}
+	// start over with a clean window, the old one would quarantine the probe again right away
+	health->quarantined = false;
+	health->consecutiveErrors = 0;
+	health->windowCount = 0;
+	health->windowNext = 0;
+	return true;
+}
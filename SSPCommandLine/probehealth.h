@@ -0,0 +1,77 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef PROBEHEALTH_H
+#define PROBEHEALTH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "protocol.h"
+
+// Health tracking for the probes of a multi-probe mode. The outcome and latency of the most recent operations of a
+// probe are kept in a sliding window; a probe whose error rate or latency exceeds the thresholds is quarantined. A
+// quarantined probe gets no routed work, it is checked periodically with a software version command and reinstated
+// after a number of successive good checks.
+
+#define PROBEHEALTH_WINDOW 64
+
+typedef struct {
+	unsigned maxErrorPercent;		///< error rate in the window above which the probe is quarantined
+	uint64_t maxLatencyNs;			///< 95th percentile latency in the window above which the probe is quarantined
+	unsigned minSamples;			///< operations needed in the window before the thresholds apply
+	unsigned maxConsecutiveErrors;	///< successive errors that quarantine the probe right away
+	uint64_t checkIntervalNs;		///< time between the checks of a quarantined probe
+	unsigned reinstateChecks;		///< successive good checks needed to reinstate a probe
+} ProbeHealthThresholds;
+
+#define PROBEHEALTH_THRESHOLDS_DEFAULT { 20, 1000000000ull, 16, 3, 5000000000ull, 3 }
+
+typedef struct {
+	// sliding window of recent operations
+	uint64_t latencyNs[PROBEHEALTH_WINDOW];
+	bool failed[PROBEHEALTH_WINDOW];
+	unsigned windowCount;
+	unsigned windowNext;
+	// totals since the start
+	uint64_t operations;
+	uint64_t errors;
+	uint64_t crcErrors;
+	uint64_t timeouts;
+	uint64_t quarantines;
+	unsigned consecutiveErrors;
+	// quarantine state
+	bool quarantined;
+	uint64_t nextCheckNs;
+	unsigned goodChecks;
+} ProbeHealth;
+
+void probeHealthInit(ProbeHealth * health);
+// Records the outcome of an operation that took latencyNs.
+void probeHealthRecord(ProbeHealth * health, SspResult result, uint64_t latencyNs);
+// Latency below which the given percentage of the operations in the window completed, 0 when the window is empty.
+uint64_t probeHealthPercentile(const ProbeHealth * health, unsigned percent);
+// Error rate in the window, in percent.
+unsigned probeHealthErrorPercent(const ProbeHealth * health);
+// Quarantines the probe when it exceeds the thresholds. Returns true when the probe was quarantined by this call.
+bool probeHealthEvaluate(ProbeHealth * health, const ProbeHealthThresholds * thresholds, uint64_t nowNs);
+// Whether a quarantined probe is due for a check.
+bool probeHealthCheckDue(const ProbeHealth * health, uint64_t nowNs);
+// Records the outcome of a check of a quarantined probe. Returns true when the probe was reinstated by this call.
+bool probeHealthCheckDone(ProbeHealth * health, const ProbeHealthThresholds * thresholds, SspResult result, uint64_t latencyNs, uint64_t nowNs);
+
+#endif /* not defined PROBEHEALTH_H */
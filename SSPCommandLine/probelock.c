@@ -0,0 +1,121 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "probelock.h"
+#include "util.h"
+
+#define PROBELOCK_MAX_LOCKS 64
+// Interval at which a locked probe is retried while waiting
+#define PROBELOCK_RETRY_MS 20
+
+typedef struct {
+	char * key;
+	int fd;
+} ProbeLock;
+
+// Locks held by this process. The descriptors are never closed, the locks are released when the process exits.
+static ProbeLock probeLocks[PROBELOCK_MAX_LOCKS];
+static size_t probeLockCount = 0;
+
+// The lock directory: SSP_LOCK_DIR, or /run/lock, which all users share, or the runtime directory of the user when
+// there is no writable /run/lock.
+static const char * lockDirectory() {
+	const char * directory = getenv("SSP_LOCK_DIR");
+	if (directory != NULL && directory[0] != '\0') {
+		return directory;
+	}
+	if (access("/run/lock", W_OK | X_OK) == 0) {
+		return "/run/lock";
+	}
+	directory = getenv("XDG_RUNTIME_DIR");
+	if (directory != NULL && directory[0] != '\0') {
+		return directory;
+	}
+	return "/tmp";
+}
+
+// Builds the lock file name; characters that cannot be part of a file name (such as the '/' of a HID path) become '_'.
+static void lockFileName(const char * key, char * name, size_t size) {
+	const char * directory = lockDirectory();
+	int length = snprintf(name, size, "%s/ssp-", directory);
+	for (const char * c = key; *c != '\0' && length < (int)size - 6; c++) {
+		name[length++] = (*c == '/' || *c == ':' || *c == ' ') ? '_' : *c;
+	}
+	snprintf(name + length, size - length, ".lock");
+}
+
+ProbeLockResult lockProbe(const char * key, int timeoutMs) {
+	for (size_t i = 0; i < probeLockCount; i++) {
+		if (strcmp(probeLocks[i].key, key) == 0) {
+			return ProbeLockOk;
+		}
+	}
+	if (probeLockCount == PROBELOCK_MAX_LOCKS) {
+		return ProbeLockError;
+	}
+
+	char name[512];
+	lockFileName(key, name, sizeof(name));
+	// The directory can be writable by everyone: a link planted at the name is not followed, and the file is only
+	// opened for reading (which is all flock needs, also for other users locking the same probe) and never changed.
+	// O_NONBLOCK keeps a planted FIFO from blocking the open.
+	int fd = open(name, O_RDONLY | O_CREAT | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return ProbeLockError;
+	}
+	// the lock file of another user is fine, but it has to be a plain file and not a hard link to another one
+	struct stat status;
+	if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode) || status.st_nlink != 1) {
+		close(fd);
+		errno = EPERM;
+		return ProbeLockError;
+	}
+
+	// the lock is held by another process, so the timeout is on the real clock also in the simulation mode
+	uint64_t deadline = getRealMonotonicTimeNs() + (uint64_t)(timeoutMs > 0 ? timeoutMs : 0) * 1000000ull;
+	while (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		if (errno != EWOULDBLOCK && errno != EINTR) {
+			close(fd);
+			return ProbeLockError;
+		}
+		if (timeoutMs == 0 || (timeoutMs > 0 && getRealMonotonicTimeNs() >= deadline)) {
+			close(fd);
+			return ProbeLockBusy;
+		}
+		struct timespec retry = { 0, PROBELOCK_RETRY_MS * 1000000L };
+		nanosleep(&retry, NULL);
+	}
+
+	probeLocks[probeLockCount].key = strdup(key);
+	if (probeLocks[probeLockCount].key == NULL) {
+		close(fd);
+		return ProbeLockError;
+	}
+	probeLocks[probeLockCount].fd = fd;
+	probeLockCount++;
+	return ProbeLockOk;
+}
@@ -0,0 +1,39 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef PROBELOCK_H
+#define PROBELOCK_H
+
+#include <stdbool.h>
+
+// Advisory per-probe locks (Linux only), so parallel invocations of the tool never talk to the same probe: a probe is
+// locked with flock on <lock directory>/ssp-<serial>.lock before it is opened, and the lock is held until the process
+// exits. The lock directory is the one given in the SSP_LOCK_DIR environment variable, or /run/lock, or when that is not
+// writable $XDG_RUNTIME_DIR (which only locks against the processes of the same user) and finally /tmp.
+
+typedef enum {
+	ProbeLockOk,
+	ProbeLockBusy,		///< the probe is locked by another process (after waiting, when a timeout was given)
+	ProbeLockError,		///< the lock file could not be created
+} ProbeLockResult;
+
+// Locks the probe with the given key (its serial number, or its HID path when it has none). timeoutMs is the time to
+// wait for another process to release it: 0 tries once, a negative value waits forever.
+// Locking a probe that this process has already locked succeeds immediately.
+ProbeLockResult lockProbe(const char * key, int timeoutMs);
+
+#endif /* not defined PROBELOCK_H */
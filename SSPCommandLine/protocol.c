@@ -23,19 +23,46 @@ IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <wchar.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <linux/usbdevice_fs.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
 
 #include "hidapi/hidapi.h"
+#include "hidbackend.h"
+#include "hidreport.h"
 #include "SSPCommandLineTool.h"
 #include "protocol.h"
+#include "usdt.h"
 #include "util.h"
 
-hid_device * sspHid = NULL;
-
 // responses from the probe are always short: only tag + overhead
 #define COMM_USB_MAX_PACKETDATASIZE_IN 256
-// messages sent to the probe are longer, containing up to 120 data bytes. Let's just round that to 256 bytes.
-#define COMM_USB_MAX_PACKETDATASIZE_OUT 256
-#define USB_HID_REPORT_LENGTH 64
+// messages sent to the probe are longer, containing up to 120 data bytes (see SSP_MAX_FRAME_LENGTH)
+#define COMM_USB_MAX_PACKETDATASIZE_OUT SSP_MAX_FRAME_LENGTH
+// Report length used when the report descriptor cannot be read (e.g. on Windows)
+#define USB_HID_DEFAULT_REPORT_LENGTH 64
+// Largest report supported: the maximum packet size of a high-speed interrupt endpoint
+#define USB_HID_MAX_REPORT_LENGTH 1024
+// Smallest output report that still makes sense for sending frames
+#define USB_HID_MIN_REPORT_LENGTH 8
+
+static const HidReportLayout defaultReportLayout = {
+	.inputReportId = 0,
+	.inputReportLength = USB_HID_DEFAULT_REPORT_LENGTH,
+	.outputReportId = 0,
+	.outputReportLength = USB_HID_DEFAULT_REPORT_LENGTH,
+};
 
 typedef enum { up_start, up_tag, up_length1, up_length2, up_data, up_checksum1, up_checksum2, up_end } comm_usb_bytereader_state_t;
 
@@ -49,17 +76,97 @@ typedef struct {
 	bool dle_escape;									///< if the previous character was a DLE
 } comm_usb_parse_data_t;
 
-/// Initialize the parse state: no data yet, everything on zero and empty, bytereader starts in the up_start state and the dle-escape state is false (no escape)
-comm_usb_parse_data_t parse_state = {
-	.tag = 0,
-	.length = 0,
-	.packetbuffer = { 0, },
-	.checksum = 0,
-	.fillpointer = 0,
-	.brstate = up_start,
-	.dle_escape = false,
+struct SspDevice_s {
+	hid_device * hid;
+	HidReportLayout reportLayout;		///< Report IDs and lengths, detected from the report descriptor when the device is opened
+	comm_usb_parse_data_t parse_state;
+	// Last input report read. A report can hold the end of one frame and the start of the next, the bytes after a
+	// complete frame are parsed by the next sspPollResponse before it reads again.
+	uint8_t input[USB_HID_MAX_REPORT_LENGTH + 1];
+	size_t inputOffset;					///< Next byte of input to parse
+	size_t inputLength;
+	char errorMessage[256];				///< Description of the last error
+	char serial[128];					///< Serial number, used to find the probe again when it has to be reopened
+	char path[256];						///< HID path the probe was opened with
+	SspRecoveryOptions recovery;
+	bool recovering;					///< Set while the configuration is replayed, failing commands are not retried then
+	// Configuration sent to the probe since the last reset to defaults, replayed after a reconnect
+	uint8_t trackData[3][SSP_MAX_TRACK_LENGTH];
+	size_t trackDataLength[3];
+	bool trackDataSet[3];
+	uint8_t trackConfig[3][SSP_TRACK_CONFIG_LENGTH];
+	bool trackConfigSet[3];
+	int triggerMode;					///< -1 when not set
+	bool keepAwake;						///< Runtime suspend of the USB device is prevented, see sspPreventAutosuspend
+	char usbDevice[256];				///< sysfs directory of the USB device whose power/control was changed
+	char savedPowerControl[16];			///< power/control before it was changed, restored on close
+	SspCommandObserver observer;		///< Called for every command sent, see sspSetCommandObserver
+	void * observerContext;
+	SspMetrics * metrics;				///< Counters, NULL when not kept, see sspSetMetrics
+	uint64_t armedNs;					///< When the last go was written, for the swipe latency
 };
 
+// Metrics are updated with relaxed atomic adds: they are only read for reporting, so they need no ordering
+#ifdef _MSC_VER
+#define sspMetricsAdd(counter, value) InterlockedExchangeAdd64((volatile LONG64 *)&(counter), (LONG64)(value))
+#else
+#define sspMetricsAdd(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#endif
+
+
+/// Initialize the parse state: no data yet, everything on zero and empty, bytereader starts in the up_start state and the dle-escape state is false (no escape)
+static void resetParseState(comm_usb_parse_data_t * parse_state) {
+	memset(parse_state, 0, sizeof(*parse_state));
+	parse_state->brstate = up_start;
+	parse_state->dle_escape = false;
+}
+
+// Returns a description of a result code.
+const char * sspResultString(SspResult result) {
+	switch (result) {
+	case SspResultOk:						return "OK";
+	case SspResultPending:					return "Response pending";
+	case SspResultErrorHidApi:				return "Error initializing HID api";
+	case SspResultErrorHidOpen:				return "Error opening HID device";
+	case SspResultErrorReportDescriptor:	return "The report descriptor of the probe does not describe usable input and output reports";
+	case SspResultErrorOutOfMemory:			return "Out of memory";
+	case SspResultErrorFrameTooLong:		return "Communication protocol error, constructed message would be too long to transfer to the device";
+	case SspResultErrorWrite:				return "Communication protocol error, incorrect number of bytes written";
+	case SspResultErrorRead:				return "Communication protocol error, reading from the device failed";
+	case SspResultErrorNoResponse:			return "Communication protocol error, no response received";
+	case SspResultErrorParse:				return "Communication protocol error, error parsing response";
+	case SspResultErrorCrc:					return "Communication protocol error, CRC is wrong";
+	case SspResultErrorNotOk:				return "Communication protocol error, device did not report OK on methodcall";
+	case SspResultErrorWrongTag:			return "Communication protocol error, device did not report same tag";
+	case SspResultErrorShortResponse:		return "Communication protocol error, too short response";
+	case SspResultErrorInvalidCharacter:	return "Invalid character supplied";
+	case SspResultErrorCancelled:			return "Operation cancelled";
+	default:								return "Unknown error";
+	}
+}
+
+// Returns a description of the last error on the device, with details when available.
+const char * sspErrorMessage(SspDevice * device) {
+	return device->errorMessage;
+}
+
+// Stores the error message for result on the device and returns result. When format is NULL the generic description is used.
+static SspResult setError(SspDevice * device, SspResult result, const char * format, ...) {
+	if (device->metrics != NULL) {
+		sspMetricsAdd(device->metrics->failures[result], 1);
+	}
+	if (format == NULL) {
+		snprintf(device->errorMessage, sizeof(device->errorMessage), "%s", sspResultString(result));
+	}
+	else {
+		va_list argptr;
+		va_start(argptr, format);
+		vsnprintf(device->errorMessage, sizeof(device->errorMessage), format, argptr);
+		va_end(argptr);
+	}
+	return result;
+}
+
 static bool addData(uint8_t * data, size_t * fillcount, size_t maxlength, uint8_t newbyte) {
 	data[*fillcount] = newbyte;
 
@@ -82,20 +189,62 @@ static bool addDataEscapeDle(uint8_t * data, size_t * fillcount, size_t maxlengt
 // On Linux data is apparently not lost when closing the device. So to make sure there is no data in the buffer we do a
 // quick flush, otherwise the simple method of parsing the responses used in this utility will get confused, because on
 // reading it gets an earlier (=wrong) response.
-void sspHidFlush() {
-	uint8_t response[USB_HID_REPORT_LENGTH + 1];
+static void sspHidFlush(SspDevice * device) {
+	uint8_t response[USB_HID_MAX_REPORT_LENGTH + 1];
+	resetParseState(&device->parse_state);
+	device->inputOffset = device->inputLength = 0;
+	if (device->hid == NULL) {
+		return;
+	}
 	for (int i = 0; i < 5; i++) {
-		int bytesread = hid_read_timeout(sspHid, response, ARRAY_SIZE(response), 1);
+		int bytesread = hidBackend->read_timeout(device->hid, response, device->reportLayout.inputReportLength + 1, 1);
 		// timeout
 		if (bytesread == 0) {
 			return;
 		}
+		SSP_USDT2(flush_discard, device->serial, bytesread);
+	}
+}
+
+// Keeps track of the configuration sent to the probe, so it can be replayed after a reconnect.
+static void sspRememberCommand(SspDevice * device, SspCommandTag tag, const uint8_t * data, size_t length) {
+	if (device->recovering) {
+		return;
+	}
+	if (tag == SspCommandDefaultConfiguration) {
+		memset(device->trackDataSet, 0, sizeof(device->trackDataSet));
+		memset(device->trackConfigSet, 0, sizeof(device->trackConfigSet));
+		device->triggerMode = -1;
+	}
+	else if (tag >= SspCommandData1 && tag <= SspCommandData3 && length <= SSP_MAX_TRACK_LENGTH) {
+		int track = tag - SspCommandData1;
+		memcpy(device->trackData[track], data, length);
+		device->trackDataLength[track] = length;
+		device->trackDataSet[track] = true;
+	}
+	else if (tag >= SspCommandConfig1 && tag <= SspCommandConfig3 && length == SSP_TRACK_CONFIG_LENGTH) {
+		int track = tag - SspCommandConfig1;
+		memcpy(device->trackConfig[track], data, length);
+		device->trackConfigSet[track] = true;
+	}
+	else if (tag == SspCommandTriggerMode && length == 1) {
+		device->triggerMode = data[0];
 	}
 }
 
-static void sspSendCommand(SspCommandTag tag, const unsigned char *data, size_t length) {
-	sspHidFlush();
-	uint8_t report[COMM_USB_MAX_PACKETDATASIZE_OUT];
+// Encodes a command as a frame: header, escaped data, CRC and tail. The frame can be sent any number of times with
+// sspMethodCallEncoded. Returns SspResultErrorFrameTooLong when the command does not fit in a frame.
+SspResult sspEncodeFrame(SspCommandTag tag, const void *argument_data, size_t length, SspEncodedFrame * encoded) {
+	const uint8_t * data = argument_data;
+	uint8_t * report = encoded->frame;
+	if (length > SSP_MAX_TRACK_LENGTH) {
+		return SspResultErrorFrameTooLong;
+	}
+	encoded->tag = tag;
+	if (length > 0) {
+		memcpy(encoded->data, data, length);
+	}
+	encoded->length = (uint16_t)length;
 
 	size_t fillcount = 0;
 	// report number of the hid report
@@ -111,85 +260,124 @@ static void sspSendCommand(SspCommandTag tag, const unsigned char *data, size_t
 	}
 	bool lengthOk = false;
 	// Header: DLE STX
-	lengthOk = addData(report, &fillcount, ARRAY_SIZE(report), DLE);
-	lengthOk &= addData(report, &fillcount, ARRAY_SIZE(report), STX);
+	lengthOk = addData(report, &fillcount, ARRAY_SIZE(encoded->frame), DLE);
+	lengthOk &= addData(report, &fillcount, ARRAY_SIZE(encoded->frame), STX);
 	// Tag
-	lengthOk &= addDataEscapeDle(report, &fillcount, ARRAY_SIZE(report), tag);
+	lengthOk &= addDataEscapeDle(report, &fillcount, ARRAY_SIZE(encoded->frame), tag);
 	// Length
-	lengthOk &= addDataEscapeDle(report, &fillcount, ARRAY_SIZE(report), ((length >> 8) & 0xff));
-	lengthOk &= addDataEscapeDle(report, &fillcount, ARRAY_SIZE(report), (length & 0xff));
+	lengthOk &= addDataEscapeDle(report, &fillcount, ARRAY_SIZE(encoded->frame), ((length >> 8) & 0xff));
+	lengthOk &= addDataEscapeDle(report, &fillcount, ARRAY_SIZE(encoded->frame), (length & 0xff));
 	// Data
 	for (size_t i = 0; i < length; i++) {
-		lengthOk &= addDataEscapeDle(report, &fillcount, ARRAY_SIZE(report), data[i]);
+		lengthOk &= addDataEscapeDle(report, &fillcount, ARRAY_SIZE(encoded->frame), data[i]);
 	}
 	// CRC:
-	lengthOk &= addDataEscapeDle(report, &fillcount, ARRAY_SIZE(report), ((crc >> 8) & 0xff));
-	lengthOk &= addDataEscapeDle(report, &fillcount, ARRAY_SIZE(report), (crc & 0xff));
+	lengthOk &= addDataEscapeDle(report, &fillcount, ARRAY_SIZE(encoded->frame), ((crc >> 8) & 0xff));
+	lengthOk &= addDataEscapeDle(report, &fillcount, ARRAY_SIZE(encoded->frame), (crc & 0xff));
 
 	// Tail: DLE ETX
-	lengthOk &= addData(report, &fillcount, ARRAY_SIZE(report), DLE);
-	lengthOk &= addData(report, &fillcount, ARRAY_SIZE(report), ETX);
+	lengthOk &= addData(report, &fillcount, ARRAY_SIZE(encoded->frame), DLE);
+	lengthOk &= addData(report, &fillcount, ARRAY_SIZE(encoded->frame), ETX);
 
 	if (!lengthOk) {
-		cleanUpAndExit(ExitErrorCommunicationProtocol, "Communication protocol error, constructed message would be too long to transfer to the device");
+		return SspResultErrorFrameTooLong;
 	}
+	encoded->frameLength = (uint16_t)fillcount;
+	return SspResultOk;
+}
+
+// Sends an encoded frame to the device. Frames longer than one report are sent in parts.
+static SspResult sspWriteFrame(SspDevice * device, const SspEncodedFrame * encoded) {
+	if (device->hid == NULL) {
+		return setError(device, SspResultErrorWrite, "The probe is not connected");
+	}
+	const uint8_t * report = encoded->frame;
+	size_t fillcount = encoded->frameLength;
+	uint64_t start = (device->metrics != NULL) ? getMonotonicTimeNs() : 0;
+	SSP_USDT3(frame_send, device->serial, encoded->tag, encoded->length);
 
 	// transfer the message, if needed in parts.
 	unsigned int transferred = 0;
 	while (transferred < fillcount) {
-		uint8_t tempbuffer[USB_HID_REPORT_LENGTH + 1];
-		unsigned int thisTransferLength = min(USB_HID_REPORT_LENGTH, fillcount - transferred);
+		uint8_t tempbuffer[USB_HID_MAX_REPORT_LENGTH + 1];
+		size_t reportSize = device->reportLayout.outputReportLength + 1;
+		unsigned int thisTransferLength = min(device->reportLayout.outputReportLength, fillcount - transferred);
 		// unused bytes filled with zeroes.
-		memset(tempbuffer, 0, sizeof(tempbuffer));
+		memset(tempbuffer, 0, reportSize);
 		
 		// report id in position 0
-		tempbuffer[0] = 0;
+		tempbuffer[0] = device->reportLayout.outputReportId;
 		
 		// copy data to temp buffer
 		memcpy(tempbuffer + 1, report + transferred, thisTransferLength);
-		/*printf("Writing: ");
-		for (int i = 0; i < sizeof(tempbuffer); i++) {
-			printf("%02x ", tempbuffer[i]);
-		}
-		printf("\n"); 
-		printf("Writing: ");
-		for (int i = 0; i < sizeof(tempbuffer); i++) {
-			printf("%c  ", tempbuffer[i]);
-		}
-		printf("\n"); */
 		// write tempbuffer to device.
-		int numbyteswritten = hid_write(sspHid, tempbuffer, sizeof(tempbuffer));
-		if (numbyteswritten != sizeof(tempbuffer)) {
-			cleanUpAndExit(ExitErrorCommunicationProtocol, "Incorrect number of bytes written: %d", numbyteswritten);
+		int numbyteswritten = hidBackend->write(device->hid, tempbuffer, reportSize);
+		if (numbyteswritten != (int)reportSize) {
+			return setError(device, SspResultErrorWrite, "Incorrect number of bytes written: %d", numbyteswritten);
 		}
 
 		transferred += thisTransferLength;
 
 	}
+	SSP_USDT3(frame_sent, device->serial, encoded->tag, encoded->length);
+	if (encoded->tag == SspCommandTriggerArm) {
+		SSP_USDT1(swipe_arm, device->serial);
+	}
+	if (device->metrics != NULL) {
+		uint64_t now = getMonotonicTimeNs();
+		histogramRecord(&device->metrics->writeLatency, now - start);
+		sspMetricsAdd(device->metrics->commands[encoded->tag & 0xff], 1);
+		if (encoded->tag == SspCommandTriggerArm) {
+			device->armedNs = now;
+		}
+	}
+	sspRememberCommand(device, encoded->tag, encoded->data, encoded->length);
+	if (device->observer != NULL && !device->recovering) {
+		device->observer(device->observerContext, encoded->tag, encoded->data, encoded->length);
+	}
+	return SspResultOk;
+}
+
+// Sends a frame to the device.
+static SspResult sspSendFrame(SspDevice * device, SspCommandTag tag, const void *argument_data, size_t length) {
+	SspEncodedFrame encoded;
+	if (device->hid == NULL) {
+		return setError(device, SspResultErrorWrite, "The probe is not connected");
+	}
+	if (sspEncodeFrame(tag, argument_data, length, &encoded) != SspResultOk) {
+		return setError(device, SspResultErrorFrameTooLong, NULL);
+	}
+	return sspWriteFrame(device, &encoded);
+}
+
+// Sends a command to the device, without waiting for the response. Anything the device sent before is discarded.
+SspResult sspSendCommand(SspDevice * device, SspCommandTag tag, const void *argument_data, size_t length) {
+	sspHidFlush(device);
+	return sspSendFrame(device, tag, argument_data, length);
 }
 
 typedef enum {parse_busy, parse_error, parse_done} ParseState;
 
 /// Parses packets. Packets consist of DLE STX [tag] [lenght] [lenght] [value] ... [CRC] [CRC] DLE ETX. If a DLE is found in the data, it is escaped with a DLE.
-ParseState packetParser(uint8_t c) {
+static ParseState packetParser(comm_usb_parse_data_t * parse_state, uint8_t c) {
 	ParseState result = parse_busy;
 	// First de DLE filtering, to avoid an exessive amount of cases in the statemachine:
-	if (parse_state.dle_escape) {
+	if (parse_state->dle_escape) {
 		// We received a DLE previously, so now we get the escaped character. The only allowed characters are: STX ETX or DLE, otherwise its a parse error.
-		parse_state.dle_escape = false;
+		parse_state->dle_escape = false;
 		if (c == STX) {
 			// DLE STX
 			// If we're not in start state we are getting a DLE STX in the middle of parsing a message
-			if (parse_state.brstate != up_start) {
+			if (parse_state->brstate != up_start) {
 				result = parse_error;
 			}
-			parse_state.brstate = up_tag;
+			parse_state->brstate = up_tag;
 			return result;
 		}
 		else if (c == ETX) {
 			//DLE ETX, we're done.
 			result = parse_done;
-			parse_state.brstate = up_start;
+			parse_state->brstate = up_start;
 			return result;
 		}
 		else if (c == DLE) {
@@ -202,72 +390,81 @@ ParseState packetParser(uint8_t c) {
 	}
 	else if (c == DLE) {
 		// First DLE
-		parse_state.dle_escape = true;
+		parse_state->dle_escape = true;
 		return result;
 	}
 
 	// So if and when you end up here, c contains a databyte and not a control byte (like start/end transmission) 
-	switch (parse_state.brstate) {
+	switch (parse_state->brstate) {
 	case up_start:
 		// If you end up here, then it's a character that was not sent within a message. Because if it was a DLE STX 
 		// it would have been filtered and the state machine would have been advanced to the up_tag state. We stay in 
 		// this state until a DLE STX is detected.
 		break;
 	case up_tag:
-		parse_state.tag = c;
-		parse_state.brstate = up_length1;
+		parse_state->tag = c;
+		parse_state->brstate = up_length1;
 		break;
 	case up_length1:
 		// MSB of length
-		parse_state.length = ((uint16_t)c) << 8;
-		parse_state.brstate = up_length2;
+		parse_state->length = ((uint16_t)c) << 8;
+		parse_state->brstate = up_length2;
 		break;
 	case up_length2:
 		// MSB of length
-		parse_state.length = parse_state.length | c;
-		if (parse_state.length > 0) {
-			parse_state.brstate = up_data;
-			parse_state.fillpointer = 0;
+		parse_state->length = parse_state->length | c;
+		if (parse_state->length > 0) {
+			parse_state->brstate = up_data;
+			parse_state->fillpointer = 0;
 		}
 		else {
-			parse_state.brstate = up_checksum1;
+			parse_state->brstate = up_checksum1;
 		}
 		break;
 	case up_data:
 		// Store the byte if it fits. 
 		// If there are more bytes than will fit, we will just ignore them silently. Maybe I'm going to regret this decision...
-		if (parse_state.fillpointer < COMM_USB_MAX_PACKETDATASIZE_IN) {
-			parse_state.packetbuffer[parse_state.fillpointer] = c;
+		if (parse_state->fillpointer < COMM_USB_MAX_PACKETDATASIZE_IN) {
+			parse_state->packetbuffer[parse_state->fillpointer] = c;
 		}
-		parse_state.fillpointer++;
+		parse_state->fillpointer++;
 		// Got all bytes? Move to checksum.
-		if (parse_state.fillpointer >= parse_state.length) {
-			parse_state.brstate = up_checksum1;
+		if (parse_state->fillpointer >= parse_state->length) {
+			parse_state->brstate = up_checksum1;
 		}
 		break;
 	case up_checksum1:
-		parse_state.checksum = ((uint16_t)c) << 8;
-		parse_state.brstate = up_checksum2;
+		parse_state->checksum = ((uint16_t)c) << 8;
+		parse_state->brstate = up_checksum2;
 		break;
 	case up_checksum2:
-		parse_state.checksum = parse_state.checksum | c;
-		parse_state.brstate = up_end;
+		parse_state->checksum = parse_state->checksum | c;
+		parse_state->brstate = up_end;
 		break;
 	case up_end:
 		result = parse_error;
 		break;
 	default:
 		// Just in case the state machine breaks...
-		parse_state.brstate = up_start;
+		parse_state->brstate = up_start;
 		result = parse_error;
 		break;
 	}
 	return result;
 }
-// lets the packetParser parse the packet until it's done or encountered an error. When parse_ok is returned, parse_state contains the packet contents
-ParseState parseResponsePacket(uint8_t * response, size_t length) {
-	for (size_t i = 0; i < length; i++) {
-		ParseState p = packetParser(response[i]);
+// lets the packetParser parse the input of the device until it's done or encountered an error. When parse_ok is returned, the parse_state of the device contains the packet contents
+// and the input after the packet is left for the next call.
+static ParseState parseResponsePacket(SspDevice * device) {
+	comm_usb_parse_data_t * parse_state = &device->parse_state;
+	while (device->inputOffset < device->inputLength) {
+		uint8_t c = device->input[device->inputOffset++];
+		ParseState p = packetParser(parse_state, c);
+		if (p == parse_done) {
+			SSP_USDT3(frame_complete, device->serial, parse_state->tag, parse_state->length);
+		}
+		else if (p == parse_error) {
+			SSP_USDT3(parse_error, device->serial, parse_state->brstate, c);
+		}
 		if (p != parse_busy) {
 			return p;
 		}
@@ -275,79 +472,183 @@ ParseState parseResponsePacket(uint8_t * response, size_t length) {
 	return parse_busy;
 }
 
-bool receivedCrcIsOk() {
+static bool receivedCrcIsOk(comm_usb_parse_data_t * parse_state) {
 	uint16_t calculatedCrc;
 
 	Crc_init(&calculatedCrc);
-	Crc_add(&calculatedCrc, parse_state.tag);
-	Crc_add(&calculatedCrc, (parse_state.length >> 8) & 0xff);
-	Crc_add(&calculatedCrc, parse_state.length & 0xff);
+	Crc_add(&calculatedCrc, parse_state->tag);
+	Crc_add(&calculatedCrc, (parse_state->length >> 8) & 0xff);
+	Crc_add(&calculatedCrc, parse_state->length & 0xff);
 
-	for (uint16_t i = 0; i < parse_state.length; i++) {
-		Crc_add(&calculatedCrc, parse_state.packetbuffer[i]);
+	uint16_t stored = min(parse_state->length, COMM_USB_MAX_PACKETDATASIZE_IN);
+	for (uint16_t i = 0; i < stored; i++) {
+		Crc_add(&calculatedCrc, parse_state->packetbuffer[i]);
 	}
-	return calculatedCrc == parse_state.checksum;
+	return calculatedCrc == parse_state->checksum;
 }
 
-// Sends a comand as method call to the device. A valid method call should always result in a OperationOk response.
-void sspMethodCall(SspCommandTag tag, const void *argument_data, size_t argument_length) {
-	sspSendCommand(tag, argument_data, argument_length);
-	
-	uint8_t response[USB_HID_REPORT_LENGTH + 1];
-	int bytesread = hid_read_timeout(sspHid, response, ARRAY_SIZE(response), 1000);
-	// timeout
-	if (bytesread == -1) {
-		cleanUpAndExit(ExitErrorCommunicationProtocol, "Communication protocol error, no response received");
+// Parses the rest of the last report, and when that holds no complete frame reads at most one report from the probe,
+// waiting up to timeoutMs, and feeds it to the parser. Returns SspResultPending when no complete frame has been received
+// yet; frames spanning several reports are assembled over several calls.
+SspResult sspPollResponse(SspDevice * device, int timeoutMs, SspResponse * response) {
+	if (device->hid == NULL) {
+		return setError(device, SspResultErrorRead, "The probe is not connected");
+	}
+	ParseState p = parseResponsePacket(device);
+	if (p == parse_busy) {
+		int bytesread = hidBackend->read_timeout(device->hid, device->input, device->reportLayout.inputReportLength + 1, timeoutMs);
+		if (bytesread < 0) {
+			return setError(device, SspResultErrorRead, NULL);
+		}
+		// numbered input reports start with the report ID
+		device->inputOffset = (device->reportLayout.inputReportId != 0) ? 1 : 0;
+		device->inputLength = (bytesread > 0) ? (size_t)bytesread : 0;
+		p = parseResponsePacket(device);
+		if (p == parse_busy) {
+			return SspResultPending;
+		}
 	}
-	if (parseResponsePacket(response, ARRAY_SIZE(response)) != parse_done) {
-		cleanUpAndExit(ExitErrorCommunicationProtocol, "Communication protocol error, error parsing response");
+	if (p == parse_error) {
+		resetParseState(&device->parse_state);
+		return setError(device, SspResultErrorParse, NULL);
 	}
-	if (!receivedCrcIsOk()) {
-		cleanUpAndExit(ExitErrorCommunicationProtocol, "Communication protocol error, CRC is wrong");
+	if (!receivedCrcIsOk(&device->parse_state)) {
+		SSP_USDT4(crc_mismatch, device->serial, device->parse_state.tag, device->parse_state.length, device->parse_state.checksum);
+		return setError(device, SspResultErrorCrc, NULL);
 	}
-	if (parse_state.tag != SspStatusOperationOk) {
-		cleanUpAndExit(ExitErrorCommunicationProtocol, "Communication protocol error, device did not report OK on methodcall");
+	response->tag = device->parse_state.tag;
+	response->length = min(device->parse_state.length, COMM_USB_MAX_PACKETDATASIZE_IN);
+	response->data = device->parse_state.packetbuffer;
+	SSP_USDT3(frame_receive, device->serial, response->tag, response->length);
+	if (response->tag == SspEventSwiped) {
+		SSP_USDT1(swipe_complete, device->serial);
 	}
+	if (device->metrics != NULL) {
+		sspMetricsAdd(device->metrics->responses[response->tag], 1);
+		if (response->tag == SspEventSwiped && device->armedNs != 0) {
+			histogramRecord(&device->metrics->swipeLatency, getMonotonicTimeNs() - device->armedNs);
+			device->armedNs = 0;
+		}
+	}
+	return SspResultOk;
 }
 
-// Sends a comand as method call to the device. A valid method call should always result in a OperationOk response.
-void sspFunctionCall(SspCommandTag tag, const unsigned char *argument_data, size_t argument_length, void *result_data, size_t result_length) {
-	sspSendCommand(tag, argument_data, argument_length);
-
-	uint8_t response[USB_HID_REPORT_LENGTH + 1];
-	int bytesread = hid_read_timeout(sspHid, response, ARRAY_SIZE(response), 1000);
-	// timeout
-	if (bytesread == -1) {
-		cleanUpAndExit(ExitErrorCommunicationProtocol, "Communication protocol error, no response received");
-	}
-	if (parseResponsePacket(response, ARRAY_SIZE(response)) != parse_done) {
-		cleanUpAndExit(ExitErrorCommunicationProtocol, "Communication protocol error, error parsing response");
+// Waits up to timeoutMs for a complete response frame.
+SspResult sspWaitResponse(SspDevice * device, int timeoutMs, SspResponse * response) {
+	uint64_t deadline = getMonotonicTimeNs() + (uint64_t)timeoutMs * 1000000ull;
+	for (;;) {
+		uint64_t now = getMonotonicTimeNs();
+		int remainingMs = (now >= deadline) ? 0 : (int)((deadline - now + 999999) / 1000000);
+		SspResult result = sspPollResponse(device, remainingMs, response);
+		if (result != SspResultPending) {
+			return result;
+		}
+		if (now >= deadline) {
+			return setError(device, SspResultErrorNoResponse, NULL);
+		}
 	}
-	if (!receivedCrcIsOk()) {
-		cleanUpAndExit(ExitErrorCommunicationProtocol, "Communication protocol error, CRC is wrong");
+}
+
+// A valid method call should always result in a OperationOk response.
+SspResult sspCheckMethodResponse(SspDevice * device, const SspResponse * response) {
+	if (response->tag != SspStatusOperationOk) {
+		return setError(device, SspResultErrorNotOk, "Communication protocol error, device did not report OK on methodcall (status 0x%02x)", response->tag);
 	}
+	return SspResultOk;
+}
 
-	// function calls return responses using the same tag.
-	if (parse_state.tag != tag) {
-		cleanUpAndExit(ExitErrorCommunicationProtocol, "Communication protocol error, device did not report same tag");
+// Function calls return responses using the same tag. Copies up to result_length bytes of the response to result_data.
+SspResult sspCheckFunctionResponse(SspDevice * device, SspCommandTag tag, const SspResponse * response, void * result_data, size_t result_length) {
+	if (response->tag != tag) {
+		return setError(device, SspResultErrorWrongTag, NULL);
 	}
 	
 	// Responses can be longer in the future, but never shorter (for forwards compatibility). So if we get a response that's shorter than the variable we're requested to fill, that's an error.
-	if (parse_state.length < result_length) {
-		cleanUpAndExit(ExitErrorCommunicationProtocol, "Communication protocol error, too short response");
+	if (response->length < result_length) {
+		return setError(device, SspResultErrorShortResponse, NULL);
 	}
 	// copy up to result_length number of bytes to the result_data
-	memcpy(result_data, parse_state.packetbuffer, result_length);
+	memcpy(result_data, response->data, result_length);
+	return SspResultOk;
+}
+
+static bool sspRecover(SspDevice * device, SspCommandTag tag, SspResult result, unsigned * attempt);
+
+// Waits for the response to the command just written by a method or function call, and adds its latency to the metrics.
+static SspResult sspWaitCallResponse(SspDevice * device, SspResponse * response) {
+	uint64_t start = (device->metrics != NULL) ? getMonotonicTimeNs() : 0;
+	SspResult result = sspWaitResponse(device, SSP_RESPONSE_TIMEOUT_MS, response);
+	if (device->metrics != NULL && result == SspResultOk) {
+		histogramRecord(&device->metrics->responseLatency, getMonotonicTimeNs() - start);
+	}
+	return result;
+}
+
+// Sends a comand as method call to the device. A valid method call should always result in a OperationOk response.
+SspResult sspMethodCall(SspDevice * device, SspCommandTag tag, const void *argument_data, size_t argument_length) {
+	SspResponse response;
+	SspResult result;
+	unsigned attempt = 0;
+	do {
+		result = sspSendCommand(device, tag, argument_data, argument_length);
+		if (result == SspResultOk) {
+			result = sspWaitCallResponse(device, &response);
+		}
+		if (result == SspResultOk) {
+			result = sspCheckMethodResponse(device, &response);
+		}
+	} while (sspRecover(device, tag, result, &attempt));
+	return result;
+}
+
+// Sends a frame encoded with sspEncodeFrame without waiting for the response, for pipelining commands. Unlike
+// sspSendCommand the input is not flushed, so responses to earlier commands are kept.
+SspResult sspSendEncoded(SspDevice * device, const SspEncodedFrame * encoded) {
+	return sspWriteFrame(device, encoded);
+}
+
+// Sends a frame encoded with sspEncodeFrame as method call to the device.
+SspResult sspMethodCallEncoded(SspDevice * device, const SspEncodedFrame * encoded) {
+	SspResponse response;
+	SspResult result;
+	unsigned attempt = 0;
+	do {
+		sspHidFlush(device);
+		result = sspWriteFrame(device, encoded);
+		if (result == SspResultOk) {
+			result = sspWaitCallResponse(device, &response);
+		}
+		if (result == SspResultOk) {
+			result = sspCheckMethodResponse(device, &response);
+		}
+	} while (sspRecover(device, encoded->tag, result, &attempt));
+	return result;
+}
+
+// Sends a comand as function call to the device and copies result_length bytes of the response to result_data.
+SspResult sspFunctionCall(SspDevice * device, SspCommandTag tag, const void *argument_data, size_t argument_length, void *result_data, size_t result_length) {
+	SspResponse response;
+	SspResult result;
+	unsigned attempt = 0;
+	do {
+		result = sspSendCommand(device, tag, argument_data, argument_length);
+		if (result == SspResultOk) {
+			result = sspWaitCallResponse(device, &response);
+		}
+		if (result == SspResultOk) {
+			result = sspCheckFunctionResponse(device, tag, &response, result_data, result_length);
+		}
+	} while (sspRecover(device, tag, result, &attempt));
+	return result;
 }
 
 // Get firmware version
-SspFirmwareVersion sspGetFirmwareVersion() {
-	SspFirmwareVersion version;
-	sspFunctionCall(SspCommandSoftwareVersion, NULL, 0, &version, sizeof(version));
-	return version;
+SspResult sspGetFirmwareVersion(SspDevice * device, SspFirmwareVersion * version) {
+	return sspFunctionCall(device, SspCommandSoftwareVersion, NULL, 0, version, sizeof(*version));
 }
 
-/* Set track data using supplied string. If the string is "" then nothing will be sent on this track, so no zeros before and after as well.
+/* Converts track data characters to the symbol values sent to the probe. symbols must hold length bytes. On an invalid
+ * character SspResultErrorInvalidCharacter is returned and errorPosition (when not NULL) is set to its index.
  * Extra info:
  *  Magstripe cards do not use 8 bits for characters. 
  *  To encode a useful amount of data in the limited available space, a limited character set is used; there are less than the usual 8 bits per symbol.
@@ -364,7 +665,7 @@ SspFirmwareVersion sspGetFirmwareVersion() {
  *  To convert an ascii value to a symbol value subtract 0x30.
  *  The SSP allows up to 120 bytes for track 2 and 3
  */
-void sspSetTrackDataString(int tracknum, char * trackdata, size_t length) {
+SspResult sspEncodeTrackData(int tracknum, const char * trackdata, size_t length, uint8_t * symbols, size_t * errorPosition) {
 	uint8_t min;
 	uint8_t max;
 	uint8_t subtract;
@@ -377,50 +678,98 @@ void sspSetTrackDataString(int tracknum, char * trackdata, size_t length) {
 		max = 0x3f;
 		subtract = 0x30;
 	}
-	char * converteddata = alloca(length);
-	memcpy(converteddata, trackdata, length);
-	
 	for (size_t i = 0; i < length; i++) {
 		if ((trackdata[i] >= min) && (trackdata[i] <= max)) {
-			converteddata[i] = (trackdata[i] - subtract);
+			symbols[i] = (uint8_t)(trackdata[i] - subtract);
 		}
 		else {
-			cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid character supplied, 0x%02x (%c) at position %d is not between 0x%02x and 0x%02x", trackdata[i], trackdata[i], i + 1, min, max);
+			if (errorPosition != NULL) {
+				*errorPosition = i;
+			}
+			return SspResultErrorInvalidCharacter;
 		}
 	}
-	sspMethodCall(SspCommandDataBase + tracknum, converteddata, length);
+	return SspResultOk;
+}
+
+// Set track data using supplied string. If the string is "" then nothing will be sent on this track, so no zeros before and after as well.
+// See sspEncodeTrackData for the valid characters per track.
+SspResult sspSetTrackDataString(SspDevice * device, int tracknum, const char * trackdata, size_t length) {
+	uint8_t * converteddata = alloca(length + 1);
+	size_t position = 0;
+	if (sspEncodeTrackData(tracknum, trackdata, length, converteddata, &position) != SspResultOk) {
+		uint8_t min = (tracknum == 1) ? 0x20 : 0x30;
+		uint8_t max = (tracknum == 1) ? 0x5f : 0x3f;
+		return setError(device, SspResultErrorInvalidCharacter, "Invalid character supplied, 0x%02x (%c) at position %zu is not between 0x%02x and 0x%02x",
+			(uint8_t)trackdata[position], trackdata[position], position + 1, min, max);
+	}
+	return sspMethodCall(device, SspCommandDataBase + tracknum, converteddata, length);
 }
 
 // use this function to directly set the binary characters of the track data. If you want the parity of the byte to be wrong, make the most significant bit high. 
 // Because the SSP internally calculates the party over the whole byte, and then ignores the most significant 2 or 4 bits, the parity bit will be inverted.
-void sspSetTrackDataBinary(int tracknum, uint8_t * trackdata, size_t length) {
-	sspMethodCall(SspCommandDataBase + tracknum, trackdata, length);
+SspResult sspSetTrackDataBinary(SspDevice * device, int tracknum, const uint8_t * trackdata, size_t length) {
+	return sspMethodCall(device, SspCommandDataBase + tracknum, trackdata, length);
 }
 
 // Set the trigger mode: there is only one valid mode: immediately. The other ones are not implemented in hardware.
-void sspSetTriggerMode(SspTriggerMode triggerMode) {
+SspResult sspSetTriggerMode(SspDevice * device, SspTriggerMode triggerMode) {
 	uint8_t payload[] = { triggerMode };
-	sspMethodCall(SspCommandTriggerMode, payload, ARRAY_SIZE(payload));
+	return sspMethodCall(device, SspCommandTriggerMode, payload, ARRAY_SIZE(payload));
 }
 
 // Reset trackdata and track settings to their default values.
-void sspResetToDefaultConfiguration() {
-	sspMethodCall(SspCommandDefaultConfiguration, NULL, 0);
+SspResult sspResetToDefaultConfiguration(SspDevice * device) {
+	return sspMethodCall(device, SspCommandDefaultConfiguration, NULL, 0);
 }
 
 // send a go, with triggermode set to immediately, this will result in a immediate swipe of the card.
-void sspSendGo() {
-	sspMethodCall(SspCommandTriggerArm, NULL, 0);
+SspResult sspSendGo(SspDevice * device) {
+	return sspMethodCall(device, SspCommandTriggerArm, NULL, 0);
+}
+
+// Sends a go at the given getMonotonicTimeNs time and waits for its response. Anything the probe sent before is flushed
+// before sleeping, so the go leaves as close to the deadline as possible. armedNs (when not NULL) is set to the time
+// the go was written to the probe. A go that could not be written is sent again after a reconnect (see
+// sspSetRecovery), as soon as possible; armedNs is then the time of the go that was sent last.
+SspResult sspSendGoAt(SspDevice * device, uint64_t deadlineNs, uint64_t * armedNs) {
+	SspResponse response;
+	SspResult result;
+	unsigned attempt = 0;
+	do {
+		sspHidFlush(device);
+		sleepUntilNs(deadlineNs);
+		result = sspSendFrame(device, SspCommandTriggerArm, NULL, 0);
+		if (armedNs != NULL) {
+			*armedNs = getMonotonicTimeNs();
+		}
+		if (result == SspResultOk) {
+			result = sspWaitCallResponse(device, &response);
+		}
+		if (result == SspResultOk) {
+			result = sspCheckMethodResponse(device, &response);
+		}
+	} while (sspRecover(device, SspCommandTriggerArm, result, &attempt));
+	return result;
 }
 
 // Stop mode: not used for triggermode==immediately
-void sspSendStop() {
-	sspMethodCall(SspCommandTriggerDisarm, NULL, 0);
+SspResult sspSendStop(SspDevice * device) {
+	return sspMethodCall(device, SspCommandTriggerDisarm, NULL, 0);
 }
 
-// Send trackconfig to the probe
-void sspSetTrackConfig(int tracknum, SspTrackConfiguration * trackconfig) {
-	uint8_t trackconfig_bytes[8];
+// Waits up to timeoutMs for the SspEventSwiped event the probe sends when it finished a swipe.
+SspResult sspAwaitSwiped(SspDevice * device, int timeoutMs) {
+	SspResponse response;
+	SspResult result = sspWaitResponse(device, timeoutMs, &response);
+	if (result == SspResultOk && response.tag != SspEventSwiped) {
+		return setError(device, SspResultErrorWrongTag, "Communication protocol error, expected swiped event but received 0x%02x", response.tag);
+	}
+	return result;
+}
+
+// Converts a track configuration to the bytes sent to the probe. The deprecated fields are sent as zeroes.
+void sspEncodeTrackConfig(const SspTrackConfiguration * trackconfig, uint8_t * trackconfig_bytes) {
 	trackconfig_bytes[0] = trackconfig->lrcGeneration;
 	trackconfig_bytes[1] = 0;
 	trackconfig_bytes[2] = 0;
@@ -429,12 +778,17 @@ void sspSetTrackConfig(int tracknum, SspTrackConfiguration * trackconfig) {
 	trackconfig_bytes[5] = 0;
 	trackconfig_bytes[6] = 0;
 	trackconfig_bytes[7] = trackconfig->manualLrc;
-	
-	sspMethodCall(SspCommandConfigBase + tracknum, trackconfig, ARRAY_SIZE(trackconfig));
+}
+
+// Send trackconfig to the probe
+SspResult sspSetTrackConfig(SspDevice * device, int tracknum, SspTrackConfiguration * trackconfig) {
+	uint8_t trackconfig_bytes[SSP_TRACK_CONFIG_LENGTH];
+	sspEncodeTrackConfig(trackconfig, trackconfig_bytes);
+	return sspMethodCall(device, SspCommandConfigBase + tracknum, trackconfig_bytes, ARRAY_SIZE(trackconfig_bytes));
 }
 
 // Manually configure the LRC. If you want to do this you will know what to do. By making the most significant bit high, you can send the lrc with a wrong parity bit.
-void sspSetManualLrc(int tracknum, uint8_t lrc) {
+SspResult sspSetManualLrc(SspDevice * device, int tracknum, uint8_t lrc) {
 	SspTrackConfiguration trackConfig = {
 		.lrcGeneration = LrcManual,					// The lrc is supplied by the user
 		.halfbittime = 0,							// Deprecated
@@ -442,11 +796,11 @@ void sspSetManualLrc(int tracknum, uint8_t lrc) {
 		.postrunZeros = 0,							// Deprecated
 		.manualLrc = lrc,							// Value of LRC when lrcGeneration == LrcManual
 	};
-	sspSetTrackConfig(tracknum, &trackConfig);
+	return sspSetTrackConfig(device, tracknum, &trackConfig);
 }
 
 // Reset the track config back to the default. (Is done internally for all tracks on SspCommandDefaultConfiguration as well).
-void sspSetTrackConfigDefault(int tracknum) {
+SspResult sspSetTrackConfigDefault(SspDevice * device, int tracknum) {
 	SspTrackConfiguration trackConfig = {
 		.lrcGeneration = LrcAuto,					// The lrc is automatically generated (by the SSP)
 		.halfbittime = 0,							// Deprecated
@@ -454,32 +808,628 @@ void sspSetTrackConfigDefault(int tracknum) {
 		.postrunZeros = 0,							// Deprecated
 		.manualLrc = 0,								// Value of LRC when lrcGeneration == LrcManual
 	};
-	sspSetTrackConfig(tracknum, &trackConfig);
+	return sspSetTrackConfig(device, tracknum, &trackConfig);
+}
+
+// Reads the report descriptor of the opened probe and adapts the report IDs and lengths used for framing. When the backend
+// cannot provide the descriptor the default layout (unnumbered 64 byte reports) is used.
+static SspResult sspDetectReportLayout(SspDevice * device) {
+	device->reportLayout = defaultReportLayout;
+	if (hidBackend->get_report_descriptor == NULL) {
+		return SspResultOk;
+	}
+	uint8_t descriptor[4096];
+	int length = hidBackend->get_report_descriptor(device->hid, descriptor, sizeof(descriptor));
+	if (length <= 0) {
+		return SspResultOk;
+	}
+
+	HidReportLayout detected;
+	if (!hidParseReportLayout(descriptor, (size_t)length, &detected)) {
+		return setError(device, SspResultErrorReportDescriptor, NULL);
+	}
+	if (detected.outputReportLength < USB_HID_MIN_REPORT_LENGTH || detected.outputReportLength > USB_HID_MAX_REPORT_LENGTH
+		|| detected.inputReportLength < USB_HID_MIN_REPORT_LENGTH || detected.inputReportLength > USB_HID_MAX_REPORT_LENGTH) {
+		return setError(device, SspResultErrorReportDescriptor, "Unsupported report lengths in the report descriptor of the probe: input %d, output %d bytes",
+			detected.inputReportLength, detected.outputReportLength);
+	}
+	device->reportLayout = detected;
+	return SspResultOk;
+}
+
+// Returns the report layout in use for the device.
+HidReportLayout sspGetReportLayout(SspDevice * device) {
+	return device->reportLayout;
 }
 
-// Connect to the probe. If serial points to a string "auto" the HID library will select the probe automatically based on USB PID/VID.
-void sspConnect(char * serial) {
-	if (hid_init()) {
-		cleanUpAndExit(ExitErrorHidApi, "Error initializing HID api\n");
+// Makes sure a HID backend is selected and initialized. Uses the default backend when none was selected.
+static SspResult sspInitBackend() {
+	if (hidBackend == NULL && !hidBackendSelect(hidBackendNames[0])) {
+		return SspResultErrorHidApi;
+	}
+	if (hidBackend->init()) {
+		return SspResultErrorHidApi;
 	}
+	return SspResultOk;
+}
 
-	if (strcmp(serial, "auto") == 0) {
-		sspHid = hid_open(SSP_VID, SSP_PID, NULL);
-		if (sspHid == NULL) {
-			cleanUpAndExit(ExitErrorHidOpen, "Error opening HID device (using automatic selection)\n");
+// Finds a probe in the enumeration: the one with the given serial number, the one with the given HID path, or the first
+// one when both are NULL. Stores its path and serial number (when the buffers are not NULL).
+static bool sspFindProbe(const char * serial, const char * path, char * foundPath, size_t pathSize, char * foundSerial, size_t serialSize) {
+	bool found = false;
+	struct hid_device_info * devs = hidBackend->enumerate(SSP_VID, SSP_PID);
+	for (struct hid_device_info * dev = devs; dev != NULL && !found; dev = dev->next) {
+		char devSerial[128] = "";
+		if (dev->serial_number != NULL) {
+			wcstombs(devSerial, dev->serial_number, sizeof(devSerial) - 1);
+		}
+		found = (serial == NULL || strcmp(serial, devSerial) == 0) && (path == NULL || strcmp(path, dev->path) == 0);
+		if (found && foundPath != NULL) {
+			snprintf(foundPath, pathSize, "%s", dev->path);
+		}
+		if (found && foundSerial != NULL) {
+			snprintf(foundSerial, serialSize, "%s", devSerial);
 		}
 	}
+	hidBackend->free_enumeration(devs);
+	return found;
+}
+
+// Wraps an opened HID device in a new SspDevice.
+static SspResult sspAttach(hid_device * hid, SspDevice ** device) {
+	SspDevice * newDevice = calloc(1, sizeof(SspDevice));
+	if (newDevice == NULL) {
+		hidBackend->close(hid);
+		return SspResultErrorOutOfMemory;
+	}
+	newDevice->hid = hid;
+	newDevice->triggerMode = -1;
+	resetParseState(&newDevice->parse_state);
+
+	SspResult result = sspDetectReportLayout(newDevice);
+	if (result != SspResultOk) {
+		sspClose(newDevice);
+		return result;
+	}
+	*device = newDevice;
+	return SspResultOk;
+}
+
+// Opens the probe at path and remembers its serial number and path for reconnecting.
+static SspResult sspOpenFound(const char * serial, const char * path, SspDevice ** device) {
+	hid_device * hid = hidBackend->open_path(path);
+	SspResult result = (hid != NULL) ? sspAttach(hid, device) : SspResultErrorHidOpen;
+	if (result == SspResultOk) {
+		snprintf((*device)->serial, sizeof((*device)->serial), "%s", serial);
+		snprintf((*device)->path, sizeof((*device)->path), "%s", path);
+		SSP_USDT3(open, (*device)->serial, (*device)->path, result);
+	}
 	else {
-		size_t newsize = strlen(serial) + 1;
-		wchar_t * wserial = (wchar_t *)checkMalloc(malloc(newsize * sizeof(wchar_t)));
-		mbstowcs(wserial, serial, newsize);
-		
-		sspHid = hid_open(SSP_VID, SSP_PID, wserial);
-		
-		free(wserial);
-	
-		if (sspHid == NULL) {
-			cleanUpAndExit(ExitErrorHidOpen, "Error opening HID device (using serial %s)\n", serial);
+		SSP_USDT3(open, serial, path, result);
+	}
+	return result;
+}
+
+// Connect to the probe. If serial is NULL or points to a string "auto" the first probe found (based on USB PID/VID) is selected.
+// Uses the backend selected with hidBackendSelect, or the default backend when none was selected.
+SspResult sspOpen(const char * serial, SspDevice ** device) {
+	SspResult result = sspInitBackend();
+	if (result != SspResultOk) {
+		return result;
+	}
+	if (serial != NULL && strcmp(serial, "auto") == 0) {
+		serial = NULL;
+	}
+	char path[256];
+	char foundSerial[128];
+	if (!sspFindProbe(serial, NULL, path, sizeof(path), foundSerial, sizeof(foundSerial))) {
+		return SspResultErrorHidOpen;
+	}
+	return sspOpenFound(foundSerial, path, device);
+}
+
+// Connect to the probe with the given HID path, as returned by hid_enumerate.
+SspResult sspOpenPath(const char * path, SspDevice ** device) {
+	SspResult result = sspInitBackend();
+	if (result != SspResultOk) {
+		return result;
+	}
+	// the serial number is only needed for reconnecting, a probe without one can still be used
+	char serial[128] = "";
+	sspFindProbe(NULL, path, NULL, 0, serial, sizeof(serial));
+	return sspOpenFound(serial, path, device);
+}
+
+#ifdef __linux__
+// Reads a sysfs attribute of a device into value, without the trailing newline.
+// Builds the name of a sysfs attribute. Returns false when it does not fit.
+static bool sspAttributeName(const char * directory, const char * attribute, char * name, size_t size) {
+	int length = snprintf(name, size, "%s/%s", directory, attribute);
+	return length >= 0 && (size_t)length < size;
+}
+
+static bool sspReadAttribute(const char * directory, const char * attribute, char * value, size_t size) {
+	char name[PATH_MAX];
+	if (!sspAttributeName(directory, attribute, name, sizeof(name))) {
+		return false;
+	}
+	FILE * file = fopen(name, "r");
+	if (file == NULL) {
+		return false;
+	}
+	bool ok = fgets(value, (int)size, file) != NULL;
+	fclose(file);
+	value[strcspn(value, "\n")] = '\0';
+	return ok;
+}
+
+static bool sspWriteAttribute(const char * directory, const char * attribute, const char * value) {
+	char name[PATH_MAX];
+	if (!sspAttributeName(directory, attribute, name, sizeof(name))) {
+		return false;
+	}
+	FILE * file = fopen(name, "w");
+	if (file == NULL) {
+		return false;
+	}
+	bool ok = fputs(value, file) >= 0;
+	return (fclose(file) == 0) && ok;
+}
+
+// Finds the sysfs directory of the USB device of the probe with the given HID path.
+static bool sspFindUsbDevice(const char * path, char * usbDevice, size_t size) {
+	unsigned int bus;
+	unsigned int address;
+	unsigned int interface;
+	if (sscanf(path, "%x:%x:%x", &bus, &address, &interface) == 3) {
+		// libusb backend paths are <bus>:<address>:<interface>, find the device with that bus and device number
+		DIR * devices = opendir("/sys/bus/usb/devices");
+		if (devices == NULL) {
+			return false;
+		}
+		bool found = false;
+		struct dirent * entry;
+		while (!found && (entry = readdir(devices)) != NULL) {
+			char value[32];
+			snprintf(usbDevice, size, "/sys/bus/usb/devices/%s", entry->d_name);
+			found = sspReadAttribute(usbDevice, "busnum", value, sizeof(value)) && (unsigned int)atoi(value) == bus
+				&& sspReadAttribute(usbDevice, "devnum", value, sizeof(value)) && (unsigned int)atoi(value) == address;
+		}
+		closedir(devices);
+		return found;
+	}
+	// hidraw backend paths are /dev/hidrawN. In sysfs the USB device is the parent of the interface of the HID device.
+	const char * name = strrchr(path, '/');
+	char link[PATH_MAX];
+	char resolved[PATH_MAX];
+	snprintf(link, sizeof(link), "/sys/class/hidraw/%s/device/../..", (name != NULL) ? name + 1 : path);
+	if (realpath(link, resolved) == NULL || strlen(resolved) >= size) {
+		return false;
+	}
+	strcpy(usbDevice, resolved);
+	return true;
+}
+
+// Resets the USB port of the probe with the given HID path, as libusb_reset_device does: with the USBDEVFS_RESET ioctl
+// on its USB device node. The probe is enumerated again afterwards, possibly under another path.
+static bool sspResetUsbPort(const char * path) {
+	char usbDevice[PATH_MAX];
+	char bus[32];
+	char address[32];
+	if (!sspFindUsbDevice(path, usbDevice, sizeof(usbDevice)) || !sspReadAttribute(usbDevice, "busnum", bus, sizeof(bus))
+		|| !sspReadAttribute(usbDevice, "devnum", address, sizeof(address))) {
+		return false;
+	}
+	char node[64];
+	snprintf(node, sizeof(node), "/dev/bus/usb/%03d/%03d", atoi(bus), atoi(address));
+	int fd = open(node, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	bool reset = ioctl(fd, USBDEVFS_RESET, 0) == 0;
+	close(fd);
+	return reset;
+}
+
+// Sets power/control of the USB device of the probe to "on", which keeps the kernel from suspending it when it is idle.
+// The previous setting is kept in the device for sspRestoreAutosuspend.
+static bool sspApplyKeepAwake(SspDevice * device) {
+	char usbDevice[PATH_MAX];
+	if (!sspFindUsbDevice(device->path, usbDevice, sizeof(usbDevice)) || strlen(usbDevice) >= sizeof(device->usbDevice)) {
+		return false;
+	}
+	char control[16];
+	if (!sspReadAttribute(usbDevice, "power/control", control, sizeof(control))) {
+		return false;
+	}
+	if (device->savedPowerControl[0] == '\0') {
+		snprintf(device->savedPowerControl, sizeof(device->savedPowerControl), "%s", control);
+	}
+	strcpy(device->usbDevice, usbDevice);
+	return strcmp(control, "on") == 0 || sspWriteAttribute(usbDevice, "power/control", "on");
+}
+
+static void sspRestoreAutosuspend(SspDevice * device) {
+	if (device->savedPowerControl[0] != '\0' && device->usbDevice[0] != '\0') {
+		sspWriteAttribute(device->usbDevice, "power/control", device->savedPowerControl);
+	}
+	device->savedPowerControl[0] = '\0';
+}
+#endif
+
+// Keeps the probe out of USB runtime suspend while it is open, so the first command after an idle period is not slowed
+// down by waking it up. On Linux power/control of the USB device is set to "on" (which needs write access to sysfs);
+// the previous setting is restored when the device is closed. Returns false when the setting could not be changed, or
+// on other platforms.
+bool sspPreventAutosuspend(SspDevice * device) {
+#ifdef __linux__
+	device->keepAwake = sspApplyKeepAwake(device);
+	return device->keepAwake;
+#else
+	return false;
+#endif
+}
+
+// Sends the configuration remembered by sspRememberCommand to the (reopened) probe again.
+static SspResult sspReplayConfiguration(SspDevice * device) {
+	device->recovering = true;
+	SspResult result = sspMethodCall(device, SspCommandDefaultConfiguration, NULL, 0);
+	for (int t = 0; t < 3 && result == SspResultOk; t++) {
+		if (device->trackConfigSet[t]) {
+			result = sspMethodCall(device, SspCommandConfig1 + t, device->trackConfig[t], SSP_TRACK_CONFIG_LENGTH);
+		}
+		if (result == SspResultOk && device->trackDataSet[t]) {
+			result = sspMethodCall(device, SspCommandData1 + t, device->trackData[t], device->trackDataLength[t]);
+		}
+	}
+	if (result == SspResultOk && device->triggerMode >= 0) {
+		uint8_t payload[] = { (uint8_t)device->triggerMode };
+		result = sspMethodCall(device, SspCommandTriggerMode, payload, ARRAY_SIZE(payload));
+	}
+	device->recovering = false;
+	return result;
+}
+
+// One reconnect attempt: closes the probe, waits delayMs, opens it again by its serial number (so it is also found when
+// it was enumerated again under another path) and replays its configuration. With resetPort the USB port of the probe
+// is reset first.
+static SspResult sspReconnectOnce(SspDevice * device, bool resetPort, int delayMs) {
+	if (device->hid != NULL) {
+		hidBackend->close(device->hid);
+		device->hid = NULL;
+	}
+#ifdef __linux__
+	if (resetPort) {
+		sspResetUsbPort(device->path);
+	}
+#endif
+	sleepMs(delayMs);
+	if (device->serial[0] == '\0') {
+		return setError(device, SspResultErrorHidOpen, "Cannot reconnect to a probe without serial number");
+	}
+	char path[256];
+	if (!sspFindProbe(device->serial, NULL, path, sizeof(path), NULL, 0)) {
+		return setError(device, SspResultErrorHidOpen, "Probe %s not found while reconnecting", device->serial);
+	}
+	device->hid = hidBackend->open_path(path);
+	if (device->hid == NULL) {
+		return setError(device, SspResultErrorHidOpen, "Probe %s could not be opened while reconnecting", device->serial);
+	}
+	snprintf(device->path, sizeof(device->path), "%s", path);
+	resetParseState(&device->parse_state);
+	device->inputOffset = device->inputLength = 0;
+	if (device->metrics != NULL) {
+		sspMetricsAdd(device->metrics->reconnects, 1);
+	}
+#ifdef __linux__
+	// the probe may be a new USB device now
+	if (device->keepAwake) {
+		sspApplyKeepAwake(device);
+	}
+#endif
+	SspResult result = sspDetectReportLayout(device);
+	if (result == SspResultOk) {
+		result = sspReplayConfiguration(device);
+	}
+	SSP_USDT3(reconnect, device->serial, device->path, result);
+	return result;
+}
+
+// Errors that point at a broken connection rather than at a wrong command
+static bool sspIsConnectionError(SspResult result) {
+	return result == SspResultErrorWrite || result == SspResultErrorRead || result == SspResultErrorNoResponse;
+}
+
+// Reconnects after a connection error, up to the configured number of attempts (counted in attempt, which starts at 0
+// for a new command). Returns true when the command has to be sent again. A go that may have reached the probe is not
+// sent again, it could swipe the card twice; the probe is reconnected, but the error is returned.
+static bool sspRecover(SspDevice * device, SspCommandTag tag, SspResult result, unsigned * attempt) {
+	if (!sspIsConnectionError(result) || device->recovering) {
+		return false;
+	}
+	SspResult failure = result;
+	char failureMessage[sizeof(device->errorMessage)];
+	snprintf(failureMessage, sizeof(failureMessage), "%s", device->errorMessage);
+	while (*attempt < device->recovery.attempts) {
+		(*attempt)++;
+		bool resetPort = device->recovery.portReset && *attempt > 1;
+		int delayMs = device->recovery.delayMs << min(*attempt - 1, 10u);
+		if (sspReconnectOnce(device, resetPort, delayMs) == SspResultOk) {
+			if (tag == SspCommandTriggerArm && failure != SspResultErrorWrite) {
+				// the failure was counted already, only restore its message
+				snprintf(device->errorMessage, sizeof(device->errorMessage), "%s", failureMessage);
+				return false;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+// Enables (options->attempts > 0) or disables reconnecting after connection errors.
+void sspSetRecovery(SspDevice * device, const SspRecoveryOptions * options) {
+	device->recovery = *options;
+}
+
+// Sets the function called for every command written to the probe, NULL to stop observing.
+void sspSetCommandObserver(SspDevice * device, SspCommandObserver observer, void * context) {
+	device->observer = observer;
+	device->observerContext = context;
+}
+
+// Keeps the counters of the probe in metrics from now on, NULL to stop. metrics must stay valid while it is set.
+void sspSetMetrics(SspDevice * device, SspMetrics * metrics) {
+	device->metrics = metrics;
+}
+
+// Serial number of the probe, empty when it has none.
+const char * sspGetSerial(SspDevice * device) {
+	return device->serial;
+}
+
+// Reconnects to the probe by its serial number and replays its configuration, with the configured number of attempts.
+SspResult sspReconnect(SspDevice * device) {
+	unsigned attempts = max(device->recovery.attempts, 1u);
+	SspResult result = SspResultErrorHidOpen;
+	for (unsigned attempt = 1; attempt <= attempts && result != SspResultOk; attempt++) {
+		result = sspReconnectOnce(device, device->recovery.portReset && attempt > 1, device->recovery.delayMs << min(attempt - 1, 10u));
+	}
+	return result;
+}
+
+// Close the connection to the probe and free the device.
+void sspClose(SspDevice * device) {
+	if (device == NULL) {
+		return;
+	}
+	if (device->hid != NULL) {
+		hidBackend->close(device->hid);
+	}
+#ifdef __linux__
+	sspRestoreAutosuspend(device);
+#endif
+	free(device);
+}
+
+// Release the HID backend, so another backend can be selected afterwards. Close all devices first.
+void sspExit() {
+	if (hidBackend != NULL) {
+		hidBackend->exit();
+	}
+}
+
+// Returns the index of the first card from index on that still has to be swiped, or count when there is none.
+static size_t sspBatchNextCard(const SspSwipeResult * results, size_t index, size_t count) {
+	while (index < count && results[index].result != SspResultPending) {
+		index++;
+	}
+	return index;
+}
+
+// Sends command number [command] of card: the data of track 1, 2 and 3, followed by go.
+static SspResult sspBatchSend(SspDevice * device, const SspCard * card, int command) {
+	if (command == SSP_BATCH_COMMANDS_PER_CARD - 1) {
+		return sspSendFrame(device, SspCommandTriggerArm, NULL, 0);
+	}
+	uint8_t symbols[SSP_MAX_TRACK_LENGTH];
+	sspEncodeTrackData(command + 1, card->track[command], card->length[command], symbols, NULL);
+	return sspSendFrame(device, SspCommandDataBase + command + 1, symbols, card->length[command]);
+}
+
+// Checks the track data of a card, so invalid cards can be skipped before anything is sent.
+static SspResult sspBatchValidate(const SspCard * card) {
+	uint8_t symbols[SSP_MAX_TRACK_LENGTH];
+	for (int t = 0; t < 3; t++) {
+		if (card->length[t] > SSP_MAX_TRACK_LENGTH) {
+			return SspResultErrorFrameTooLong;
+		}
+		SspResult result = sspEncodeTrackData(t + 1, card->track[t], card->length[t], symbols, NULL);
+		if (result != SspResultOk) {
+			return result;
+		}
+	}
+	return SspResultOk;
+}
+
+// Marks all cards that were not handled yet with result.
+static void sspBatchFinish(SspSwipeResult * results, size_t count, SspResult result) {
+	for (size_t i = 0; i < count; i++) {
+		if (results[i].result == SspResultPending) {
+			results[i].result = result;
+		}
+	}
+}
+
+// Swipes count cards in one call. Commands are sent without waiting for the response of the previous one, as long as
+// no more than options->window responses are outstanding. The probe answers the commands in order, so every response
+// is matched to the oldest command in flight. When a command fails the input is flushed and the batch continues with
+// the first card that was not swiped yet (or stops, with options->stopOnError).
+SspResult sspSwipeMany(SspDevice * device, const SspCard * cards, size_t count, SspSwipeResult * results, const SspBatchOptions * options) {
+	SspBatchOptions defaultOptions = SSP_BATCH_OPTIONS_DEFAULT;
+	if (options == NULL) {
+		options = &defaultOptions;
+	}
+	unsigned int window = max(options->window, 1);
+	SspResult batchResult = SspResultOk;
+
+	for (size_t i = 0; i < count; i++) {
+		results[i].result = sspBatchValidate(&cards[i]);
+		results[i].completedNs = 0;
+		if (results[i].result == SspResultOk) {
+			results[i].result = SspResultPending;
+		}
+		else if (batchResult == SspResultOk) {
+			batchResult = setError(device, results[i].result, "Card %zu: %s", i + 1, sspResultString(results[i].result));
+		}
+	}
+	if (batchResult != SspResultOk && options->stopOnError) {
+		sspBatchFinish(results, count, SspResultErrorCancelled);
+		return batchResult;
+	}
+
+	sspHidFlush(device);
+	SspResult result = sspSetTriggerMode(device, SspTriggerModeImmediately);
+	if (result != SspResultOk) {
+		sspBatchFinish(results, count, result);
+		return result;
+	}
+
+	size_t sendCard = sspBatchNextCard(results, 0, count);		// card of the next command to send
+	int sendCommand = 0;
+	size_t ackCard = sendCard;									// card of the oldest command in flight
+	int ackCommand = 0;
+	unsigned int inFlight = 0;
+	bool swipePending = false;									// go of ackCard acknowledged, waiting for its swiped event
+	bool loadBlocked = false;									// go sent, the next card is loaded after the swipe
+	size_t recoveredCard = count;								// card at which the connection was last recovered
+	unsigned recoveries = 0;									// recoveries at that card
+	while (ackCard < count) {
+		// fill the pipeline. When waiting for swiped events, the next card is only loaded after the swipe.
+		while (inFlight < window && sendCard < count && !loadBlocked) {
+			result = sspBatchSend(device, &cards[sendCard], sendCommand);
+			if (result != SspResultOk) {
+				break;
+			}
+			inFlight++;
+			if (++sendCommand == SSP_BATCH_COMMANDS_PER_CARD) {
+				sendCommand = 0;
+				sendCard = sspBatchNextCard(results, sendCard + 1, count);
+				loadBlocked = options->awaitSwiped;
+			}
+		}
+
+		SspResponse response;
+		if (result == SspResultOk) {
+			result = sspWaitResponse(device, (inFlight > 0) ? SSP_RESPONSE_TIMEOUT_MS : options->swipeTimeoutMs, &response);
+		}
+		if (result == SspResultOk) {
+			if (response.tag == SspEventSwiped) {
+				if (swipePending) {
+					results[ackCard].result = SspResultOk;
+					results[ackCard].completedNs = getMonotonicTimeNs();
+					swipePending = false;
+					loadBlocked = false;
+					ackCard = sspBatchNextCard(results, ackCard + 1, count);
+				}
+				// events of cards that are not waited for are ignored
+				continue;
+			}
+			if (swipePending || inFlight == 0) {
+				// a response while no command is in flight (or while waiting for the swipe): the probe is out of sync
+				result = setError(device, SspResultErrorWrongTag, "Communication protocol error, expected swiped event but received 0x%02x", response.tag);
+			}
+			else {
+				result = sspCheckMethodResponse(device, &response);
+			}
+		}
+		if (result == SspResultOk) {
+			inFlight--;
+			if (++ackCommand == SSP_BATCH_COMMANDS_PER_CARD) {
+				ackCommand = 0;
+				if (options->awaitSwiped) {
+					swipePending = true;
+				}
+				else {
+					results[ackCard].result = SspResultOk;
+					results[ackCard].completedNs = getMonotonicTimeNs();
+					ackCard = sspBatchNextCard(results, ackCard + 1, count);
+				}
+			}
+			continue;
+		}
+
+		// After a connection error the probe is reconnected (when enabled) and the card of the failed command is tried
+		// again, unless its go was already sent. When reconnecting fails the remaining cards cannot be swiped.
+		bool recovered = false;
+		if (sspIsConnectionError(result) && device->recovery.attempts > 0) {
+			recoveries = (recoveredCard == ackCard) ? recoveries + 1 : 1;
+			recoveredCard = ackCard;
+			if (recoveries <= device->recovery.attempts) {
+				if (sspReconnect(device) != SspResultOk) {
+					sspBatchFinish(results, count, result);
+					return (batchResult == SspResultOk) ? result : batchResult;
+				}
+				recovered = true;
+			}
+		}
+
+		// Otherwise the card of the failed command failed. Cards after it whose go was already sent may or may not have
+		// been swiped, those get the same result. The batch restarts with the first card whose go was not sent.
+		size_t restartCard = (sendCard > ackCard) ? sendCard : (recovered ? ackCard : sspBatchNextCard(results, ackCard + 1, count));
+		if (batchResult == SspResultOk && restartCard > ackCard) {
+			batchResult = result;
+		}
+		for (size_t i = ackCard; i < restartCard; i++) {
+			if (results[i].result == SspResultPending) {
+				results[i].result = result;
+			}
+		}
+		if (options->stopOnError && restartCard > ackCard) {
+			sspBatchFinish(results, count, SspResultErrorCancelled);
+			return batchResult;
+		}
+		sspHidFlush(device);
+		sendCard = ackCard = restartCard;
+		sendCommand = ackCommand = 0;
+		inFlight = 0;
+		swipePending = false;
+		loadBlocked = false;
+		result = SspResultOk;
+	}
+	return batchResult;
+}
+
+// Parses a deck, see protocol.h. Lines end with LF or CR LF.
+size_t sspParseDeck(const char * text, size_t length, SspCard * cards, size_t maxCards) {
+	size_t count = 0;
+	size_t position = 0;
+	while (position < length) {
+		const char * line = text + position;
+		const char * newline = memchr(line, '\n', length - position);
+		size_t lineLength = (newline != NULL) ? (size_t)(newline - line) : length - position;
+		position += lineLength + 1;
+		if (lineLength > 0 && line[lineLength - 1] == '\r') {
+			lineLength--;
+		}
+		if (lineLength == 0) {
+			continue;
+		}
+		if (count < maxCards) {
+			SspCard * card = &cards[count];
+			for (int t = 0; t < 3; t++) {
+				const char * separator = memchr(line, '|', lineLength);
+				size_t trackLength = (separator != NULL) ? (size_t)(separator - line) : lineLength;
+				card->track[t] = line;
+				card->length[t] = trackLength;
+				line += trackLength;
+				lineLength -= trackLength;
+				if (separator != NULL) {
+					line++;
+					lineLength--;
+				}
+			}
 		}
+		count++;
 	}
+	return count;
 }
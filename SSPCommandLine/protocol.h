@@ -19,6 +19,16 @@ IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #ifndef SSPPROTOCOL_H
 #define SSPPROTOCOL_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "hidreport.h"
+#include "histogram.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef enum {
 	SspTriggerModeImmediately = 0x01,	///< Immediately on each go-command when data is loaded. The probe enters stop-mode immediately after executing swipe.
@@ -74,12 +84,163 @@ typedef struct {
 	uint8_t manualLrc;					///< Value of LRC when lrcGeneration is set to manual.
 } SspTrackConfiguration;
 
-void sspConnect(char * serial);
-void sspResetToDefaultConfiguration();
-SspFirmwareVersion sspGetFirmwareVersion();
-void sspSetTrackDataString(int tracknum, char * trackdata, size_t length);
-void sspSetTriggerMode(SspTriggerMode triggerMode);
-void sspSendGo();
-void sspSendStop();
+// Result of the protocol functions. Nothing in the protocol layer exits the process, errors are returned to the caller.
+typedef enum {
+	SspResultOk = 0,
+	SspResultPending,					///< No complete response received yet (only returned by sspPollResponse)
+	SspResultErrorHidApi,				///< The HID backend could not be loaded or initialized
+	SspResultErrorHidOpen,				///< No (matching) probe could be opened
+	SspResultErrorReportDescriptor,		///< The report descriptor of the probe does not describe usable reports
+	SspResultErrorOutOfMemory,
+	SspResultErrorFrameTooLong,			///< The command does not fit in a frame
+	SspResultErrorWrite,				///< Writing a report to the probe failed
+	SspResultErrorRead,					///< Reading from the probe failed, usually because it was disconnected
+	SspResultErrorNoResponse,			///< The probe did not respond in time
+	SspResultErrorParse,				///< The response could not be parsed
+	SspResultErrorCrc,					///< The CRC of the response is wrong
+	SspResultErrorNotOk,				///< The probe did not report OK on a method call
+	SspResultErrorWrongTag,				///< The probe responded with another tag than expected
+	SspResultErrorShortResponse,		///< The response is shorter than expected
+	SspResultErrorInvalidCharacter,		///< The track data contains a character that cannot be encoded on the track
+	SspResultErrorCancelled,			///< The operation was cancelled before it completed
+	SspResultCount,						///< Number of result codes, not a result
+} SspResult;
+
+// A response frame received from the probe. data points into the device and is valid until the next call for that device.
+typedef struct {
+	uint8_t tag;
+	uint16_t length;
+	const uint8_t * data;
+} SspResponse;
+
+// An opened probe. All protocol state (HID handle, report layout, parser state) is kept per device, so several probes
+// can be used from one process. A device must not be used from more than one thread at the same time.
+typedef struct SspDevice_s SspDevice;
+
+// Time the probe gets to respond to a command
+#define SSP_RESPONSE_TIMEOUT_MS 1000
+// Longest track data that fits in a frame
+#define SSP_MAX_TRACK_LENGTH 120
+// Size of the track configuration sent to the probe
+#define SSP_TRACK_CONFIG_LENGTH 8
+// Longest frame sent to the probe: the track data with every byte escaped, plus header, CRC and tail
+#define SSP_MAX_FRAME_LENGTH 256
+
+// A command encoded ahead of time with sspEncodeFrame, so sending it costs no more than writing the reports.
+typedef struct {
+	SspCommandTag tag;
+	uint16_t length;
+	uint8_t data[SSP_MAX_TRACK_LENGTH];		///< the command data, kept to replay the configuration after a reconnect
+	uint16_t frameLength;
+	uint8_t frame[SSP_MAX_FRAME_LENGTH];	///< the frame as written to the probe
+} SspEncodedFrame;
+
+// Recovery from connection errors (failed writes or reads, missing responses). When enabled, the probe is closed and
+// opened again by its serial number, also when it was enumerated again under another HID path, and the track data,
+// track configuration and trigger mode sent before are replayed. Then the failed command is sent again; a go is only
+// sent again when it never reached the probe, so a card is not swiped twice.
+typedef struct {
+	unsigned int attempts;	///< Reconnect attempts per failed command, 0 disables recovery
+	int delayMs;			///< Wait before the first attempt, doubled for every next attempt
+	bool portReset;			///< From the second attempt on, reset the USB port of the probe first (Linux only)
+} SspRecoveryOptions;
+
+#define SSP_RECOVERY_OPTIONS_DEFAULT { 5, 200, false }
+
+// Called for every command written to the probe, after it was written. The configuration replayed after a reconnect is
+// not reported, it repeats commands that were reported before.
+typedef void (*SspCommandObserver)(void * context, SspCommandTag tag, const uint8_t * data, size_t length);
+
+// Counters of a probe, kept by the protocol when set with sspSetMetrics. They are updated with relaxed atomic adds and
+// can be read (with relaxed atomic loads) from another thread while the probe is in use. The histograms are written by
+// the thread using the probe, see histogram.h.
+typedef struct {
+	uint64_t commands[256];					///< Commands written, by SspCommandTag
+	uint64_t responses[256];				///< Responses and events received, by SspResponseTag
+	uint64_t failures[SspResultCount];		///< Errors, by SspResult
+	uint64_t reconnects;
+	Histogram writeLatency;					///< Writing the reports of a command, in ns
+	Histogram responseLatency;				///< From writing a method or function call to its response
+	Histogram swipeLatency;					///< From writing a go to the swiped event
+} SspMetrics;
+
+const char * sspResultString(SspResult result);
+const char * sspErrorMessage(SspDevice * device);
+
+SspResult sspOpen(const char * serial, SspDevice ** device);
+SspResult sspOpenPath(const char * path, SspDevice ** device);
+void sspClose(SspDevice * device);
+void sspExit();
+HidReportLayout sspGetReportLayout(SspDevice * device);
+void sspSetRecovery(SspDevice * device, const SspRecoveryOptions * options);
+SspResult sspReconnect(SspDevice * device);
+bool sspPreventAutosuspend(SspDevice * device);
+void sspSetCommandObserver(SspDevice * device, SspCommandObserver observer, void * context);
+void sspSetMetrics(SspDevice * device, SspMetrics * metrics);
+const char * sspGetSerial(SspDevice * device);
+
+// Low level access: sends a command and polls for its response without blocking longer than timeoutMs.
+SspResult sspSendCommand(SspDevice * device, SspCommandTag tag, const void * data, size_t length);
+SspResult sspPollResponse(SspDevice * device, int timeoutMs, SspResponse * response);
+SspResult sspWaitResponse(SspDevice * device, int timeoutMs, SspResponse * response);
+SspResult sspCheckMethodResponse(SspDevice * device, const SspResponse * response);
+SspResult sspCheckFunctionResponse(SspDevice * device, SspCommandTag tag, const SspResponse * response, void * result_data, size_t result_length);
+SspResult sspMethodCall(SspDevice * device, SspCommandTag tag, const void * argument_data, size_t argument_length);
+SspResult sspEncodeFrame(SspCommandTag tag, const void * argument_data, size_t argument_length, SspEncodedFrame * encoded);
+SspResult sspMethodCallEncoded(SspDevice * device, const SspEncodedFrame * encoded);
+SspResult sspSendEncoded(SspDevice * device, const SspEncodedFrame * encoded);
+SspResult sspFunctionCall(SspDevice * device, SspCommandTag tag, const void * argument_data, size_t argument_length, void * result_data, size_t result_length);
+
+SspResult sspEncodeTrackData(int tracknum, const char * trackdata, size_t length, uint8_t * symbols, size_t * errorPosition);
+
+SspResult sspResetToDefaultConfiguration(SspDevice * device);
+SspResult sspGetFirmwareVersion(SspDevice * device, SspFirmwareVersion * version);
+SspResult sspSetTrackDataString(SspDevice * device, int tracknum, const char * trackdata, size_t length);
+SspResult sspSetTrackDataBinary(SspDevice * device, int tracknum, const uint8_t * trackdata, size_t length);
+SspResult sspSetTriggerMode(SspDevice * device, SspTriggerMode triggerMode);
+SspResult sspSendGo(SspDevice * device);
+SspResult sspSendGoAt(SspDevice * device, uint64_t deadlineNs, uint64_t * armedNs);
+SspResult sspSendStop(SspDevice * device);
+SspResult sspAwaitSwiped(SspDevice * device, int timeoutMs);
+void sspEncodeTrackConfig(const SspTrackConfiguration * trackconfig, uint8_t * trackconfig_bytes);
+SspResult sspSetTrackConfig(SspDevice * device, int tracknum, SspTrackConfiguration * trackconfig);
+SspResult sspSetManualLrc(SspDevice * device, int tracknum, uint8_t lrc);
+SspResult sspSetTrackConfigDefault(SspDevice * device, int tracknum);
+
+// A card for sspSwipeMany: the data of track 1, 2 and 3 as characters (not NUL terminated). A length of 0 leaves a track empty.
+typedef struct {
+	const char * track[3];
+	size_t length[3];
+} SspCard;
+
+typedef struct {
+	SspResult result;		///< SspResultOk when the card was swiped
+	uint64_t completedNs;	///< Monotonic time (getMonotonicTimeNs) at which the swipe was acknowledged
+} SspSwipeResult;
+
+typedef struct {
+	unsigned int window;	///< Maximum number of commands sent ahead of their responses, 1 sends them in lock-step
+	bool awaitSwiped;		///< Wait for the SspEventSwiped event of each card before loading the next one
+	int swipeTimeoutMs;		///< Time to wait for the swiped event
+	bool stopOnError;		///< Stop at the first failing card, the remaining cards get SspResultErrorCancelled
+} SspBatchOptions;
+
+// Commands per card in a batch: data for track 1, 2 and 3, and go. With a window of up to this size a failure can
+// never leave a later card swiped without its result being known.
+#define SSP_BATCH_COMMANDS_PER_CARD 4
+#define SSP_BATCH_OPTIONS_DEFAULT { SSP_BATCH_COMMANDS_PER_CARD, false, 5000, false }
+
+// Swipes count cards in one call, with the commands pipelined up to options->window deep. The result of each card is
+// stored in results[]. Returns the first error, or SspResultOk when all cards were swiped. options may be NULL.
+SspResult sspSwipeMany(SspDevice * device, const SspCard * cards, size_t count, SspSwipeResult * results, const SspBatchOptions * options);
+
+// Parses a deck: one card per line, with the data of track 1, 2 and 3 separated by '|' (not a valid track character).
+// The cards point into text, nothing is copied. Stores at most maxCards cards and returns the number of cards in the
+// deck, so it can be called with cards NULL to count them first. Empty lines are skipped.
+size_t sspParseDeck(const char * text, size_t length, SspCard * cards, size_t maxCards);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* not defined SSPPROTOCOL_H*/
\ No newline at end of file
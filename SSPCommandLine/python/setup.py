@@ -0,0 +1,21 @@
+# Builds the sspprobe Python extension module:
+#   python3 setup.py build_ext --inplace
+# The hidapi backend libraries (libhidapi-hidraw.so / libhidapi-libusb.so) are loaded at runtime, see COMPILING.md.
+
+import sys
+from setuptools import setup, Extension
+
+sources = ['sspprobe.c', '../protocol.c', '../util.c', '../hidbackend.c', '../hidreport.c', '../histogram.c']
+
+libraries = []
+extra_compile_args = []
+if sys.platform != 'win32':
+	libraries = ['dl']
+	extra_compile_args = ['--std=gnu99']
+
+setup(
+	name='sspprobe',
+	version='0.2',
+	description='SmartStripe probe access',
+	ext_modules=[Extension('sspprobe', sources=sources, libraries=libraries, extra_compile_args=extra_compile_args)],
+)
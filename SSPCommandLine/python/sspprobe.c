@@ -0,0 +1,448 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+// Python extension module "sspprobe": drives SmartStripe probes from Python without starting the command line
+// utility per card. Probes stay open between calls, decks are passed as bytes-like objects and parsed in place
+// (see sspParseDeck), and the GIL is released during USB I/O so several probes can be driven from Python threads.
+//
+//	import sspprobe
+//	with sspprobe.Probe("auto") as probe:
+//		results = probe.swipe_deck(open("deck.txt", "rb").read())
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hidapi/hidapi.h"
+#include "../hidbackend.h"
+#include "../SSPCommandLineTool.h"
+#include "../protocol.h"
+
+static PyObject * SspError;
+
+// Serializes backend selection, initialization and opening, which use the process wide hidBackend. It is never held
+// while waiting for the GIL, so it can be taken with the GIL held.
+static PyThread_type_lock openLock;
+// Probes open, protected by openLock. The backend cannot be switched while there are any: their hid_device handles
+// belong to the library of the current backend.
+static int openProbes = 0;
+
+typedef enum { BackendOk, BackendUnknown, BackendInUse } BackendSelection;
+
+typedef struct {
+	PyObject_HEAD
+	SspDevice * device;
+	PyThread_type_lock lock;		///< held while the device is used, so one probe is never used by two threads at once
+} ProbeObject;
+
+// Raises sspprobe.Error(result, message) and returns NULL.
+static PyObject * raiseResult(SspResult result, const char * message) {
+	PyObject * args = Py_BuildValue("(is)", (int)result, message);
+	if (args != NULL) {
+		PyErr_SetObject(SspError, args);
+		Py_DECREF(args);
+	}
+	return NULL;
+}
+
+// Called with the probe lock held, the error message belongs to the device.
+static PyObject * raiseDeviceResult(ProbeObject * self, SspResult result) {
+	return raiseResult(result, sspErrorMessage(self->device));
+}
+
+// Acquires the probe lock without holding the GIL.
+static void lockProbe(ProbeObject * self) {
+	if (!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+		Py_BEGIN_ALLOW_THREADS
+		PyThread_acquire_lock(self->lock, WAIT_LOCK);
+		Py_END_ALLOW_THREADS
+	}
+}
+
+static void unlockProbe(ProbeObject * self) {
+	PyThread_release_lock(self->lock);
+}
+
+// Acquires the probe lock when the probe is open. When it is closed (also by another thread while waiting for the
+// lock) it raises and returns false, without the lock.
+static bool lockOpenProbe(ProbeObject * self) {
+	lockProbe(self);
+	if (self->device == NULL) {
+		unlockProbe(self);
+		raiseResult(SspResultErrorHidOpen, "Probe is closed");
+		return false;
+	}
+	return true;
+}
+
+// Selects the backend to open or enumerate with, the default one when none is given and none was selected before.
+// Called with openLock held.
+static BackendSelection selectProbeBackend(const char * backend) {
+	if (backend == NULL) {
+		return (hidBackend != NULL || hidBackendSelect(hidBackendNames[0])) ? BackendOk : BackendUnknown;
+	}
+	if (hidBackend != NULL && strcmp(hidBackend->name, backend) == 0) {
+		return BackendOk;
+	}
+	if (openProbes > 0) {
+		return BackendInUse;
+	}
+	return hidBackendSelect(backend) ? BackendOk : BackendUnknown;
+}
+
+// Raises the error for a failed selectProbeBackend and returns NULL.
+static PyObject * raiseBackendError(BackendSelection selection, const char * backend) {
+	if (selection == BackendInUse) {
+		return PyErr_Format(SspError, "Cannot switch to HID backend %s while probes are open with backend %s", backend, hidBackend->name);
+	}
+	return PyErr_Format(SspError, "HID backend %s is unknown or could not be loaded", (backend != NULL) ? backend : hidBackendNames[0]);
+}
+
+// Closes the device of the probe, with the probe lock or from dealloc.
+static void closeDevice(ProbeObject * self) {
+	if (self->device == NULL) {
+		return;
+	}
+	sspClose(self->device);
+	self->device = NULL;
+	PyThread_acquire_lock(openLock, WAIT_LOCK);
+	openProbes--;
+	PyThread_release_lock(openLock);
+}
+
+static int Probe_init(ProbeObject * self, PyObject * args, PyObject * kwds) {
+	static char * kwlist[] = { "serial", "backend", "path", NULL };
+	const char * serial = "auto";
+	const char * backend = NULL;
+	const char * path = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|szz", kwlist, &serial, &backend, &path)) {
+		return -1;
+	}
+	if (self->device != NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "Probe is already open");
+		return -1;
+	}
+
+	SspResult result = SspResultOk;
+	BackendSelection selection;
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(openLock, WAIT_LOCK);
+	selection = selectProbeBackend(backend);
+	if (selection == BackendOk) {
+		result = (path != NULL) ? sspOpenPath(path, &self->device) : sspOpen(serial, &self->device);
+		if (result == SspResultOk) {
+			openProbes++;
+		}
+	}
+	PyThread_release_lock(openLock);
+	Py_END_ALLOW_THREADS
+
+	if (selection != BackendOk) {
+		raiseBackendError(selection, backend);
+		return -1;
+	}
+	if (result != SspResultOk) {
+		raiseResult(result, sspResultString(result));
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject * Probe_new(PyTypeObject * type, PyObject * args, PyObject * kwds) {
+	ProbeObject * self = (ProbeObject *)type->tp_alloc(type, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+	self->device = NULL;
+	self->lock = PyThread_allocate_lock();
+	if (self->lock == NULL) {
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	return (PyObject *)self;
+}
+
+static void Probe_dealloc(ProbeObject * self) {
+	closeDevice(self);
+	if (self->lock != NULL) {
+		PyThread_free_lock(self->lock);
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject * Probe_close(ProbeObject * self, PyObject * Py_UNUSED(ignored)) {
+	lockProbe(self);
+	closeDevice(self);
+	unlockProbe(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject * Probe_enter(ProbeObject * self, PyObject * Py_UNUSED(ignored)) {
+	Py_INCREF(self);
+	return (PyObject *)self;
+}
+
+static PyObject * Probe_exit(ProbeObject * self, PyObject * args) {
+	return Probe_close(self, NULL);
+}
+
+static PyObject * Probe_firmware_version(ProbeObject * self, PyObject * Py_UNUSED(ignored)) {
+	SspFirmwareVersion version;
+	SspResult result;
+	if (!lockOpenProbe(self)) {
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	result = sspGetFirmwareVersion(self->device, &version);
+	Py_END_ALLOW_THREADS
+	if (result != SspResultOk) {
+		raiseDeviceResult(self, result);
+	}
+	unlockProbe(self);
+	if (result != SspResultOk) {
+		return NULL;
+	}
+	return Py_BuildValue("(iiii)", version.firmwareMajor, version.firmwareMinor, version.bootloaderMajor, version.bootloaderMinor);
+}
+
+static PyObject * Probe_reset(ProbeObject * self, PyObject * Py_UNUSED(ignored)) {
+	SspResult result;
+	if (!lockOpenProbe(self)) {
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	result = sspResetToDefaultConfiguration(self->device);
+	Py_END_ALLOW_THREADS
+	if (result != SspResultOk) {
+		raiseDeviceResult(self, result);
+	}
+	unlockProbe(self);
+	if (result != SspResultOk) {
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+// swipe(track1=b"", track2=b"", track3=b""): loads the tracks and swipes the card.
+static PyObject * Probe_swipe(ProbeObject * self, PyObject * args, PyObject * kwds) {
+	static char * kwlist[] = { "track1", "track2", "track3", NULL };
+	Py_buffer tracks[3] = { { 0 }, { 0 }, { 0 } };
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|y*y*y*", kwlist, &tracks[0], &tracks[1], &tracks[2])) {
+		return NULL;
+	}
+	if (!lockOpenProbe(self)) {
+		for (int t = 0; t < 3; t++) {
+			PyBuffer_Release(&tracks[t]);
+		}
+		return NULL;
+	}
+	SspResult result = SspResultOk;
+	Py_BEGIN_ALLOW_THREADS
+	for (int t = 0; t < 3 && result == SspResultOk; t++) {
+		result = sspSetTrackDataString(self->device, t + 1, tracks[t].buf != NULL ? tracks[t].buf : "", (size_t)tracks[t].len);
+	}
+	if (result == SspResultOk) {
+		result = sspSetTriggerMode(self->device, SspTriggerModeImmediately);
+	}
+	if (result == SspResultOk) {
+		result = sspSendGo(self->device);
+	}
+	Py_END_ALLOW_THREADS
+	if (result != SspResultOk) {
+		raiseDeviceResult(self, result);
+	}
+	unlockProbe(self);
+	for (int t = 0; t < 3; t++) {
+		PyBuffer_Release(&tracks[t]);
+	}
+	if (result != SspResultOk) {
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+// swipe_deck(deck, window=4, await_swiped=False, stop_on_error=False): swipes all cards of a deck (bytes, bytearray,
+// memoryview, ...) in one batch. Returns a list with the result code of every card, 0 when it was swiped.
+static PyObject * Probe_swipe_deck(ProbeObject * self, PyObject * args, PyObject * kwds) {
+	static char * kwlist[] = { "deck", "window", "await_swiped", "stop_on_error", "swipe_timeout_ms", NULL };
+	Py_buffer deck;
+	SspBatchOptions options = SSP_BATCH_OPTIONS_DEFAULT;
+	int awaitSwiped = options.awaitSwiped;
+	int stopOnError = options.stopOnError;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|Ippi", kwlist, &deck, &options.window, &awaitSwiped, &stopOnError, &options.swipeTimeoutMs)) {
+		return NULL;
+	}
+	options.awaitSwiped = awaitSwiped;
+	options.stopOnError = stopOnError;
+
+	// The cards point into the deck buffer, which stays exported (and unmodifiable) until the batch is done.
+	size_t count = sspParseDeck(deck.buf, (size_t)deck.len, NULL, 0);
+	SspCard * cards = PyMem_RawMalloc((count + 1) * sizeof(SspCard));
+	SspSwipeResult * results = PyMem_RawMalloc((count + 1) * sizeof(SspSwipeResult));
+	if (cards == NULL || results == NULL) {
+		PyMem_RawFree(cards);
+		PyMem_RawFree(results);
+		PyBuffer_Release(&deck);
+		return PyErr_NoMemory();
+	}
+	sspParseDeck(deck.buf, (size_t)deck.len, cards, count);
+
+	if (!lockOpenProbe(self)) {
+		PyMem_RawFree(cards);
+		PyMem_RawFree(results);
+		PyBuffer_Release(&deck);
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	sspSwipeMany(self->device, cards, count, results, &options);
+	Py_END_ALLOW_THREADS
+	unlockProbe(self);
+	PyBuffer_Release(&deck);
+
+	PyObject * list = PyList_New((Py_ssize_t)count);
+	for (size_t i = 0; list != NULL && i < count; i++) {
+		PyList_SET_ITEM(list, (Py_ssize_t)i, PyLong_FromLong(results[i].result));
+	}
+	PyMem_RawFree(cards);
+	PyMem_RawFree(results);
+	return list;
+}
+
+static PyObject * Probe_report_layout(ProbeObject * self, PyObject * Py_UNUSED(ignored)) {
+	if (!lockOpenProbe(self)) {
+		return NULL;
+	}
+	HidReportLayout layout = sspGetReportLayout(self->device);
+	unlockProbe(self);
+	return Py_BuildValue("(iiii)", layout.inputReportId, layout.inputReportLength, layout.outputReportId, layout.outputReportLength);
+}
+
+static PyMethodDef Probe_methods[] = {
+	{ "close", (PyCFunction)Probe_close, METH_NOARGS, "Close the probe." },
+	{ "firmware_version", (PyCFunction)Probe_firmware_version, METH_NOARGS,
+		"Return (firmware major, firmware minor, bootloader major, bootloader minor)." },
+	{ "reset", (PyCFunction)Probe_reset, METH_NOARGS, "Reset track data and track settings to their default values." },
+	{ "swipe", (PyCFunction)(void(*)(void))Probe_swipe, METH_VARARGS | METH_KEYWORDS,
+		"swipe(track1=b'', track2=b'', track3=b'')\n\nLoad the track data and swipe the card." },
+	{ "swipe_deck", (PyCFunction)(void(*)(void))Probe_swipe_deck, METH_VARARGS | METH_KEYWORDS,
+		"swipe_deck(deck, window=4, await_swiped=False, stop_on_error=False, swipe_timeout_ms=5000)\n\n"
+		"Swipe all cards of a deck: a bytes-like object with one card per line, tracks separated by '|'.\n"
+		"Returns a list with the result code of every card (0 = swiped)." },
+	{ "report_layout", (PyCFunction)Probe_report_layout, METH_NOARGS,
+		"Return (input report id, input length, output report id, output length)." },
+	{ "__enter__", (PyCFunction)Probe_enter, METH_NOARGS, NULL },
+	{ "__exit__", (PyCFunction)Probe_exit, METH_VARARGS, NULL },
+	{ NULL },
+};
+
+static PyTypeObject ProbeType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "sspprobe.Probe",
+	.tp_doc = "Probe(serial='auto', backend=None, path=None)\n\nAn opened SmartStripe probe. All probes of a process use the same HID backend, it can only be switched while no probe is open.",
+	.tp_basicsize = sizeof(ProbeObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = Probe_new,
+	.tp_init = (initproc)Probe_init,
+	.tp_dealloc = (destructor)Probe_dealloc,
+	.tp_methods = Probe_methods,
+};
+
+// list_probes(backend=None): returns a list of (serial, path) of the connected probes.
+static PyObject * list_probes(PyObject * module, PyObject * args, PyObject * kwds) {
+	static char * kwlist[] = { "backend", NULL };
+	const char * backend = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|z", kwlist, &backend)) {
+		return NULL;
+	}
+	struct hid_device_info * devs = NULL;
+	// the enumeration is freed by the library that made it, even when another backend was selected meanwhile
+	HidBackend * enumerator = NULL;
+	BackendSelection selection;
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(openLock, WAIT_LOCK);
+	selection = selectProbeBackend(backend);
+	if (selection == BackendOk) {
+		enumerator = hidBackend;
+		devs = enumerator->enumerate(SSP_VID, SSP_PID);
+	}
+	PyThread_release_lock(openLock);
+	Py_END_ALLOW_THREADS
+	if (selection != BackendOk) {
+		return raiseBackendError(selection, backend);
+	}
+
+	PyObject * list = PyList_New(0);
+	for (struct hid_device_info * dev = devs; list != NULL && dev != NULL; dev = dev->next) {
+		PyObject * item = Py_BuildValue("(us)", dev->serial_number != NULL ? dev->serial_number : L"", dev->path);
+		if (item == NULL || PyList_Append(list, item) < 0) {
+			Py_CLEAR(list);
+		}
+		Py_XDECREF(item);
+	}
+	enumerator->free_enumeration(devs);
+	return list;
+}
+
+static PyObject * result_string(PyObject * module, PyObject * arg) {
+	long result = PyLong_AsLong(arg);
+	if (result == -1 && PyErr_Occurred()) {
+		return NULL;
+	}
+	return PyUnicode_FromString(sspResultString((SspResult)result));
+}
+
+static PyMethodDef module_methods[] = {
+	{ "list_probes", (PyCFunction)(void(*)(void))list_probes, METH_VARARGS | METH_KEYWORDS,
+		"list_probes(backend=None)\n\nReturn a list of (serial, path) of the connected probes." },
+	{ "result_string", result_string, METH_O, "Return the description of a result code." },
+	{ NULL },
+};
+
+static struct PyModuleDef sspprobeModule = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "sspprobe",
+	.m_doc = "SmartStripe probe access.",
+	.m_size = -1,
+	.m_methods = module_methods,
+};
+
+PyMODINIT_FUNC PyInit_sspprobe(void) {
+	if (PyType_Ready(&ProbeType) < 0) {
+		return NULL;
+	}
+	openLock = PyThread_allocate_lock();
+	if (openLock == NULL) {
+		return PyErr_NoMemory();
+	}
+	PyObject * module = PyModule_Create(&sspprobeModule);
+	if (module == NULL) {
+		return NULL;
+	}
+	SspError = PyErr_NewExceptionWithDoc("sspprobe.Error", "Probe error, args are (result code, message).", NULL, NULL);
+	Py_INCREF(&ProbeType);
+	if (SspError == NULL || PyModule_AddObject(module, "Error", SspError) < 0
+		|| PyModule_AddObject(module, "Probe", (PyObject *)&ProbeType) < 0
+		|| PyModule_AddIntConstant(module, "RESULT_OK", SspResultOk) < 0) {
+		Py_DECREF(module);
+		return NULL;
+	}
+	Py_INCREF(SspError);
+	return module;
+}
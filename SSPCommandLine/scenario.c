@@ -0,0 +1,603 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "SSPCommandLineTool.h"
+#include "protocol.h"
+#include "scenario.h"
+#include "util.h"
+
+// Longest line of a scenario after the variables are filled in
+#define SCENARIO_MAX_LINE 1024
+// Time to wait for the swiped event when await has no time
+#define SCENARIO_AWAIT_DEFAULT_MS 5000
+
+typedef struct {
+	char * name;
+	char * value;
+} ScenarioVariable;
+
+typedef struct {
+	char ** lines;
+	size_t lineCount;
+	ScenarioVariable * variables;
+	size_t variableCount;
+	ScenarioVariable * cards;			///< card templates: name and the unexpanded tracks
+	size_t cardCount;
+	ScenarioProgram * program;
+	size_t allocatedInstructions;
+	size_t allocatedFrames;
+	char * error;
+	size_t errorSize;
+} ScenarioCompiler;
+
+static bool compileError(ScenarioCompiler * c, size_t line, const char * format, ...) {
+	va_list arguments;
+	int length = snprintf(c->error, c->errorSize, "Line %zu: ", line + 1);
+	va_start(arguments, format);
+	if (length >= 0 && (size_t)length < c->errorSize) {
+		vsnprintf(c->error + length, c->errorSize - length, format, arguments);
+	}
+	va_end(arguments);
+	return false;
+}
+
+static ScenarioVariable * findVariable(ScenarioVariable * variables, size_t count, const char * name, size_t nameLength) {
+	for (size_t i = 0; i < count; i++) {
+		if (strlen(variables[i].name) == nameLength && strncmp(variables[i].name, name, nameLength) == 0) {
+			return &variables[i];
+		}
+	}
+	return NULL;
+}
+
+// Sets a variable or card template, replacing an earlier value.
+static bool defineVariable(ScenarioVariable ** variables, size_t * count, const char * name, const char * value) {
+	ScenarioVariable * variable = findVariable(*variables, *count, name, strlen(name));
+	char * copy = strdup(value);
+	if (copy == NULL) {
+		return false;
+	}
+	if (variable == NULL) {
+		ScenarioVariable * grown = realloc(*variables, (*count + 1) * sizeof(ScenarioVariable));
+		if (grown == NULL || (grown[*count].name = strdup(name)) == NULL) {
+			*variables = (grown != NULL) ? grown : *variables;
+			free(copy);
+			return false;
+		}
+		*variables = grown;
+		variable = &grown[(*count)++];
+	}
+	else {
+		free(variable->value);
+	}
+	variable->value = copy;
+	return true;
+}
+
+static void freeVariables(ScenarioVariable * variables, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		free(variables[i].name);
+		free(variables[i].value);
+	}
+	free(variables);
+}
+
+// Fills in the variables ($name, ${name}, $$ for a '$') of text.
+static bool substitute(ScenarioCompiler * c, size_t line, const char * text, char * out, size_t outSize) {
+	size_t length = 0;
+	for (const char * p = text; *p != '\0'; ) {
+		const char * value = p;
+		size_t valueLength = 1;
+		if (*p == '$' && p[1] == '$') {
+			p += 2;
+		}
+		else if (*p == '$') {
+			bool braced = p[1] == '{';
+			const char * name = p + (braced ? 2 : 1);
+			size_t nameLength = 0;
+			while (isalnum((unsigned char)name[nameLength]) || name[nameLength] == '_') {
+				nameLength++;
+			}
+			if (nameLength == 0 || (braced && name[nameLength] != '}')) {
+				return compileError(c, line, "Invalid variable reference, use $name or ${name} ($$ for a '$')");
+			}
+			ScenarioVariable * variable = findVariable(c->variables, c->variableCount, name, nameLength);
+			if (variable == NULL) {
+				return compileError(c, line, "Unknown variable %.*s", (int)nameLength, name);
+			}
+			value = variable->value;
+			valueLength = strlen(value);
+			p = name + nameLength + (braced ? 1 : 0);
+		}
+		else {
+			p++;
+		}
+		if (length + valueLength >= outSize) {
+			return compileError(c, line, "Line too long");
+		}
+		memcpy(out + length, value, valueLength);
+		length += valueLength;
+	}
+	out[length] = '\0';
+	return true;
+}
+
+// Splits off the next word (separated by spaces or tabs) at *cursor, NULL when there are no more.
+static char * nextWord(char ** cursor) {
+	char * word = *cursor + strspn(*cursor, " \t");
+	if (*word == '\0') {
+		*cursor = word;
+		return NULL;
+	}
+	char * end = word + strcspn(word, " \t");
+	*cursor = (*end != '\0') ? end + 1 : end;
+	*end = '\0';
+	return word;
+}
+
+// The rest of the line at *cursor, without the leading spaces.
+static char * restOfLine(char ** cursor) {
+	char * rest = *cursor + strspn(*cursor, " \t");
+	*cursor = rest + strlen(rest);
+	return rest;
+}
+
+static bool emit(ScenarioCompiler * c, ScenarioOpcode opcode, uint32_t argument, size_t line) {
+	ScenarioProgram * program = c->program;
+	if (program->instructionCount == c->allocatedInstructions) {
+		size_t allocated = (c->allocatedInstructions == 0) ? 64 : c->allocatedInstructions * 2;
+		ScenarioInstruction * grown = realloc(program->instructions, allocated * sizeof(ScenarioInstruction));
+		if (grown == NULL) {
+			return compileError(c, line, "Out of memory");
+		}
+		program->instructions = grown;
+		c->allocatedInstructions = allocated;
+	}
+	program->instructions[program->instructionCount++] = (ScenarioInstruction) { opcode, argument, 0, (uint32_t)(line + 1) };
+	return true;
+}
+
+// Encodes a command and adds the instruction that sends it.
+static bool emitFrame(ScenarioCompiler * c, SspCommandTag tag, const uint8_t * data, size_t length, size_t line) {
+	ScenarioProgram * program = c->program;
+	if (program->frameCount == c->allocatedFrames) {
+		size_t allocated = (c->allocatedFrames == 0) ? 64 : c->allocatedFrames * 2;
+		SspEncodedFrame * grown = realloc(program->frames, allocated * sizeof(SspEncodedFrame));
+		if (grown == NULL) {
+			return compileError(c, line, "Out of memory");
+		}
+		program->frames = grown;
+		c->allocatedFrames = allocated;
+	}
+	if (sspEncodeFrame(tag, data, length, &program->frames[program->frameCount]) != SspResultOk) {
+		return compileError(c, line, "The data does not fit in a frame");
+	}
+	return emit(c, ScenarioOpFrame, (uint32_t)program->frameCount++, line);
+}
+
+static bool emitTrackData(ScenarioCompiler * c, int track, const char * data, size_t length, size_t line) {
+	uint8_t symbols[SSP_MAX_TRACK_LENGTH];
+	size_t position = 0;
+	if (length > SSP_MAX_TRACK_LENGTH) {
+		return compileError(c, line, "Track %d is longer than %d characters", track, SSP_MAX_TRACK_LENGTH);
+	}
+	if (sspEncodeTrackData(track, data, length, symbols, &position) != SspResultOk) {
+		return compileError(c, line, "Invalid character '%c' at position %zu of track %d", data[position], position + 1, track);
+	}
+	return emitFrame(c, SspCommandDataBase + track, symbols, length, line);
+}
+
+static bool parseTrackNumber(ScenarioCompiler * c, const char * text, int * track, size_t line) {
+	if (text == NULL || text[0] < '1' || text[0] > '3' || text[1] != '\0') {
+		return compileError(c, line, "Expected a track number (1, 2 or 3)");
+	}
+	*track = text[0] - '0';
+	return true;
+}
+
+// Loads the tracks of a card template, expanded with the current variables, and arms when arm is set.
+static bool compileCard(ScenarioCompiler * c, const char * name, bool arm, size_t line) {
+	ScenarioVariable * card = (name != NULL) ? findVariable(c->cards, c->cardCount, name, strlen(name)) : NULL;
+	if (card == NULL) {
+		return compileError(c, line, "Unknown card %s", (name != NULL) ? name : "(none given)");
+	}
+	char tracks[SCENARIO_MAX_LINE];
+	if (!substitute(c, line, card->value, tracks, sizeof(tracks))) {
+		return false;
+	}
+	const char * start = tracks;
+	for (int t = 1; t <= 3; t++) {
+		const char * end = strchr(start, '|');
+		size_t length = (end != NULL && t < 3) ? (size_t)(end - start) : strlen(start);
+		if (!emitTrackData(c, t, start, length, line)) {
+			return false;
+		}
+		start = (end != NULL && t < 3) ? end + 1 : start + length;
+	}
+	return !arm || emitFrame(c, SspCommandTriggerArm, NULL, 0, line);
+}
+
+// Index of the end that closes the block starting after line first, or lineCount when there is none.
+static size_t findEnd(ScenarioCompiler * c, size_t first) {
+	unsigned depth = 1;
+	for (size_t i = first; i < c->lineCount; i++) {
+		char word[16] = "";
+		sscanf(c->lines[i], "%15s", word);
+		if (strcmp(word, "repeat") == 0 || strcmp(word, "for") == 0) {
+			depth++;
+		}
+		else if (strcmp(word, "end") == 0 && --depth == 0) {
+			return i;
+		}
+	}
+	return c->lineCount;
+}
+
+static bool compileBlock(ScenarioCompiler * c, size_t * index, bool inBlock);
+
+// Compiles one statement. Blocks (repeat, for) advance *index past their end.
+static bool compileStatement(ScenarioCompiler * c, size_t * index) {
+	size_t line = (*index)++;
+	const char * raw = c->lines[line];
+	while (isspace((unsigned char)*raw)) {
+		raw++;
+	}
+	if (*raw == '\0' || *raw == '#') {
+		return true;
+	}
+	// card templates are stored as written, their variables are filled in where the card is used
+	if (strncmp(raw, "card", 4) == 0 && isspace((unsigned char)raw[4])) {
+		char name[64];
+		int consumed = 0;
+		if (sscanf(raw + 4, " %63[^ \t]%n", name, &consumed) != 1) {
+			return compileError(c, line, "Expected card <name> <track1>|<track2>|<track3>");
+		}
+		const char * tracks = raw + 4 + consumed;
+		while (*tracks == ' ' || *tracks == '\t') {
+			tracks++;
+		}
+		return defineVariable(&c->cards, &c->cardCount, name, tracks) || compileError(c, line, "Out of memory");
+	}
+
+	char text[SCENARIO_MAX_LINE];
+	if (!substitute(c, line, raw, text, sizeof(text))) {
+		return false;
+	}
+	char * cursor = text;
+	char * command = nextWord(&cursor);
+	char * argument = nextWord(&cursor);
+	if (command == NULL) {
+		return true;
+	}
+
+	if (strcmp(command, "set") == 0) {
+		char * value = restOfLine(&cursor);
+		if (argument == NULL) {
+			return compileError(c, line, "Expected set <name> <value>");
+		}
+		return defineVariable(&c->variables, &c->variableCount, argument, value) || compileError(c, line, "Out of memory");
+	}
+	if (strcmp(command, "reset") == 0) {
+		return emitFrame(c, SspCommandDefaultConfiguration, NULL, 0, line);
+	}
+	if (strcmp(command, "trigger") == 0) {
+		uint8_t mode;
+		if (argument != NULL && strcmp(argument, "immediately") == 0) {
+			mode = SspTriggerModeImmediately;
+		}
+		else if (argument != NULL && strcmp(argument, "single") == 0) {
+			mode = SspTriggerModeSingle;
+		}
+		else if (argument != NULL && strcmp(argument, "auto") == 0) {
+			mode = SspTriggerModeauto;
+		}
+		else {
+			return compileError(c, line, "Expected trigger (immediately | single | auto)");
+		}
+		return emitFrame(c, SspCommandTriggerMode, &mode, 1, line);
+	}
+	if (strcmp(command, "track") == 0) {
+		int track;
+		char * data = restOfLine(&cursor);
+		return parseTrackNumber(c, argument, &track, line) && emitTrackData(c, track, data, strlen(data), line);
+	}
+	if (strcmp(command, "raw") == 0) {
+		int track;
+		uint8_t symbols[SSP_MAX_TRACK_LENGTH];
+		size_t length = 0;
+		if (!parseTrackNumber(c, argument, &track, line)) {
+			return false;
+		}
+		for (char * byte = nextWord(&cursor); byte != NULL; byte = nextWord(&cursor)) {
+			char * end;
+			unsigned long value = strtoul(byte, &end, 16);
+			if (*end != '\0' || value > 0xff) {
+				return compileError(c, line, "Invalid symbol %s, expected a hexadecimal byte", byte);
+			}
+			if (length == SSP_MAX_TRACK_LENGTH) {
+				return compileError(c, line, "More than %d symbols", SSP_MAX_TRACK_LENGTH);
+			}
+			symbols[length++] = (uint8_t)value;
+		}
+		return emitFrame(c, SspCommandDataBase + track, symbols, length, line);
+	}
+	if (strcmp(command, "lrc") == 0) {
+		int track;
+		char * value = nextWord(&cursor);
+		if (!parseTrackNumber(c, argument, &track, line)) {
+			return false;
+		}
+		SspTrackConfiguration trackConfig = { .lrcGeneration = LrcAuto };
+		uint8_t config[SSP_TRACK_CONFIG_LENGTH];
+		if (value == NULL) {
+			return compileError(c, line, "Expected lrc <track> (<hex> | auto)");
+		}
+		if (strcmp(value, "auto") != 0) {
+			char * end;
+			unsigned long lrc = strtoul(value, &end, 16);
+			if (*end != '\0' || lrc > 0xff) {
+				return compileError(c, line, "Invalid LRC %s, expected a hexadecimal byte or auto", value);
+			}
+			trackConfig.lrcGeneration = LrcManual;
+			trackConfig.manualLrc = (uint8_t)lrc;
+		}
+		sspEncodeTrackConfig(&trackConfig, config);
+		return emitFrame(c, SspCommandConfigBase + track, config, sizeof(config), line);
+	}
+	if (strcmp(command, "load") == 0 || strcmp(command, "swipe") == 0) {
+		return compileCard(c, argument, strcmp(command, "swipe") == 0, line);
+	}
+	if (strcmp(command, "arm") == 0) {
+		return emitFrame(c, SspCommandTriggerArm, NULL, 0, line);
+	}
+	if (strcmp(command, "stop") == 0) {
+		return emitFrame(c, SspCommandTriggerDisarm, NULL, 0, line);
+	}
+	if (strcmp(command, "await") == 0) {
+		int ms = (argument != NULL) ? atoi(argument) : SCENARIO_AWAIT_DEFAULT_MS;
+		if (ms <= 0) {
+			return compileError(c, line, "Expected await [<ms>]");
+		}
+		return emit(c, ScenarioOpAwaitSwiped, (uint32_t)ms, line);
+	}
+	if (strcmp(command, "delay") == 0) {
+		double ms = (argument != NULL) ? atof(argument) : -1;
+		if (ms < 0 || ms > 3600000) {
+			return compileError(c, line, "Expected delay <ms>");
+		}
+		return emit(c, ScenarioOpDelay, (uint32_t)(ms * 1000), line);
+	}
+	if (strcmp(command, "repeat") == 0) {
+		long count = (argument != NULL) ? atol(argument) : -1;
+		if (count < 0) {
+			return compileError(c, line, "Expected repeat <n>");
+		}
+		size_t repeat = c->program->instructionCount;
+		if (!emit(c, ScenarioOpRepeat, (uint32_t)count, line) || !compileBlock(c, index, true) || !emit(c, ScenarioOpEnd, 0, line)) {
+			return false;
+		}
+		size_t end = c->program->instructionCount - 1;
+		c->program->instructions[repeat].target = (uint32_t)end;
+		c->program->instructions[end].target = (uint32_t)repeat;
+		return true;
+	}
+	if (strcmp(command, "for") == 0) {
+		char * in = nextWord(&cursor);
+		if (argument == NULL || in == NULL || strcmp(in, "in") != 0) {
+			return compileError(c, line, "Expected for <name> in <value> ...");
+		}
+		size_t end = findEnd(c, *index);
+		if (end == c->lineCount) {
+			return compileError(c, line, "for without end");
+		}
+		// the loop is unrolled: the body is compiled again for every value
+		for (char * value = nextWord(&cursor); value != NULL; value = nextWord(&cursor)) {
+			size_t body = *index;
+			if (!defineVariable(&c->variables, &c->variableCount, argument, value)) {
+				return compileError(c, line, "Out of memory");
+			}
+			if (!compileBlock(c, &body, true)) {
+				return false;
+			}
+		}
+		*index = end + 1;
+		return true;
+	}
+	return compileError(c, line, "Unknown statement %s", command);
+}
+
+// Compiles statements up to the end of the block (inBlock) or of the scenario, *index ends after the block.
+static bool compileBlock(ScenarioCompiler * c, size_t * index, bool inBlock) {
+	size_t first = *index;
+	while (*index < c->lineCount) {
+		char word[16] = "";
+		sscanf(c->lines[*index], "%15s", word);
+		if (strcmp(word, "end") == 0) {
+			if (!inBlock) {
+				return compileError(c, *index, "end without repeat or for");
+			}
+			(*index)++;
+			return true;
+		}
+		if (!compileStatement(c, index)) {
+			return false;
+		}
+	}
+	return !inBlock || compileError(c, (first > 0) ? first - 1 : 0, "Block without end");
+}
+
+bool scenarioCompile(const char * text, ScenarioProgram * program, char * error, size_t errorSize) {
+	ScenarioCompiler c;
+	memset(&c, 0, sizeof(c));
+	memset(program, 0, sizeof(*program));
+	c.program = program;
+	c.error = error;
+	c.errorSize = errorSize;
+
+	// split the text into lines
+	char * copy = strdup(text);
+	bool ok = copy != NULL;
+	for (char * p = copy; ok && p != NULL; ) {
+		char * next = strchr(p, '\n');
+		if (next != NULL) {
+			*next++ = '\0';
+		}
+		size_t length = strlen(p);
+		if (length > 0 && p[length - 1] == '\r') {
+			p[length - 1] = '\0';
+		}
+		char ** grown = realloc(c.lines, (c.lineCount + 1) * sizeof(char *));
+		ok = grown != NULL;
+		if (ok) {
+			c.lines = grown;
+			c.lines[c.lineCount++] = p;
+		}
+		p = next;
+	}
+	if (!ok) {
+		snprintf(error, errorSize, "Out of memory");
+	}
+	else {
+		size_t index = 0;
+		ok = compileBlock(&c, &index, false);
+	}
+
+	free(c.lines);
+	free(copy);
+	freeVariables(c.variables, c.variableCount);
+	freeVariables(c.cards, c.cardCount);
+	if (!ok) {
+		scenarioFree(program);
+	}
+	return ok;
+}
+
+SspResult scenarioRun(SspDevice * device, const ScenarioProgram * program, ScenarioStatistics * statistics) {
+	const ScenarioInstruction * instructions = program->instructions;
+	uint32_t * runs = calloc(program->instructionCount + 1, sizeof(uint32_t));
+	SspResult result = SspResultOk;
+	memset(statistics, 0, sizeof(*statistics));
+	if (runs == NULL) {
+		return SspResultErrorOutOfMemory;
+	}
+	for (size_t pc = 0; pc < program->instructionCount && result == SspResultOk; pc++) {
+		const ScenarioInstruction * instruction = &instructions[pc];
+		switch (instruction->opcode) {
+		case ScenarioOpFrame:
+			result = sspMethodCallEncoded(device, &program->frames[instruction->argument]);
+			statistics->frames++;
+			break;
+		case ScenarioOpAwaitSwiped:
+			result = sspAwaitSwiped(device, (int)instruction->argument);
+			statistics->swipes += (result == SspResultOk);
+			break;
+		case ScenarioOpDelay:
+			sleepUntilNs(getMonotonicTimeNs() + instruction->argument * 1000ull);
+			break;
+		case ScenarioOpRepeat:
+			runs[pc] = 0;
+			if (instruction->argument == 0) {
+				pc = instruction->target;
+			}
+			break;
+		case ScenarioOpEnd:
+			if (++runs[instruction->target] < instructions[instruction->target].argument) {
+				pc = instruction->target;
+			}
+			break;
+		}
+		if (result != SspResultOk) {
+			statistics->failedLine = instruction->line;
+		}
+	}
+	free(runs);
+	return result;
+}
+
+void scenarioFree(ScenarioProgram * program) {
+	free(program->instructions);
+	free(program->frames);
+	memset(program, 0, sizeof(*program));
+}
+
+// Reads a whole file into a NUL terminated buffer.
+static char * readScenarioFile(const char * filename) {
+	FILE * file = fopen(filename, "rb");
+	if (file == NULL) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Cannot open scenario %s", filename);
+	}
+	size_t length = 0;
+	size_t allocated = 4096;
+	char * text = checkMalloc(malloc(allocated));
+	size_t n;
+	while ((n = fread(text + length, 1, allocated - length - 1, file)) > 0) {
+		length += n;
+		if (length + 1 == allocated) {
+			allocated *= 2;
+			text = checkMalloc(realloc(text, allocated));
+		}
+	}
+	fclose(file);
+	text[length] = '\0';
+	return text;
+}
+
+int runScenario() {
+	char * serial = getCommandLineParameterValue("--serial", "auto");
+	char * filename = getCommandLineParameterValue("--file", "");
+	bool checkOnly = getCommandLineParameterPresent("--check");
+
+	char * text = readScenarioFile(filename);
+	ScenarioProgram program;
+	char error[256];
+	bool compiled = scenarioCompile(text, &program, error, sizeof(error));
+	free(text);
+	if (!compiled) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "%s: %s", filename, error);
+	}
+	size_t frameBytes = 0;
+	for (size_t i = 0; i < program.frameCount; i++) {
+		frameBytes += program.frames[i].frameLength;
+	}
+	IFNOTQUIET(printf("Compiled %s: %zu instructions, %zu frames (%zu bytes)\n", filename, program.instructionCount, program.frameCount, frameBytes));
+	if (checkOnly) {
+		scenarioFree(&program);
+		return 0;
+	}
+
+	selectBackend();
+	connectProbe(serial);
+	ScenarioStatistics statistics;
+	uint64_t start = getMonotonicTimeNs();
+	SspResult result = scenarioRun(probe, &program, &statistics);
+	uint64_t elapsed = getMonotonicTimeNs() - start;
+	IFNOTQUIET(printf("%llu frames sent and %llu swipes seen in %.3f s (%.1f frames/s)\n", (unsigned long long)statistics.frames,
+		(unsigned long long)statistics.swipes, elapsed / 1e9, statistics.frames / (elapsed / 1e9)));
+	scenarioFree(&program);
+	if (result != SspResultOk) {
+		cleanUpAndExit(ExitErrorCommunicationProtocol, "%s, line %u: %s", filename, statistics.failedLine, sspErrorMessage(probe));
+	}
+	return 0;
+}
@@ -0,0 +1,84 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "protocol.h"
+
+// Scenarios: test sequences written in a small line based language, compiled up front into a flat program of encoded
+// frames, so running them costs no parsing or encoding per step. One statement per line, '#' starts a comment:
+//
+//	set <name> <value>					defines a variable, used as $name or ${name} in the lines after it ($$ is a '$')
+//	card <name> <track1>|<track2>|<track3>	defines a card template, its variables are filled in where it is used
+//	reset								resets the track data and configuration of the probe
+//	trigger immediately					sets the trigger mode
+//	track <n> <data>					loads the data of track n, as characters
+//	raw <n> <hex> <hex> ...				loads the symbols of track n, a symbol with bit 7 set has a wrong parity
+//	lrc <n> (<hex> | auto)				sets the LRC of track n, or lets the probe calculate it again
+//	load <card>							loads the three tracks of a card
+//	swipe <card>						loads the three tracks of a card and arms
+//	arm									swipes the loaded tracks
+//	stop								disarms
+//	await [<ms>]						waits for the swiped event (default 5000 ms)
+//	delay <ms>							waits
+//	repeat <n> ... end					runs the lines up to the matching end n times
+//	for <name> in <value> ... end		runs the lines up to the matching end once for every value, as variable name
+
+typedef enum {
+	ScenarioOpFrame,			///< sends frames[argument] as method call
+	ScenarioOpAwaitSwiped,		///< waits up to argument ms for the swiped event
+	ScenarioOpDelay,			///< waits argument microseconds
+	ScenarioOpRepeat,			///< starts a loop of argument runs, target is the index of its ScenarioOpEnd
+	ScenarioOpEnd,				///< ends a loop, target is the index of its ScenarioOpRepeat
+} ScenarioOpcode;
+
+typedef struct {
+	ScenarioOpcode opcode;
+	uint32_t argument;
+	uint32_t target;
+	uint32_t line;				///< line of the statement in the scenario, for error messages
+} ScenarioInstruction;
+
+typedef struct {
+	ScenarioInstruction * instructions;
+	size_t instructionCount;
+	SspEncodedFrame * frames;
+	size_t frameCount;
+} ScenarioProgram;
+
+typedef struct {
+	uint64_t frames;			///< frames sent
+	uint64_t swipes;			///< swiped events received
+	uint32_t failedLine;		///< line of the statement that failed, 0 when the program completed
+} ScenarioStatistics;
+
+// Compiles the scenario text into program. Returns false with a message (including the line) in error when the scenario
+// is invalid.
+bool scenarioCompile(const char * text, ScenarioProgram * program, char * error, size_t errorSize);
+// Runs a compiled program on the probe, stops at the first error.
+SspResult scenarioRun(SspDevice * device, const ScenarioProgram * program, ScenarioStatistics * statistics);
+void scenarioFree(ScenarioProgram * program);
+
+// scenario command: compiles and runs a scenario file.
+int runScenario();
+
+#endif /* not defined SCENARIO_H */
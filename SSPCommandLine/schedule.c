@@ -0,0 +1,281 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "SSPCommandLineTool.h"
+#include "protocol.h"
+#include "loadprofile.h"
+#include "metrics.h"
+#include "schedule.h"
+#include "util.h"
+
+// Time between the start and the first deadline, enough to load the first card
+#define SCHEDULE_LEAD_NS 100000000ull
+
+typedef struct {
+	uint64_t targetNs;			///< deadline, relative to the start
+	uint64_t armedNs;			///< time the go was sent, relative to the start
+	SspResult result;
+	size_t probeIndex;			///< probe that swiped the card
+} ScheduledSwipe;
+
+// The schedule shared by the probe threads. Every probe takes the next swipe as soon as it is done with its previous
+// one, so a slow probe only makes its own swipe late.
+typedef struct {
+	const uint64_t * times;
+	size_t count;
+	size_t next;				///< next swipe to take, taken with an atomic increment
+	const SspCard * cards;
+	size_t cardCount;
+	ScheduledSwipe * swipes;
+	uint64_t start;
+	bool awaitSwiped;
+} Schedule;
+
+typedef struct {
+	Schedule * schedule;
+	SspDevice * device;
+	size_t index;
+	pthread_t thread;
+	Histogram * lateness;		///< lateness of the gos of this probe, merged after the threads are done
+} ScheduleProbe;
+
+// Reads a file with one time in milliseconds (fractions allowed) per line into nanoseconds. With ascending, the times
+// should not decrease.
+static size_t readMilliseconds(const char * filename, bool ascending, uint64_t ** times) {
+	FILE * file = fopen(filename, "r");
+	if (file == NULL) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Cannot open times file %s", filename);
+	}
+	size_t count = 0;
+	size_t allocated = 0;
+	*times = NULL;
+	char line[128];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char * end;
+		double ms = strtod(line, &end);
+		if (end == line) {
+			// empty line or comment
+			continue;
+		}
+		if (ms < 0 || (ascending && count > 0 && (uint64_t)(ms * 1e6) < (*times)[count - 1])) {
+			fclose(file);
+			cleanUpAndExit(ExitErrorCommandLineParameter, "Times in %s should be %snot negative: %s", filename, ascending ? "ascending and " : "", line);
+		}
+		if (count == allocated) {
+			allocated = (allocated == 0) ? 256 : allocated * 2;
+			*times = checkMalloc(realloc(*times, allocated * sizeof(uint64_t)));
+		}
+		(*times)[count++] = (uint64_t)(ms * 1e6);
+	}
+	fclose(file);
+	return count;
+}
+
+// Builds the load profile from --profile and its options. --interval=<ms> is a constant profile.
+static void readLoadProfile(LoadProfile * profile, size_t cardCount) {
+	char * name = getCommandLineParameterValue("--profile", "constant");
+	double intervalMs = atof(getCommandLineParameterValue("--interval", "0"));
+	memset(profile, 0, sizeof(*profile));
+	if (!loadProfileKindFromName(name, &profile->kind)) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Unknown --profile=%s, should be constant, poisson, bursts, ramp or trace", name);
+	}
+	profile->rate = (intervalMs > 0) ? 1000.0 / intervalMs : atof(getCommandLineParameterValue("--rate", "0"));
+	profile->endRate = atof(getCommandLineParameterValue("--end-rate", "0"));
+	profile->onSeconds = atof(getCommandLineParameterValue("--on", "0"));
+	profile->offSeconds = atof(getCommandLineParameterValue("--off", "0"));
+	profile->randomArrivals = getCommandLineParameterPresent("--poisson");
+	profile->durationSeconds = atof(getCommandLineParameterValue("--duration", "0"));
+	profile->count = (size_t)atoi(getCommandLineParameterValue("--count", "0"));
+	profile->seed = strtoull(getCommandLineParameterValue("--seed", "1"), NULL, 0);
+	if (profile->kind == LoadProfileTrace) {
+		char * traceFilename = getCommandLineParameterValue("--trace", NULL);
+		if (traceFilename == NULL) {
+			cleanUpAndExit(ExitErrorCommandLineParameter, "The trace profile needs --trace=<file>");
+		}
+		uint64_t * trace;
+		profile->traceLength = readMilliseconds(traceFilename, false, &trace);
+		profile->trace = trace;
+	}
+	else if (profile->count == 0 && profile->durationSeconds <= 0) {
+		// by default every card of the deck is swiped once
+		profile->count = cardCount;
+	}
+	const char * error = loadProfileCheck(profile);
+	if (error != NULL) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "%s", error);
+	}
+}
+
+// Swipes the cards of the schedule on one probe: takes the next swipe, loads its card and sends the go at its deadline.
+static void * runScheduleProbe(void * argument) {
+	ScheduleProbe * p = argument;
+	Schedule * schedule = p->schedule;
+	for (;;) {
+		size_t i = __atomic_fetch_add(&schedule->next, 1, __ATOMIC_RELAXED);
+		if (i >= schedule->count) {
+			virtualClockRemoveThread();
+			return NULL;
+		}
+		// load the card ahead of its deadline, only the go is sent at the deadline
+		const SspCard * card = &schedule->cards[i % schedule->cardCount];
+		SspResult result = SspResultOk;
+		for (int t = 0; t < 3 && result == SspResultOk; t++) {
+			result = sspSetTrackDataString(p->device, t + 1, card->track[t], card->length[t]);
+		}
+		uint64_t armedNs = getMonotonicTimeNs();
+		if (result == SspResultOk) {
+			result = sspSendGoAt(p->device, schedule->start + schedule->times[i], &armedNs);
+		}
+		if (result == SspResultOk && schedule->awaitSwiped) {
+			result = sspAwaitSwiped(p->device, 5000);
+		}
+		schedule->swipes[i].targetNs = schedule->times[i];
+		schedule->swipes[i].armedNs = armedNs - schedule->start;
+		schedule->swipes[i].result = result;
+		schedule->swipes[i].probeIndex = p->index;
+		if (result == SspResultOk) {
+			// sspSendGoAt never sends before the deadline
+			histogramRecord(p->lateness, schedule->swipes[i].armedNs - schedule->swipes[i].targetNs);
+		}
+	}
+}
+
+int scheduleSwipes() {
+	char * serial = getCommandLineParameterValue("--serial", "auto");
+	char * filename = getCommandLineParameterValue("--file", "");
+	char * timesFilename = getCommandLineParameterValue("--times", NULL);
+	char * logFilename = getCommandLineParameterValue("--log", NULL);
+
+	Schedule schedule;
+	memset(&schedule, 0, sizeof(schedule));
+	schedule.awaitSwiped = getCommandLineParameterPresent("--await-swiped");
+	SspCard * cards;
+	char * buffer;
+	schedule.cardCount = readDeck(filename, &cards, &buffer);
+	schedule.cards = cards;
+	if (schedule.cardCount == 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Deck %s contains no cards", filename);
+	}
+
+	// deadlines relative to the first one, all known before the first swipe
+	uint64_t * times = NULL;
+	LoadProfile profile = { 0 };
+	if (timesFilename != NULL) {
+		schedule.count = readMilliseconds(timesFilename, true, &times);
+	}
+	else {
+		readLoadProfile(&profile, schedule.cardCount);
+		schedule.count = loadProfileGenerate(&profile, &times);
+		checkMalloc(times);
+	}
+	if (schedule.count == 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "The schedule contains no swipes");
+	}
+	schedule.times = times;
+	schedule.swipes = checkMalloc(calloc(schedule.count + 1, sizeof(ScheduledSwipe)));
+
+	selectBackend();
+	SspDevice ** devices;
+	size_t probeCount = connectProbes(serial, &devices);
+	ScheduleProbe * probes = checkMalloc(calloc(probeCount, sizeof(ScheduleProbe)));
+	for (size_t i = 0; i < probeCount; i++) {
+		checkResult(sspResetToDefaultConfiguration(devices[i]));
+		checkResult(sspSetTriggerMode(devices[i], SspTriggerModeImmediately));
+		probes[i] = (ScheduleProbe) { &schedule, devices[i], i };
+		probes[i].lateness = checkMalloc(malloc(sizeof(Histogram)));
+		histogramInit(probes[i].lateness);
+	}
+
+	IFNOTQUIET(printf("Scheduling %zu swipes over %.3f s on %zu probe(s), cards from %s\n", schedule.count, times[schedule.count - 1] / 1e9, probeCount, filename));
+	schedule.start = getMonotonicTimeNs() + SCHEDULE_LEAD_NS;
+	for (size_t i = 0; i < probeCount; i++) {
+		virtualClockAddThread();
+		if (pthread_create(&probes[i].thread, NULL, runScheduleProbe, &probes[i]) != 0) {
+			cleanUpAndExit(ExitErrorHidApi, "Cannot start the thread for probe %zu", i);
+		}
+	}
+	// the main thread does not take part in the virtual clock while it waits for the probe threads
+	virtualClockRemoveThread();
+	for (size_t i = 0; i < probeCount; i++) {
+		pthread_join(probes[i].thread, NULL);
+	}
+	virtualClockAddThread();
+
+	ScheduledSwipe * swipes = schedule.swipes;
+	size_t count = schedule.count;
+	size_t failed = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (swipes[i].result != SspResultOk) {
+			failed++;
+			printf("Swipe %zu (probe %zu): %s\n", i + 1, swipes[i].probeIndex, sspResultString(swipes[i].result));
+		}
+	}
+
+	if (logFilename != NULL) {
+		FILE * log = fopen(logFilename, "w");
+		if (log == NULL) {
+			cleanUpAndExit(ExitErrorCommandLineParameter, "Cannot write log file %s", logFilename);
+		}
+		fprintf(log, "swipe,probe,target_ms,armed_ms,lateness_us,result\n");
+		for (size_t i = 0; i < count; i++) {
+			fprintf(log, "%zu,%zu,%.3f,%.3f,%.1f,%s\n", i + 1, swipes[i].probeIndex, swipes[i].targetNs / 1e6, swipes[i].armedNs / 1e6,
+				((int64_t)swipes[i].armedNs - (int64_t)swipes[i].targetNs) / 1e3, sspResultString(swipes[i].result));
+		}
+		fclose(log);
+	}
+
+	// lateness of every go, and how far the time between two gos is off the scheduled time between them
+	Histogram * lateness = checkMalloc(malloc(sizeof(Histogram)));
+	Histogram * intervalError = checkMalloc(malloc(sizeof(Histogram)));
+	histogramInit(lateness);
+	histogramInit(intervalError);
+	for (size_t i = 0; i < probeCount; i++) {
+		histogramMerge(lateness, probes[i].lateness);
+		free(probes[i].lateness);
+	}
+	for (size_t i = 1; i < count; i++) {
+		if (swipes[i].result == SspResultOk && swipes[i - 1].result == SspResultOk) {
+			int64_t error = ((int64_t)swipes[i].armedNs - (int64_t)swipes[i - 1].armedNs) - ((int64_t)swipes[i].targetNs - (int64_t)swipes[i - 1].targetNs);
+			histogramRecord(intervalError, (uint64_t)((error < 0) ? -error : error));
+		}
+	}
+	printf("%zu of %zu swipes done\n", count - failed, count);
+	histogramPrint(stdout, "lateness", lateness);
+	histogramPrint(stdout, "interval error", intervalError);
+	metricsSaveHistogram("schedule/lateness", lateness);
+	metricsSaveHistogram("schedule/interval-error", intervalError);
+
+	free(lateness);
+	free(intervalError);
+	free(probes);
+	free(swipes);
+	free(times);
+	free((void *)profile.trace);
+	free(cards);
+	free(buffer);
+	if (failed > 0) {
+		cleanUpAndExit(ExitErrorCommunicationProtocol, "%zu swipe(s) failed", failed);
+	}
+	return 0;
+}
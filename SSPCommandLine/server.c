@@ -0,0 +1,415 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "hidapi/hidapi.h"
+#include "hidbackend.h"
+#include "SSPCommandLineTool.h"
+#include "protocol.h"
+#include "server.h"
+#include "shmring.h"
+#include "probelock.h"
+#include "probehealth.h"
+#include "simprobe.h"
+#include "util.h"
+
+// Requests taken from the ring at once. Requests for the same probe are swiped as one pipelined batch.
+#define SERVER_BATCH_SIZE 64
+// Probes a routed request is tried on before its error is reported
+#define SERVER_MAX_ATTEMPTS 3
+
+// A request being served. Routed requests (submitted for any probe) that fail are routed again to another probe.
+typedef struct {
+	SspShmRequest request;
+	bool routed;
+	unsigned attempts;
+	bool done;
+} ServerRequest;
+
+static SspDevice ** servedProbes = NULL;
+static ProbeHealth * servedProbeHealth = NULL;
+static uint64_t * servedProbeLastUsedNs = NULL;		///< time of the last command sent to each probe, for --keep-alive
+static size_t servedProbeCount = 0;
+static ProbeHealthThresholds healthThresholds = PROBEHEALTH_THRESHOLDS_DEFAULT;
+static SspShm * serverShm = NULL;
+static volatile sig_atomic_t stopServer = 0;
+
+static void handleStopSignal(int signal) {
+	stopServer = 1;
+}
+
+void serverCleanUp() {
+	for (size_t i = 0; i < servedProbeCount; i++) {
+		sspClose(servedProbes[i]);
+	}
+	free(servedProbes);
+	free(servedProbeHealth);
+	free(servedProbeLastUsedNs);
+	servedProbes = NULL;
+	servedProbeHealth = NULL;
+	servedProbeLastUsedNs = NULL;
+	servedProbeCount = 0;
+	sspShmDestroy(serverShm);
+	serverShm = NULL;
+}
+
+// Adds an opened probe to the served probes.
+static void addServedProbe(SspDevice * device, const char * serial) {
+	servedProbes = checkMalloc(realloc(servedProbes, (servedProbeCount + 1) * sizeof(SspDevice *)));
+	servedProbes[servedProbeCount] = device;
+	servedProbeHealth = checkMalloc(realloc(servedProbeHealth, (servedProbeCount + 1) * sizeof(ProbeHealth)));
+	probeHealthInit(&servedProbeHealth[servedProbeCount]);
+	servedProbeLastUsedNs = checkMalloc(realloc(servedProbeLastUsedNs, (servedProbeCount + 1) * sizeof(uint64_t)));
+	servedProbeLastUsedNs[servedProbeCount] = getMonotonicTimeNs();
+	IFNOTQUIET(printf("Probe %zu: %s\n", servedProbeCount, serial));
+	servedProbeCount++;
+	applyDeviceOptions(device);
+	checkResult(sspResetToDefaultConfiguration(device));
+}
+
+// Opens the probes given with --serial (comma separated), or all connected probes.
+static void openServedProbes() {
+	char * serials = getCommandLineParameterValue("--serial", "");
+	SspDevice * device;
+	if (strlen(serials) > 0) {
+		char * list = strdup(serials);
+		for (char * serial = strtok(list, ","); serial != NULL; serial = strtok(NULL, ",")) {
+			if (!simulationActive() && lockProbe(serial, 0) != ProbeLockOk) {
+				free(list);
+				cleanUpAndExit(ExitErrorHidOpen, "Probe %s is in use by another process", serial);
+			}
+			SspResult result = sspOpen(serial, &device);
+			if (result != SspResultOk) {
+				free(list);
+				cleanUpAndExit(ExitErrorHidOpen, "Error opening HID device (using serial %s)", serial);
+			}
+			addServedProbe(device, serial);
+		}
+		free(list);
+		return;
+	}
+
+	struct hid_device_info * devs = hidBackend->enumerate(SSP_VID, SSP_PID);
+	for (struct hid_device_info * dev = devs; dev != NULL; dev = dev->next) {
+		char serial[128];
+		snprintf(serial, sizeof(serial), "%ls", dev->serial_number);
+		if (!simulationActive() && lockProbe(serial[0] != '\0' ? serial : dev->path, 0) != ProbeLockOk) {
+			fprintf(stderr, "Skipping probe %s: in use by another process\n", serial);
+			continue;
+		}
+		SspResult result = sspOpenPath(dev->path, &device);
+		if (result != SspResultOk) {
+			fprintf(stderr, "Skipping probe %s: %s\n", serial, sspResultString(result));
+			continue;
+		}
+		addServedProbe(device, serial);
+	}
+	hidBackend->free_enumeration(devs);
+	if (servedProbeCount == 0) {
+		cleanUpAndExit(ExitErrorHidOpen, "No probes found");
+	}
+}
+
+// Swipes the requests for one probe as a batch and posts the results. A batch with routed requests stops at the first
+// error, so the cards after it can be routed to another probe instead of waiting for this one to time out again. The cards
+// pinned to this probe that were not tried stay queued for it.
+static void serveBatch(uint32_t probeIndex, ServerRequest * requests, size_t count, const SspBatchOptions * options) {
+	SspCard cards[SERVER_BATCH_SIZE];
+	SspSwipeResult results[SERVER_BATCH_SIZE];
+	size_t indices[SERVER_BATCH_SIZE];
+	size_t n = 0;
+	SspBatchOptions batchOptions = *options;
+	for (size_t i = 0; i < count; i++) {
+		if (requests[i].done || requests[i].request.probeIndex != probeIndex) {
+			continue;
+		}
+		for (int t = 0; t < 3; t++) {
+			cards[n].track[t] = requests[i].request.track[t];
+			cards[n].length[t] = requests[i].request.length[t];
+		}
+		batchOptions.stopOnError = batchOptions.stopOnError || requests[i].routed;
+		indices[n++] = i;
+	}
+	if (n == 0) {
+		return;
+	}
+	uint64_t previousNs = getMonotonicTimeNs();
+	sspSwipeMany(servedProbes[probeIndex], cards, n, results, &batchOptions);
+	uint64_t now = getMonotonicTimeNs();
+	servedProbeLastUsedNs[probeIndex] = now;
+	for (size_t i = 0; i < n; i++) {
+		ServerRequest * request = &requests[indices[i]];
+		// cards after a stop were not tried: they are left for the next round, without an attempt or a health record
+		if (results[i].result == SspResultPending || results[i].result == SspResultErrorCancelled) {
+			if (request->routed) {
+				request->request.probeIndex = SSP_SHM_ANY_PROBE;
+			}
+			continue;
+		}
+		// the latency of a card is the time since the previous card completed, cards that failed have no completion time
+		uint64_t completedNs = (results[i].completedNs >= previousNs) ? results[i].completedNs : now;
+		probeHealthRecord(&servedProbeHealth[probeIndex], results[i].result, completedNs - previousNs);
+		previousNs = completedNs;
+		if (results[i].result != SspResultOk && request->routed && ++request->attempts < SERVER_MAX_ATTEMPTS) {
+			request->request.probeIndex = SSP_SHM_ANY_PROBE;
+			continue;
+		}
+		// the client times the swipe on its own clock, which is not the virtual one of the simulation mode
+		sspShmComplete(serverShm, &request->request, results[i].result,
+			virtualClockActive() ? getRealMonotonicTimeNs() : results[i].completedNs);
+		request->done = true;
+	}
+	ProbeHealth * health = &servedProbeHealth[probeIndex];
+	if (probeHealthEvaluate(health, &healthThresholds, now)) {
+		printf("Probe %u quarantined: %u%% errors, 95th percentile latency %.1f ms\n", probeIndex,
+			probeHealthErrorPercent(health), probeHealthPercentile(health, 95) / 1e6);
+	}
+}
+
+// Checks the quarantined probes that are due with a software version command, and reinstates the ones that recovered.
+static void checkQuarantinedProbes() {
+	for (uint32_t p = 0; p < servedProbeCount; p++) {
+		ProbeHealth * health = &servedProbeHealth[p];
+		if (!probeHealthCheckDue(health, getMonotonicTimeNs())) {
+			continue;
+		}
+		SspFirmwareVersion version;
+		uint64_t start = getMonotonicTimeNs();
+		SspResult result = sspGetFirmwareVersion(servedProbes[p], &version);
+		uint64_t now = getMonotonicTimeNs();
+		servedProbeLastUsedNs[p] = now;
+		if (probeHealthCheckDone(health, &healthThresholds, result, now - start, now)) {
+			printf("Probe %u reinstated\n", p);
+		}
+	}
+}
+
+// Sends a software version command to the healthy probes that were idle for intervalNs, so they are not suspended.
+static void keepProbesAlive(uint64_t intervalNs) {
+	for (uint32_t p = 0; p < servedProbeCount; p++) {
+		if (servedProbeHealth[p].quarantined || getMonotonicTimeNs() - servedProbeLastUsedNs[p] < intervalNs) {
+			continue;
+		}
+		SspFirmwareVersion version;
+		sspGetFirmwareVersion(servedProbes[p], &version);
+		servedProbeLastUsedNs[p] = getMonotonicTimeNs();
+	}
+}
+
+// Assigns the requests for any probe to the healthy probes, spreading them evenly over the batch. When every probe is
+// quarantined they are spread over all probes, so the work slows down instead of failing.
+static void routeRequests(ServerRequest * requests, size_t count) {
+	size_t assigned[servedProbeCount];
+	bool anyHealthy = false;
+	for (size_t p = 0; p < servedProbeCount; p++) {
+		assigned[p] = 0;
+		anyHealthy = anyHealthy || !servedProbeHealth[p].quarantined;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (requests[i].request.probeIndex < servedProbeCount) {
+			assigned[requests[i].request.probeIndex]++;
+		}
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (requests[i].request.probeIndex != SSP_SHM_ANY_PROBE) {
+			continue;
+		}
+		size_t best = servedProbeCount;
+		for (size_t p = 0; p < servedProbeCount; p++) {
+			if ((!anyHealthy || !servedProbeHealth[p].quarantined) && (best == servedProbeCount || assigned[p] < assigned[best])) {
+				best = p;
+			}
+		}
+		requests[i].request.probeIndex = (uint32_t)best;
+		assigned[best]++;
+	}
+}
+
+// Prints the health statistics of every probe.
+static void printProbeHealth() {
+	for (size_t p = 0; p < servedProbeCount; p++) {
+		ProbeHealth * health = &servedProbeHealth[p];
+		printf("Probe %zu: %llu operations, %llu errors (%llu CRC, %llu timeouts), %llu quarantines%s, recent latency p50 %.2f ms p95 %.2f ms p99 %.2f ms\n",
+			p, (unsigned long long)health->operations, (unsigned long long)health->errors, (unsigned long long)health->crcErrors,
+			(unsigned long long)health->timeouts, (unsigned long long)health->quarantines, health->quarantined ? " (quarantined)" : "",
+			probeHealthPercentile(health, 50) / 1e6, probeHealthPercentile(health, 95) / 1e6, probeHealthPercentile(health, 99) / 1e6);
+	}
+}
+
+int serveProbes() {
+	char * name = getCommandLineParameterValue("--shm", "ssp");
+	SspBatchOptions options = SSP_BATCH_OPTIONS_DEFAULT;
+	options.window = atoi(getCommandLineParameterValue("--window", "4"));
+	options.awaitSwiped = getCommandLineParameterPresent("--await-swiped");
+	if (options.window == 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --window, should be a positive number");
+	}
+	healthThresholds.maxErrorPercent = atoi(getCommandLineParameterValue("--max-error-rate", "20"));
+	healthThresholds.maxLatencyNs = (uint64_t)atoi(getCommandLineParameterValue("--max-latency", "1000")) * 1000000ull;
+	healthThresholds.checkIntervalNs = (uint64_t)atoi(getCommandLineParameterValue("--check-interval", "5")) * 1000000000ull;
+	if (healthThresholds.maxLatencyNs == 0 || healthThresholds.checkIntervalNs == 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --max-latency or --check-interval, should be a positive number");
+	}
+	uint64_t keepAliveNs = (uint64_t)atoi(getCommandLineParameterValue("--keep-alive", "0")) * 1000000ull;
+
+	selectBackend();
+	openServedProbes();
+	if (!sspShmCreate(name, (uint32_t)servedProbeCount, &serverShm)) {
+		cleanUpAndExit(ExitErrorHidApi, "Cannot create shared memory segment %s: %s", name, strerror(errno));
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handleStopSignal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	IFNOTQUIET(printf("Serving %zu probe(s) on shared memory segment %s\n", servedProbeCount, name));
+	ServerRequest requests[SERVER_BATCH_SIZE];
+	SspShmRequest received[SERVER_BATCH_SIZE];
+	size_t count = 0;
+	while (!stopServer) {
+		checkQuarantinedProbes();
+		// requests that are still open from the previous round come first
+		size_t n = sspShmReceive(serverShm, received, SERVER_BATCH_SIZE - count);
+		for (size_t i = 0; i < n; i++) {
+			requests[count].request = received[i];
+			requests[count].routed = (received[i].probeIndex == SSP_SHM_ANY_PROBE);
+			requests[count].attempts = 0;
+			requests[count].done = false;
+			count++;
+		}
+		if (count == 0) {
+			if (keepAliveNs > 0) {
+				keepProbesAlive(keepAliveNs);
+			}
+			sspShmWaitForRequests(serverShm, 100);
+			continue;
+		}
+		routeRequests(requests, count);
+		for (size_t i = 0; i < count; i++) {
+			if (requests[i].request.probeIndex >= servedProbeCount) {
+				sspShmComplete(serverShm, &requests[i].request, SspResultErrorHidOpen, getRealMonotonicTimeNs());
+				requests[i].done = true;
+			}
+		}
+		for (uint32_t p = 0; p < servedProbeCount; p++) {
+			serveBatch(p, requests, count, &options);
+		}
+		size_t open = 0;
+		for (size_t i = 0; i < count; i++) {
+			if (!requests[i].done) {
+				requests[open++] = requests[i];
+			}
+		}
+		count = open;
+	}
+	IFNOTQUIET(printProbeHealth());
+	IFNOTQUIET(printf("Server stopped\n"));
+	serverCleanUp();
+	return 0;
+}
+
+int submitDeck() {
+	char * name = getCommandLineParameterValue("--shm", "ssp");
+	char * filename = getCommandLineParameterValue("--file", "");
+	char * probe = getCommandLineParameterValue("--probe", "0");
+	uint32_t probeIndex = (strcmp(probe, "any") == 0) ? SSP_SHM_ANY_PROBE : (uint32_t)atoi(probe);
+
+	SspCard * cards;
+	char * buffer;
+	size_t count = readDeck(filename, &cards, &buffer);
+
+	SspShm * shm;
+	if (!sspShmAttach(name, &shm)) {
+		free(cards);
+		free(buffer);
+		cleanUpAndExit(ExitErrorHidOpen, "Cannot attach to shared memory segment %s: %s", name, strerror(errno));
+	}
+
+	uint64_t * submitNs = checkMalloc(malloc((count + 1) * sizeof(uint64_t)));
+	SspShmCompletion completions[SSP_SHM_COMPLETION_SLOTS];
+	size_t submitted = 0;
+	size_t completed = 0;
+	size_t swiped = 0;
+	uint64_t firstRequestId = 0;
+	uint64_t totalLatencyNs = 0;
+	uint64_t firstLatencyNs = 0;
+	uint64_t start = getMonotonicTimeNs();
+	while (completed < count) {
+		while (submitted < count) {
+			uint64_t requestId;
+			submitNs[submitted] = getMonotonicTimeNs();
+			if (!sspShmSubmit(shm, probeIndex, &cards[submitted], &requestId)) {
+				// ring full: collect results first
+				if (errno == EAGAIN) {
+					break;
+				}
+				sspShmDetach(shm);
+				cleanUpAndExit(ExitErrorCommandLineParameter, "Card %zu: %s", submitted + 1, strerror(errno));
+			}
+			if (submitted == 0) {
+				firstRequestId = requestId;
+			}
+			submitted++;
+		}
+		size_t n = sspShmWait(shm, completions, ARRAY_SIZE(completions), 10000);
+		if (n == 0) {
+			printf("Timeout waiting for the server\n");
+			break;
+		}
+		for (size_t i = 0; i < n; i++) {
+			size_t card = (size_t)(completions[i].requestId - firstRequestId);
+			if (completions[i].result == SspResultOk) {
+				swiped++;
+				totalLatencyNs += completions[i].completedNs - submitNs[card];
+				if (card == 0) {
+					firstLatencyNs = completions[i].completedNs - submitNs[card];
+				}
+			}
+			else {
+				printf("Card %zu: %s\n", card + 1, sspResultString((SspResult)completions[i].result));
+			}
+		}
+		completed += n;
+	}
+	uint64_t elapsed = getMonotonicTimeNs() - start;
+	IFNOTQUIET(printf("%zu of %zu cards swiped in %.3f s (%.1f cards/s), average latency %.3f ms\n", swiped, count,
+		elapsed / 1e9, swiped / (elapsed / 1e9), swiped > 0 ? totalLatencyNs / 1e6 / swiped : 0.0));
+	// the first card may include waking up the probe
+	if (swiped > 1 && firstLatencyNs > 0) {
+		IFNOTQUIET(printf("First card latency %.3f ms, average of the others %.3f ms\n", firstLatencyNs / 1e6, (totalLatencyNs - firstLatencyNs) / 1e6 / (swiped - 1)));
+	}
+
+	sspShmDetach(shm);
+	free(submitNs);
+	free(cards);
+	free(buffer);
+	if (swiped != count) {
+		cleanUpAndExit(ExitErrorCommunicationProtocol, "%zu card(s) failed", count - swiped);
+	}
+	return 0;
+}
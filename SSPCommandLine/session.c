@@ -0,0 +1,324 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "SSPCommandLineTool.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "session.h"
+#include "util.h"
+
+// Size of the write buffer of the log
+#define SESSION_BUFFER_SIZE (1 << 16)
+
+typedef struct {
+	uint64_t timeNs;			///< time since the first command of the log
+	uint8_t probe;
+	SspCommandTag tag;
+	uint16_t length;
+	const uint8_t * data;		///< points into the log
+} SessionCommand;
+
+// Commands sent ahead of their responses to one probe, with --window
+typedef struct {
+	size_t * commands;			///< indices of the commands in flight, oldest first
+	size_t count;
+} SessionInFlight;
+
+static FILE * sessionLog = NULL;
+static pthread_mutex_t sessionLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t sessionLastNs = 0;
+static unsigned sessionProbeCount = 0;
+
+static void writeVarint(FILE * file, uint64_t value) {
+	while (value >= 0x80) {
+		fputc((int)(value & 0x7f) | 0x80, file);
+		value >>= 7;
+	}
+	fputc((int)value, file);
+}
+
+// Reads a varint at *position, returns false when the log ends in the middle of it.
+static bool readVarint(const uint8_t * log, size_t length, size_t * position, uint64_t * value) {
+	*value = 0;
+	for (unsigned shift = 0; *position < length && shift < 64; shift += 7) {
+		uint8_t byte = log[(*position)++];
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Command observer of a recorded probe; probes used from several threads share the log.
+static void recordCommand(void * context, SspCommandTag tag, const uint8_t * data, size_t length) {
+	uint64_t now = getMonotonicTimeNs();
+	pthread_mutex_lock(&sessionLock);
+	if (sessionLog != NULL) {
+		writeVarint(sessionLog, now - sessionLastNs);
+		fputc((int)(uintptr_t)context, sessionLog);
+		fputc(tag, sessionLog);
+		writeVarint(sessionLog, length);
+		fwrite(data, 1, length, sessionLog);
+		sessionLastNs = now;
+	}
+	pthread_mutex_unlock(&sessionLock);
+}
+
+bool sessionRecordStart(const char * filename) {
+	sessionLog = fopen(filename, "wb");
+	if (sessionLog == NULL) {
+		return false;
+	}
+	setvbuf(sessionLog, NULL, _IOFBF, SESSION_BUFFER_SIZE);
+	fwrite(SESSION_MAGIC, 1, 8, sessionLog);
+	sessionLastNs = getMonotonicTimeNs();
+	return true;
+}
+
+void sessionRecordProbe(SspDevice * device) {
+	sspSetCommandObserver(device, recordCommand, (void *)(uintptr_t)sessionProbeCount++);
+}
+
+void sessionRecordStop() {
+	pthread_mutex_lock(&sessionLock);
+	if (sessionLog != NULL) {
+		fclose(sessionLog);
+		sessionLog = NULL;
+	}
+	pthread_mutex_unlock(&sessionLock);
+}
+
+// Reads a log into memory and parses its commands.
+static size_t readSession(const char * filename, uint8_t ** log, SessionCommand ** commands) {
+	FILE * file = fopen(filename, "rb");
+	if (file == NULL) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Cannot open session log %s", filename);
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	*log = checkMalloc(malloc(size > 0 ? (size_t)size : 1));
+	size_t length = fread(*log, 1, size > 0 ? (size_t)size : 0, file);
+	fclose(file);
+	if (length < 8 || memcmp(*log, SESSION_MAGIC, 8) != 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "%s is not a session log", filename);
+	}
+
+	size_t count = 0;
+	size_t allocated = 0;
+	*commands = NULL;
+	uint64_t time = 0;
+	size_t position = 8;
+	while (position < length) {
+		uint64_t delta;
+		uint64_t dataLength;
+		if (!readVarint(*log, length, &position, &delta) || position + 2 > length) {
+			break;
+		}
+		uint8_t probeNumber = (*log)[position++];
+		uint8_t tag = (*log)[position++];
+		if (!readVarint(*log, length, &position, &dataLength) || dataLength > SSP_MAX_TRACK_LENGTH || position + dataLength > length) {
+			break;
+		}
+		if (count == allocated) {
+			allocated = (allocated == 0) ? 4096 : allocated * 2;
+			*commands = checkMalloc(realloc(*commands, allocated * sizeof(SessionCommand)));
+		}
+		// the first command is at time 0
+		time = (count == 0) ? 0 : time + delta;
+		(*commands)[count++] = (SessionCommand) { time, probeNumber, (SspCommandTag)tag, (uint16_t)dataLength, *log + position };
+		position += dataLength;
+	}
+	if (position < length) {
+		fprintf(stderr, "Warning: %s ends with an incomplete command, replaying the %zu complete ones\n", filename, count);
+	}
+	return count;
+}
+
+// Sends the configuration the probe had before command first: the last reset, track data, track configuration and
+// trigger mode sent to it before, so a range from the middle of a session starts from the same state.
+static SspResult primeProbe(SspDevice * device, const SessionCommand * commands, size_t first, uint8_t probeNumber) {
+	const SessionCommand * last[256] = { NULL };
+	for (size_t i = 0; i < first; i++) {
+		if (commands[i].probe != probeNumber) {
+			continue;
+		}
+		if (commands[i].tag == SspCommandDefaultConfiguration) {
+			memset(last, 0, sizeof(last));
+		}
+		last[commands[i].tag] = &commands[i];
+	}
+	SspResult result = sspResetToDefaultConfiguration(device);
+	for (int tag = 0; tag < 256 && result == SspResultOk; tag++) {
+		bool configuration = (tag >= SspCommandData1 && tag <= SspCommandData3) || (tag >= SspCommandConfig1 && tag <= SspCommandConfig3) || tag == SspCommandTriggerMode;
+		if (configuration && last[tag] != NULL) {
+			result = sspMethodCall(device, (SspCommandTag)tag, last[tag]->data, last[tag]->length);
+		}
+	}
+	return result;
+}
+
+// Waits for the next response of a probe with commands in flight and matches it to the oldest one. Swiped events are
+// counted and skipped. Returns false when the oldest command failed.
+static bool collectResponse(SspDevice * device, SessionInFlight * inFlight, const SessionCommand * commands, size_t * swipes) {
+	SspResponse response;
+	SspResult result = sspWaitResponse(device, SSP_RESPONSE_TIMEOUT_MS, &response);
+	if (result == SspResultOk && response.tag == SspEventSwiped) {
+		(*swipes)++;
+		return true;
+	}
+	size_t index = inFlight->commands[0];
+	memmove(inFlight->commands, inFlight->commands + 1, --inFlight->count * sizeof(size_t));
+	if (result == SspResultOk) {
+		result = (commands[index].tag == SspCommandSoftwareVersion) ? sspCheckFunctionResponse(device, SspCommandSoftwareVersion, &response, NULL, 0)
+			: sspCheckMethodResponse(device, &response);
+	}
+	if (result != SspResultOk) {
+		printf("Command %zu (tag 0x%02x, %u bytes, probe %u): %s\n", index + 1, commands[index].tag, commands[index].length, commands[index].probe, sspErrorMessage(device));
+		return false;
+	}
+	return true;
+}
+
+int replaySession() {
+	char * serial = getCommandLineParameterValue("--serial", "auto");
+	char * filename = getCommandLineParameterValue("--file", "");
+	bool fast = getCommandLineParameterPresent("--fast");
+	double speed = atof(getCommandLineParameterValue("--speed", "1"));
+	size_t from = (size_t)atol(getCommandLineParameterValue("--from", "1"));
+	size_t to = (size_t)atol(getCommandLineParameterValue("--to", "0"));
+	size_t window = (size_t)atol(getCommandLineParameterValue("--window", "1"));
+	if (speed <= 0 || from == 0 || window == 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --speed, --from or --window, should be positive numbers");
+	}
+
+	uint8_t * log;
+	SessionCommand * commands;
+	size_t count = readSession(filename, &log, &commands);
+	if (to == 0 || to > count) {
+		to = count;
+	}
+	if (from > to) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "%s has %zu commands, nothing to replay from command %zu", filename, count, from);
+	}
+
+	selectBackend();
+	SspDevice ** devices;
+	size_t probeCount = connectProbes(serial, &devices);
+	// probes of the session are mapped onto the probes given, in turn
+	for (size_t p = 0; p < probeCount; p++) {
+		checkResult(sspResetToDefaultConfiguration(devices[p]));
+	}
+	if (from > 1) {
+		for (size_t p = 0; p < 256; p++) {
+			bool used = false;
+			for (size_t i = 0; i < from - 1 && !used; i++) {
+				used = commands[i].probe == p;
+			}
+			if (used) {
+				checkResult(primeProbe(devices[p % probeCount], commands, from - 1, (uint8_t)p));
+			}
+		}
+	}
+
+	IFNOTQUIET(printf("Replaying commands %zu to %zu of %s %s (window %zu)\n", from, to, filename, fast ? "as fast as possible" : "at the recorded timing", window));
+	SessionInFlight * inFlight = checkMalloc(calloc(probeCount, sizeof(SessionInFlight)));
+	for (size_t p = 0; p < probeCount; p++) {
+		inFlight[p].commands = checkMalloc(malloc(window * sizeof(size_t)));
+	}
+	Histogram * lateness = checkMalloc(malloc(sizeof(Histogram)));
+	histogramInit(lateness);
+	size_t failed = 0;
+	size_t swipes = 0;
+	uint64_t startTimeNs = commands[from - 1].timeNs;
+	uint64_t start = getMonotonicTimeNs();
+	for (size_t i = from - 1; i < to; i++) {
+		const SessionCommand * command = &commands[i];
+		SspDevice * device = devices[command->probe % probeCount];
+		SessionInFlight * deviceInFlight = &inFlight[command->probe % probeCount];
+		while (window > 1 && deviceInFlight->count == window) {
+			failed += !collectResponse(device, deviceInFlight, commands, &swipes);
+		}
+		if (!fast) {
+			uint64_t deadline = start + (uint64_t)((command->timeNs - startTimeNs) / speed);
+			sleepUntilNs(deadline);
+			histogramRecord(lateness, getMonotonicTimeNs() - deadline);
+		}
+		SspResult result;
+		if (window > 1) {
+			// pipelined: the response is collected later
+			SspEncodedFrame encoded;
+			result = sspEncodeFrame(command->tag, command->data, command->length, &encoded);
+			if (result == SspResultOk) {
+				result = sspSendEncoded(device, &encoded);
+			}
+			if (result == SspResultOk) {
+				deviceInFlight->commands[deviceInFlight->count++] = i;
+			}
+		}
+		else if (command->tag == SspCommandSoftwareVersion) {
+			SspFirmwareVersion version;
+			result = sspGetFirmwareVersion(device, &version);
+		}
+		else {
+			SspEncodedFrame encoded;
+			result = sspEncodeFrame(command->tag, command->data, command->length, &encoded);
+			if (result == SspResultOk) {
+				result = sspMethodCallEncoded(device, &encoded);
+			}
+		}
+		if (result != SspResultOk) {
+			failed++;
+			printf("Command %zu (tag 0x%02x, %u bytes, probe %u): %s\n", i + 1, command->tag, command->length, command->probe, sspErrorMessage(device));
+		}
+	}
+	for (size_t p = 0; p < probeCount; p++) {
+		while (inFlight[p].count > 0) {
+			failed += !collectResponse(devices[p], &inFlight[p], commands, &swipes);
+		}
+		free(inFlight[p].commands);
+	}
+	free(inFlight);
+	uint64_t elapsed = getMonotonicTimeNs() - start;
+	size_t replayed = to - from + 1;
+	printf("%zu commands replayed in %.3f s (%.1f commands/s), %zu failed", replayed, elapsed / 1e9, replayed / (elapsed / 1e9), failed);
+	if (!fast) {
+		printf(", recorded duration %.3f s, lateness avg %.3f ms p99 %.3f ms max %.3f ms", (commands[to - 1].timeNs - startTimeNs) / 1e9,
+			histogramMean(lateness) / 1e6, histogramPercentile(lateness, 99) / 1e6, histogramMax(lateness) / 1e6);
+		metricsSaveHistogram("replay/lateness", lateness);
+	}
+	printf("\n");
+	free(lateness);
+	if (swipes > 0) {
+		printf("%zu swiped events received\n", swipes);
+	}
+
+	free(commands);
+	free(log);
+	if (failed > 0) {
+		cleanUpAndExit(ExitErrorCommunicationProtocol, "%zu command(s) failed", failed);
+	}
+	return 0;
+}
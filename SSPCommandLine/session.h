@@ -0,0 +1,50 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdbool.h>
+
+#include "protocol.h"
+
+// Session recording and replay (Linux only). With --record=<file> every command sent to a probe is written to a binary
+// log: its tag, its data and the time since the previous command. The replay command sends the commands of a log to a
+// probe again, at the original timing or as fast as possible, optionally only a range of them. With --window=<n> up to n
+// commands are sent ahead of their responses, as sspSwipeMany does, otherwise every command is a method call.
+//
+// Log format: the 8 byte header "SSPSESS" 0x01, followed by one record per command:
+//	varint	nanoseconds since the previous command (since the start of the recording for the first)
+//	uint8	probe number, in the order the probes were opened
+//	uint8	tag
+//	varint	data length
+//	bytes	data
+// Varints are unsigned LEB128: 7 bits per byte, least significant first, the high bit set on all but the last byte.
+
+#define SESSION_MAGIC "SSPSESS\x01"
+
+// Starts recording to filename. Returns false when the file cannot be created.
+bool sessionRecordStart(const char * filename);
+// Records the commands sent to an opened probe.
+void sessionRecordProbe(SspDevice * device);
+// Flushes and closes the log, called from cleanUpAndExit.
+void sessionRecordStop();
+
+// replay command: sends the commands of a recorded session to the probe.
+int replaySession();
+
+#endif /* not defined SESSION_H */
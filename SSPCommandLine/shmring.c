@@ -0,0 +1,358 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shmring.h"
+#include "util.h"
+
+#define CACHE_LINE 64
+// Time the server keeps polling the request ring before it goes to sleep on the futex.
+#define SSP_SHM_SPIN_NS 50000
+
+typedef struct {
+	uint64_t sequence;
+	SspShmRequest request;
+} SspShmRequestSlot;
+
+// Completion ring of one client. The server writes tail, the client writes head.
+typedef struct {
+	uint32_t inUse;
+	uint32_t pid;
+	uint32_t generation;		///< incremented every time a client claims the ring
+	uint32_t futex;				///< incremented by the server after posting, waited on by a sleeping client
+	uint32_t sleeping;			///< set by the client before it sleeps on futex
+	uint64_t head __attribute__((aligned(CACHE_LINE)));
+	uint64_t tail __attribute__((aligned(CACHE_LINE)));
+	SspShmCompletion slots[SSP_SHM_COMPLETION_SLOTS];
+} SspShmCompletionRing;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t probeCount;
+	uint32_t ready;
+	uint64_t enqueuePosition __attribute__((aligned(CACHE_LINE)));
+	uint64_t dequeuePosition __attribute__((aligned(CACHE_LINE)));
+	uint32_t futex __attribute__((aligned(CACHE_LINE)));	///< incremented by clients after submitting, waited on by a sleeping server
+	uint32_t sleeping;										///< set by the server before it sleeps on futex
+	SspShmRequestSlot requests[SSP_SHM_REQUEST_SLOTS] __attribute__((aligned(CACHE_LINE)));
+	SspShmCompletionRing clients[SSP_SHM_MAX_CLIENTS];
+} SspShmSegment;
+
+struct SspShm_s {
+	SspShmSegment * segment;
+	char name[256];
+	bool server;
+	uint32_t clientIndex;
+	uint32_t clientGeneration;
+	uint64_t nextRequestId;
+	uint64_t submitted;			///< client: requests submitted, to keep the outstanding count within the completion ring
+	uint64_t completed;
+};
+
+static long futexWait(uint32_t * word, uint32_t value, int timeoutMs) {
+	struct timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+	return syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void futexWake(uint32_t * word) {
+	syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+// Bumps the futex word and wakes the other side only when it announced that it sleeps.
+static void notify(uint32_t * futex, uint32_t * sleeping) {
+	__atomic_add_fetch(futex, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(sleeping, __ATOMIC_SEQ_CST)) {
+		futexWake(futex);
+	}
+}
+
+// Sleeps on futex unless work became available after announcing it (checked with hasWork).
+static void sleepUnless(uint32_t * futex, uint32_t * sleeping, bool (*hasWork)(SspShm *), SspShm * shm, int timeoutMs) {
+	uint32_t value = __atomic_load_n(futex, __ATOMIC_SEQ_CST);
+	__atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+	if (!hasWork(shm)) {
+		futexWait(futex, value, timeoutMs);
+	}
+	__atomic_store_n(sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+static bool mapSegment(const char * name, int flags, SspShm ** shm) {
+	char path[256];
+	snprintf(path, sizeof(path), "/%s", name);
+	int fd = shm_open(path, flags, 0600);
+	if (fd < 0) {
+		return false;
+	}
+	if ((flags & O_CREAT) && ftruncate(fd, sizeof(SspShmSegment)) != 0) {
+		close(fd);
+		return false;
+	}
+	void * mapping = mmap(NULL, sizeof(SspShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		return false;
+	}
+	*shm = calloc(1, sizeof(SspShm));
+	if (*shm == NULL) {
+		munmap(mapping, sizeof(SspShmSegment));
+		return false;
+	}
+	(*shm)->segment = mapping;
+	snprintf((*shm)->name, sizeof((*shm)->name), "%s", path);
+	return true;
+}
+
+bool sspShmCreate(const char * name, uint32_t probeCount, SspShm ** shm) {
+	char path[256];
+	snprintf(path, sizeof(path), "/%s", name);
+	shm_unlink(path);
+	if (!mapSegment(name, O_RDWR | O_CREAT | O_EXCL, shm)) {
+		return false;
+	}
+	SspShmSegment * segment = (*shm)->segment;
+	(*shm)->server = true;
+	for (uint64_t i = 0; i < SSP_SHM_REQUEST_SLOTS; i++) {
+		segment->requests[i].sequence = i;
+	}
+	segment->magic = SSP_SHM_MAGIC;
+	segment->version = SSP_SHM_VERSION;
+	segment->probeCount = probeCount;
+	__atomic_store_n(&segment->ready, 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+void sspShmDestroy(SspShm * shm) {
+	if (shm == NULL) {
+		return;
+	}
+	__atomic_store_n(&shm->segment->ready, 0, __ATOMIC_RELEASE);
+	munmap(shm->segment, sizeof(SspShmSegment));
+	shm_unlink(shm->name);
+	free(shm);
+}
+
+uint32_t sspShmProbeCount(SspShm * shm) {
+	return shm->segment->probeCount;
+}
+
+static bool requestsAvailable(SspShm * shm) {
+	SspShmSegment * segment = shm->segment;
+	uint64_t position = __atomic_load_n(&segment->dequeuePosition, __ATOMIC_RELAXED);
+	SspShmRequestSlot * slot = &segment->requests[position & (SSP_SHM_REQUEST_SLOTS - 1)];
+	return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == position + 1;
+}
+
+// Only the server dequeues, so the consumer side needs no compare-and-swap.
+size_t sspShmReceive(SspShm * shm, SspShmRequest * requests, size_t max) {
+	SspShmSegment * segment = shm->segment;
+	uint64_t position = __atomic_load_n(&segment->dequeuePosition, __ATOMIC_RELAXED);
+	size_t count = 0;
+	while (count < max) {
+		SspShmRequestSlot * slot = &segment->requests[position & (SSP_SHM_REQUEST_SLOTS - 1)];
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1) {
+			break;
+		}
+		requests[count++] = slot->request;
+		__atomic_store_n(&slot->sequence, position + SSP_SHM_REQUEST_SLOTS, __ATOMIC_RELEASE);
+		position++;
+	}
+	__atomic_store_n(&segment->dequeuePosition, position, __ATOMIC_RELAXED);
+	return count;
+}
+
+void sspShmWaitForRequests(SspShm * shm, int timeoutMs) {
+	// the requests come from other processes, so this waits on the real clock also in the simulation mode
+	uint64_t spinUntil = getRealMonotonicTimeNs() + SSP_SHM_SPIN_NS;
+	while (getRealMonotonicTimeNs() < spinUntil) {
+		if (requestsAvailable(shm)) {
+			return;
+		}
+	}
+	sleepUnless(&shm->segment->futex, &shm->segment->sleeping, requestsAvailable, shm, timeoutMs);
+}
+
+void sspShmComplete(SspShm * shm, const SspShmRequest * request, SspResult result, uint64_t completedNs) {
+	if (request->clientIndex >= SSP_SHM_MAX_CLIENTS) {
+		return;
+	}
+	SspShmCompletionRing * ring = &shm->segment->clients[request->clientIndex];
+	// the client left, nobody is waiting for this result
+	if (__atomic_load_n(&ring->inUse, __ATOMIC_ACQUIRE) != 1 || __atomic_load_n(&ring->generation, __ATOMIC_RELAXED) != request->clientGeneration) {
+		return;
+	}
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	// the client never has more requests outstanding than fit in its ring, this is a misbehaving client
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= SSP_SHM_COMPLETION_SLOTS) {
+		return;
+	}
+	SspShmCompletion * completion = &ring->slots[tail & (SSP_SHM_COMPLETION_SLOTS - 1)];
+	completion->requestId = request->requestId;
+	completion->result = result;
+	completion->completedNs = completedNs;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	notify(&ring->futex, &ring->sleeping);
+}
+
+bool sspShmAttach(const char * name, SspShm ** shm) {
+	if (!mapSegment(name, O_RDWR, shm)) {
+		return false;
+	}
+	SspShmSegment * segment = (*shm)->segment;
+	if (segment->magic != SSP_SHM_MAGIC || segment->version != SSP_SHM_VERSION || !__atomic_load_n(&segment->ready, __ATOMIC_ACQUIRE)) {
+		sspShmDetach(*shm);
+		errno = EPROTO;
+		return false;
+	}
+	for (uint32_t i = 0; i < SSP_SHM_MAX_CLIENTS; i++) {
+		SspShmCompletionRing * ring = &segment->clients[i];
+		uint32_t inUse = __atomic_load_n(&ring->inUse, __ATOMIC_ACQUIRE);
+		uint32_t pid = __atomic_load_n(&ring->pid, __ATOMIC_RELAXED);
+		// reclaim rings of clients that died without detaching
+		bool stale = inUse && pid != 0 && kill((pid_t)pid, 0) != 0 && errno == ESRCH;
+		if ((inUse && !stale) || !__atomic_compare_exchange_n(&ring->inUse, &inUse, 2, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&ring->head, tail, __ATOMIC_RELEASE);
+		__atomic_store_n(&ring->pid, (uint32_t)getpid(), __ATOMIC_RELAXED);
+		(*shm)->clientGeneration = __atomic_add_fetch(&ring->generation, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&ring->inUse, 1, __ATOMIC_RELEASE);
+		(*shm)->clientIndex = i;
+		(*shm)->nextRequestId = 1;
+		return true;
+	}
+	(*shm)->clientIndex = SSP_SHM_MAX_CLIENTS;
+	sspShmDetach(*shm);
+	errno = EBUSY;
+	return false;
+}
+
+void sspShmDetach(SspShm * shm) {
+	if (shm == NULL) {
+		return;
+	}
+	if (shm->clientIndex < SSP_SHM_MAX_CLIENTS) {
+		SspShmCompletionRing * ring = &shm->segment->clients[shm->clientIndex];
+		__atomic_store_n(&ring->pid, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&ring->inUse, 0, __ATOMIC_RELEASE);
+	}
+	munmap(shm->segment, sizeof(SspShmSegment));
+	free(shm);
+}
+
+bool sspShmSubmit(SspShm * shm, uint32_t probeIndex, const SspCard * card, uint64_t * requestId) {
+	SspShmSegment * segment = shm->segment;
+	if (shm->submitted - shm->completed >= SSP_SHM_COMPLETION_SLOTS) {
+		errno = EAGAIN;
+		return false;
+	}
+	for (int t = 0; t < 3; t++) {
+		if (card->length[t] > SSP_SHM_MAX_TRACK_LENGTH) {
+			errno = EMSGSIZE;
+			return false;
+		}
+	}
+
+	uint64_t position = __atomic_load_n(&segment->enqueuePosition, __ATOMIC_RELAXED);
+	SspShmRequestSlot * slot;
+	for (;;) {
+		slot = &segment->requests[position & (SSP_SHM_REQUEST_SLOTS - 1)];
+		uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		int64_t difference = (int64_t)(sequence - position);
+		if (difference == 0) {
+			if (__atomic_compare_exchange_n(&segment->enqueuePosition, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if (difference < 0) {
+			// ring full, the server is behind
+			errno = EAGAIN;
+			return false;
+		}
+		else {
+			position = __atomic_load_n(&segment->enqueuePosition, __ATOMIC_RELAXED);
+		}
+	}
+
+	SspShmRequest * request = &slot->request;
+	request->requestId = shm->nextRequestId++;
+	request->clientIndex = shm->clientIndex;
+	request->clientGeneration = shm->clientGeneration;
+	request->probeIndex = probeIndex;
+	for (int t = 0; t < 3; t++) {
+		request->length[t] = (uint16_t)card->length[t];
+		memcpy(request->track[t], card->track[t], card->length[t]);
+	}
+	__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+	notify(&segment->futex, &segment->sleeping);
+
+	shm->submitted++;
+	if (requestId != NULL) {
+		*requestId = request->requestId;
+	}
+	return true;
+}
+
+static bool completionsAvailable(SspShm * shm) {
+	SspShmCompletionRing * ring = &shm->segment->clients[shm->clientIndex];
+	return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+}
+
+size_t sspShmPoll(SspShm * shm, SspShmCompletion * completions, size_t max) {
+	SspShmCompletionRing * ring = &shm->segment->clients[shm->clientIndex];
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	size_t count = 0;
+	while (head != tail && count < max) {
+		completions[count++] = ring->slots[head & (SSP_SHM_COMPLETION_SLOTS - 1)];
+		head++;
+	}
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	shm->completed += count;
+	return count;
+}
+
+size_t sspShmWait(SspShm * shm, SspShmCompletion * completions, size_t max, int timeoutMs) {
+	uint64_t deadline = getRealMonotonicTimeNs() + (uint64_t)timeoutMs * 1000000ull;
+	for (;;) {
+		size_t count = sspShmPoll(shm, completions, max);
+		uint64_t now = getRealMonotonicTimeNs();
+		if (count > 0 || now >= deadline) {
+			return count;
+		}
+		SspShmCompletionRing * ring = &shm->segment->clients[shm->clientIndex];
+		int remainingMs = (int)((deadline - now + 999999) / 1000000);
+		sleepUnless(&ring->futex, &ring->sleeping, completionsAvailable, shm, remainingMs);
+	}
+}
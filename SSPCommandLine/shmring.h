@@ -0,0 +1,86 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "protocol.h"
+
+// Shared-memory transport between a resident server that owns the probes (the serve command) and local clients
+// (Linux only). The segment contains one request ring, shared by all clients, and one completion ring per client.
+//
+// The request ring is a bounded lock-free multi-producer queue: every slot carries a sequence number, producers claim
+// a position with a compare-and-swap and publish the slot by advancing its sequence. The completion rings are single
+// producer (server), single consumer (client). Neither side makes a system call while the other side is busy: a
+// futex in the segment is only woken when the other side announced that it is about to sleep.
+
+#define SSP_SHM_MAGIC				0x52505353		// "SSPR"
+#define SSP_SHM_VERSION				1
+#define SSP_SHM_REQUEST_SLOTS		1024			// power of two
+#define SSP_SHM_COMPLETION_SLOTS	1024			// power of two, also the maximum number of outstanding requests per client
+#define SSP_SHM_MAX_CLIENTS			32
+#define SSP_SHM_MAX_TRACK_LENGTH	120
+#define SSP_SHM_ANY_PROBE			0xFFFFFFFFu		// probe index that lets the server route the request to a healthy probe
+
+// A swipe request: the card (in the layout of SspCard, with the track data inline) and the probe to swipe it on.
+typedef struct {
+	uint64_t requestId;
+	uint32_t clientIndex;
+	uint32_t clientGeneration;	///< results for a previous owner of the completion ring are dropped
+	uint32_t probeIndex;
+	uint16_t length[3];
+	char track[3][SSP_SHM_MAX_TRACK_LENGTH];
+} SspShmRequest;
+
+// The result of a request, as in SspSwipeResult.
+typedef struct {
+	uint64_t requestId;
+	int32_t result;				///< SspResult
+	uint64_t completedNs;		///< CLOCK_MONOTONIC time at which the swipe was acknowledged
+} SspShmCompletion;
+
+typedef struct SspShm_s SspShm;
+
+// Server: creates (or replaces) the segment /dev/shm/<name> for probeCount probes.
+bool sspShmCreate(const char * name, uint32_t probeCount, SspShm ** shm);
+// Server: removes the segment.
+void sspShmDestroy(SspShm * shm);
+// Server: takes up to max requests from the request ring without blocking. Returns the number of requests.
+size_t sspShmReceive(SspShm * shm, SspShmRequest * requests, size_t max);
+// Server: spins for a short while and then sleeps until a request is submitted or timeoutMs passed.
+void sspShmWaitForRequests(SspShm * shm, int timeoutMs);
+// Server: posts the result of a request to the completion ring of its client.
+void sspShmComplete(SspShm * shm, const SspShmRequest * request, SspResult result, uint64_t completedNs);
+
+// Client: attaches to the segment of a running server and claims a completion ring.
+bool sspShmAttach(const char * name, SspShm ** shm);
+// Client: releases the completion ring and unmaps the segment.
+void sspShmDetach(SspShm * shm);
+// Number of probes served.
+uint32_t sspShmProbeCount(SspShm * shm);
+// Client: submits a card. Returns false when the card does not fit or too many requests are outstanding.
+bool sspShmSubmit(SspShm * shm, uint32_t probeIndex, const SspCard * card, uint64_t * requestId);
+// Client: takes up to max completions without blocking. Returns the number of completions.
+size_t sspShmPoll(SspShm * shm, SspShmCompletion * completions, size_t max);
+// Client: like sspShmPoll, but waits up to timeoutMs for at least one completion.
+size_t sspShmWait(SspShm * shm, SspShmCompletion * completions, size_t max, int timeoutMs);
+
+#endif /* not defined SHMRING_H */
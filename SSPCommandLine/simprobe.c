@@ -0,0 +1,358 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "SSPCommandLineTool.h"
+#include "simprobe.h"
+#include "hidbackend.h"
+#include "util.h"
+
+// Length of the input and output reports of the simulated probe
+#define SIM_REPORT_LENGTH 64
+// Input reports the probe holds before it drops new ones
+#define SIM_QUEUE_LENGTH 64
+
+// An input report and the virtual time it can be read
+typedef struct {
+	uint8_t data[SIM_REPORT_LENGTH];
+	uint64_t readyNs;
+	bool swiped;				///< the swiped event, withdrawn by a stop before it is read
+} SimReport;
+
+typedef struct {
+	unsigned int index;
+	// command frame being received
+	uint8_t frame[SSP_MAX_FRAME_LENGTH];
+	size_t frameLength;
+	bool inFrame;
+	bool escape;
+	// probe state
+	uint8_t triggerMode;
+	uint64_t busyUntilNs;		///< the probe handles commands one after the other
+	// input reports ordered by the time they can be read
+	SimReport queue[SIM_QUEUE_LENGTH];
+	size_t queueCount;
+} SimProbe;
+
+static SimProbe * simProbes = NULL;
+static unsigned int simProbeCount = 0;
+static uint64_t simLatencyNs = 0;
+static uint64_t simSwipeNs = 0;
+static uint64_t simVirtualStartNs = 0;
+static struct timespec simRealStart;
+
+// Adds a report to the queue, after the reports that are ready at the same time.
+static void simQueue(SimProbe * p, const uint8_t * data, size_t length, uint64_t readyNs, bool swiped) {
+	if (p->queueCount == SIM_QUEUE_LENGTH) {
+		return;
+	}
+	size_t i = p->queueCount;
+	while (i > 0 && p->queue[i - 1].readyNs > readyNs) {
+		i--;
+	}
+	memmove(&p->queue[i + 1], &p->queue[i], (p->queueCount - i) * sizeof(SimReport));
+	memset(p->queue[i].data, 0, SIM_REPORT_LENGTH);
+	memcpy(p->queue[i].data, data, min(length, SIM_REPORT_LENGTH));
+	p->queue[i].readyNs = readyNs;
+	p->queue[i].swiped = swiped;
+	p->queueCount++;
+}
+
+// Sends a response frame. Responses are framed like commands, without the report number in front.
+static void simRespond(SimProbe * p, uint8_t tag, const uint8_t * data, size_t length, uint64_t readyNs, bool swiped) {
+	SspEncodedFrame encoded;
+	if (sspEncodeFrame((SspCommandTag)tag, data, length, &encoded) == SspResultOk) {
+		simQueue(p, encoded.frame + 1, encoded.frameLength - 1, readyNs, swiped);
+	}
+}
+
+// Withdraws a swiped event that was not read yet.
+static void simCancelSwipe(SimProbe * p) {
+	for (size_t i = 0; i < p->queueCount; i++) {
+		if (p->queue[i].swiped) {
+			memmove(&p->queue[i], &p->queue[i + 1], (p->queueCount - i - 1) * sizeof(SimReport));
+			p->queueCount--;
+			return;
+		}
+	}
+}
+
+// Checks and executes a received command frame: tag, length (2 bytes), data, CRC (2 bytes).
+static void simExecute(SimProbe * p) {
+	uint64_t now = getMonotonicTimeNs();
+	uint64_t readyNs = max(now, p->busyUntilNs) + simLatencyNs;
+	p->busyUntilNs = readyNs;
+	if (p->frameLength < 5) {
+		simRespond(p, SspStatusErrorParsing, NULL, 0, readyNs, false);
+		return;
+	}
+	uint8_t tag = p->frame[0];
+	size_t length = ((size_t)p->frame[1] << 8) | p->frame[2];
+	if (length + 5 != p->frameLength) {
+		simRespond(p, SspStatusErrorSize, NULL, 0, readyNs, false);
+		return;
+	}
+	uint16_t crc;
+	Crc_init(&crc);
+	for (size_t i = 0; i < length + 3; i++) {
+		Crc_add(&crc, p->frame[i]);
+	}
+	if (crc != (((uint16_t)p->frame[length + 3] << 8) | p->frame[length + 4])) {
+		simRespond(p, SspStatusErrorChecksum, NULL, 0, readyNs, false);
+		return;
+	}
+	const uint8_t * data = p->frame + 3;
+
+	uint8_t status = SspStatusOperationOk;
+	switch (tag) {
+	case SspCommandDefaultConfiguration:
+		simCancelSwipe(p);
+		p->triggerMode = SspTriggerModeImmediately;
+		break;
+	case SspCommandData1:
+	case SspCommandData2:
+	case SspCommandData3:
+		status = (length <= SSP_MAX_TRACK_LENGTH) ? SspStatusOperationOk : SspStatusErrorSize;
+		break;
+	case SspCommandConfig1:
+	case SspCommandConfig2:
+	case SspCommandConfig3:
+		status = (length == SSP_TRACK_CONFIG_LENGTH) ? SspStatusOperationOk : SspStatusErrorSize;
+		break;
+	case SspCommandTriggerMode:
+		if (length == 1) {
+			p->triggerMode = data[0];
+		}
+		else {
+			status = SspStatusErrorSize;
+		}
+		break;
+	case SspCommandTriggerArm:
+		if (p->triggerMode == SspTriggerModeImmediately) {
+			simCancelSwipe(p);
+			simRespond(p, SspEventSwiped, NULL, 0, readyNs + simSwipeNs, true);
+		}
+		break;
+	case SspCommandTriggerDisarm:
+		simCancelSwipe(p);
+		break;
+	case SspCommandSoftwareVersion: {
+		SspFirmwareVersion version = { 1, 0, 2, 0 };
+		simRespond(p, SspCommandSoftwareVersion, (const uint8_t *)&version, sizeof(version), readyNs, false);
+		return;
+	}
+	case SspCommandStartBootloader:
+		break;
+	default:
+		status = SspStatusErrorIllegalCommand;
+	}
+	simRespond(p, status, NULL, 0, readyNs, false);
+}
+
+static int simInit(void) {
+	return 0;
+}
+
+static int simExit(void) {
+	return 0;
+}
+
+static struct hid_device_info * simEnumerate(unsigned short vendorId, unsigned short productId) {
+	struct hid_device_info * devs = NULL;
+	if ((vendorId != 0 && vendorId != SSP_VID) || (productId != 0 && productId != SSP_PID)) {
+		return NULL;
+	}
+	for (unsigned int i = simProbeCount; i-- > 0;) {
+		struct hid_device_info * dev = checkMalloc(calloc(1, sizeof(struct hid_device_info)));
+		char path[32];
+		wchar_t serial[32];
+		snprintf(path, sizeof(path), "sim:%u", i);
+		swprintf(serial, ARRAY_SIZE(serial), L"%s%04u", SIM_SERIAL_PREFIX, i);
+		dev->path = checkMalloc(strdup(path));
+		dev->serial_number = checkMalloc(wcsdup(serial));
+		dev->manufacturer_string = checkMalloc(wcsdup(L"Simulated"));
+		dev->product_string = checkMalloc(wcsdup(L"SmartStripeProbe"));
+		dev->vendor_id = SSP_VID;
+		dev->product_id = SSP_PID;
+		dev->next = devs;
+		devs = dev;
+	}
+	return devs;
+}
+
+static void simFreeEnumeration(struct hid_device_info * devs) {
+	while (devs != NULL) {
+		struct hid_device_info * next = devs->next;
+		free(devs->path);
+		free(devs->serial_number);
+		free(devs->manufacturer_string);
+		free(devs->product_string);
+		free(devs);
+		devs = next;
+	}
+}
+
+// Opening resets the receiver, the probe keeps its configuration and pending input like a real one.
+static hid_device * simOpenIndex(unsigned int index) {
+	if (index >= simProbeCount) {
+		return NULL;
+	}
+	SimProbe * p = &simProbes[index];
+	p->inFrame = false;
+	p->escape = false;
+	return (hid_device *)p;
+}
+
+static hid_device * simOpen(unsigned short vendorId, unsigned short productId, const wchar_t * serial) {
+	unsigned int index = 0;
+	if (serial != NULL && swscanf(serial, L"" SIM_SERIAL_PREFIX "%u", &index) != 1) {
+		return NULL;
+	}
+	return simOpenIndex(index);
+}
+
+static hid_device * simOpenPath(const char * path) {
+	unsigned int index;
+	if (sscanf(path, "sim:%u", &index) != 1) {
+		return NULL;
+	}
+	return simOpenIndex(index);
+}
+
+// Receives an output report: the report number, followed by part of a command frame.
+static int simWrite(hid_device * device, const unsigned char * data, size_t length) {
+	SimProbe * p = (SimProbe *)device;
+	for (size_t i = 1; i < length; i++) {
+		uint8_t c = data[i];
+		if (p->escape) {
+			p->escape = false;
+			if (c == STX) {
+				p->inFrame = true;
+				p->frameLength = 0;
+				continue;
+			}
+			if (c == ETX) {
+				if (p->inFrame) {
+					simExecute(p);
+				}
+				p->inFrame = false;
+				continue;
+			}
+			// DLE DLE is an escaped DLE, anything else breaks the frame
+			if (c != DLE) {
+				p->inFrame = false;
+				continue;
+			}
+		}
+		else if (c == DLE) {
+			p->escape = true;
+			continue;
+		}
+		if (p->inFrame && p->frameLength < sizeof(p->frame)) {
+			p->frame[p->frameLength++] = c;
+		}
+	}
+	return (int)length;
+}
+
+// Returns the first input report once it is ready, waiting on the virtual clock up to milliseconds (forever when negative).
+static int simReadTimeout(hid_device * device, unsigned char * data, size_t length, int milliseconds) {
+	SimProbe * p = (SimProbe *)device;
+	uint64_t deadline = getMonotonicTimeNs() + (uint64_t)max(milliseconds, 0) * 1000000ull;
+	for (;;) {
+		uint64_t now = getMonotonicTimeNs();
+		uint64_t readyNs = (p->queueCount > 0) ? p->queue[0].readyNs : UINT64_MAX;
+		if (readyNs <= now) {
+			size_t n = min(length, SIM_REPORT_LENGTH);
+			memcpy(data, p->queue[0].data, n);
+			memmove(&p->queue[0], &p->queue[1], --p->queueCount * sizeof(SimReport));
+			return (int)n;
+		}
+		if (milliseconds >= 0 && now >= deadline) {
+			return 0;
+		}
+		sleepUntilNs((milliseconds >= 0) ? min(readyNs, deadline) : readyNs);
+	}
+}
+
+static void simClose(hid_device * device) {
+	(void)device;
+}
+
+static HidBackend simBackend = {
+	.name = "sim",
+	.init = simInit,
+	.exit = simExit,
+	.enumerate = simEnumerate,
+	.free_enumeration = simFreeEnumeration,
+	.open = simOpen,
+	.open_path = simOpenPath,
+	.write = simWrite,
+	.read_timeout = simReadTimeout,
+	.close = simClose,
+	.get_report_descriptor = NULL,	// the default report layout of 64 bytes is used
+};
+
+void simulationStart() {
+	if (simProbes != NULL) {
+		hidBackend = &simBackend;
+		return;
+	}
+	int count = atoi(getCommandLineParameterValue("--sim-probes", "1"));
+	int latencyUs = atoi(getCommandLineParameterValue("--sim-latency", "1000"));
+	int swipeMs = atoi(getCommandLineParameterValue("--sim-swipe", "100"));
+	if (count <= 0 || count > 9999 || latencyUs < 0 || swipeMs < 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --sim-probes, --sim-latency or --sim-swipe");
+	}
+	simProbeCount = (unsigned int)count;
+	simLatencyNs = (uint64_t)latencyUs * 1000ull;
+	simSwipeNs = (uint64_t)swipeMs * 1000000ull;
+	simProbes = checkMalloc(calloc(simProbeCount, sizeof(SimProbe)));
+	for (unsigned int i = 0; i < simProbeCount; i++) {
+		simProbes[i].index = i;
+		simProbes[i].triggerMode = SspTriggerModeImmediately;
+	}
+	hidBackend = &simBackend;
+
+	clock_gettime(CLOCK_MONOTONIC, &simRealStart);
+	virtualClockStart();
+	simVirtualStartNs = getMonotonicTimeNs();
+	IFNOTQUIET(printf("Simulating %u probe(s) on a virtual clock\n", simProbeCount));
+}
+
+void simulationStop() {
+	if (simProbes == NULL) {
+		return;
+	}
+	struct timespec realEnd;
+	clock_gettime(CLOCK_MONOTONIC, &realEnd);
+	double realSeconds = (double)(realEnd.tv_sec - simRealStart.tv_sec) + (realEnd.tv_nsec - simRealStart.tv_nsec) / 1e9;
+	double simulatedSeconds = (getMonotonicTimeNs() - simVirtualStartNs) / 1e9;
+	IFNOTQUIET(fprintf(stderr, "Simulated %.3f s in %.3f s\n", simulatedSeconds, realSeconds));
+	free(simProbes);
+	simProbes = NULL;
+}
+
+bool simulationActive() {
+	return simProbes != NULL;
+}
@@ -0,0 +1,42 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef SIMPROBE_H
+#define SIMPROBE_H
+
+#include <stdbool.h>
+
+// Simulation mode (Linux only). With --simulate the probes are replaced by in-process stand-ins behind the HID backend
+// interface, and all sleeps, response timeouts and pacing run on the virtual clock of util.h. Time jumps to the next event
+// instead of passing, so a campaign plan of days is checked in seconds, with the same control flow as on real probes.
+// The stand-in checks the framing, length and CRC of every command like the probe does, responds after --sim-latency
+// (commands are handled one after the other) and, in immediate trigger mode, sends the swiped event --sim-swipe after
+// a go unless it is stopped before.
+//	--sim-probes=<n>		number of simulated probes, serial numbers SIM0000, SIM0001, ... (default 1)
+//	--sim-latency=<us>		time the probe takes to respond to a command (default 1000)
+//	--sim-swipe=<ms>		time from a go to the swiped event (default 100)
+
+#define SIM_SERIAL_PREFIX "SIM"
+
+// Selects the simulated probes as HID backend and starts the virtual clock, called by selectBackend.
+void simulationStart();
+// Prints the simulated time and the real time it took, called from cleanUpAndExit.
+void simulationStop();
+// True between simulationStart and simulationStop. The simulated probes belong to this process, so they are not locked.
+bool simulationActive();
+
+#endif /* not defined SIMPROBE_H */
@@ -0,0 +1,464 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <functional>
+
+#include "sspasync.hpp"
+
+namespace ssp {
+namespace detail {
+
+bool OperationStateBase::setContinuation(std::coroutine_handle<> continuation) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (ready()) {
+		return false;
+	}
+	continuation_ = continuation;
+	return true;
+}
+
+void OperationStateBase::wait() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	completed_.wait(lock, [this] { return ready(); });
+}
+
+void OperationStateBase::fail(std::exception_ptr error) {
+	error_ = error;
+	finish();
+}
+
+void OperationStateBase::finish() {
+	std::coroutine_handle<> continuation;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		done_.store(true, std::memory_order_release);
+		continuation = continuation_;
+		continuation_ = nullptr;
+	}
+	completed_.notify_all();
+	if (continuation) {
+		continuation.resume();
+	}
+}
+
+// One queued operation of a probe.
+struct Request {
+	enum class Kind {
+		Open,		///< open the probe (connect)
+		Close,		///< close the probe
+		Method,		///< command answered with SspStatusOperationOk
+		Function,	///< command answered with a response carrying the same tag
+		Event,		///< no command, wait for an event of the probe
+	};
+
+	Kind kind;
+	SspCommandTag tag = SspCommandSoftwareVersion;
+	std::vector<uint8_t> payload;
+	Deadline deadline = noDeadline;
+	std::shared_ptr<OperationStateBase> operation;
+	// Called with the response of a Function or Event request, must complete the operation.
+	std::function<void(const SspResponse &)> onResponse;
+	// Called when the request completed successfully without response data (Open, Close, Method).
+	std::function<void()> onDone;
+
+	bool started = false;
+	Deadline responseDeadline = noDeadline;
+};
+
+struct ProbeState {
+	std::string serial;
+	SspDevice * device = nullptr;
+	std::deque<std::unique_ptr<Request>> queue;		///< protected by the mutex of the IoContext
+	bool closed = false;							///< closed or failed to open, protected by the mutex of the IoContext
+	std::unique_ptr<Request> active;				///< only used by the thread executing the operations
+};
+
+} // namespace detail
+
+using detail::Request;
+using detail::ProbeState;
+
+namespace {
+
+template <typename T>
+std::shared_ptr<detail::OperationState<T>> newState() {
+	return std::make_shared<detail::OperationState<T>>();
+}
+
+void failOperation(Request & request, SspResult result, const std::string & message) {
+	request.operation->fail(std::make_exception_ptr(Error(result, message)));
+}
+
+// Request for a command the probe acknowledges with SspStatusOperationOk.
+std::unique_ptr<Request> methodRequest(const std::shared_ptr<detail::OperationState<void>> & state, SspCommandTag tag,
+	std::vector<uint8_t> payload, Deadline deadline) {
+	auto request = std::make_unique<Request>();
+	request->kind = Request::Kind::Method;
+	request->tag = tag;
+	request->payload = std::move(payload);
+	request->deadline = deadline;
+	request->operation = state;
+	request->onDone = [state] { state->setValue({}); };
+	return request;
+}
+
+} // namespace
+
+const std::string & Probe::serial() const {
+	return state_->serial;
+}
+
+Operation<void> Probe::resetToDefaults(Deadline deadline) {
+	auto state = newState<void>();
+	context_->submit(state_, methodRequest(state, SspCommandDefaultConfiguration, {}, deadline));
+	return Operation<void>(context_, state);
+}
+
+Operation<SspFirmwareVersion> Probe::firmwareVersion(Deadline deadline) {
+	auto state = newState<SspFirmwareVersion>();
+	auto request = std::make_unique<Request>();
+	request->kind = Request::Kind::Function;
+	request->tag = SspCommandSoftwareVersion;
+	request->deadline = deadline;
+	request->operation = state;
+	request->onResponse = [state](const SspResponse & response) {
+		SspFirmwareVersion version;
+		if (response.length < sizeof(version)) {
+			state->fail(std::make_exception_ptr(Error(SspResultErrorShortResponse)));
+			return;
+		}
+		std::memcpy(&version, response.data, sizeof(version));
+		state->setValue(version);
+	};
+	context_->submit(state_, std::move(request));
+	return Operation<SspFirmwareVersion>(context_, state);
+}
+
+Operation<void> Probe::setTrack(int tracknum, std::string_view data, Deadline deadline) {
+	auto state = newState<void>();
+	std::vector<uint8_t> symbols(data.size());
+	size_t position = 0;
+	if (sspEncodeTrackData(tracknum, data.data(), data.size(), symbols.data(), &position) != SspResultOk) {
+		state->fail(std::make_exception_ptr(Error(SspResultErrorInvalidCharacter,
+			"Invalid character supplied at position " + std::to_string(position + 1) + " of track " + std::to_string(tracknum))));
+		return Operation<void>(context_, state);
+	}
+	context_->submit(state_, methodRequest(state, static_cast<SspCommandTag>(SspCommandDataBase + tracknum), std::move(symbols), deadline));
+	return Operation<void>(context_, state);
+}
+
+Operation<void> Probe::setTrackBinary(int tracknum, std::vector<uint8_t> symbols, Deadline deadline) {
+	auto state = newState<void>();
+	context_->submit(state_, methodRequest(state, static_cast<SspCommandTag>(SspCommandDataBase + tracknum), std::move(symbols), deadline));
+	return Operation<void>(context_, state);
+}
+
+Operation<void> Probe::setTriggerMode(SspTriggerMode mode, Deadline deadline) {
+	auto state = newState<void>();
+	context_->submit(state_, methodRequest(state, SspCommandTriggerMode, { static_cast<uint8_t>(mode) }, deadline));
+	return Operation<void>(context_, state);
+}
+
+Operation<void> Probe::arm(Deadline deadline) {
+	auto state = newState<void>();
+	context_->submit(state_, methodRequest(state, SspCommandTriggerArm, {}, deadline));
+	return Operation<void>(context_, state);
+}
+
+Operation<void> Probe::disarm(Deadline deadline) {
+	auto state = newState<void>();
+	context_->submit(state_, methodRequest(state, SspCommandTriggerDisarm, {}, deadline));
+	return Operation<void>(context_, state);
+}
+
+Operation<void> Probe::awaitSwiped(Deadline deadline) {
+	auto state = newState<void>();
+	auto request = std::make_unique<Request>();
+	request->kind = Request::Kind::Event;
+	request->deadline = deadline;
+	request->operation = state;
+	request->onResponse = [state](const SspResponse &) { state->setValue({}); };
+	context_->submit(state_, std::move(request));
+	return Operation<void>(context_, state);
+}
+
+Operation<void> Probe::close() {
+	auto state = newState<void>();
+	auto request = std::make_unique<Request>();
+	request->kind = Request::Kind::Close;
+	request->operation = state;
+	request->onDone = [state] { state->setValue({}); };
+	context_->submit(state_, std::move(request));
+	return Operation<void>(context_, state);
+}
+
+IoContext::IoContext(Mode mode) : mode_(mode) {
+	if (mode_ == Mode::Thread) {
+		thread_ = std::thread([this] { run(); });
+	}
+}
+
+IoContext::~IoContext() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	wakeup_.notify_all();
+	if (thread_.joinable()) {
+		thread_.join();
+	}
+	std::vector<std::shared_ptr<ProbeState>> probes;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		probes.swap(probes_);
+	}
+	for (auto & probe : probes) {
+		std::deque<std::unique_ptr<Request>> queue;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			queue.swap(probe->queue);
+		}
+		if (probe->active) {
+			queue.push_front(std::move(probe->active));
+		}
+		for (auto & request : queue) {
+			failOperation(*request, SspResultErrorCancelled, sspResultString(SspResultErrorCancelled));
+		}
+		sspClose(probe->device);
+		probe->device = nullptr;
+	}
+}
+
+Operation<Probe> IoContext::connect(std::string serial, Deadline deadline) {
+	auto state = newState<Probe>();
+	auto probe = std::make_shared<ProbeState>();
+	probe->serial = std::move(serial);
+
+	auto request = std::make_unique<Request>();
+	request->kind = Request::Kind::Open;
+	request->deadline = deadline;
+	request->operation = state;
+	std::weak_ptr<ProbeState> weakProbe = probe;
+	request->onDone = [this, state, weakProbe] { state->setValue(Probe(this, weakProbe.lock())); };
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		probes_.push_back(probe);
+	}
+	submit(probe, std::move(request));
+	return Operation<Probe>(this, state);
+}
+
+void IoContext::submit(const std::shared_ptr<ProbeState> & probe, std::unique_ptr<Request> request) {
+	SspResult rejected = SspResultOk;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (stopping_) {
+			rejected = SspResultErrorCancelled;
+		}
+		else if (probe->closed) {
+			// nothing services the queue of a closed probe anymore
+			rejected = SspResultErrorHidOpen;
+		}
+		else {
+			probe->queue.push_back(std::move(request));
+			submitted_ = true;
+			outstanding_++;
+		}
+	}
+	// fail outside the lock: the continuation may submit again
+	if (rejected == SspResultErrorCancelled) {
+		failOperation(*request, rejected, sspResultString(rejected));
+		return;
+	}
+	if (rejected != SspResultOk) {
+		failOperation(*request, rejected, "Probe " + probe->serial + " is not connected");
+		return;
+	}
+	wakeup_.notify_one();
+}
+
+bool IoContext::busy() const {
+	return outstanding_.load(std::memory_order_relaxed) > 0;
+}
+
+// Advances the active request of the probe by one step. Returns true when anything happened.
+bool IoContext::service(ProbeState & probe) {
+	if (!probe.active) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (probe.queue.empty()) {
+			return false;
+		}
+		probe.active = std::move(probe.queue.front());
+		probe.queue.pop_front();
+	}
+	Request & request = *probe.active;
+	Deadline now = Clock::now();
+
+	SspResult result = SspResultPending;
+	std::string message;
+	bool done = false;
+	const SspResponse * responsePtr = nullptr;
+	SspResponse response;
+
+	if (request.operation->cancelled()) {
+		result = SspResultErrorCancelled;
+	}
+	else if (!request.started && now >= request.deadline) {
+		result = SspResultErrorNoResponse;
+	}
+	else if (request.kind == Request::Kind::Open) {
+		result = sspOpen(probe.serial.c_str(), &probe.device);
+		done = (result == SspResultOk);
+	}
+	else if (probe.device == nullptr) {
+		result = SspResultErrorHidOpen;
+		message = "Probe " + probe.serial + " is not connected";
+	}
+	else if (request.kind == Request::Kind::Close) {
+		sspClose(probe.device);
+		probe.device = nullptr;
+		result = SspResultOk;
+		done = true;
+	}
+	else if (!request.started) {
+		request.started = true;
+		if (request.kind == Request::Kind::Event) {
+			request.responseDeadline = request.deadline;
+		}
+		else {
+			request.responseDeadline = std::min(request.deadline, now + std::chrono::milliseconds(SSP_RESPONSE_TIMEOUT_MS));
+			result = sspSendCommand(probe.device, request.tag, request.payload.data(), request.payload.size());
+			if (result == SspResultOk) {
+				result = SspResultPending;
+			}
+		}
+		if (result == SspResultPending) {
+			return true;
+		}
+	}
+	else {
+		result = sspPollResponse(probe.device, 0, &response);
+		if (result == SspResultPending) {
+			if (now < request.responseDeadline) {
+				return false;
+			}
+			result = SspResultErrorNoResponse;
+		}
+		else if (result == SspResultOk) {
+			switch (request.kind) {
+			case Request::Kind::Method:
+				result = sspCheckMethodResponse(probe.device, &response);
+				done = (result == SspResultOk);
+				break;
+			case Request::Kind::Function:
+				if (response.tag != request.tag) {
+					result = SspResultErrorWrongTag;
+				}
+				else {
+					responsePtr = &response;
+					done = true;
+				}
+				break;
+			case Request::Kind::Event:
+				// other frames are ignored while waiting for the event
+				if (response.tag != SspEventSwiped) {
+					return true;
+				}
+				responsePtr = &response;
+				done = true;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	if (result != SspResultOk && message.empty()) {
+		bool deviceError = probe.device != nullptr && result != SspResultErrorCancelled && result != SspResultErrorNoResponse
+			&& result != SspResultErrorWrongTag;
+		message = deviceError ? sspErrorMessage(probe.device) : sspResultString(result);
+	}
+
+	// Complete the request after detaching it: the continuation may submit new requests for this probe.
+	std::unique_ptr<Request> finished = std::move(probe.active);
+	outstanding_--;
+	if (done) {
+		if (responsePtr != nullptr) {
+			finished->onResponse(*responsePtr);
+		}
+		else {
+			finished->onDone();
+		}
+	}
+	else {
+		failOperation(*finished, result, message);
+	}
+	// Forget probes that are closed (or failed to open) once their queue is drained. Requests submitted from then on
+	// fail right away.
+	if (probe.device == nullptr) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		probe.closed = true;
+		if (probe.queue.empty() && !probe.active) {
+			probes_.erase(std::remove_if(probes_.begin(), probes_.end(),
+				[&probe](const std::shared_ptr<ProbeState> & p) { return p.get() == &probe; }), probes_.end());
+		}
+	}
+	return true;
+}
+
+bool IoContext::poll() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		snapshot_ = probes_;
+	}
+	bool progress = false;
+	for (auto & probe : snapshot_) {
+		progress |= service(*probe);
+	}
+	snapshot_.clear();
+	return progress;
+}
+
+void IoContext::waitForWork(Clock::duration maxWait) {
+	std::unique_lock<std::mutex> lock(mutex_);
+	// While requests wait for a response the probes have to be polled; otherwise sleep until something is submitted.
+	if (outstanding_.load(std::memory_order_relaxed) > 0) {
+		maxWait = std::min<Clock::duration>(maxWait, pollInterval);
+	}
+	wakeup_.wait_for(lock, maxWait, [this] { return submitted_ || stopping_; });
+	submitted_ = false;
+}
+
+bool IoContext::runOnce(Clock::duration maxWait) {
+	if (poll()) {
+		return true;
+	}
+	waitForWork(maxWait);
+	return poll();
+}
+
+void IoContext::run() {
+	while (!stopping_) {
+		runOnce(std::chrono::milliseconds(100));
+	}
+}
+
+} // namespace ssp
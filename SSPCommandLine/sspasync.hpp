@@ -0,0 +1,266 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+// Asynchronous C++20 interface to SmartStripe probes, on top of the protocol layer in protocol.c.
+//
+// Operations are queued per probe and executed by an ssp::IoContext, either on its own I/O thread or from a
+// user-supplied event loop that calls poll(). Every operation returns an ssp::Operation<T>, which can be waited on
+// like a future (get(), wait()) or co_awaited from a coroutine. Operations support deadlines and cancellation.
+// A single thread can keep many probes busy: commands for different probes are in flight at the same time, while
+// the commands for one probe are executed in order.
+//
+// Example:
+//	ssp::IoContext io;
+//	ssp::Probe probe = io.connect("auto").get();
+//	probe.setTrack(2, ";1234567890123456=99121010000000000000?");
+//	probe.setTriggerMode(SspTriggerModeImmediately);
+//	probe.arm();
+//	probe.awaitSwiped(ssp::after(std::chrono::seconds(2))).get();
+
+#ifndef SSPASYNC_HPP
+#define SSPASYNC_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include "protocol.h"
+
+namespace ssp {
+
+using Clock = std::chrono::steady_clock;
+using Deadline = Clock::time_point;
+
+// No deadline: only the response timeout of the probe (SSP_RESPONSE_TIMEOUT_MS per command) applies.
+constexpr Deadline noDeadline = Deadline::max();
+
+// Deadline timeout from now.
+inline Deadline after(Clock::duration timeout) {
+	return Clock::now() + timeout;
+}
+
+// Thrown by Operation::get() and co_await when an operation failed, timed out or was cancelled.
+class Error : public std::runtime_error {
+public:
+	Error(SspResult result, const std::string & message) : std::runtime_error(message), result_(result) {}
+	explicit Error(SspResult result) : Error(result, sspResultString(result)) {}
+	SspResult result() const { return result_; }
+private:
+	SspResult result_;
+};
+
+class IoContext;
+class Probe;
+
+namespace detail {
+
+struct Request;
+struct ProbeState;
+
+// State shared between an Operation and the request executing it.
+class OperationStateBase {
+public:
+	virtual ~OperationStateBase() = default;
+
+	bool ready() const { return done_.load(std::memory_order_acquire); }
+	void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+	bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+	// Registers the coroutine to resume on completion. Returns false when the operation already completed.
+	bool setContinuation(std::coroutine_handle<> continuation);
+	void wait();
+	void fail(std::exception_ptr error);
+
+protected:
+	void finish();
+	std::exception_ptr error_;
+
+private:
+	std::mutex mutex_;
+	std::condition_variable completed_;
+	std::atomic<bool> done_{ false };
+	std::atomic<bool> cancelled_{ false };
+	std::coroutine_handle<> continuation_;
+};
+
+template <typename T>
+class OperationState : public OperationStateBase {
+public:
+	using Stored = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+	void setValue(Stored value) {
+		value_.emplace(std::move(value));
+		finish();
+	}
+
+	T take() {
+		if (error_) {
+			std::rethrow_exception(error_);
+		}
+		if constexpr (!std::is_void_v<T>) {
+			return std::move(*value_);
+		}
+	}
+
+private:
+	std::optional<Stored> value_;
+};
+
+} // namespace detail
+
+// Handle to an asynchronous operation. Use get() to block until the result is available, or co_await it from a
+// coroutine. When the IoContext runs its own thread, coroutines are resumed on that thread; in manual mode they are
+// resumed from within IoContext::poll(). Do not block on other operations from a resumed coroutine.
+template <typename T>
+class Operation {
+public:
+	Operation(IoContext * context, std::shared_ptr<detail::OperationState<T>> state)
+		: context_(context), state_(std::move(state)) {}
+
+	bool ready() const { return state_->ready(); }
+
+	// Requests cancellation. A queued operation never starts; an operation waiting for the probe stops waiting.
+	// Either way it completes with SspResultErrorCancelled, unless it completed already.
+	void cancel() { state_->cancel(); }
+
+	// Waits for completion. In manual mode the IoContext is driven from this call.
+	void wait();
+
+	// Waits for completion and returns the result, or throws ssp::Error.
+	T get() {
+		wait();
+		return state_->take();
+	}
+
+	bool await_ready() const { return state_->ready(); }
+	bool await_suspend(std::coroutine_handle<> continuation) { return state_->setContinuation(continuation); }
+	T await_resume() { return state_->take(); }
+
+private:
+	IoContext * context_;
+	std::shared_ptr<detail::OperationState<T>> state_;
+};
+
+// An opened probe. Cheap to copy: all copies refer to the same probe. Operations on one probe are executed in the
+// order they were submitted, so a command can be queued without waiting for the previous one to complete.
+class Probe {
+public:
+	Probe() = default;
+
+	explicit operator bool() const { return state_ != nullptr; }
+	const std::string & serial() const;
+
+	Operation<void> resetToDefaults(Deadline deadline = noDeadline);
+	Operation<SspFirmwareVersion> firmwareVersion(Deadline deadline = noDeadline);
+	// Sets the data of track 1, 2 or 3. Invalid characters fail the operation immediately with SspResultErrorInvalidCharacter.
+	Operation<void> setTrack(int tracknum, std::string_view data, Deadline deadline = noDeadline);
+	Operation<void> setTrackBinary(int tracknum, std::vector<uint8_t> symbols, Deadline deadline = noDeadline);
+	Operation<void> setTriggerMode(SspTriggerMode mode, Deadline deadline = noDeadline);
+	// Arms the trigger. With SspTriggerModeImmediately the card is swiped immediately.
+	Operation<void> arm(Deadline deadline = noDeadline);
+	Operation<void> disarm(Deadline deadline = noDeadline);
+	// Waits for the swiped event of the probe. Queue it directly after arm(): sending another command to the probe
+	// first discards the event.
+	Operation<void> awaitSwiped(Deadline deadline);
+	// Closes the probe once the operations queued before have completed. Operations queued afterwards fail.
+	Operation<void> close();
+
+private:
+	friend class IoContext;
+	Probe(IoContext * context, std::shared_ptr<detail::ProbeState> state) : context_(context), state_(std::move(state)) {}
+
+	IoContext * context_ = nullptr;
+	std::shared_ptr<detail::ProbeState> state_;
+};
+
+// Executes the operations of all probes connected through it.
+class IoContext {
+public:
+	enum class Mode {
+		Thread,		///< Operations are executed by an internal I/O thread
+		Manual,		///< Operations are executed from poll() / runOnce(), called by the user's event loop
+	};
+
+	explicit IoContext(Mode mode = Mode::Thread);
+	// Cancels all outstanding operations and closes all probes.
+	~IoContext();
+
+	IoContext(const IoContext &) = delete;
+	IoContext & operator=(const IoContext &) = delete;
+
+	// Opens a probe by serial number, or the first probe found with "auto".
+	Operation<Probe> connect(std::string serial, Deadline deadline = noDeadline);
+
+	// Manual mode: makes progress on all probes without blocking. Returns true when anything happened.
+	bool poll();
+	// Manual mode: like poll(), but waits up to maxWait for something to happen.
+	bool runOnce(Clock::duration maxWait);
+	// True when operations are queued or in progress.
+	bool busy() const;
+
+	Mode mode() const { return mode_; }
+
+	// How long the I/O loop sleeps between polls of probes that are waiting for a response.
+	static constexpr std::chrono::microseconds pollInterval{ 200 };
+
+private:
+	friend class Probe;
+
+	void submit(const std::shared_ptr<detail::ProbeState> & probe, std::unique_ptr<detail::Request> request);
+	bool service(detail::ProbeState & probe);
+	void waitForWork(Clock::duration maxWait);
+	void run();
+
+	Mode mode_;
+	mutable std::mutex mutex_;
+	std::condition_variable wakeup_;
+	bool submitted_ = false;
+	std::atomic<bool> stopping_{ false };
+	std::atomic<size_t> outstanding_{ 0 };
+	std::vector<std::shared_ptr<detail::ProbeState>> probes_;
+	std::vector<std::shared_ptr<detail::ProbeState>> snapshot_;	///< only used by the thread executing the operations
+	std::thread thread_;
+};
+
+template <typename T>
+void Operation<T>::wait() {
+	if (context_->mode() == IoContext::Mode::Manual) {
+		while (!state_->ready()) {
+			context_->runOnce(std::chrono::milliseconds(1));
+		}
+	}
+	else {
+		state_->wait();
+	}
+}
+
+} // namespace ssp
+
+#endif /* not defined SSPASYNC_HPP */
@@ -0,0 +1,98 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+// Tests of the asynchronous interface that need a probe (or any device the selected hidapi backend presents as one):
+//	make async-test && ./sspasync_test [<serial>]
+// Every test has to complete within a few seconds; an operation that never completes fails the test instead of
+// hanging it.
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <future>
+#include <string>
+
+#include "sspasync.hpp"
+
+namespace {
+
+using namespace std::chrono_literals;
+
+int failures = 0;
+
+void check(bool condition, const char * test, const char * what) {
+	if (!condition) {
+		std::printf("FAIL %s: %s\n", test, what);
+		failures++;
+	}
+}
+
+// Runs body on another thread and fails the test when it does not return within the timeout.
+void run(const char * test, std::function<void()> body) {
+	auto done = std::async(std::launch::async, [&] {
+		try {
+			body();
+		}
+		catch (const std::exception & e) {
+			check(false, test, e.what());
+		}
+	});
+	if (done.wait_for(5s) != std::future_status::ready) {
+		std::printf("FAIL %s: did not complete\n", test);
+		std::fflush(stdout);
+		std::quick_exit(1);
+	}
+	std::printf("done %s\n", test);
+}
+
+// Result of an operation that should fail.
+template <typename T>
+SspResult failure(ssp::Operation<T> operation) {
+	try {
+		operation.get();
+	}
+	catch (const ssp::Error & e) {
+		return e.result();
+	}
+	return SspResultOk;
+}
+
+void submitAfterClose(ssp::IoContext::Mode mode, const std::string & serial) {
+	ssp::IoContext io(mode);
+	ssp::Probe probe = io.connect(serial).get();
+	probe.firmwareVersion().get();
+	// queued behind the close, failed when it is executed
+	auto close = probe.close();
+	auto queued = probe.firmwareVersion();
+	close.get();
+	check(failure(queued) == SspResultErrorHidOpen, "submit after close", "a command queued behind close() did not fail");
+	// submitted once the probe is forgotten by the context, failed right away
+	check(failure(probe.firmwareVersion()) == SspResultErrorHidOpen, "submit after close", "a command after close() did not fail");
+	check(failure(probe.arm()) == SspResultErrorHidOpen, "submit after close", "a second command after close() did not fail");
+	check(!io.busy(), "submit after close", "the context is still busy");
+}
+
+} // namespace
+
+int main(int argc, char * argv[]) {
+	std::string serial = (argc > 1) ? argv[1] : "auto";
+	run("submit after close (thread)", [&] { submitAfterClose(ssp::IoContext::Mode::Thread, serial); });
+	run("submit after close (manual)", [&] { submitAfterClose(ssp::IoContext::Mode::Manual, serial); });
+	std::printf("%s\n", (failures == 0) ? "all tests passed" : "tests failed");
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,262 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "SSPCommandLineTool.h"
+#include "protocol.h"
+#include "stress.h"
+#include "util.h"
+
+// Time between the start of a step and its first arm
+#define STRESS_LEAD_NS 50000000ull
+
+typedef struct {
+	SspDevice * device;
+	bool swipePending;		///< armed, the swiped event has not been received yet
+	uint64_t lastSwipedNs;	///< time the last swiped event was received, 0 when none yet
+} StressProbe;
+
+typedef struct {
+	double targetRate;		///< arms per second over all probes
+	size_t arms;			///< arms sent
+	size_t errors;			///< arms that were not acknowledged or not swiped
+	size_t accepted;		///< swipes acknowledged on the feedback source
+	double achievedRate;	///< arms per second actually sent
+	uint64_t p99LatenessNs;
+	uint64_t maxLatenessNs;
+	uint64_t minSwipeIntervalNs;	///< shortest time between two swiped events of one probe, 0 when not measured
+	bool passed;
+} StressStep;
+
+static StressProbe * stressProbes = NULL;
+static size_t stressProbeCount = 0;
+
+// Stores the time of a swiped event of probe p and keeps the shortest interval between two of them.
+static void recordSwiped(StressProbe * p, StressStep * step) {
+	uint64_t now = getMonotonicTimeNs();
+	if (p->lastSwipedNs != 0) {
+		uint64_t interval = now - p->lastSwipedNs;
+		if (step->minSwipeIntervalNs == 0 || interval < step->minSwipeIntervalNs) {
+			step->minSwipeIntervalNs = interval;
+		}
+	}
+	p->lastSwipedNs = now;
+	p->swipePending = false;
+}
+
+// Picks up the swiped events that have arrived, without waiting.
+static void pollSwiped(StressStep * step) {
+	for (size_t i = 0; i < stressProbeCount; i++) {
+		StressProbe * p = &stressProbes[i];
+		SspResponse response;
+		if (p->swipePending && sspPollResponse(p->device, 0, &response) == SspResultOk && response.tag == SspEventSwiped) {
+			recordSwiped(p, step);
+		}
+	}
+}
+
+// Waits for the swiped event of probe p, if it still has one pending.
+static void awaitSwiped(StressProbe * p, StressStep * step, int timeoutMs) {
+	if (!p->swipePending) {
+		return;
+	}
+	if (sspAwaitSwiped(p->device, timeoutMs) == SspResultOk) {
+		recordSwiped(p, step);
+	}
+	else {
+		p->swipePending = false;
+		step->errors++;
+	}
+}
+
+// Runs one step: arms at targetRate (over all probes, in turn) for stepNs, then waits for the last swipes and feedback.
+static void runStep(StressStep * step, double targetRate, uint64_t stepNs, int swipeTimeoutMs, int feedbackFd, int settleMs, double minAcceptPercent) {
+	memset(step, 0, sizeof(*step));
+	step->targetRate = targetRate;
+	for (size_t i = 0; i < stressProbeCount; i++) {
+		stressProbes[i].lastSwipedNs = 0;
+	}
+	if (feedbackFd >= 0) {
+		// acknowledgements of an earlier step that came in late do not count
+		readFeedbackLines(feedbackFd);
+	}
+
+	uint64_t periodNs = (uint64_t)(1e9 / targetRate);
+	size_t count = (size_t)(stepNs / periodNs);
+	if (count == 0) {
+		count = 1;
+	}
+	Histogram * lateness = checkMalloc(malloc(sizeof(Histogram)));
+	histogramInit(lateness);
+	uint64_t start = getMonotonicTimeNs() + STRESS_LEAD_NS;
+	uint64_t firstArmedNs = 0;
+	uint64_t lastArmedNs = 0;
+	for (size_t k = 0; k < count; k++) {
+		StressProbe * p = &stressProbes[k % stressProbeCount];
+		uint64_t deadline = start + k * periodNs;
+		// the probe swipes one card at a time, a swipe still in progress holds up its next arm
+		awaitSwiped(p, step, swipeTimeoutMs);
+		uint64_t armedNs;
+		SspResult result = sspSendGoAt(p->device, deadline, &armedNs);
+		histogramRecord(lateness, (armedNs > deadline) ? armedNs - deadline : 0);
+		if (k == 0) {
+			firstArmedNs = armedNs;
+		}
+		lastArmedNs = armedNs;
+		step->arms++;
+		if (result == SspResultOk) {
+			p->swipePending = true;
+		}
+		else {
+			step->errors++;
+		}
+		pollSwiped(step);
+	}
+	for (size_t i = 0; i < stressProbeCount; i++) {
+		awaitSwiped(&stressProbes[i], step, swipeTimeoutMs);
+	}
+	step->p99LatenessNs = histogramPercentile(lateness, 99);
+	step->maxLatenessNs = histogramMax(lateness);
+	free(lateness);
+	// the achieved rate over the same number of periods as the target rate
+	step->achievedRate = (count > 1) ? (count - 1) / ((lastArmedNs - firstArmedNs) / 1e9) : targetRate;
+
+	if (feedbackFd >= 0) {
+		sleepMs(settleMs);
+		step->accepted = readFeedbackLines(feedbackFd);
+	}
+	step->passed = step->errors == 0 && step->achievedRate >= 0.95 * targetRate
+		&& (feedbackFd < 0 || step->accepted * 100.0 >= minAcceptPercent * step->arms);
+
+	printf("%9.1f arms/s: %9.1f achieved, %6zu arms, %4zu errors", targetRate, step->achievedRate, step->arms, step->errors);
+	if (feedbackFd >= 0) {
+		printf(", %6zu accepted", step->accepted);
+	}
+	if (step->minSwipeIntervalNs != 0) {
+		printf(", min swipe interval %8.3f ms", step->minSwipeIntervalNs / 1e6);
+	}
+	printf(", lateness p99 %8.3f ms max %8.3f ms: %s\n", step->p99LatenessNs / 1e6, step->maxLatenessNs / 1e6, step->passed ? "pass" : "FAIL");
+}
+
+int stressSwipes() {
+	char * serial = getCommandLineParameterValue("--serial", "auto");
+	char * filename = getCommandLineParameterValue("--file", "");
+	char * feedbackFilename = getCommandLineParameterValue("--feedback", NULL);
+	double startRate = atof(getCommandLineParameterValue("--start-rate", "10"));
+	double stepRate = atof(getCommandLineParameterValue("--step", "10"));
+	double maxRate = atof(getCommandLineParameterValue("--max-rate", "500"));
+	double stepSeconds = atof(getCommandLineParameterValue("--step-time", "2"));
+	int swipeTimeoutMs = atoi(getCommandLineParameterValue("--swipe-timeout", "1000"));
+	int settleMs = atoi(getCommandLineParameterValue("--settle", "1000"));
+	double minAcceptPercent = atof(getCommandLineParameterValue("--min-accept", "100"));
+	int searchSteps = atoi(getCommandLineParameterValue("--search", "6"));
+	if (startRate <= 0 || stepRate <= 0 || maxRate < startRate || stepSeconds <= 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Invalid --start-rate, --step, --max-rate or --step-time");
+	}
+
+	SspCard * cards;
+	char * buffer;
+	if (readDeck(filename, &cards, &buffer) == 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Deck %s contains no cards", filename);
+	}
+
+	int feedbackFd = -1;
+	if (feedbackFilename != NULL && (feedbackFd = openFeedback(feedbackFilename)) < 0) {
+		cleanUpAndExit(ExitErrorCommandLineParameter, "Cannot open feedback source %s", feedbackFilename);
+	}
+
+	selectBackend();
+	SspDevice ** devices;
+	stressProbeCount = connectProbes(serial, &devices);
+	stressProbes = checkMalloc(calloc(stressProbeCount, sizeof(StressProbe)));
+	for (size_t i = 0; i < stressProbeCount; i++) {
+		stressProbes[i].device = devices[i];
+	}
+	// the card is loaded once, every arm swipes it again
+	for (size_t i = 0; i < stressProbeCount; i++) {
+		SspDevice * device = stressProbes[i].device;
+		checkResult(sspResetToDefaultConfiguration(device));
+		for (int t = 0; t < 3; t++) {
+			checkResult(sspSetTrackDataString(device, t + 1, cards[0].track[t], cards[0].length[t]));
+		}
+		checkResult(sspSetTriggerMode(device, SspTriggerModeImmediately));
+	}
+
+	IFNOTQUIET(printf("Ramping from %.1f to %.1f arms/s in steps of %.1f arms/s, %.1f s per step, on %zu probe(s)\n",
+		startRate, maxRate, stepRate, stepSeconds, stressProbeCount));
+	uint64_t stepNs = (uint64_t)(stepSeconds * 1e9);
+	StressStep step;
+	StressStep best = { 0 };
+	double failedRate = 0;
+	uint64_t minSwipeIntervalNs = 0;
+	for (double rate = startRate; rate <= maxRate; rate += stepRate) {
+		runStep(&step, rate, stepNs, swipeTimeoutMs, feedbackFd, settleMs, minAcceptPercent);
+		if (step.minSwipeIntervalNs != 0 && (minSwipeIntervalNs == 0 || step.minSwipeIntervalNs < minSwipeIntervalNs)) {
+			minSwipeIntervalNs = step.minSwipeIntervalNs;
+		}
+		if (!step.passed) {
+			failedRate = rate;
+			break;
+		}
+		best = step;
+	}
+
+	// the acceptance feedback narrows the knee down between the last passing and the first failing rate
+	if (feedbackFd >= 0 && failedRate > 0) {
+		double low = best.passed ? best.targetRate : 0;
+		double high = failedRate;
+		for (int i = 0; i < searchSteps; i++) {
+			double rate = (low + high) / 2;
+			runStep(&step, rate, stepNs, swipeTimeoutMs, feedbackFd, settleMs, minAcceptPercent);
+			if (step.passed) {
+				low = rate;
+				best = step;
+			}
+			else {
+				high = rate;
+			}
+		}
+	}
+
+	if (minSwipeIntervalNs != 0) {
+		printf("Shortest time between two swiped events of a probe: %.3f ms (%.1f swipes/s)\n", minSwipeIntervalNs / 1e6, 1e9 / minSwipeIntervalNs);
+	}
+	if (!best.passed) {
+		printf("No rate passed, the knee is below %.1f arms/s\n", startRate);
+	}
+	else if (failedRate == 0) {
+		printf("All rates up to %.1f arms/s passed (%.1f achieved), the knee is above --max-rate\n", best.targetRate, best.achievedRate);
+	}
+	else {
+		printf("Knee point: %.1f arms/s sustained (%.1f achieved)\n", best.targetRate, best.achievedRate);
+	}
+
+	if (feedbackFd >= 0) {
+		close(feedbackFd);
+	}
+	free(stressProbes);
+	stressProbes = NULL;
+	free(cards);
+	free(buffer);
+	return 0;
+}
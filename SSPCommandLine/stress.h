@@ -0,0 +1,30 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef STRESS_H
+#define STRESS_H
+
+// Swipe rate stress test (the stress command, Linux only). The track data of one card is loaded once, after which only
+// arms are sent, at a rate that is raised step by step on one or more probes until a step fails. A step fails when not
+// every arm is acknowledged and swiped, when the achieved rate stays behind the target, or, with --feedback, when the
+// terminal under test does not acknowledge enough swipes. With --feedback the highest sustainable rate is then found by a
+// binary search between the last passing and the first failing rate.
+
+// stress command: runs the test and prints the achieved rates and the knee point.
+int stressSwipes();
+
+#endif /* not defined STRESS_H */
@@ -0,0 +1,62 @@
+/*
+
+Copyright 2017 UL TS B.V. The Netherlands
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef USDT_H
+#define USDT_H
+
+// Static tracepoints (USDT, the SystemTap SDT format) on the protocol paths, for bpftrace, perf and SystemTap. A
+// tracepoint is a nop in the code and a note in the binary; it costs nothing until a tracer attaches to it, and unlike
+// a uprobe on a function it stays put when the compiler inlines the function. They are compiled in on Linux when
+// <sys/sdt.h> is installed (package systemtap-sdt-dev or systemtap-sdt-devel) and left out with -DSSP_NO_USDT.
+//
+// The provider is ssp. The first argument is always the serial number of the probe (char *): its address is fixed for
+// an open probe, so it can be used as a map key as well as read with str().
+//	frame_send		serial, tag, length					before a command frame is written, length of the unescaped data
+//	frame_sent		serial, tag, length					after the last report of the frame is written
+//	frame_complete	serial, tag, length					the parser has a whole frame, before the CRC check
+//	frame_receive	serial, tag, length					a frame with a correct CRC is received
+//	parse_error		serial, state, byte					the parser rejects a frame: parser state after the byte, and the byte
+//	crc_mismatch	serial, tag, length, crc			the CRC received does not match the frame
+//	flush_discard	serial, length						sspHidFlush discarded a report of length bytes
+//	open			serial, path, result				a probe was opened (result 0) or could not be opened (SspResult)
+//	reconnect		serial, path, result				a probe was opened again while reconnecting, result of replaying its configuration
+//	swipe_arm		serial								a go was written
+//	swipe_complete	serial								the swiped event of the probe was received
+// For example the swipe latency of every probe:
+//	bpftrace -e 'usdt:./SSPCommandLine:ssp:swipe_arm { @arm[arg0] = nsecs; }
+//		usdt:./SSPCommandLine:ssp:swipe_complete /@arm[arg0]/ { @us[str(arg0)] = hist((nsecs - @arm[arg0]) / 1000); delete(@arm[arg0]); }'
+
+#if defined(__linux__) && !defined(SSP_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SSP_USDT_ENABLED
+#endif
+#endif
+
+#ifdef SSP_USDT_ENABLED
+#define SSP_USDT1(name, a) DTRACE_PROBE1(ssp, name, a)
+#define SSP_USDT2(name, a, b) DTRACE_PROBE2(ssp, name, a, b)
+#define SSP_USDT3(name, a, b, c) DTRACE_PROBE3(ssp, name, a, b, c)
+#define SSP_USDT4(name, a, b, c, d) DTRACE_PROBE4(ssp, name, a, b, c, d)
+#else
+#define SSP_USDT1(name, a) do { } while (0)
+#define SSP_USDT2(name, a, b) do { } while (0)
+#define SSP_USDT3(name, a, b, c) do { } while (0)
+#define SSP_USDT4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif /* not defined USDT_H */
@@ -24,7 +24,17 @@ IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <string.h>
 #include <stdint.h>
 
-#include "SSPCommandLineTool.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+#include "util.h"
 
 /** CRC table for the CRC-16. The poly is 0x8005 (x^16 + x^15 + x^2 + 1) */
 const uint16_t crc16_table[256] = {
@@ -70,11 +80,195 @@ void Crc_add(uint16_t * crc, uint8_t byte) {
 	*crc = ((*crc >> 8) ^ crc16_table[(*crc ^ byte) & 0xff]) & 0xffff;
 }
 
-// Exits when the passed pointer is NULL
-void * checkMalloc(void * ptr) {
-	if (ptr == NULL) {
-		cleanUpAndExit(-1, "Out of memory, exiting...");
+#ifndef _WIN32
+// A thread sleeping on the virtual clock
+typedef struct VirtualSleeper_s {
+	uint64_t wakeNs;
+	struct VirtualSleeper_s * next;
+} VirtualSleeper;
+
+static struct {
+	bool active;
+	uint64_t nowNs;				///< read without the mutex, written with it
+	size_t threads;				///< threads taking part, the main thread included
+	size_t sleeping;
+	VirtualSleeper * sleepers;
+	pthread_mutex_t mutex;
+	pthread_cond_t advanced;
+} virtualClock = { false, 0, 1, 0, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// When every thread taking part sleeps, jumps to the earliest wake up time. Called with the mutex held.
+static void virtualClockAdvance() {
+	if (virtualClock.sleeping == 0 || virtualClock.sleeping < virtualClock.threads) {
+		return;
+	}
+	uint64_t next = UINT64_MAX;
+	for (VirtualSleeper * sleeper = virtualClock.sleepers; sleeper != NULL; sleeper = sleeper->next) {
+		next = min(next, sleeper->wakeNs);
+	}
+	if (next > virtualClock.nowNs) {
+		__atomic_store_n(&virtualClock.nowNs, next, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&virtualClock.advanced);
+	}
+}
+
+static void virtualClockSleepUntil(uint64_t deadlineNs) {
+	pthread_mutex_lock(&virtualClock.mutex);
+	if (deadlineNs > virtualClock.nowNs) {
+		VirtualSleeper self = { deadlineNs, virtualClock.sleepers };
+		virtualClock.sleepers = &self;
+		virtualClock.sleeping++;
+		virtualClockAdvance();
+		while (virtualClock.nowNs < deadlineNs) {
+			pthread_cond_wait(&virtualClock.advanced, &virtualClock.mutex);
+		}
+		VirtualSleeper ** link = &virtualClock.sleepers;
+		while (*link != &self) {
+			link = &(*link)->next;
+		}
+		*link = self.next;
+		virtualClock.sleeping--;
+	}
+	pthread_mutex_unlock(&virtualClock.mutex);
+}
+
+// Switches getMonotonicTimeNs, sleepMs and sleepUntilNs to the virtual clock, starting at the current time.
+void virtualClockStart() {
+	pthread_mutex_lock(&virtualClock.mutex);
+	if (!virtualClock.active) {
+		virtualClock.nowNs = getMonotonicTimeNs();
+		virtualClock.active = true;
 	}
-	return ptr;
+	pthread_mutex_unlock(&virtualClock.mutex);
 }
 
+bool virtualClockActive() {
+	return virtualClock.active;
+}
+
+// Registers a thread that is about to be started. Call it before creating the thread, so the clock cannot advance before
+// the thread gets to run.
+void virtualClockAddThread() {
+	if (!virtualClock.active) {
+		return;
+	}
+	pthread_mutex_lock(&virtualClock.mutex);
+	virtualClock.threads++;
+	pthread_mutex_unlock(&virtualClock.mutex);
+}
+
+// Unregisters the calling thread, when it ends or before it blocks on something else than the clock (like pthread_join).
+void virtualClockRemoveThread() {
+	if (!virtualClock.active) {
+		return;
+	}
+	pthread_mutex_lock(&virtualClock.mutex);
+	virtualClock.threads--;
+	virtualClockAdvance();
+	pthread_mutex_unlock(&virtualClock.mutex);
+}
+#endif
+
+// Monotonic wall clock time in nanoseconds, for measuring intervals. On the virtual clock while it is active.
+uint64_t getMonotonicTimeNs() {
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+	if (virtualClock.active) {
+		return __atomic_load_n(&virtualClock.nowNs, __ATOMIC_RELAXED);
+	}
+	return getRealMonotonicTimeNs();
+#endif
+}
+
+// CLOCK_MONOTONIC time in nanoseconds even while the virtual clock is active, for waiting on and timing against other processes.
+uint64_t getRealMonotonicTimeNs() {
+#ifdef _WIN32
+	return getMonotonicTimeNs();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// CPU time (user + system) consumed by this process, in nanoseconds.
+uint64_t getProcessCpuTimeNs() {
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	// FILETIME is in units of 100 ns
+	uint64_t k = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+	uint64_t u = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+	return (k + u) * 100;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return ((uint64_t)usage.ru_utime.tv_sec + (uint64_t)usage.ru_stime.tv_sec) * 1000000000ull
+		+ ((uint64_t)usage.ru_utime.tv_usec + (uint64_t)usage.ru_stime.tv_usec) * 1000ull;
+#endif
+}
+
+// Sleeps for the given number of milliseconds.
+void sleepMs(int milliseconds) {
+#ifdef _WIN32
+	Sleep(milliseconds);
+#else
+	if (virtualClock.active) {
+		virtualClockSleepUntil(getMonotonicTimeNs() + (uint64_t)milliseconds * 1000000ull);
+		return;
+	}
+	struct timespec ts = { milliseconds / 1000, (long)(milliseconds % 1000) * 1000000L };
+	while (nanosleep(&ts, &ts) != 0) {
+	}
+#endif
+}
+
+// Sleeps until the given getMonotonicTimeNs time. Returns immediately when it has passed.
+void sleepUntilNs(uint64_t deadlineNs) {
+#ifdef _WIN32
+	uint64_t now = getMonotonicTimeNs();
+	if (deadlineNs > now) {
+		Sleep((DWORD)((deadlineNs - now) / 1000000));
+	}
+	// Sleep has millisecond granularity, spin for the rest
+	while (getMonotonicTimeNs() < deadlineNs) {
+	}
+#else
+	if (virtualClock.active) {
+		virtualClockSleepUntil(deadlineNs);
+		return;
+	}
+	struct timespec ts = { (time_t)(deadlineNs / 1000000000ull), (long)(deadlineNs % 1000000000ull) };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+	}
+#endif
+}
+
+#ifndef _WIN32
+// Opens a feedback source (a file or pipe) for reading without blocking. For a regular file only the lines added from now
+// on count. Returns -1 when it cannot be opened.
+int openFeedback(const char * filename) {
+	int fd = open(filename, O_RDONLY | O_NONBLOCK);
+	if (fd >= 0) {
+		lseek(fd, 0, SEEK_END);
+	}
+	return fd;
+}
+
+// Counts the lines that can be read from a feedback source without waiting.
+size_t readFeedbackLines(int fd) {
+	size_t lines = 0;
+	char buffer[4096];
+	ssize_t length;
+	while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+		for (ssize_t i = 0; i < length; i++) {
+			lines += (buffer[i] == '\n');
+		}
+	}
+	return lines;
+}
+#endif
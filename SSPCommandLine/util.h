@@ -19,6 +19,8 @@ IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define UTIL_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
 
@@ -34,8 +36,27 @@ IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 	#define alloca _alloca
 #endif
 
-// Exits when the passed pointer is NULL
-void * checkMalloc(void * ptr);
+// Monotonic wall clock time in nanoseconds, for measuring intervals.
+uint64_t getMonotonicTimeNs();
+// CLOCK_MONOTONIC time in nanoseconds even while the virtual clock is active, for waiting on and timing against other processes.
+uint64_t getRealMonotonicTimeNs();
+// CPU time (user + system) consumed by this process, in nanoseconds.
+uint64_t getProcessCpuTimeNs();
+// Sleeps for the given number of milliseconds.
+void sleepMs(int milliseconds);
+// Sleeps until the given getMonotonicTimeNs time (an absolute deadline, so lateness does not add up over a series).
+void sleepUntilNs(uint64_t deadlineNs);
+#ifndef _WIN32
+// Virtual clock for the simulation mode: time only passes when every thread taking part waits for it, and then jumps to the
+// first wake up. Threads other than the main thread take part between virtualClockAddThread and virtualClockRemoveThread.
+void virtualClockStart();
+bool virtualClockActive();
+void virtualClockAddThread();
+void virtualClockRemoveThread();
+// A feedback source is a file or pipe the system under test writes a line to for every swipe it accepted.
+int openFeedback(const char * filename);
+size_t readFeedbackLines(int fd);
+#endif
 
 void Crc_init(uint16_t * crc);
 void Crc_add(uint16_t * crc, uint8_t byte);
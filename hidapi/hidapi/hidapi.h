@@ -372,6 +372,22 @@ extern "C" {
 		*/
 		int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *device, int string_index, wchar_t *string, size_t maxlen);
 
+		/** @brief Get the report descriptor of a HID device.
+
+			The descriptor describes the reports (and their sizes and
+			Report IDs) the device sends and accepts.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param buf The buffer to copy the descriptor into.
+			@param buf_size The size of the buffer in bytes.
+
+			@returns
+				This function returns the number of bytes copied into
+				@p buf on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_get_report_descriptor(hid_device *device, unsigned char *buf, size_t buf_size);
+
 		/** @brief Get a string describing the last error which occurred.
 
 			@ingroup API
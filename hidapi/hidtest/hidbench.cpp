@@ -0,0 +1,345 @@
+/*******************************************************
+ HIDAPI round-trip latency benchmark
+
+ Sends output reports to a device and times each
+ write -> read round trip. Report sizes and send rates
+ can be swept, and per step a latency histogram and the
+ achieved reports per second are printed.
+
+ By default the report contains a SmartStripe probe
+ SspCommandSoftwareVersion frame (VID 2B2F, PID 0001),
+ which the probe answers without side effects.
+
+ This contents of this file may be used by anyone
+ for any reason without any conditions and may be
+ used as a starting point for your own applications
+ which use HIDAPI.
+********************************************************/
+
+#include <stdio.h>
+#include <wchar.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include "hidapi.h"
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <unistd.h>
+	#include <time.h>
+#endif
+
+#define MAX_REPORT_SIZE 1024
+#define MAX_STEPS 32
+#define NUM_BUCKETS 24 /* 1 us .. ~8 s in powers of two */
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options]\n", name);
+	printf("  -d VID:PID     device to open (hex, default 2b2f:0001)\n");
+	printf("  -s SERIAL      serial number of the device (default: first found)\n");
+	printf("  -n COUNT       round trips per step (default 1000)\n");
+	printf("  -z SIZES       comma separated report sizes in bytes, without report ID (default 64)\n");
+	printf("  -r RATES       comma separated send rates in reports/s, 0 = as fast as possible (default 0)\n");
+	printf("  -t TAG         SSP command tag sent in the report (hex, default 5e = software version)\n");
+	printf("  -x HEXBYTES    raw report payload instead of an SSP frame, e.g. 1002...\n");
+	printf("  -i ID          report ID (default 0)\n");
+	printf("  -w MS          read timeout per round trip in ms (default 1000)\n");
+}
+
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/* Sleep until the absolute CLOCK_MONOTONIC time deadline_ns. */
+static void sleep_until(uint64_t deadline_ns)
+{
+#ifdef _WIN32
+	uint64_t t = now_ns();
+	if (deadline_ns > t)
+		Sleep((DWORD)((deadline_ns - t) / 1000000));
+#else
+	struct timespec ts;
+	ts.tv_sec = deadline_ns / 1000000000ull;
+	ts.tv_nsec = deadline_ns % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+#endif
+}
+
+/* CRC-16, poly 0x8005 (reflected), as used by the SSP protocol. */
+static uint16_t crc16_add(uint16_t crc, uint8_t byte)
+{
+	int i;
+	crc ^= byte;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+	return crc;
+}
+
+static size_t add_escaped(unsigned char *out, size_t pos, uint8_t byte)
+{
+	if (byte == 0x10)
+		out[pos++] = 0x10;
+	out[pos++] = byte;
+	return pos;
+}
+
+/* Builds an SSP frame without payload: DLE STX tag len len crc crc DLE ETX. */
+static size_t build_ssp_frame(unsigned char *out, uint8_t tag)
+{
+	size_t pos = 0;
+	uint16_t crc = 0;
+	crc = crc16_add(crc, tag);
+	crc = crc16_add(crc, 0);
+	crc = crc16_add(crc, 0);
+
+	out[pos++] = 0x10;
+	out[pos++] = 0x02;
+	pos = add_escaped(out, pos, tag);
+	pos = add_escaped(out, pos, 0);
+	pos = add_escaped(out, pos, 0);
+	pos = add_escaped(out, pos, (crc >> 8) & 0xff);
+	pos = add_escaped(out, pos, crc & 0xff);
+	out[pos++] = 0x10;
+	out[pos++] = 0x03;
+	return pos;
+}
+
+static size_t parse_hex(const char *hex, unsigned char *out, size_t maxlen)
+{
+	size_t len = 0;
+	unsigned int byte;
+	while (len < maxlen && sscanf(hex, "%2x", &byte) == 1) {
+		out[len++] = (unsigned char)byte;
+		hex += 2;
+		if (*hex == '\0')
+			break;
+	}
+	return len;
+}
+
+static int parse_list(const char *list, int *values, int maxvalues)
+{
+	int n = 0;
+	char *copy = strdup(list);
+	char *token = strtok(copy, ",");
+	while (token && n < maxvalues) {
+		values[n++] = atoi(token);
+		token = strtok(NULL, ",");
+	}
+	free(copy);
+	return n;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void print_histogram(uint64_t *samples, int count)
+{
+	unsigned int buckets[NUM_BUCKETS];
+	unsigned int max_bucket = 0;
+	int i, b;
+
+	memset(buckets, 0, sizeof(buckets));
+	for (i = 0; i < count; i++) {
+		uint64_t us = samples[i] / 1000;
+		b = 0;
+		while (us > 1 && b < NUM_BUCKETS - 1) {
+			us >>= 1;
+			b++;
+		}
+		buckets[b]++;
+	}
+	for (b = 0; b < NUM_BUCKETS; b++) {
+		if (buckets[b] > max_bucket)
+			max_bucket = buckets[b];
+	}
+	printf("    %11s %7s\n", ">= latency", "count");
+	for (b = 0; b < NUM_BUCKETS; b++) {
+		int bar;
+		if (buckets[b] == 0)
+			continue;
+		bar = (int)(50.0 * buckets[b] / max_bucket);
+		printf("    %8llu us %7u |", b == 0 ? 0ull : (1ull << b), buckets[b]);
+		while (bar-- > 0)
+			printf("#");
+		printf("\n");
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned short vid = 0x2b2f, pid = 0x0001;
+	const char *serial = NULL;
+	int count = 1000;
+	int sizes[MAX_STEPS] = { 64 };
+	int num_sizes = 1;
+	int rates[MAX_STEPS] = { 0 };
+	int num_rates = 1;
+	unsigned char payload[MAX_REPORT_SIZE];
+	size_t payload_len;
+	int report_id = 0;
+	int timeout_ms = 1000;
+	hid_device *handle;
+	uint64_t *samples;
+	int i, s, r;
+
+	payload_len = build_ssp_frame(payload, 0x5e);
+
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+		if (arg[0] != '-' || arg[1] == '\0' || arg[2] != '\0' || !val) {
+			usage(argv[0]);
+			return 1;
+		}
+		switch (arg[1]) {
+		case 'd': {
+			unsigned int v, p;
+			if (sscanf(val, "%x:%x", &v, &p) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			vid = (unsigned short)v;
+			pid = (unsigned short)p;
+			break;
+		}
+		case 's': serial = val; break;
+		case 'n': count = atoi(val); break;
+		case 'z': num_sizes = parse_list(val, sizes, MAX_STEPS); break;
+		case 'r': num_rates = parse_list(val, rates, MAX_STEPS); break;
+		case 't': payload_len = build_ssp_frame(payload, (uint8_t)strtol(val, NULL, 16)); break;
+		case 'x': payload_len = parse_hex(val, payload, sizeof(payload)); break;
+		case 'i': report_id = atoi(val); break;
+		case 'w': timeout_ms = atoi(val); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+		i++;
+	}
+	if (count <= 0 || num_sizes <= 0 || num_rates <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (hid_init())
+		return -1;
+
+	if (serial) {
+		size_t len = strlen(serial) + 1;
+		wchar_t *wserial = (wchar_t *)malloc(len * sizeof(wchar_t));
+		mbstowcs(wserial, serial, len);
+		handle = hid_open(vid, pid, wserial);
+		free(wserial);
+	}
+	else {
+		handle = hid_open(vid, pid, NULL);
+	}
+	if (!handle) {
+		printf("unable to open device %04hx:%04hx\n", vid, pid);
+		return 1;
+	}
+
+	samples = (uint64_t *)malloc(count * sizeof(uint64_t));
+
+	printf("%d round trips per step, payload %u bytes, report ID %d\n\n", count, (unsigned int)payload_len, report_id);
+
+	for (s = 0; s < num_sizes; s++) {
+		int size = sizes[s];
+		unsigned char out[MAX_REPORT_SIZE + 1];
+		unsigned char in[MAX_REPORT_SIZE + 1];
+
+		if (size <= 0 || size > MAX_REPORT_SIZE) {
+			printf("skipping invalid report size %d\n", size);
+			continue;
+		}
+		memset(out, 0, sizeof(out));
+		out[0] = (unsigned char)report_id;
+		memcpy(out + 1, payload, payload_len < (size_t)size ? payload_len : (size_t)size);
+
+		for (r = 0; r < num_rates; r++) {
+			int rate = rates[r];
+			uint64_t interval = rate > 0 ? 1000000000ull / rate : 0;
+			uint64_t start, elapsed, deadline;
+			uint64_t total = 0;
+			int done = 0, timeouts = 0, errors = 0;
+
+			/* Drain anything left over from a previous step. */
+			while (hid_read_timeout(handle, in, sizeof(in), 1) > 0)
+				;
+
+			start = now_ns();
+			deadline = start;
+			for (i = 0; i < count; i++) {
+				uint64_t t0, t1;
+				int res;
+
+				if (interval) {
+					sleep_until(deadline);
+					deadline += interval;
+				}
+
+				t0 = now_ns();
+				res = hid_write(handle, out, size + 1);
+				if (res < 0) {
+					errors++;
+					continue;
+				}
+				res = hid_read_timeout(handle, in, sizeof(in), timeout_ms);
+				t1 = now_ns();
+				if (res < 0) {
+					errors++;
+					continue;
+				}
+				if (res == 0) {
+					timeouts++;
+					continue;
+				}
+				samples[done++] = t1 - t0;
+				total += t1 - t0;
+			}
+			elapsed = now_ns() - start;
+
+			printf("size %d bytes, rate %s", size, rate > 0 ? "" : "max");
+			if (rate > 0)
+				printf("%d/s", rate);
+			printf(": %.1f reports/s achieved, %d ok, %d timeouts, %d errors\n",
+				done / (elapsed / 1e9), done, timeouts, errors);
+			if (done > 0) {
+				qsort(samples, done, sizeof(uint64_t), compare_u64);
+				printf("    min %.1f us  avg %.1f us  p50 %.1f us  p90 %.1f us  p99 %.1f us  max %.1f us\n",
+					samples[0] / 1e3, (double)total / done / 1e3,
+					samples[done / 2] / 1e3, samples[(int)(done * 0.9)] / 1e3,
+					samples[(int)(done * 0.99)] / 1e3, samples[done - 1] / 1e3);
+				print_histogram(samples, done);
+			}
+			printf("\n");
+		}
+	}
+
+	free(samples);
+	hid_close(handle);
+
+	/* Free static HIDAPI objects. */
+	hid_exit();
+
+	return 0;
+}
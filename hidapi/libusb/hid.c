@@ -162,6 +162,10 @@ struct hid_device_ {
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 
+	/* Whether the kernel driver was detached in hid_open_path() and
+	   must be re-attached in hid_close() */
+	int is_driver_detached; /* boolean */
+
 	/* Read thread objects */
 	pthread_t thread;
 	pthread_mutex_t mutex; /* Protects input_reports */
@@ -381,10 +385,20 @@ static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
 }
 
 
-/* This function returns a newly allocated wide string containing the USB
-   device string numbered by the index. The returned string must be freed
-   by using free(). */
-static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
+/* Determine which language to use for string descriptors: the one for
+   the current locale if the device supports it, else its first one. */
+static uint16_t get_usb_string_language(libusb_device_handle *dev)
+{
+	uint16_t lang;
+	lang = get_usb_code_for_current_locale();
+	if (!is_language_supported(dev, lang))
+		lang = get_first_language(dev);
+	return lang;
+}
+
+/* Like get_usb_string(), but with the language already determined (see
+   get_usb_string_language()). */
+static wchar_t *get_usb_string_lang(libusb_device_handle *dev, uint16_t lang, uint8_t idx)
 {
 	char buf[512];
 	int len;
@@ -405,12 +419,6 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	char *outptr;
 #endif
 
-	/* Determine which language to use. */
-	uint16_t lang;
-	lang = get_usb_code_for_current_locale();
-	if (!is_language_supported(dev, lang))
-		lang = get_first_language(dev);
-
 	/* Get the string from libusb. */
 	len = libusb_get_string_descriptor(dev,
 			idx,
@@ -477,6 +485,104 @@ err:
 	return str;
 }
 
+/* This function returns a newly allocated wide string containing the USB
+   device string numbered by the index. The returned string must be freed
+   by using free(). */
+static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
+{
+	return get_usb_string_lang(dev, get_usb_string_language(dev), idx);
+}
+
+/* Lazily opened device handle used while enumerating one device. */
+struct string_reader {
+	libusb_device *dev;
+	libusb_device_handle *handle;
+	int open_failed;
+	uint16_t lang;
+	int lang_known;
+};
+
+/* Cache of serial numbers, keyed by bus, port path and device address.
+   Reading a serial number takes several control transfers, and hid_open()
+   by serial number enumerates every time. The address changes whenever
+   a device is re-plugged, so stale entries are never matched. */
+#define SERIAL_CACHE_MAX_PORTS 8
+struct serial_cache_entry {
+	uint8_t bus;
+	uint8_t address;
+	uint8_t ports[SERIAL_CACHE_MAX_PORTS];
+	int num_ports;
+	wchar_t *serial_number;
+	struct serial_cache_entry *next;
+};
+
+static struct serial_cache_entry *serial_cache = NULL;
+static pthread_mutex_t serial_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void serial_cache_key(libusb_device *dev, struct serial_cache_entry *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->bus = libusb_get_bus_number(dev);
+	key->address = libusb_get_device_address(dev);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+	key->num_ports = libusb_get_port_numbers(dev, key->ports, SERIAL_CACHE_MAX_PORTS);
+	if (key->num_ports < 0)
+		key->num_ports = 0;
+#endif
+}
+
+static int serial_cache_key_equal(const struct serial_cache_entry *a, const struct serial_cache_entry *b)
+{
+	return a->bus == b->bus &&
+	       a->address == b->address &&
+	       a->num_ports == b->num_ports &&
+	       memcmp(a->ports, b->ports, a->num_ports) == 0;
+}
+
+/* Returns a newly allocated copy of the cached serial number, or NULL. */
+static wchar_t *serial_cache_lookup(const struct serial_cache_entry *key)
+{
+	struct serial_cache_entry *e;
+	wchar_t *ret = NULL;
+
+	pthread_mutex_lock(&serial_cache_mutex);
+	for (e = serial_cache; e; e = e->next) {
+		if (serial_cache_key_equal(e, key)) {
+			ret = wcsdup(e->serial_number);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&serial_cache_mutex);
+
+	return ret;
+}
+
+static void serial_cache_store(const struct serial_cache_entry *key, const wchar_t *serial_number)
+{
+	struct serial_cache_entry *e = malloc(sizeof(*e));
+	if (!e)
+		return;
+	*e = *key;
+	e->serial_number = wcsdup(serial_number);
+
+	pthread_mutex_lock(&serial_cache_mutex);
+	e->next = serial_cache;
+	serial_cache = e;
+	pthread_mutex_unlock(&serial_cache_mutex);
+}
+
+static void serial_cache_clear(void)
+{
+	pthread_mutex_lock(&serial_cache_mutex);
+	while (serial_cache) {
+		struct serial_cache_entry *next = serial_cache->next;
+		free(serial_cache->serial_number);
+		free(serial_cache);
+		serial_cache = next;
+	}
+	pthread_mutex_unlock(&serial_cache_mutex);
+}
+
 static char *make_path(libusb_device *dev, int interface_number)
 {
 	char str[64];
@@ -510,6 +616,8 @@ int HID_API_EXPORT hid_init(void)
 
 int HID_API_EXPORT hid_exit(void)
 {
+	serial_cache_clear();
+
 	if (usb_context) {
 		libusb_exit(usb_context);
 		usb_context = NULL;
@@ -518,11 +626,67 @@ int HID_API_EXPORT hid_exit(void)
 	return 0;
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* Opens the device behind a string_reader on first use. Enumeration only
+   opens devices whose VID/PID match and whose strings are not cached. */
+static libusb_device_handle *string_reader_handle(struct string_reader *r)
+{
+	if (!r->handle && !r->open_failed) {
+		if (libusb_open(r->dev, &r->handle) < 0) {
+			r->handle = NULL;
+			r->open_failed = 1;
+		}
+	}
+	return r->handle;
+}
+
+/* Reads a string descriptor through a string_reader. The language is
+   looked up once per device instead of once per string. */
+static wchar_t *string_reader_get(struct string_reader *r, uint8_t idx)
+{
+	libusb_device_handle *handle = string_reader_handle(r);
+	if (!handle)
+		return NULL;
+
+	if (!r->lang_known) {
+		r->lang = get_usb_string_language(handle);
+		r->lang_known = 1;
+	}
+	return get_usb_string_lang(handle, r->lang, idx);
+}
+
+static void string_reader_close(struct string_reader *r)
+{
+	if (r->handle)
+		libusb_close(r->handle);
+	r->handle = NULL;
+}
+
+/* Returns the serial number of the device, from the cache if possible. */
+static wchar_t *get_serial_number(struct string_reader *r, uint8_t idx)
+{
+	struct serial_cache_entry key;
+	wchar_t *serial;
+
+	serial_cache_key(r->dev, &key);
+	serial = serial_cache_lookup(&key);
+	if (serial)
+		return serial;
+
+	serial = string_reader_get(r, idx);
+	if (serial)
+		serial_cache_store(&key, serial);
+	return serial;
+}
+
+/* Enumerates the HID interfaces of all devices matching vendor_id and
+   product_id (0 matches any). The VID/PID is checked on the cached device
+   descriptor before anything else, so other devices on the bus are never
+   opened. When want_strings is 0 only the (cached) serial number is read,
+   which is all hid_open() needs. */
+static struct hid_device_info *enumerate(unsigned short vendor_id, unsigned short product_id, int want_strings)
 {
 	libusb_device **devs;
 	libusb_device *dev;
-	libusb_device_handle *handle;
 	ssize_t num_devs;
 	int i = 0;
 
@@ -538,12 +702,29 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 	while ((dev = devs[i++]) != NULL) {
 		struct libusb_device_descriptor desc;
 		struct libusb_config_descriptor *conf_desc = NULL;
+		struct string_reader reader;
+		wchar_t *serial_number = NULL;
+		wchar_t *manufacturer_string = NULL;
+		wchar_t *product_string = NULL;
+		int strings_read = 0;
 		int j, k;
 		int interface_num = 0;
+		unsigned short dev_vid;
+		unsigned short dev_pid;
 
 		int res = libusb_get_device_descriptor(dev, &desc);
-		unsigned short dev_vid = desc.idVendor;
-		unsigned short dev_pid = desc.idProduct;
+		if (res < 0)
+			continue;
+		dev_vid = desc.idVendor;
+		dev_pid = desc.idProduct;
+
+		/* Check the VID/PID against the arguments */
+		if ((vendor_id != 0x0 && vendor_id != dev_vid) ||
+		    (product_id != 0x0 && product_id != dev_pid))
+			continue;
+
+		memset(&reader, 0, sizeof(reader));
+		reader.dev = dev;
 
 		res = libusb_get_active_config_descriptor(dev, &conf_desc);
 		if (res < 0)
@@ -555,123 +736,126 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 					const struct libusb_interface_descriptor *intf_desc;
 					intf_desc = &intf->altsetting[k];
 					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+						struct hid_device_info *tmp;
 						interface_num = intf_desc->bInterfaceNumber;
 
-						/* Check the VID/PID against the arguments */
-						if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
-						    (product_id == 0x0 || product_id == dev_pid)) {
-							struct hid_device_info *tmp;
-
-							/* VID/PID match. Create the record. */
-							tmp = calloc(1, sizeof(struct hid_device_info));
-							if (cur_dev) {
-								cur_dev->next = tmp;
-							}
-							else {
-								root = tmp;
-							}
-							cur_dev = tmp;
-
-							/* Fill out the record */
-							cur_dev->next = NULL;
-							cur_dev->path = make_path(dev, interface_num);
-
-							res = libusb_open(dev, &handle);
-
-							if (res >= 0) {
-								/* Serial Number */
-								if (desc.iSerialNumber > 0)
-									cur_dev->serial_number =
-										get_usb_string(handle, desc.iSerialNumber);
-
-								/* Manufacturer and Product strings */
-								if (desc.iManufacturer > 0)
-									cur_dev->manufacturer_string =
-										get_usb_string(handle, desc.iManufacturer);
-								if (desc.iProduct > 0)
-									cur_dev->product_string =
-										get_usb_string(handle, desc.iProduct);
+						/* VID/PID match. Create the record. */
+						tmp = calloc(1, sizeof(struct hid_device_info));
+						if (cur_dev) {
+							cur_dev->next = tmp;
+						}
+						else {
+							root = tmp;
+						}
+						cur_dev = tmp;
+
+						/* Fill out the record */
+						cur_dev->next = NULL;
+						cur_dev->path = make_path(dev, interface_num);
+
+						/* The strings are per device, not per
+						   interface, so read them only once. */
+						if (!strings_read) {
+							/* Serial Number */
+							if (desc.iSerialNumber > 0)
+								serial_number = get_serial_number(&reader, desc.iSerialNumber);
+
+							/* Manufacturer and Product strings */
+							if (want_strings && desc.iManufacturer > 0)
+								manufacturer_string = string_reader_get(&reader, desc.iManufacturer);
+							if (want_strings && desc.iProduct > 0)
+								product_string = string_reader_get(&reader, desc.iProduct);
+							strings_read = 1;
+						}
+						cur_dev->serial_number = serial_number? wcsdup(serial_number): NULL;
+						cur_dev->manufacturer_string = manufacturer_string? wcsdup(manufacturer_string): NULL;
+						cur_dev->product_string = product_string? wcsdup(product_string): NULL;
 
 #ifdef INVASIVE_GET_USAGE
 {
-							/*
-							This section is removed because it is too
-							invasive on the system. Getting a Usage Page
-							and Usage requires parsing the HID Report
-							descriptor. Getting a HID Report descriptor
-							involves claiming the interface. Claiming the
-							interface involves detaching the kernel driver.
-							Detaching the kernel driver is hard on the system
-							because it will unclaim interfaces (if another
-							app has them claimed) and the re-attachment of
-							the driver will sometimes change /dev entry names.
-							It is for these reasons that this section is
-							#if 0. For composite devices, use the interface
-							field in the hid_device_info struct to distinguish
-							between interfaces. */
-								unsigned char data[256];
+						/*
+						This section is removed because it is too
+						invasive on the system. Getting a Usage Page
+						and Usage requires parsing the HID Report
+						descriptor. Getting a HID Report descriptor
+						involves claiming the interface. Claiming the
+						interface involves detaching the kernel driver.
+						Detaching the kernel driver is hard on the system
+						because it will unclaim interfaces (if another
+						app has them claimed) and the re-attachment of
+						the driver will sometimes change /dev entry names.
+						It is for these reasons that this section is
+						#if 0. For composite devices, use the interface
+						field in the hid_device_info struct to distinguish
+						between interfaces. */
+						libusb_device_handle *handle = string_reader_handle(&reader);
+						if (handle) {
+							unsigned char data[256];
 #ifdef DETACH_KERNEL_DRIVER
-								int detached = 0;
-								/* Usage Page and Usage */
-								res = libusb_kernel_driver_active(handle, interface_num);
-								if (res == 1) {
-									res = libusb_detach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
-									else
-										detached = 1;
-								}
+							int detached = 0;
+							/* Usage Page and Usage */
+							res = libusb_kernel_driver_active(handle, interface_num);
+							if (res == 1) {
+								res = libusb_detach_kernel_driver(handle, interface_num);
+								if (res < 0)
+									LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
+								else
+									detached = 1;
+							}
 #endif
-								res = libusb_claim_interface(handle, interface_num);
+							res = libusb_claim_interface(handle, interface_num);
+							if (res >= 0) {
+								/* Get the HID Report Descriptor. */
+								res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
 								if (res >= 0) {
-									/* Get the HID Report Descriptor. */
-									res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
-									if (res >= 0) {
-										unsigned short page=0, usage=0;
-										/* Parse the usage and usage page
-										   out of the report descriptor. */
-										get_usage(data, res,  &page, &usage);
-										cur_dev->usage_page = page;
-										cur_dev->usage = usage;
-									}
-									else
-										LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
-
-									/* Release the interface */
-									res = libusb_release_interface(handle, interface_num);
-									if (res < 0)
-										LOG("Can't release the interface.\n");
+									unsigned short page=0, usage=0;
+									/* Parse the usage and usage page
+									   out of the report descriptor. */
+									get_usage(data, res,  &page, &usage);
+									cur_dev->usage_page = page;
+									cur_dev->usage = usage;
 								}
 								else
-									LOG("Can't claim interface %d\n", res);
+									LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
+
+								/* Release the interface */
+								res = libusb_release_interface(handle, interface_num);
+								if (res < 0)
+									LOG("Can't release the interface.\n");
+							}
+							else
+								LOG("Can't claim interface %d\n", res);
 #ifdef DETACH_KERNEL_DRIVER
-								/* Re-attach kernel driver if necessary. */
-								if (detached) {
-									res = libusb_attach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't re-attach kernel driver.\n");
-								}
+							/* Re-attach kernel driver if necessary. */
+							if (detached) {
+								res = libusb_attach_kernel_driver(handle, interface_num);
+								if (res < 0)
+									LOG("Couldn't re-attach kernel driver.\n");
+							}
 #endif
+						}
 }
 #endif /* INVASIVE_GET_USAGE */
 
-								libusb_close(handle);
-							}
-							/* VID/PID */
-							cur_dev->vendor_id = dev_vid;
-							cur_dev->product_id = dev_pid;
+						/* VID/PID */
+						cur_dev->vendor_id = dev_vid;
+						cur_dev->product_id = dev_pid;
 
-							/* Release Number */
-							cur_dev->release_number = desc.bcdDevice;
+						/* Release Number */
+						cur_dev->release_number = desc.bcdDevice;
 
-							/* Interface Number */
-							cur_dev->interface_number = interface_num;
-						}
+						/* Interface Number */
+						cur_dev->interface_number = interface_num;
 					}
 				} /* altsettings */
 			} /* interfaces */
 			libusb_free_config_descriptor(conf_desc);
 		}
+
+		string_reader_close(&reader);
+		free(serial_number);
+		free(manufacturer_string);
+		free(product_string);
 	}
 
 	libusb_free_device_list(devs, 1);
@@ -679,6 +863,11 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 	return root;
 }
 
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	return enumerate(vendor_id, product_id, 1);
+}
+
 void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 {
 	struct hid_device_info *d = devs;
@@ -699,7 +888,8 @@ hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const
 	const char *path_to_open = NULL;
 	hid_device *handle = NULL;
 
-	devs = hid_enumerate(vendor_id, product_id);
+	/* Only the serial number is needed to pick a device. */
+	devs = enumerate(vendor_id, product_id, 0);
 	cur_dev = devs;
 	while (cur_dev) {
 		if (cur_dev->vendor_id == vendor_id &&
@@ -876,17 +1066,29 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	int res;
 	int d = 0;
 	int good_open = 0;
+	unsigned int path_bus, path_address;
+	int path_ok;
 
 	if(hid_init() < 0)
 		return NULL;
 
 	dev = new_hid_device();
 
+	/* The path encodes bus and address (see make_path()), which allows
+	   skipping all other devices without reading their descriptors. */
+	path_ok = sscanf(path, "%x:%x:", &path_bus, &path_address) == 2;
+
 	libusb_get_device_list(usb_context, &devs);
 	while ((usb_dev = devs[d++]) != NULL) {
 		struct libusb_device_descriptor desc;
 		struct libusb_config_descriptor *conf_desc = NULL;
 		int i,j,k;
+
+		if (path_ok &&
+		    (libusb_get_bus_number(usb_dev) != path_bus ||
+		     libusb_get_device_address(usb_dev) != path_address))
+			continue;
+
 		libusb_get_device_descriptor(usb_dev, &desc);
 
 		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
@@ -921,6 +1123,7 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 								good_open = 0;
 								break;
 							}
+							dev->is_driver_detached = 1;
 						}
 #endif
 						res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
@@ -1251,6 +1454,15 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
 
+#ifdef DETACH_KERNEL_DRIVER
+	/* Give the device back to the kernel driver (hidraw), so other
+	   programs and backends can use it again. */
+	if (dev->is_driver_detached) {
+		if (libusb_attach_kernel_driver(dev->device_handle, dev->interface) < 0)
+			LOG("Couldn't re-attach kernel driver.\n");
+	}
+#endif
+
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 
@@ -1295,6 +1507,26 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 		return -1;
 }
 
+int HID_API_EXPORT_CALL hid_get_report_descriptor(hid_device *dev, unsigned char *buf, size_t buf_size)
+{
+	int res;
+
+	/* The report descriptor is a class descriptor of the interface. */
+	res = libusb_control_transfer(dev->device_handle,
+		LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE,
+		LIBUSB_REQUEST_GET_DESCRIPTOR,
+		(LIBUSB_DT_REPORT << 8),
+		dev->interface,
+		buf, buf_size,
+		5000/*timeout*/);
+	if (res < 0) {
+		LOG("libusb_control_transfer() for getting the HID report descriptor failed with %d\n", res);
+		return -1;
+	}
+
+	return res;
+}
+
 
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
@@ -36,6 +36,7 @@
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
 
 /* Linux */
 #include <linux/hidraw.h>
@@ -80,6 +81,29 @@ struct hid_device_ {
 
 static __u32 kernel_version = 0;
 
+/* A single udev context is shared by enumeration and string lookups for
+   the lifetime of the process (until hid_exit()). Creating one is not
+   free, and hid_open() by serial number enumerates on every call.
+   A udev context must not be used by several threads at once, so it is
+   only used between get_udev() and put_udev(), which hold udev_lock. */
+static struct udev *udev_ctx = NULL;
+static pthread_mutex_t udev_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct udev *get_udev(void)
+{
+	pthread_mutex_lock(&udev_lock);
+	if (!udev_ctx)
+		udev_ctx = udev_new();
+	if (!udev_ctx)
+		pthread_mutex_unlock(&udev_lock);
+	return udev_ctx;
+}
+
+static void put_udev(void)
+{
+	pthread_mutex_unlock(&udev_lock);
+}
+
 static __u32 detect_kernel_version(void)
 {
 	struct utsname name;
@@ -199,6 +223,38 @@ static int uses_numbered_reports(__u8 *report_descriptor, __u32 size) {
 	return 0;
 }
 
+/* parse_hidraw_syspath_ids() extracts the bus type, vendor and product ID
+   from the sysfs path of a hidraw node. The kernel names the parent HID
+   device "BBBB:VVVV:PPPP.NNNN", so the path looks like
+     /sys/devices/.../0003:2B2F:0001.0004/hidraw/hidraw3
+   This lets hid_enumerate() reject non-matching devices without creating
+   a udev_device or reading any sysfs attribute. Returns 1 on success, 0 if
+   the path does not have the expected layout. */
+static int parse_hidraw_syspath_ids(const char *syspath, int *bus_type,
+	unsigned short *vendor_id, unsigned short *product_id)
+{
+	const char *hidraw = NULL;
+	const char *p = syspath;
+	const char *start;
+
+	/* Find the last "/hidraw/" component; the HID device is right before it. */
+	while ((p = strstr(p, "/hidraw/")) != NULL) {
+		hidraw = p;
+		p++;
+	}
+	if (!hidraw || hidraw == syspath)
+		return 0;
+
+	start = hidraw - 1;
+	while (start > syspath && *start != '/')
+		start--;
+	if (*start != '/')
+		return 0;
+	start++;
+
+	return sscanf(start, "%x:%hx:%hx.", bus_type, vendor_id, product_id) == 3;
+}
+
 /*
  * The caller is responsible for free()ing the (newly-allocated) character
  * strings pointed to by serial_number_utf8 and product_name_utf8 after use.
@@ -266,17 +322,17 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
         char *serial_number_utf8 = NULL;
         char *product_name_utf8 = NULL;
 
-	/* Create the udev object */
-	udev = udev_new();
-	if (!udev) {
-		printf("Can't create udev\n");
-		return -1;
-	}
-
 	/* Get the dev_t (major/minor numbers) from the file handle. */
 	ret = fstat(dev->device_handle, &s);
 	if (-1 == ret)
 		return ret;
+
+	/* Get the shared udev object, it is held until put_udev() */
+	udev = get_udev();
+	if (!udev) {
+		printf("Can't create udev\n");
+		return -1;
+	}
 	/* Open a udev device from the dev_t. 'c' means character device. */
 	udev_dev = udev_device_new_from_devnum(udev, 'c', s.st_rdev);
 	if (udev_dev) {
@@ -354,8 +410,8 @@ end:
 	udev_device_unref(udev_dev);
 	/* parent and hid_dev don't need to be (and can't be) unref'd.
 	   I'm not sure why, but they'll throw double-free() errors. */
-	udev_unref(udev);
 
+	put_udev();
 	return ret;
 }
 
@@ -375,7 +431,13 @@ int HID_API_EXPORT hid_init(void)
 
 int HID_API_EXPORT hid_exit(void)
 {
-	/* Nothing to do for this in the Linux/hidraw implementation. */
+	/* Release the shared udev context. */
+	pthread_mutex_lock(&udev_lock);
+	if (udev_ctx) {
+		udev_unref(udev_ctx);
+		udev_ctx = NULL;
+	}
+	pthread_mutex_unlock(&udev_lock);
 	return 0;
 }
 
@@ -392,8 +454,8 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 
 	hid_init();
 
-	/* Create the udev object */
-	udev = udev_new();
+	/* Get the shared udev object */
+	udev = get_udev();
 	if (!udev) {
 		printf("Can't create udev\n");
 		return NULL;
@@ -424,6 +486,17 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 		/* Get the filename of the /sys entry for the device
 		   and create a udev_device object (dev) representing it */
 		sysfs_path = udev_list_entry_get_name(dev_list_entry);
+
+		/* When filtering on VID/PID, first try the IDs encoded in the
+		   sysfs path. That costs no I/O at all, so on hosts with many
+		   HID devices only the matching ones are examined further. */
+		if ((vendor_id != 0x0 || product_id != 0x0) &&
+		    parse_hidraw_syspath_ids(sysfs_path, &bus_type, &dev_vid, &dev_pid)) {
+			if ((vendor_id != 0x0 && vendor_id != dev_vid) ||
+			    (product_id != 0x0 && product_id != dev_pid))
+				continue;
+		}
+
 		raw_dev = udev_device_new_from_syspath(udev, sysfs_path);
 		dev_path = udev_device_get_devnode(raw_dev);
 
@@ -561,9 +634,9 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 		   unref()d.  It will cause a double-free() error.  I'm not
 		   sure why.  */
 	}
-	/* Free the enumerator and udev objects. */
+	/* Free the enumerator. The udev object is shared, see get_udev(). */
 	udev_enumerate_unref(enumerate);
-	udev_unref(udev);
+	put_udev();
 
 	return root;
 }
@@ -790,6 +863,31 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 	return -1;
 }
 
+int HID_API_EXPORT_CALL hid_get_report_descriptor(hid_device *dev, unsigned char *buf, size_t buf_size)
+{
+	int res, desc_size = 0;
+	struct hidraw_report_descriptor rpt_desc;
+
+	memset(&rpt_desc, 0x0, sizeof(rpt_desc));
+
+	/* Get Report Descriptor Size */
+	res = ioctl(dev->device_handle, HIDIOCGRDESCSIZE, &desc_size);
+	if (res < 0)
+		return -1;
+
+	/* Get Report Descriptor */
+	rpt_desc.size = desc_size;
+	res = ioctl(dev->device_handle, HIDIOCGRDESC, &rpt_desc);
+	if (res < 0)
+		return -1;
+
+	if ((size_t)desc_size > buf_size)
+		desc_size = buf_size;
+	memcpy(buf, rpt_desc.value, desc_size);
+
+	return desc_size;
+}
+
 
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
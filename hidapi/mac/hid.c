@@ -1027,6 +1027,31 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 	return 0;
 }
 
+int HID_API_EXPORT_CALL hid_get_report_descriptor(hid_device *dev, unsigned char *buf, size_t buf_size)
+{
+	CFTypeRef ref;
+	CFDataRef data;
+	CFIndex len;
+
+	if (dev->disconnected)
+		return -1;
+
+	/* The descriptor is a property of the device, no need to ask the device itself. */
+	ref = IOHIDDeviceGetProperty(dev->device_handle, CFSTR(kIOHIDReportDescriptorKey));
+	if (ref == NULL || CFGetTypeID(ref) != CFDataGetTypeID())
+		return -1;
+
+	data = (CFDataRef) ref;
+	len = CFDataGetLength(data);
+	if (len <= 0)
+		return -1;
+	if ((size_t) len > buf_size)
+		len = (CFIndex) buf_size;
+	CFDataGetBytes(data, CFRangeMake(0, len), buf);
+
+	return (int) len;
+}
+
 
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {